@@ -4,10 +4,13 @@
 
 #include "sql_priv.h"
 #include "sql_class.h"                         
+#include "key.h"                               /* key_restore */
+#include "item_cmpfunc.h"                      /* Item_func_like */
 #include "ha_spartan.h"
 #include "probes_mysql.h"
 #include "sql_plugin.h"
 #include "my_sys.h"
+#include "my_atomic.h"
 
 static handler *spartan_create_handler(handlerton *hton,
                                        TABLE_SHARE *table, 
@@ -20,6 +23,45 @@ static const char* spartan_system_database();
 static bool spartan_is_supported_system_table(const char *db,
                                       const char *table_name,
                                       bool is_sql_layer_system_table);
+
+static bool table_comment_has(LEX_STRING comment, const char *word);
+static uint ngram_fields(Field **fields, Field **to);
+
+/* Row cache budget per table and the counters behind its status variables */
+static ulonglong srv_row_cache_size= 0;
+static int64 spartan_row_cache_hits= 0;
+static int64 spartan_row_cache_misses= 0;
+
+/* Index page cache budget per index */
+static ulonglong srv_index_cache_size= 0;
+
+/* Largest index (in bytes of memory) kept as an in-memory radix tree */
+static ulonglong srv_index_art_size= 0;
+
+/* Adaptive hash index budget per index and the counters of its lookups */
+static ulonglong srv_index_hash_size= 0;
+static int64 spartan_index_hash_hits= 0;
+static int64 spartan_index_hash_misses= 0;
+
+/* Bits of bloom filter per key of each index */
+static uint srv_index_bloom_bits= 0;
+
+/* Memory table size of each index kept as sorted runs */
+static ulonglong srv_index_lsm_memtable_size= 0;
+
+/* Table scans narrowed down by an n-gram index */
+static int64 spartan_ngram_scans= 0;
+
+/* Memory and sort threads given to each index that is built as a whole */
+static ulonglong srv_index_build_memory= 0;
+static uint srv_index_build_threads= 0;
+
+/* Limit on the memory of the in-memory index structures of all tables */
+static ulonglong srv_index_memory_limit= 0;
+
+/* Use index files in place through mmap() instead of reading pages */
+static my_bool srv_index_mmap= TRUE;
+
 #ifdef HAVE_PSI_INTERFACE
 static PSI_mutex_key ex_key_mutex_Spartan_share_mutex;
 
@@ -38,13 +80,21 @@ static void init_spartan_psi_keys()
 }
 #endif
 
-Spartan_share::Spartan_share()
+Spartan_share::Spartan_share(uint keys, uint ngrams)
 {
   thr_lock_init(&lock);
   mysql_mutex_init(ex_key_mutex_Spartan_share_mutex,
                    &mutex, MY_MUTEX_INIT_FAST);
   data_class = new Spartan_data();
-  index_class = new Spartan_index();
+  /* a table without keys still has an (empty) index file */
+  num_indexes = (keys > 0) ? keys : 1;
+  for (uint i = 0; i < num_indexes; i++)
+    index_class[i] = new Spartan_index();
+  num_ngrams = ngrams;
+  for (uint i = 0; i < num_ngrams; i++)
+    ngram_class[i] = new Spartan_ngram_index();
+  row_cache = new Spartan_row_cache();
+  use_count = 0;
 }
 
 
@@ -62,6 +112,7 @@ static int spartan_init_func(void *p)
   spartan_hton->flags=                     HTON_CAN_RECREATE;
   spartan_hton->system_database=   spartan_system_database;
   spartan_hton->is_supported_system_table= spartan_is_supported_system_table;
+  Spartan_slab::set_limit(srv_index_memory_limit);
 
   DBUG_RETURN(0);
 }
@@ -78,13 +129,15 @@ static int spartan_init_func(void *p)
 Spartan_share *ha_spartan::get_share()
 {
   Spartan_share *tmp_share;
+  Field *ngrams[SDE_MAX_NGRAMS];
 
   DBUG_ENTER("ha_spartan::get_share()");
 
   lock_shared_ha_data();
   if (!(tmp_share= static_cast<Spartan_share*>(get_ha_share_ptr())))
   {
-    tmp_share= new Spartan_share;
+    tmp_share= new Spartan_share(table_share->keys,
+                                 ngram_fields(table_share->field, ngrams));
     if (!tmp_share)
       goto err;
 
@@ -105,7 +158,27 @@ static handler* spartan_create_handler(handlerton *hton,
 
 ha_spartan::ha_spartan(handlerton *hton, TABLE_SHARE *table_arg)
   :handler(hton, table_arg)
-{}
+{
+  scan_buf.block = NULL;
+  scan_buf.block_start = -1;
+  scan_buf.block_len = 0;
+  memset(&cursor, 0, sizeof(cursor));
+  key_unique = false;
+  batch = NULL;
+  batch_done = false;
+  end_batch();
+  key_record = NULL;
+  keyread = false;
+  memset(index_sort_len, 0, sizeof(index_sort_len));
+  memset(index_key_len, 0, sizeof(index_key_len));
+  memset(index_images, 0, sizeof(index_images));
+  memset(builder, 0, sizeof(builder));
+  building = false;
+  ngram_buf[0] = ngram_buf[1] = NULL;
+  ngram_query_count = 0;
+  ngram_rows = NULL;
+  ngram_row_count = ngram_row_next = 0;
+}
 
 
 /**
@@ -128,10 +201,12 @@ ha_spartan::ha_spartan(handlerton *hton, TABLE_SHARE *table_arg)
 
 #define SDE_EXT ".sde"
 #define SDI_EXT ".sdi"
+#define SDN_EXT ".sdn"
 
 static const char *ha_spartan_exts[] = {
   SDE_EXT,
   SDI_EXT,
+  SDE_LIVE_EXT,
   NullS
 };
 
@@ -140,6 +215,36 @@ const char **ha_spartan::bas_ext() const
   return ha_spartan_exts;
 }
 
+/*
+  Name of the file of index keynr. The first index is kept in the .sdi
+  file, the others in .sdi1, .sdi2 and so on.
+*/
+static char *index_file_name(char *buff, const char *name, uint keynr)
+{
+  char ext[16];
+
+  if (keynr == 0)
+    strmov(ext, SDI_EXT);
+  else
+    my_snprintf(ext, sizeof(ext), "%s%u", SDI_EXT, keynr);
+  return fn_format(buff, name, "", ext, MY_REPLACE_EXT|MY_UNPACK_FILENAME);
+}
+
+/*
+  Name of the file of the n-gram index of the n-th column that has one:
+  .sdn, .sdn1, .sdn2 and so on.
+*/
+static char *ngram_file_name(char *buff, const char *name, uint n)
+{
+  char ext[16];
+
+  if (n == 0)
+    strmov(ext, SDN_EXT);
+  else
+    my_snprintf(ext, sizeof(ext), "%s%u", SDN_EXT, n);
+  return fn_format(buff, name, "", ext, MY_REPLACE_EXT|MY_UNPACK_FILENAME);
+}
+
 /*
   Following handler function provides access to
   system database specific to SE. This interface
@@ -200,6 +305,246 @@ static bool spartan_is_supported_system_table(const char *db,
 }
 
 
+/*
+  Length of the sortable form of a key part, not counting the NULL
+  marker. This is the length filesort gives the column in a sort key.
+*/
+static uint key_part_sort_length(Field *field)
+{
+  const CHARSET_INFO *cs = field->sort_charset();
+  uint length = field->sort_length();
+
+  if (use_strnxfrm(cs))
+    length = cs->coll->strnxfrmlen(cs, length);
+  return length;
+}
+
+/* length of the sortable form of a full key */
+static uint index_key_length(KEY *key_info)
+{
+  KEY_PART_INFO *part = key_info->key_part;
+  KEY_PART_INFO *end = part + key_info->user_defined_key_parts;
+  uint length = 0;
+
+  for (; part < end; part++)
+    length += key_part_sort_length(part->field) +
+              (part->field->real_maybe_null() ? 1 : 0);
+  return length;
+}
+
+/*
+  Whether a key part can be read back from its sortable form. Integers
+  are only reordered (big-endian with the sign bit flipped); the weights
+  of a string or the sort form of a float or a date are not unpacked.
+*/
+static bool key_part_unpackable(Field *field)
+{
+  switch (field->real_type()) {
+  case MYSQL_TYPE_TINY:
+  case MYSQL_TYPE_SHORT:
+  case MYSQL_TYPE_INT24:
+  case MYSQL_TYPE_LONG:
+  case MYSQL_TYPE_LONGLONG:
+  case MYSQL_TYPE_YEAR:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/*
+  The column list of an index declared with
+  COMMENT 'spartan_include=col,...', or NULL for any other index. Such
+  an index stores an image of the listed columns, and of its key parts
+  that cannot be unpacked, with each entry so reads of it never need
+  the data file.
+*/
+#define SDE_INCLUDE "spartan_include="
+
+static const char *index_include_list(KEY *key_info, uint *length)
+{
+  size_t prefix = sizeof(SDE_INCLUDE) - 1;
+
+  if (!(key_info->flags & HA_USES_COMMENT) ||
+      (key_info->comment.length < prefix) ||
+      (strncmp(key_info->comment.str, SDE_INCLUDE, prefix) != 0))
+    return NULL;
+  *length = (uint)(key_info->comment.length - prefix);
+  return key_info->comment.str + prefix;
+}
+
+/* length of a column image: the NULL marker and the column bytes */
+static uint image_length(Field *field)
+{
+  return field->pack_length() + (field->real_maybe_null() ? 1 : 0);
+}
+
+/*
+  Find the columns an index stores images of (see index_include_list())
+  in the table's field list. Returns how many there are, or -1 if a
+  listed column does not exist or there are more than SDE_MAX_IMAGES.
+*/
+static int index_image_fields(Field **fields, KEY *key_info, Field **to)
+{
+  KEY_PART_INFO *part;
+  KEY_PART_INFO *end = key_info->key_part + key_info->user_defined_key_parts;
+  const char *list;
+  const char *name;
+  char buff[NAME_LEN + 1];
+  Field **field;
+  uint length;
+  uint name_len;
+  uint count = 0;
+  uint i;
+
+  if ((list = index_include_list(key_info, &length)) == NULL)
+    return 0;
+  for (part = key_info->key_part; part < end; part++)
+  {
+    if (!key_part_unpackable(part->field))
+      to[count++] = part->field;
+  }
+  while (length > 0)
+  {
+    /* the next name, without the commas and spaces around it */
+    while ((length > 0) &&
+           ((*list == ',') || my_isspace(system_charset_info, *list)))
+      list++, length--;
+    for (name = list; (length > 0) && (*list != ','); list++, length--) ;
+    name_len = (uint)(list - name);
+    while ((name_len > 0) &&
+           my_isspace(system_charset_info, name[name_len - 1]))
+      name_len--;
+    if (name_len == 0)
+      continue;
+    if (name_len > NAME_LEN)
+      return -1;
+    memcpy(buff, name, name_len);
+    buff[name_len] = '\0';
+    for (field = fields; *field != NULL; field++)
+    {
+      if (my_strcasecmp(system_charset_info, (*field)->field_name, buff) == 0)
+        break;
+    }
+    if (*field == NULL)
+      return -1;
+    /* key parts are in the key already, or stored above */
+    for (part = key_info->key_part; part < end; part++)
+    {
+      if (part->field->field_index == (*field)->field_index)
+        break;
+    }
+    for (i = 0; (i < count) && (to[i]->field_index != (*field)->field_index);
+         i++) ;
+    if ((part < end) || (i < count))
+      continue;
+    if (count == SDE_MAX_IMAGES)
+      return -1;
+    to[count++] = *field;
+  }
+  return (int)count;
+}
+
+/* length of the entry key of an index: the sortable key and the images */
+static uint index_entry_length(KEY *key_info, Field **images, uint count)
+{
+  uint length = index_key_length(key_info);
+
+  while (count-- > 0)
+    length += image_length(images[count]);
+  return length;
+}
+
+/*
+  A CHAR or VARCHAR column declared with COMMENT 'spartan_ngram' has an
+  n-gram index (see spartan_ngram_index.h) that a table scan for
+  col LIKE '%text%' uses to read only the rows that may match.
+*/
+#define SDE_NGRAM "spartan_ngram"
+
+/*
+  Whether LIKE compares a collation byte by byte, so the trigrams of a
+  value and of a pattern can be matched as bytes: a binary collation of
+  a single-byte charset or of utf8 (whose bytes never look like a
+  wildcard inside a character), or a single-byte collation that LIKE
+  compares by the weight of each byte.
+*/
+static bool ngram_collation(const CHARSET_INFO *cs)
+{
+  if (cs->mbmaxlen > 1)
+    return (cs->state & MY_CS_BINSORT) && (cs->mbminlen == 1) &&
+           (strncmp(cs->csname, "utf8", 4) == 0);
+  return (cs->state & MY_CS_BINSORT) || (cs->sort_order != NULL);
+}
+
+/* fold text to what LIKE compares: the weight of each byte, or the byte */
+static void ngram_fold(const CHARSET_INFO *cs, uchar *text, uint len)
+{
+  if (cs->state & MY_CS_BINSORT)
+    return;
+  for (uint i = 0; i < len; i++)
+    text[i] = cs->sort_order[text[i]];
+}
+
+/* whether a column can have an n-gram index */
+static bool ngram_column(Field *field)
+{
+  return ((field->real_type() == MYSQL_TYPE_STRING) ||
+          (field->real_type() == MYSQL_TYPE_VARCHAR)) &&
+         ngram_collation(field->charset());
+}
+
+/*
+  The columns declared with an n-gram index, in column order. Returns
+  how many there are (at most SDE_MAX_NGRAMS are used).
+*/
+static uint ngram_fields(Field **fields, Field **to)
+{
+  uint count = 0;
+
+  for (; (*fields != NULL) && (count < SDE_MAX_NGRAMS); fields++)
+  {
+    if (((*fields)->comment.length > 0) &&
+        table_comment_has((*fields)->comment, SDE_NGRAM))
+      to[count++] = *fields;
+  }
+  return count;
+}
+
+
+/**
+  @brief
+  Index capabilities. Reads of an index can be answered from the index
+  alone (HA_KEYREAD_ONLY) for the key parts unpack_entry_key() can fill
+  in: integers, or any column of an index that stores images.
+
+  @details
+  part is the key part to check. First key part is 0
+  If all_parts it's set, MySQL want to know the flags for the combined
+  index up to and including 'part'.
+*/
+ulong ha_spartan::index_flags(uint inx, uint part, bool all_parts) const
+{
+  ulong flags = (HA_READ_NEXT | HA_READ_PREV | HA_READ_RANGE | HA_READ_ORDER);
+  KEY *key_info;
+  uint length;
+  uint i;
+
+  if ((table_share == NULL) || (inx >= table_share->keys))
+    return flags;
+  key_info = table_share->key_info + inx;
+  if (index_include_list(key_info, &length) != NULL)
+    return flags | HA_KEYREAD_ONLY;
+  for (i = all_parts ? 0 : part; i <= part; i++)
+  {
+    if ((i >= key_info->user_defined_key_parts) ||
+        !key_part_unpackable(key_info->key_part[i].field))
+      return flags;
+  }
+  return flags | HA_KEYREAD_ONLY;
+}
+
+
 /**
   @brief
   Used for opening tables. The name will be the name of the file.
@@ -220,9 +565,52 @@ int ha_spartan::open(const char *name, int mode, uint test_if_locked)
 {
   DBUG_ENTER("ha_spartan::open");
   char name_buff[FN_REFLEN];
+  bool fresh[SDE_MAX_NGRAMS];
+  uint i;
 
   if (!(share = get_share()))
     DBUG_RETURN(1);
+  key_record = (uchar *)my_malloc(table->s->rec_buff_length, MYF(MY_WME));
+  batch = (SDE_INDEX *)my_malloc(SDE_BATCH_SIZE * sizeof(SDE_INDEX),
+                                 MYF(MY_WME));
+  if ((key_record == NULL) || (batch == NULL))
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  if (ngram_fields(table->field, ngram_field) > 0)
+  {
+    ngram_buf[0] = (uchar *)my_malloc(table->s->reclength, MYF(MY_WME));
+    ngram_buf[1] = (uchar *)my_malloc(table->s->reclength, MYF(MY_WME));
+    if ((ngram_buf[0] == NULL) || (ngram_buf[1] == NULL))
+      DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  }
+  for (i = 0; i < table->s->keys; i++)
+  {
+    KEY *key_info = table->key_info + i;
+    int images = index_image_fields(table->field, key_info, index_image[i]);
+
+    index_images[i] = (images > 0) ? (uint)images : 0;
+    index_sort_len[i] = index_key_length(key_info);
+    index_key_len[i] = index_entry_length(key_info, index_image[i],
+                                          index_images[i]);
+    /*
+      The server only reads an index alone for columns that are part
+      of it, so the columns it stores images of are marked as such.
+    */
+    for (uint j = 0; j < index_images[i]; j++)
+      index_image[i][j]->part_of_key.set_bit(i);
+  }
+  /*
+    The data file, the indexes and the row cache are shared by all
+    handlers of the table. The first open loads them and the last close
+    writes them back, so no handler reads a tree another one is
+    loading or freeing.
+  */
+  mysql_mutex_lock(&share->mutex);
+  if (share->use_count++ > 0)
+  {
+    mysql_mutex_unlock(&share->mutex);
+    thr_lock_data_init(&share->lock,&lock,NULL);
+    DBUG_RETURN(0);
+  }
   /*
     Call the data class open table method.
     Note: the fn_format() method correctly creates a file name from the
@@ -230,12 +618,46 @@ int ha_spartan::open(const char *name, int mode, uint test_if_locked)
   */
   share->data_class->open_table(fn_format(name_buff, name, "", SDE_EXT,
                                 MY_REPLACE_EXT|MY_UNPACK_FILENAME));
-  share->index_class->open_index(fn_format(name_buff, name, "", SDI_EXT,
-                                MY_REPLACE_EXT|MY_UNPACK_FILENAME));
-  share->index_class->load_index();
-  DBUG_PRINT("info", ("here 1"));
+  for (i = 0; i < share->num_indexes; i++)
+  {
+    share->index_class[i]->set_cache_size(srv_index_cache_size);
+    share->index_class[i]->set_art_limit(srv_index_art_size);
+    share->index_class[i]->set_hash_size(srv_index_hash_size);
+    share->index_class[i]->set_bloom_bits(srv_index_bloom_bits);
+    share->index_class[i]->set_lsm_memtable_size(
+      srv_index_lsm_memtable_size);
+    share->index_class[i]->set_mmap(srv_index_mmap);
+    share->index_class[i]->open_index(index_file_name(name_buff, name, i));
+    share->index_class[i]->load_index();
+  }
+  for (i = 0; i < share->num_ngrams; i++)
+  {
+    Spartan_index *postings = share->ngram_class[i]->postings();
+
+    postings->set_cache_size(srv_index_cache_size);
+    postings->set_art_limit(srv_index_art_size);
+    postings->set_hash_size(0);
+    postings->set_bloom_bits(srv_index_bloom_bits);
+    postings->set_mmap(srv_index_mmap);
+    share->ngram_class[i]->open_ngram(ngram_file_name(name_buff, name, i),
+                                      &fresh[i]);
+  }
+  /*
+    Spartan stores every row in the full record buffer length (there are
+    no blobs and VARCHAR values are kept in their reserved width), so all
+    rows of a table have the same size and can use the fixed-width path.
+    The row cache is sized the first time the table is opened.
+  */
+  if (table->s->blob_fields == 0)
+    share->data_class->set_fixed_length(table->s->rec_buff_length);
+  if (!share->row_cache->is_enabled())
+    share->row_cache->init_cache(table->s->rec_buff_length,
+                                 srv_row_cache_size);
+  rebuild_indexes();
+  /* an n-gram index whose file was missing is filled from the rows */
+  build_ngrams(fresh);
+  mysql_mutex_unlock(&share->mutex);
   thr_lock_data_init(&share->lock,&lock,NULL);
-  DBUG_PRINT("info", ("here 2"));
   DBUG_RETURN(0);
 }
 
@@ -258,57 +680,469 @@ int ha_spartan::open(const char *name, int mode, uint test_if_locked)
 int ha_spartan::close(void)
 {
   DBUG_ENTER("ha_spartan::close");
-  share->data_class->close_table();
-  share->index_class->save_index();
-  share->index_class->destroy_index();
-  share->index_class->close_index();
+  /* a bulk insert that was not ended still writes its indexes */
+  end_bulk_insert();
+  share->data_class->end_scan(&scan_buf);
+  my_free(key_record);
+  key_record = NULL;
+  my_free(batch);
+  batch = NULL;
+  end_ngram_scan();
+  my_free(ngram_buf[0]);
+  my_free(ngram_buf[1]);
+  ngram_buf[0] = ngram_buf[1] = NULL;
+  /* the last handler to close the table writes back the shared state */
+  mysql_mutex_lock(&share->mutex);
+  if (--share->use_count == 0)
+  {
+    share->data_class->close_table();
+    for (uint i = 0; i < share->num_indexes; i++)
+    {
+      share->index_class[i]->save_index();
+      share->index_class[i]->destroy_index();
+      share->index_class[i]->close_index();
+    }
+    for (uint i = 0; i < share->num_ngrams; i++)
+      share->ngram_class[i]->close_ngram();
+  }
+  mysql_mutex_unlock(&share->mutex);
   DBUG_RETURN(0);
 }
 
-uchar *ha_spartan::get_key()
+/*
+  Write the key of index keynr for a record in a form that sorts bytewise in the
+  order the server sorts the values, so the index compares keys with a
+  plain memcmp. Each key part is stored as filesort stores it (see
+  Field::make_sort_key(): integers big-endian with the sign bit flipped,
+  strings as the weights of their collation padded to full length),
+  after a byte that is 0 for NULL and 1 otherwise if the column is
+  nullable. Only the key parts in keypart_map are written. Returns the
+  length of the key.
+*/
+uint ha_spartan::make_index_key(uint keynr, uchar *to, const uchar *record,
+                                key_part_map keypart_map)
 {
-  uchar *key = 0;
+  KEY *key_info = table->key_info + keynr;
+  KEY_PART_INFO *part = key_info->key_part;
+  KEY_PART_INFO *end = part + key_info->user_defined_key_parts;
+  my_ptrdiff_t diff = (my_ptrdiff_t)(record - table->record[0]);
+  uchar *start = to;
+  uint length;
+
+  DBUG_ENTER("ha_spartan::make_index_key");
+  for (; (part < end) && (keypart_map & 1); part++, keypart_map >>= 1)
+  {
+    Field *field = part->field;
+    length = key_part_sort_length(field);
+    if (field->real_maybe_null())
+    {
+      if (field->is_real_null(diff))
+      {
+        *to++ = 0;
+        memset(to, 0, length);
+        to += length;
+        continue;
+      }
+      *to++ = 1;
+    }
+    field->move_field_offset(diff);
+    field->make_sort_key(to, length);
+    field->move_field_offset(-diff);
+    to += length;
+  }
+  DBUG_RETURN((uint)(to - start));
+}
 
-  DBUG_ENTER("ha_spartan::get_key");
-  /*
-    For each field in the table, check to see if it is the key
-    by checking the key_start variable. (1 = is a key).
-  */
-  for (Field **field=table->field ; *field ; field++)
+/*
+  Convert a search key in the server's key format to the sortable form
+  of make_index_key() by restoring it into key_record first.
+*/
+uint ha_spartan::make_search_key(uint keynr, uchar *to, const uchar *key,
+                                 key_part_map keypart_map)
+{
+  DBUG_ENTER("ha_spartan::make_search_key");
+  key_restore(key_record, (uchar *)key, table->key_info + keynr,
+              calculate_key_len(table, keynr, key, keypart_map));
+  DBUG_RETURN(make_index_key(keynr, to, key_record, keypart_map));
+}
+
+/*
+  Write the key of index keynr for a record as it is stored in the index:
+  the sortable key of make_index_key(), then the image of each column the
+  index stores, after a NULL marker if the column is nullable. Images are
+  only carried along and never searched on. A VARCHAR keeps just the
+  bytes in use, so two images of the same value do not differ in the
+  unused part of the reserved width.
+*/
+uint ha_spartan::make_entry_key(uint keynr, uchar *to, const uchar *record)
+{
+  my_ptrdiff_t diff = (my_ptrdiff_t)(record - table->record[0]);
+  uchar *start = to;
+  uint length;
+  uint used;
+  uint i;
+
+  DBUG_ENTER("ha_spartan::make_entry_key");
+  to += make_index_key(keynr, to, record, HA_WHOLE_KEY);
+  for (i = 0; i < index_images[keynr]; i++)
   {
-    if ((*field)->key_start.to_ulonglong() == 1)
+    Field *field = index_image[keynr][i];
+    const uchar *from = field->ptr + diff;
+
+    used = length = field->pack_length();
+    if (field->real_maybe_null())
+    {
+      if (field->is_real_null(diff))
+      {
+        *to++ = 0;
+        memset(to, 0, length);
+        to += length;
+        continue;
+      }
+      *to++ = 1;
+    }
+    if (field->real_type() == MYSQL_TYPE_VARCHAR)
     {
-      /*
-        Copy field value to key value (save key)
-      */
-      key = (uchar *)my_malloc((*field)->field_length, 
-                                  MYF(MY_ZEROFILL | MY_WME));
-      memcpy(key, (*field)->ptr, (*field)->key_length());
+      uint length_bytes = ((Field_varstring *)field)->length_bytes;
+      used = length_bytes + ((length_bytes == 1) ? (uint)*from :
+                                                   (uint)uint2korr(from));
     }
+    memcpy(to, from, used);
+    memset(to + used, 0, length - used);
+    to += length;
   }
-  DBUG_RETURN(key);
+  DBUG_RETURN((uint)(to - start));
 }
 
-int ha_spartan::get_key_len()
+/*
+  Fill the columns of index keynr in buf from an entry key, for reads
+  with HA_EXTRA_KEYREAD. Integer key parts are unpacked from their
+  sortable form and the other columns are copied from their images.
+  Columns the index does not hold are left as they are.
+*/
+void ha_spartan::unpack_entry_key(uint keynr, uchar *buf, const uchar *key)
 {
-  int length = 0;
+  KEY *key_info = table->key_info + keynr;
+  KEY_PART_INFO *part = key_info->key_part;
+  KEY_PART_INFO *end = part + key_info->user_defined_key_parts;
+  my_ptrdiff_t diff = (my_ptrdiff_t)(buf - table->record[0]);
+  uint length;
+  uint i;
+
+  DBUG_ENTER("ha_spartan::unpack_entry_key");
+  for (; part < end; part++)
+  {
+    Field *field = part->field;
+    length = key_part_sort_length(field);
+    if (field->real_maybe_null())
+    {
+      if (*key++ == 0)
+      {
+        field->set_null(diff);
+        key += length;
+        continue;
+      }
+      field->set_notnull(diff);
+    }
+    if (key_part_unpackable(field))
+    {
+      uchar *to = field->ptr + diff;
+      for (i = 0; i < length; i++)
+        to[i] = key[length - 1 - i];
+      if (!((Field_num *)field)->unsigned_flag)
+        to[length - 1] ^= 128;
+    }
+    key += length;
+  }
+  for (i = 0; i < index_images[keynr]; i++)
+  {
+    Field *field = index_image[keynr][i];
+    length = field->pack_length();
+    if (field->real_maybe_null())
+    {
+      if (*key++ == 0)
+        field->set_null(diff);
+      else
+        field->set_notnull(diff);
+    }
+    memcpy(field->ptr + diff, key, length);
+    key += length;
+  }
+  DBUG_VOID_RETURN;
+}
 
-  DBUG_ENTER("ha_spartan::get_key");
-  /*
-    For each field in the table, check to see if it is the key
-    by checking the key_start variable. (1 = is a key).
-  */
-  for (Field **field=table->field ; *field ; field++)
+/*
+  Whether unique index keynr already has the entry key key (of length
+  bytes, made from record) for another row. A key with a NULL part is
+  never a duplicate. The index compares whole entry keys, images
+  included, so only the sortable key is looked for: in full for an index
+  without images (the bloom filter answers most misses), as a prefix
+  otherwise. The caller holds the share mutex.
+*/
+bool ha_spartan::duplicate_entry(uint keynr, const uchar *record,
+                                 uchar *key, uint length)
+{
+  KEY *key_info = table->key_info + keynr;
+  KEY_PART_INFO *part = key_info->key_part;
+  KEY_PART_INFO *end = part + key_info->user_defined_key_parts;
+  Spartan_index *index = share->index_class[keynr];
+  SDI_CURSOR probe;
+  SDE_INDEX *found;
+
+  if (!(key_info->flags & HA_NOSAME))
+    return false;
+  for (; part < end; part++)
+  {
+    if (part->null_bit && (record[part->null_offset] & part->null_bit))
+      return false;
+  }
+  if (index_images[keynr] == 0)
+    return (index->get_index_pos(key, length) != -1);
+  memset(&probe, 0, sizeof(probe));
+  found = index->cursor_lower_bound(&probe, key, index_sort_len[keynr]);
+  return ((found != NULL) &&
+          (memcmp(found->key, key, index_sort_len[keynr]) == 0));
+}
+
+/*
+  A builder for the whole of index keynr (see Spartan_index_builder). For
+  a unique index it is told where the NULL markers of the key are, since
+  rows with a NULL key part are never duplicates (see duplicate_entry()).
+*/
+Spartan_index_builder *ha_spartan::new_builder(uint keynr)
+{
+  KEY *key_info = table->key_info + keynr;
+  KEY_PART_INFO *part = key_info->key_part;
+  KEY_PART_INFO *end = part + key_info->user_defined_key_parts;
+  bool unique = (key_info->flags & HA_NOSAME);
+  Spartan_index_builder *b;
+  uint offset = 0;
+
+  b = new Spartan_index_builder(share->index_class[keynr],
+                                index_key_len[keynr],
+                                unique ? index_sort_len[keynr] : 0,
+                                srv_index_build_memory,
+                                srv_index_build_threads, mysql_tmpdir);
+  for (; unique && (b != NULL) && (part < end); part++)
+  {
+    if (part->field->real_maybe_null())
+      b->add_null_marker(offset++);
+    offset += key_part_sort_length(part->field);
+  }
+  return b;
+}
+
+/*
+  Rebuild the indexes that do not hold sortable keys from the data file
+  in one scan. These are indexes written before keys were stored in
+  sortable form, which hold the raw column bytes, and index files that
+  were missing. The caller holds the share mutex.
+*/
+int ha_spartan::rebuild_indexes()
+{
+  bool stale[SDE_MAX_KEYS];
+  bool any = false;
+  uint i;
+
+  DBUG_ENTER("ha_spartan::rebuild_indexes");
+  for (i = 0; i < table->s->keys; i++)
+  {
+    stale[i] = !share->index_class[i]->sortable_keys();
+    any |= stale[i];
+  }
+  if (!any)
+    DBUG_RETURN(0);
+  DBUG_RETURN(build_indexes(stale));
+}
+
+/*
+  Write the indexes marked in build from the rows of the data file. The
+  keys of the rows are read in one scan and handed to a builder for each
+  index, which sorts them in parallel; the indexes are then loaded from
+  the sorted keys at the same time. Rows with the key of another row in
+  a unique index are left out of it; the index is then marked crashed
+  and HA_ERR_FOUND_DUPP_KEY returned with errkey set. The caller holds
+  the share mutex.
+*/
+int ha_spartan::build_indexes(bool *build)
+{
+  Spartan_index_builder *builders[SDE_MAX_KEYS];
+  uint keynr[SDE_MAX_KEYS];
+  SDE_SCAN scan;
+  SDE_INDEX ndx;
+  uchar *rec = table->record[1];
+  long long row_size;
+  long long pos = 0;
+  long long next;
+  uint n = 0;
+  uint i;
+  int rc = 0;
+
+  DBUG_ENTER("ha_spartan::build_indexes");
+  for (i = 0; i < table->s->keys; i++)
   {
-    if ((*field)->key_start.to_ulonglong() == 1)
-      /*
-        Copy field length to key length
-      */
-      length = (*field)->key_length();
+    if (!build[i])
+      continue;
+    keynr[n] = i;
+    if ((builders[n++] = new_builder(i)) == NULL)
+    {
+      n--;
+      rc = HA_ERR_OUT_OF_MEM;
+    }
   }
-  DBUG_RETURN(length);
+  if (n == 0)
+    DBUG_RETURN(rc);
+  row_size = share->data_class->row_size(table->s->rec_buff_length);
+  scan.block = NULL;
+  scan.block_start = -1;
+  scan.block_len = 0;
+  share->data_class->init_scan(&scan);
+  while (!rc && ((next = share->data_class->scan_row(&scan, rec,
+                                                     table->s->rec_buff_length,
+                                                     pos)) != -1))
+  {
+    for (i = 0; !rc && (i < n); i++)
+    {
+      ndx.length = make_entry_key(keynr[i], ndx.key, rec);
+      rc = builders[i]->add_entry(ndx.key, ndx.length, next - row_size);
+    }
+    pos = next;
+  }
+  share->data_class->end_scan(&scan);
+  if (!rc)
+    rc = Spartan_index_builder::end_builds(builders, n);
+  for (i = 0; i < n; i++)
+  {
+    if (!rc && (builders[i]->duplicates() > 0))
+    {
+      share->index_class[keynr[i]]->mark_crashed();
+      errkey = keynr[i];
+      rc = HA_ERR_FOUND_DUPP_KEY;
+    }
+    delete builders[i];
+  }
+  DBUG_RETURN(rc);
 }
 
+/*
+  Write the text the n-th n-gram index holds for a record to to: the
+  column value folded to what LIKE compares. Returns its length; a NULL
+  has none.
+*/
+uint ha_spartan::ngram_value(uint n, const uchar *record, uchar *to)
+{
+  Field *field = ngram_field[n];
+  my_ptrdiff_t diff = (my_ptrdiff_t)(record - table->record[0]);
+  char buff[MAX_FIELD_WIDTH];
+  String tmp(buff, sizeof(buff), field->charset());
+  String *value;
+  uint length;
+
+  if (field->is_real_null(diff))
+    return 0;
+  field->move_field_offset(diff);
+  value = field->val_str(&tmp);
+  field->move_field_offset(-diff);
+  length = MY_MIN(value->length(), table->s->reclength);
+  memcpy(to, value->ptr(), length);
+  ngram_fold(field->charset(), to, length);
+  return length;
+}
+
+/*
+  Fill the n-gram indexes marked in build from the rows of the data
+  file. The caller holds the share mutex.
+*/
+int ha_spartan::build_ngrams(bool *build)
+{
+  SDE_SCAN scan;
+  uchar *rec = table->record[1];
+  long long row_size;
+  long long pos = 0;
+  long long next;
+  uint len;
+  uint i;
+  bool any = false;
+  int rc = 0;
+
+  DBUG_ENTER("ha_spartan::build_ngrams");
+  for (i = 0; i < share->num_ngrams; i++)
+  {
+    if (build[i])
+    {
+      share->ngram_class[i]->trunc_ngram();
+      any = true;
+    }
+  }
+  if (!any)
+    DBUG_RETURN(0);
+  row_size = share->data_class->row_size(table->s->rec_buff_length);
+  scan.block = NULL;
+  scan.block_start = -1;
+  scan.block_len = 0;
+  share->data_class->init_scan(&scan);
+  while (!rc && ((next = share->data_class->scan_row(&scan, rec,
+                                                     table->s->rec_buff_length,
+                                                     pos)) != -1))
+  {
+    for (i = 0; !rc && (i < share->num_ngrams); i++)
+    {
+      if (!build[i])
+        continue;
+      len = ngram_value(i, rec, ngram_buf[0]);
+      rc = share->ngram_class[i]->add_text(ngram_buf[0], len,
+                                           next - row_size);
+    }
+    pos = next;
+  }
+  share->data_class->end_scan(&scan);
+  DBUG_RETURN(rc);
+}
+
+/*
+  Read the row stored at pos in the data file, checking the row cache
+  first. Rows read from disk are added to the cache. A cache hit and a
+  read of a fixed-width row take no share mutex (see
+  Spartan_row_cache::fetch_row() and Spartan_data::pread_row()); the
+  mutex is only taken to store the row read, and the row is not stored
+  if a row was invalidated since the read began, so an update or delete
+  that slips in between cannot leave a stale row in the cache. Rows of
+  variable width are read with the mutex held, as the data file's
+  offset is shared.
+*/
+int ha_spartan::read_cached_row(uchar *buf, long long pos)
+{
+  int64 changes;
+  int rc = 0;
+
+  DBUG_ENTER("ha_spartan::read_cached_row");
+  if (share->row_cache->fetch_row(pos, buf))
+  {
+    my_atomic_add64(&spartan_row_cache_hits, 1);
+    DBUG_RETURN(0);
+  }
+  if (share->row_cache->is_enabled())
+    my_atomic_add64(&spartan_row_cache_misses, 1);
+  if (!share->data_class->is_fixed())
+  {
+    mysql_mutex_lock(&share->mutex);
+    rc = share->data_class->read_row(buf, table->s->rec_buff_length, pos);
+    if (rc == 0)
+      share->row_cache->store_row(pos, buf);
+    mysql_mutex_unlock(&share->mutex);
+    DBUG_RETURN(rc);
+  }
+  changes = share->row_cache->changes();
+  rc = share->data_class->pread_row(buf, pos);
+  if ((rc == 0) && share->row_cache->is_enabled())
+  {
+    mysql_mutex_lock(&share->mutex);
+    if (share->row_cache->changes() == changes)
+      share->row_cache->store_row(pos, buf);
+    mysql_mutex_unlock(&share->mutex);
+  }
+  DBUG_RETURN(rc);
+}
 
 /**
   @brief
@@ -344,24 +1178,58 @@ int ha_spartan::write_row(uchar *buf)
 {
   DBUG_ENTER("ha_spartan::write_row");
   long long pos;
-  SDE_INDEX ndx;
+  SDE_INDEX ndx[SDE_MAX_KEYS];
+  uint i;
+  int rc = 0;
 
   ha_statistic_increment(&SSV::ha_write_count);
+  for (i = 0; i < table->s->keys; i++)
+    ndx[i].length = make_entry_key(i, ndx[i].key, buf);
   /*
     Begin critical section by locking the spartan mutex variable.
   */
   mysql_mutex_lock(&share->mutex);
-  ndx.length = get_key_len();
-  memcpy(ndx.key, get_key(), get_key_len());
+  /*
+    A row with the key of another row in a unique index is not written.
+    Unique indexes are never left to a bulk build, so this holds for a
+    bulk insert as well.
+  */
+  for (i = 0; i < table->s->keys; i++)
+  {
+    if (duplicate_entry(i, buf, ndx[i].key, ndx[i].length))
+    {
+      mysql_mutex_unlock(&share->mutex);
+      errkey = i;
+      DBUG_RETURN(HA_ERR_FOUND_DUPP_KEY);
+    }
+  }
   pos = share->data_class->write_row(buf, table->s->rec_buff_length);
-  ndx.pos = pos;
-  if ((ndx.key != 0) && (ndx.length != 0))
-    share->index_class->insert_key(&ndx, false);
+  /*
+    A key that cannot be added to its builder ends the bulk build, and
+    an index that cannot take the entry is marked crashed; the row is
+    still indexed wherever it can be and the error returned.
+  */
+  for (i = 0; i < table->s->keys; i++)
+  {
+    ndx[i].pos = pos;
+    if ((builder[i] != NULL) &&
+        (rc = builder[i]->add_entry(ndx[i].key, ndx[i].length, pos)))
+      free_builders(true);
+    if ((builder[i] == NULL) &&
+        (share->index_class[i]->insert_key(&ndx[i], true) < 0))
+    {
+      share->index_class[i]->mark_crashed();
+      rc = HA_ERR_CRASHED_ON_USAGE;
+    }
+  }
+  for (i = 0; i < share->num_ngrams; i++)
+    share->ngram_class[i]->add_text(ngram_buf[0],
+                                    ngram_value(i, buf, ngram_buf[0]), pos);
   /*
     End section by unlocking the spartan mutex variable.
   */
   mysql_mutex_unlock(&share->mutex);
-  DBUG_RETURN(0);
+  DBUG_RETURN(rc);
 }
 
 
@@ -390,28 +1258,66 @@ int ha_spartan::write_row(uchar *buf)
 */
 int ha_spartan::update_row(const uchar *old_data, uchar *new_data)
 {
+  uchar old_key[SDE_MAX_KEYS][SDI_MAX_KEY_LEN];
+  uchar new_key[SDE_MAX_KEYS][SDI_MAX_KEY_LEN];
+  long long pos;
+  uint i;
+  int rc = 0;
 
   DBUG_ENTER("ha_spartan::update_row");
+  for (i = 0; i < table->s->keys; i++)
+  {
+    make_entry_key(i, old_key[i], old_data);
+    make_entry_key(i, new_key[i], new_data);
+  }
   /*
     Begin critical section by locking the spartan mutex variable.
   */
   mysql_mutex_lock(&share->mutex);
+  /* a unique key may only change to a value no other row has */
+  for (i = 0; i < table->s->keys; i++)
+  {
+    if ((memcmp(old_key[i], new_key[i], index_sort_len[i]) != 0) &&
+        duplicate_entry(i, new_data, new_key[i], index_key_len[i]))
+    {
+      mysql_mutex_unlock(&share->mutex);
+      errkey = i;
+      DBUG_RETURN(HA_ERR_FOUND_DUPP_KEY);
+    }
+  }
   share->data_class->update_row((uchar *)old_data, new_data, 
                  table->s->rec_buff_length, current_position -
                  share->data_class->row_size(table->s->rec_buff_length)); 
-  if (get_key() != 0)
+  share->row_cache->invalidate_row(current_position -
+                 share->data_class->row_size(table->s->rec_buff_length));
+  /* the row stays where it is, so only indexes whose entry changed */
+  pos = current_position -
+        share->data_class->row_size(table->s->rec_buff_length);
+  for (i = 0; i < table->s->keys; i++)
   {
-    share->index_class->update_key(get_key(), current_position -
-                   share->data_class->row_size(table->s->rec_buff_length),
-                   get_key_len());
-    share->index_class->save_index();
-    share->index_class->load_index();
+    if ((memcmp(old_key[i], new_key[i], index_key_len[i]) != 0) &&
+        share->index_class[i]->update_key(old_key[i], new_key[i], pos,
+                                          index_key_len[i]))
+    {
+      share->index_class[i]->mark_crashed();
+      rc = HA_ERR_CRASHED_ON_USAGE;
+    }
+  }
+  for (i = 0; i < share->num_ngrams; i++)
+  {
+    uint old_len = ngram_value(i, old_data, ngram_buf[0]);
+    uint new_len = ngram_value(i, new_data, ngram_buf[1]);
+
+    if ((old_len != new_len) ||
+        (memcmp(ngram_buf[0], ngram_buf[1], new_len) != 0))
+      share->ngram_class[i]->update_text(ngram_buf[0], old_len,
+                                         ngram_buf[1], new_len, pos);
   }
   /*
     End section by unlocking the spartan mutex variable.
   */
   mysql_mutex_unlock(&share->mutex);
-  DBUG_RETURN(0);
+  DBUG_RETURN(rc);
 }
 
 
@@ -439,58 +1345,224 @@ int ha_spartan::delete_row(const uchar *buf)
 {
   DBUG_ENTER("ha_spartan::delete_row");
   long long pos;
+  uchar key[SDE_MAX_KEYS][SDI_MAX_KEY_LEN];
+  uint i;
+  int rc = 0;
 
   if (current_position > 0)
     pos = current_position -
       share->data_class->row_size(table->s->rec_buff_length);
   else
     pos = 0;
+  for (i = 0; i < table->s->keys; i++)
+    make_entry_key(i, key[i], buf);
   /*
     Begin critical section by locking the spartan mutex variable.
   */
   mysql_mutex_lock(&share->mutex);
   share->data_class->delete_row((uchar *)buf, 
                                 table->s->rec_buff_length, pos);
-  if (get_key() != 0)
-    share->index_class->delete_key(get_key(), pos, get_key_len());
+  share->row_cache->invalidate_row(pos);
+  for (i = 0; i < table->s->keys; i++)
+  {
+    if (share->index_class[i]->delete_key(key[i], pos, index_key_len[i]))
+    {
+      share->index_class[i]->mark_crashed();
+      rc = HA_ERR_CRASHED_ON_USAGE;
+    }
+  }
+  for (i = 0; i < share->num_ngrams; i++)
+    share->ngram_class[i]->remove_text(ngram_buf[0],
+                                       ngram_value(i, buf, ngram_buf[0]),
+                                       pos);
   /*
     End section by unlocking the spartan mutex variable.
   */
   mysql_mutex_unlock(&share->mutex);
+  DBUG_RETURN(rc);
+}
+
+
+/**
+  @brief
+  Called before an index is used. The cursor is left on the index used
+  before, so it is cleared.
+*/
+
+int ha_spartan::index_init(uint idx, bool sorted)
+{
+  DBUG_ENTER("ha_spartan::index_init");
+  /* an index that lost entries is not read until REPAIR TABLE */
+  if (share->index_class[idx]->is_crashed())
+    DBUG_RETURN(HA_ERR_CRASHED_ON_USAGE);
+  active_index = idx;
+  memset(&cursor, 0, sizeof(cursor));
+  key_unique = false;
+  end_batch();
   DBUG_RETURN(0);
 }
 
 
+/*
+  Turn a key into the smallest key of its length that sorts after every
+  key starting with it, by adding one to its last byte and carrying.
+  Returns false if there is no such key (all bytes are 0xff).
+*/
+static bool next_key_prefix(uchar *key, uint length)
+{
+  while (length > 0)
+  {
+    if (++key[--length] != 0)
+      return true;
+  }
+  return false;
+}
+
+
 /**
   @brief
   Positions an index cursor to the index specified in the handle. Fetches the
   row if available. If the key value is null, begin at the first key of the
   index.
+
+  @details
+  keypart_map gives the key parts present in key, and an entry matches
+  if it starts with them. find_flag says which entry is read:
+
+    HA_READ_KEY_EXACT, HA_READ_PREFIX   first match
+    HA_READ_KEY_OR_NEXT                 first entry not before the key
+    HA_READ_AFTER_KEY                   first entry after the matches
+    HA_READ_BEFORE_KEY                  last entry before the matches
+    HA_READ_KEY_OR_PREV,
+    HA_READ_PREFIX_LAST_OR_PREV         last entry not after the matches
+    HA_READ_PREFIX_LAST                 last match
+
+  Each is one seek in the index: to the key, or past the matches by
+  seeking to the key with one added to it (see next_key_prefix()), and
+  for the backward reads one step back from there. Range scans
+  (read_range_first()) are built on these.
 */
 
 int ha_spartan::index_read_map(uchar *buf, const uchar *key,
-                               key_part_map keypart_map __attribute__((unused)),
-                               enum ha_rkey_function find_flag
-                               __attribute__((unused)))
+                               key_part_map keypart_map,
+                               enum ha_rkey_function find_flag)
 {
   int rc;
   long long pos;
+  SDE_INDEX *ndx;
+  Spartan_index *index = share->index_class[active_index];
+  uchar search_key[SDI_MAX_KEY_LEN];
+  uchar bound[SDI_MAX_KEY_LEN];
+  uint search_len = 0;
+  bool after = false;      /* seek past the entries that match */
+  bool backward = false;   /* then read the entry before */
+  bool match = false;      /* the entry must match the key */
   DBUG_ENTER("ha_spartan::index_read");
   MYSQL_INDEX_READ_ROW_START(table_share->db.str, table_share->table_name.str);
-  if (key == NULL)
-    pos = share->index_class->get_first_pos();
+  switch (find_flag) {
+  case HA_READ_KEY_EXACT:
+  case HA_READ_PREFIX:
+    match = true;
+    break;
+  case HA_READ_KEY_OR_NEXT:
+    break;
+  case HA_READ_AFTER_KEY:
+    after = true;
+    break;
+  case HA_READ_BEFORE_KEY:
+    backward = true;
+    break;
+  case HA_READ_KEY_OR_PREV:
+  case HA_READ_PREFIX_LAST_OR_PREV:
+    after = backward = true;
+    break;
+  case HA_READ_PREFIX_LAST:
+    after = backward = match = true;
+    break;
+  default:
+    DBUG_RETURN(HA_ERR_WRONG_COMMAND);
+  }
+  if (key != NULL)
+  {
+    memset(search_key, 0, sizeof(search_key));
+    search_len = make_search_key(active_index, search_key, key, keypart_map);
+  }
+  /* index_next_same() reads the rest of the matches ahead */
+  end_batch();
+  batch_done = false;
+  if (match && !backward)
+    batch_len = search_len;
+  /*
+    A lookup of a full key is first tried without the share mutex. If it
+    succeeds the cursor is only told which entry it is on; it finds the
+    entry in the index if this handler goes on to read the next or
+    previous one.
+  */
+  key_unique = false;
+  if ((key != NULL) && match && !backward &&
+      (search_len == index_key_len[active_index]) &&
+      index->lookup_pos(search_key, search_len, &pos, &key_unique))
+  {
+    if (pos != -1)
+      index->cursor_set(&cursor, search_key, search_len, pos);
+  }
   else
-    pos = share->index_class->get_index_pos((uchar *)key, keypart_map);
+  {
+    key_unique = false;
+    mysql_mutex_lock(&share->mutex);
+    if (key == NULL)
+      ndx = index->cursor_first(&cursor);
+    else
+    {
+      memcpy(bound, search_key, sizeof(bound));
+      if (match && !backward && (search_len == index_key_len[active_index]))
+      {
+        ndx = index->cursor_seek(&cursor, bound, search_len);
+        if (cursor.hashed)
+          my_atomic_add64(&spartan_index_hash_hits, 1);
+        else if (index->hash_enabled())
+          my_atomic_add64(&spartan_index_hash_misses, 1);
+      }
+      else if (!after || next_key_prefix(bound, search_len))
+        ndx = index->cursor_lower_bound(&cursor, bound, search_len);
+      else
+        ndx = NULL;
+      if (backward)
+        ndx = (ndx != NULL) ? index->cursor_prev(&cursor) :
+                              index->cursor_last(&cursor);
+      if ((ndx != NULL) && match &&
+          (memcmp(ndx->key, search_key, search_len) != 0))
+        ndx = NULL;
+    }
+    pos = (ndx != NULL) ? ndx->pos : -1;
+    mysql_mutex_unlock(&share->mutex);
+  }
   if (pos == -1)
     DBUG_RETURN(HA_ERR_KEY_NOT_FOUND);
-  current_position = pos + share->data_class->row_size(table->s->rec_buff_length);
-  rc = share->data_class->read_row(buf, table->s->rec_buff_length, pos);
-  share->index_class->get_next_key();
+  rc = read_index_row(buf);
   MYSQL_INDEX_READ_ROW_DONE(rc);
   DBUG_RETURN(rc);
 }
 
 
+/*
+  Make the row the cursor is on the current row and read it. With
+  HA_EXTRA_KEYREAD the columns of the index are filled in from the
+  entry instead and the data file is not read.
+*/
+int ha_spartan::read_index_row(uchar *buf)
+{
+  current_position = cursor.ndx.pos +
+                     share->data_class->row_size(table->s->rec_buff_length);
+  if (keyread)
+  {
+    unpack_entry_key(active_index, buf, cursor.ndx.key);
+    return 0;
+  }
+  return read_cached_row(buf, cursor.ndx.pos);
+}
+
+
 /**
   @brief
   Used to read forward through the index.
@@ -499,20 +1571,71 @@ int ha_spartan::index_read_map(uchar *buf, const uchar *key,
 int ha_spartan::index_next(uchar *buf)
 {
   int rc;
-  uchar *key = 0;
+  SDE_INDEX *ndx;
   long long pos;
 
   DBUG_ENTER("ha_spartan::index_next");
   MYSQL_INDEX_READ_ROW_START(table_share->db.str, table_share->table_name.str);
-  key = share->index_class->get_next_key();
-  if (key == 0)
-    DBUG_RETURN(HA_ERR_END_OF_FILE);
-  pos = share->index_class->get_index_pos((uchar *)key, get_key_len());
-  share->index_class->seek_index(key, get_key_len());
-  share->index_class->get_next_key();
-  if (pos == -1)
-    DBUG_RETURN(HA_ERR_KEY_NOT_FOUND);
-  rc = share->data_class->read_row(buf, table->s->rec_buff_length, pos);
+  key_unique = false;
+  end_batch();
+  mysql_mutex_lock(&share->mutex);
+  ndx = share->index_class[active_index]->cursor_next(&cursor);
+  pos = (ndx != NULL) ? ndx->pos : -1;
+  mysql_mutex_unlock(&share->mutex);
+  if (pos == -1)
+    DBUG_RETURN(HA_ERR_END_OF_FILE);
+  rc = read_index_row(buf);
+  MYSQL_INDEX_READ_ROW_DONE(rc);
+  DBUG_RETURN(rc);
+}
+
+
+/**
+  @brief
+  Used to read the next row with the same key as the last index read.
+
+  @details
+  After a key lookup that was answered without the mutex and found the
+  only entry with the key, there is no further match and the index
+  does not have to be searched. That is the usual case for a unique
+  index.
+
+  The rows of a non-unique key are read from the index SDE_BATCH_SIZE
+  entries at a time (see Spartan_index::cursor_fetch()), in row order,
+  so the mutex is taken once per batch rather than once per row.
+*/
+
+int ha_spartan::index_next_same(uchar *buf, const uchar *key, uint keylen)
+{
+  Spartan_index *index = share->index_class[active_index];
+  SDE_INDEX *ndx;
+  int rc;
+
+  DBUG_ENTER("ha_spartan::index_next_same");
+  if (key_unique)
+  {
+    key_unique = false;
+    DBUG_RETURN(HA_ERR_END_OF_FILE);
+  }
+  if (batch_len == 0)
+    DBUG_RETURN(handler::index_next_same(buf, key, keylen));
+  MYSQL_INDEX_READ_ROW_START(table_share->db.str, table_share->table_name.str);
+  if (batch_next == batch_count)
+  {
+    if (batch_done)
+      DBUG_RETURN(HA_ERR_END_OF_FILE);
+    mysql_mutex_lock(&share->mutex);
+    batch_count = index->cursor_fetch(&cursor, batch_len, batch,
+                                      SDE_BATCH_SIZE);
+    mysql_mutex_unlock(&share->mutex);
+    batch_next = 0;
+    batch_done = (batch_count < SDE_BATCH_SIZE);
+    if (batch_count == 0)
+      DBUG_RETURN(HA_ERR_END_OF_FILE);
+  }
+  ndx = batch + batch_next++;
+  index->cursor_set(&cursor, ndx->key, ndx->length, ndx->pos);
+  rc = read_index_row(buf);
   MYSQL_INDEX_READ_ROW_DONE(rc);
   DBUG_RETURN(rc);
 }
@@ -526,20 +1649,20 @@ int ha_spartan::index_next(uchar *buf)
 int ha_spartan::index_prev(uchar *buf)
 {
   int rc;
-  uchar *key = 0;
+  SDE_INDEX *ndx;
   long long pos;
 
   DBUG_ENTER("ha_spartan::index_prev");
   MYSQL_INDEX_READ_ROW_START(table_share->db.str, table_share->table_name.str);
-  key = share->index_class->get_prev_key();
-  if (key == 0)
-    DBUG_RETURN(HA_ERR_END_OF_FILE);
-  pos = share->index_class->get_index_pos((uchar *)key, get_key_len());
-  share->index_class->seek_index(key, get_key_len());
-  share->index_class->get_prev_key();
+  key_unique = false;
+  end_batch();
+  mysql_mutex_lock(&share->mutex);
+  ndx = share->index_class[active_index]->cursor_prev(&cursor);
+  pos = (ndx != NULL) ? ndx->pos : -1;
+  mysql_mutex_unlock(&share->mutex);
   if (pos == -1)
-    DBUG_RETURN(HA_ERR_KEY_NOT_FOUND);
-  rc = share->data_class->read_row(buf, table->s->rec_buff_length, pos);
+    DBUG_RETURN(HA_ERR_END_OF_FILE);
+  rc = read_index_row(buf);
   MYSQL_INDEX_READ_ROW_DONE(rc);
   DBUG_RETURN(rc);
 }
@@ -558,16 +1681,20 @@ int ha_spartan::index_prev(uchar *buf)
 int ha_spartan::index_first(uchar *buf)
 {
   int rc;
-  uchar *key = 0;
-  
+  SDE_INDEX *ndx;
+  long long pos;
+
   DBUG_ENTER("ha_spartan::index_first");
   MYSQL_INDEX_READ_ROW_START(table_share->db.str, table_share->table_name.str);
-  key = share->index_class->get_first_key();
-  if (key == 0)
+  key_unique = false;
+  end_batch();
+  mysql_mutex_lock(&share->mutex);
+  ndx = share->index_class[active_index]->cursor_first(&cursor);
+  pos = (ndx != NULL) ? ndx->pos : -1;
+  mysql_mutex_unlock(&share->mutex);
+  if (pos == -1)
     DBUG_RETURN(HA_ERR_END_OF_FILE);
-  else
-    rc = 0;
-  memcpy(buf, key, get_key_len());
+  rc = read_index_row(buf);
   MYSQL_INDEX_READ_ROW_DONE(rc);
   DBUG_RETURN(rc);
 }
@@ -586,16 +1713,20 @@ int ha_spartan::index_first(uchar *buf)
 int ha_spartan::index_last(uchar *buf)
 {
   int rc;
-  uchar *key = 0;
+  SDE_INDEX *ndx;
+  long long pos;
 
   DBUG_ENTER("ha_spartan::index_last");
   MYSQL_INDEX_READ_ROW_START(table_share->db.str, table_share->table_name.str);
-  key = share->index_class->get_last_key();
-  if (key == 0)
+  key_unique = false;
+  end_batch();
+  mysql_mutex_lock(&share->mutex);
+  ndx = share->index_class[active_index]->cursor_last(&cursor);
+  pos = (ndx != NULL) ? ndx->pos : -1;
+  mysql_mutex_unlock(&share->mutex);
+  if (pos == -1)
     DBUG_RETURN(HA_ERR_END_OF_FILE);
-  else
-    rc = 0;
-  memcpy(buf, key, get_key_len());
+  rc = read_index_row(buf);
   MYSQL_INDEX_READ_ROW_DONE(rc);
   DBUG_RETURN(rc);
 }
@@ -620,12 +1751,190 @@ int ha_spartan::rnd_init(bool scan)
   current_position = 0;
   stats.records = 0;
   ref_length = sizeof(long long);
+  share->data_class->init_scan(&scan_buf);
+  end_ngram_scan();
+  if (scan && (ngram_query_count > 0) && start_ngram_scan())
+    my_atomic_add64(&spartan_ngram_scans, 1);
   DBUG_RETURN(0);
 }
 
 int ha_spartan::rnd_end()
 {
   DBUG_ENTER("ha_spartan::rnd_end");
+  share->data_class->end_scan(&scan_buf);
+  end_ngram_scan();
+  DBUG_RETURN(0);
+}
+
+/*
+  Look up the trigrams of the LIKE patterns pushed down in the n-gram
+  indexes of their columns and keep the rows found in all of them for
+  the scan. A column whose trigrams are in too many rows does not narrow
+  the scan. Returns false if no column did, and every row is read; a
+  pattern no row matches leaves an empty list, and no row is read.
+*/
+bool ha_spartan::start_ngram_scan()
+{
+  uchar grams[SDN_QUERY_MAX * SDN_GRAM];
+  long long *rows;
+  long long found;
+  long long max_rows;
+  uint count;
+  uint n;
+  uint i;
+
+  DBUG_ENTER("ha_spartan::start_ngram_scan");
+  mysql_mutex_lock(&share->mutex);
+  /* reading more than half of the rows by position costs more than a scan */
+  max_rows = share->data_class->records() / 2;
+  /* once no row is left the other columns need not be looked up */
+  for (n = 0; (n < share->num_ngrams) &&
+              ((ngram_rows == NULL) || (ngram_row_count > 0)); n++)
+  {
+    for (count = 0, i = 0; i < ngram_query_count; i++)
+    {
+      if (ngram_query_col[i] == n)
+        memcpy(grams + count++ * SDN_GRAM, ngram_query + i * SDN_GRAM,
+               SDN_GRAM);
+    }
+    if ((count == 0) ||
+        share->ngram_class[n]->find_rows(grams, count, max_rows, &rows,
+                                         &found))
+      continue;
+    if (ngram_rows == NULL)
+    {
+      ngram_rows = rows;
+      ngram_row_count = found;
+    }
+    else
+    {
+      ngram_row_count = Spartan_ngram_index::intersect_rows(ngram_rows,
+                                                            ngram_row_count,
+                                                            rows, found);
+      my_free(rows);
+    }
+  }
+  mysql_mutex_unlock(&share->mutex);
+  ngram_row_next = 0;
+  DBUG_RETURN(ngram_rows != NULL);
+}
+
+/* forget the rows of an n-gram scan */
+void ha_spartan::end_ngram_scan()
+{
+  my_free(ngram_rows);
+  ngram_rows = NULL;
+  ngram_row_count = ngram_row_next = 0;
+}
+
+/*
+  Take the trigrams of a col LIKE 'pattern' condition on a column with
+  an n-gram index: those of each run of the pattern between wildcards
+  that is long enough to have one. Anything else is ignored.
+*/
+void ha_spartan::push_like(Item *item)
+{
+  Item_func_like *like;
+  Field *field;
+  const CHARSET_INFO *cs;
+  char buff[MAX_FIELD_WIDTH];
+  String tmp(buff, sizeof(buff), &my_charset_bin);
+  String *pattern;
+  const uchar *text;
+  uint length;
+  uchar run[256];
+  uchar grams[sizeof(run) * SDN_GRAM];
+  uint run_len = 0;
+  uint count;
+  uint n;
+  uint i;
+  uint j;
+
+  if ((item->type() != Item::FUNC_ITEM) ||
+      (((Item_func *)item)->functype() != Item_func::LIKE_FUNC))
+    return;
+  like = (Item_func_like *)item;
+  if ((like->arguments()[0]->real_item()->type() != Item::FIELD_ITEM) ||
+      (like->arguments()[1]->type() != Item::STRING_ITEM))
+    return;
+  field = ((Item_field *)like->arguments()[0]->real_item())->field;
+  if (field->table != table)
+    return;
+  for (n = 0; (n < share->num_ngrams) && (ngram_field[n] != field); n++)
+    ;
+  cs = field->charset();
+  if ((n == share->num_ngrams) || (like->compare_collation() != cs) ||
+      ((cs->mbmaxlen > 1) && (like->escape > 0x7f)))
+    return;
+  if ((pattern = like->arguments()[1]->val_str(&tmp)) == NULL)
+    return;
+  text = (const uchar *)pattern->ptr();
+  length = pattern->length();
+  for (i = 0; i <= length; i++)
+  {
+    if ((i < length) && (text[i] == (uint)like->escape) && (i + 1 < length))
+      i++;
+    else if ((i == length) || (text[i] == '%') || (text[i] == '_'))
+    {
+      /* the end of a run: a wildcard or the end of the pattern */
+      ngram_fold(cs, run, run_len);
+      count = Spartan_ngram_index::make_grams(run, run_len, grams);
+      for (j = 0; (j < count) && (ngram_query_count < SDN_QUERY_MAX); j++)
+      {
+        memcpy(ngram_query + ngram_query_count * SDN_GRAM,
+               grams + j * SDN_GRAM, SDN_GRAM);
+        ngram_query_col[ngram_query_count++] = n;
+      }
+      run_len = 0;
+      continue;
+    }
+    if (run_len < sizeof(run))
+      run[run_len++] = text[i];
+  }
+}
+
+/**
+  @brief
+  Pushes the WHERE condition of a table scan down. The LIKE conditions
+  on columns with an n-gram index (alone or in a top-level AND) let the
+  scan read only the rows whose values have the trigrams of the
+  pattern. The whole condition is returned, so the server still checks
+  every row read.
+*/
+const Item *ha_spartan::cond_push(const Item *cond)
+{
+  Item *item;
+
+  DBUG_ENTER("ha_spartan::cond_push");
+  ngram_query_count = 0;
+  if (share->num_ngrams == 0)
+    DBUG_RETURN(cond);
+  if ((cond->type() == Item::COND_ITEM) &&
+      (((Item_cond *)cond)->functype() == Item_func::COND_AND_FUNC))
+  {
+    List_iterator_fast<Item> it(*((Item_cond *)cond)->argument_list());
+
+    while ((item = it++))
+      push_like(item);
+  }
+  else
+    push_like((Item *)cond);
+  DBUG_RETURN(cond);
+}
+
+void ha_spartan::cond_pop()
+{
+  DBUG_ENTER("ha_spartan::cond_pop");
+  ngram_query_count = 0;
+  DBUG_VOID_RETURN;
+}
+
+/* the statement is over: drop the conditions pushed down for it */
+int ha_spartan::reset()
+{
+  DBUG_ENTER("ha_spartan::reset");
+  ngram_query_count = 0;
+  end_ngram_scan();
   DBUG_RETURN(0);
 }
 
@@ -646,17 +1955,37 @@ int ha_spartan::rnd_end()
 */
 int ha_spartan::rnd_next(uchar *buf)
 {
-  int rc;
+  int rc = 0;
+  long long pos;
   DBUG_ENTER("ha_spartan::rnd_next");
   MYSQL_READ_ROW_START(table_share->db.str, table_share->table_name.str,
                        TRUE);
+  /* an n-gram scan reads only the rows the indexes found, in order */
+  if (ngram_rows != NULL)
+  {
+    while (ngram_row_next < ngram_row_count)
+    {
+      pos = ngram_rows[ngram_row_next++];
+      if (read_cached_row(buf, pos) == 0)
+      {
+        current_position = (off_t)(pos +
+                 share->data_class->row_size(table->s->rec_buff_length));
+        stats.records++;
+        MYSQL_READ_ROW_DONE(rc);
+        DBUG_RETURN(rc);
+      }
+    }
+    DBUG_RETURN(HA_ERR_END_OF_FILE);
+  }
   /*
-    Read the row from the data file.
+    Read the row from the data file. The data class returns the position
+    just past the row, which is where the scan continues.
   */
-  rc = share->data_class->read_row(buf, table->s->rec_buff_length,
-                                   current_position); 
-  if (rc != -1)
-    current_position = (off_t)share->data_class->cur_position();
+  pos = share->data_class->scan_row(&scan_buf, buf,
+                                    table->s->rec_buff_length,
+                                    current_position);
+  if (pos != -1)
+    current_position = (off_t)pos;
   else
     DBUG_RETURN(HA_ERR_END_OF_FILE);
   stats.records++;  
@@ -714,8 +2043,13 @@ int ha_spartan::rnd_pos(uchar *buf, uchar *pos)
   MYSQL_READ_ROW_START(table_share->db.str, table_share->table_name.str,
                        TRUE);
   ha_statistic_increment(&SSV::ha_read_rnd_next_count);
+  /*
+    position() saved the file pointer just past the row (as left by
+    rnd_next), so step back one row to find its start.
+  */
   current_position = (off_t)my_get_ptr(pos,ref_length);
-  rc = share->data_class->read_row(buf, current_position, -1);
+  rc = read_cached_row(buf, current_position -
+                       share->data_class->row_size(table->s->rec_buff_length));
   MYSQL_READ_ROW_DONE(rc);
   DBUG_RETURN(rc);
 }
@@ -762,6 +2096,45 @@ int ha_spartan::rnd_pos(uchar *buf, uchar *pos)
 int ha_spartan::info(uint flag)
 {
   DBUG_ENTER("ha_spartan::info");
+  if (flag & HA_STATUS_VARIABLE)
+  {
+    mysql_mutex_lock(&share->mutex);
+    stats.records = share->data_class->records();
+    stats.deleted = share->data_class->del_records();
+    mysql_mutex_unlock(&share->mutex);
+  }
+  /*
+    The rows per value of each key prefix are estimated from a sample of
+    the leaves of the index (see Spartan_index::sample_prefixes()). The
+    full key of a unique index has one.
+  */
+  if (flag & HA_STATUS_CONST)
+  {
+    uint prefix_len[SDE_MAX_KEY_PARTS];
+    double per_prefix[SDE_MAX_KEY_PARTS];
+
+    for (uint i = 0; i < table->s->keys; i++)
+    {
+      KEY *key_info = table->key_info + i;
+      uint parts = key_info->user_defined_key_parts;
+      uint length = 0;
+
+      for (uint j = 0; j < parts; j++)
+      {
+        Field *field = key_info->key_part[j].field;
+        length += key_part_sort_length(field) +
+                  (field->real_maybe_null() ? 1 : 0);
+        prefix_len[j] = length;
+      }
+      mysql_mutex_lock(&share->mutex);
+      share->index_class[i]->sample_prefixes(prefix_len, parts, per_prefix);
+      mysql_mutex_unlock(&share->mutex);
+      for (uint j = 0; j < parts; j++)
+        key_info->rec_per_key[j] = (ulong)(per_prefix[j] + 0.5);
+      if (key_info->flags & HA_NOSAME)
+        key_info->rec_per_key[parts - 1] = 1;
+    }
+  }
   /* This is a lie, but you don't want the optimizer to see zero or 1 */
   if (stats.records < 2)
     stats.records= 2;
@@ -781,6 +2154,16 @@ int ha_spartan::info(uint flag)
 int ha_spartan::extra(enum ha_extra_function operation)
 {
   DBUG_ENTER("ha_spartan::extra");
+  switch (operation) {
+  case HA_EXTRA_KEYREAD:
+    keyread = true;
+    break;
+  case HA_EXTRA_NO_KEYREAD:
+    keyread = false;
+    break;
+  default:
+    break;
+  }
   DBUG_RETURN(0);
 }
 
@@ -812,8 +2195,14 @@ int ha_spartan::delete_all_rows()
   */
   mysql_mutex_lock(&share->mutex);
   share->data_class->trunc_table();
-  share->index_class->destroy_index();
-  share->index_class->trunc_index();
+  share->row_cache->flush_cache();
+  for (uint i = 0; i < share->num_indexes; i++)
+  {
+    share->index_class[i]->destroy_index();
+    share->index_class[i]->trunc_index();
+  }
+  for (uint i = 0; i < share->num_ngrams; i++)
+    share->ngram_class[i]->trunc_ngram();
   /*
     End section by unlocking the spartan mutex variable.
   */
@@ -846,6 +2235,135 @@ int ha_spartan::truncate()
 }
 
 
+/**
+  @brief
+  Called before a bulk insert (INSERT ... SELECT, LOAD DATA and the copy
+  of an ALTER TABLE). If the table is empty its non-unique indexes are
+  not changed row by row: the keys go to a builder for each of them and
+  the indexes are written as a whole when the insert ends. Unique
+  indexes are still written row by row, so a duplicate key is refused
+  by write_row() before the row is stored.
+
+  @details
+  Like MyISAM with its indexes disabled, other handlers of the table
+  find nothing in the built indexes until end_bulk_insert().
+*/
+void ha_spartan::start_bulk_insert(ha_rows rows)
+{
+  bool failed = false;
+  uint i;
+
+  DBUG_ENTER("ha_spartan::start_bulk_insert");
+  if ((table->s->keys == 0) || ((rows > 0) && (rows < SDE_BULK_MIN_ROWS)))
+    DBUG_VOID_RETURN;
+  mysql_mutex_lock(&share->mutex);
+  /* a table with unique indexes only has nothing to build */
+  if (share->data_class->records() == 0)
+  {
+    for (i = 0; i < table->s->keys; i++)
+    {
+      if (table->key_info[i].flags & HA_NOSAME)
+        continue;
+      if ((builder[i] = new_builder(i)) == NULL)
+        failed = true;
+      building = true;
+    }
+  }
+  if (failed)
+    free_builders(false);
+  mysql_mutex_unlock(&share->mutex);
+  DBUG_VOID_RETURN;
+}
+
+
+/**
+  @brief
+  Write the indexes of a bulk insert started by start_bulk_insert(),
+  all of them at once.
+*/
+int ha_spartan::end_bulk_insert()
+{
+  Spartan_index_builder *builders[SDE_MAX_KEYS];
+  uint n = 0;
+  int rc;
+  uint i;
+
+  DBUG_ENTER("ha_spartan::end_bulk_insert");
+  if (!building)
+    DBUG_RETURN(0);
+  mysql_mutex_lock(&share->mutex);
+  for (i = 0; i < table->s->keys; i++)
+  {
+    if (builder[i] != NULL)
+      builders[n++] = builder[i];
+  }
+  rc = Spartan_index_builder::end_builds(builders, n);
+  free_builders(rc != 0);
+  mysql_mutex_unlock(&share->mutex);
+  DBUG_RETURN(rc);
+}
+
+
+/*
+  Drop the builders of a bulk insert. If the insert failed the indexes
+  they were building lack its rows, so they are marked crashed until
+  REPAIR TABLE writes them again. The caller holds the share mutex.
+*/
+void ha_spartan::free_builders(bool failed)
+{
+  DBUG_ENTER("ha_spartan::free_builders");
+  for (uint i = 0; i < table->s->keys; i++)
+  {
+    if (failed && (builder[i] != NULL))
+      share->index_class[i]->mark_crashed();
+    delete builder[i];
+    builder[i] = NULL;
+  }
+  building = false;
+  DBUG_VOID_RETURN;
+}
+
+
+/**
+  @brief
+  REPAIR TABLE: write every index again from the rows of the data file.
+*/
+int ha_spartan::repair(THD *thd, HA_CHECK_OPT *check_opt)
+{
+  bool all[MY_MAX(SDE_MAX_KEYS, SDE_MAX_NGRAMS)];
+  int rc;
+
+  DBUG_ENTER("ha_spartan::repair");
+  for (uint i = 0; i < array_elements(all); i++)
+    all[i] = true;
+  mysql_mutex_lock(&share->mutex);
+  rc = build_indexes(all);
+  if (!rc)
+    rc = build_ngrams(all);
+  mysql_mutex_unlock(&share->mutex);
+  /* rows that share a unique key cannot all be indexed */
+  if (rc == HA_ERR_FOUND_DUPP_KEY)
+    DBUG_RETURN(HA_ADMIN_CORRUPT);
+  DBUG_RETURN(rc ? HA_ADMIN_FAILED : HA_ADMIN_OK);
+}
+
+
+/**
+  @brief
+  Whether an index of the table was marked crashed (see
+  Spartan_index::mark_crashed()), which CHECK TABLE reports.
+*/
+bool ha_spartan::is_crashed() const
+{
+  for (uint i = 0; i < share->num_indexes; i++)
+  {
+    if (share->index_class[i]->is_crashed())
+      return true;
+  }
+  return false;
+}
+
+
 /**
   @brief
   This create a lock on the table. If you are implementing a storage engine
@@ -949,13 +2467,20 @@ int ha_spartan::delete_table(const char *name)
   */
   my_delete(fn_format(name_buff, name, "", SDE_EXT,
             MY_REPLACE_EXT|MY_UNPACK_FILENAME), MYF(0));
+  my_delete(fn_format(name_buff, name, "", SDE_LIVE_EXT,
+            MY_REPLACE_EXT|MY_UNPACK_FILENAME), MYF(0));
   /*
     Call the mysql delete file method.
     Note: the fn_format() method correctly creates a file name from the
     name passed into the method.
   */
-  my_delete(fn_format(name_buff, name, "", SDI_EXT,
-            MY_REPLACE_EXT|MY_UNPACK_FILENAME), MYF(0));
+  for (uint i = 0; i < SDE_MAX_KEYS; i++)
+  {
+    Spartan_index::delete_runs(index_file_name(name_buff, name, i));
+    my_delete(name_buff, MYF(0));
+  }
+  for (uint i = 0; i < SDE_MAX_NGRAMS; i++)
+    my_delete(ngram_file_name(name_buff, name, i), MYF(0));
 
   DBUG_RETURN(0);
 }
@@ -987,15 +2512,31 @@ int ha_spartan::rename_table(const char * from, const char * to)
           MY_REPLACE_EXT|MY_UNPACK_FILENAME),
           fn_format(data_to, to, "", SDE_EXT,
           MY_REPLACE_EXT|MY_UNPACK_FILENAME), MYF(0));
-  my_copy(fn_format(index_from, from, "", SDI_EXT,
-          MY_REPLACE_EXT|MY_UNPACK_FILENAME),
-          fn_format(index_to, to, "", SDI_EXT,
-          MY_REPLACE_EXT|MY_UNPACK_FILENAME), MYF(0));
   /*
     Delete the file using MySQL's delete file method.
   */
   my_delete(data_from, MYF(0));
-  my_delete(index_from, MYF(0));
+  if (my_copy(fn_format(data_from, from, "", SDE_LIVE_EXT,
+              MY_REPLACE_EXT|MY_UNPACK_FILENAME),
+              fn_format(data_to, to, "", SDE_LIVE_EXT,
+              MY_REPLACE_EXT|MY_UNPACK_FILENAME), MYF(0)) == 0)
+    my_delete(data_from, MYF(0));
+  /* the table does not say how many indexes it has; move all there are */
+  for (uint i = 0; i < SDE_MAX_KEYS; i++)
+  {
+    if (my_copy(index_file_name(index_from, from, i),
+                index_file_name(index_to, to, i), MYF(0)) == 0)
+    {
+      Spartan_index::rename_runs(index_from, index_to);
+      my_delete(index_from, MYF(0));
+    }
+  }
+  for (uint i = 0; i < SDE_MAX_NGRAMS; i++)
+  {
+    if (my_copy(ngram_file_name(index_from, from, i),
+                ngram_file_name(index_to, to, i), MYF(0)) == 0)
+      my_delete(index_from, MYF(0));
+  }
 
   DBUG_RETURN(0);
 }
@@ -1017,8 +2558,64 @@ int ha_spartan::rename_table(const char * from, const char * to)
 ha_rows ha_spartan::records_in_range(uint inx, key_range *min_key,
                                      key_range *max_key)
 {
+  uchar min_buf[SDI_MAX_KEY_LEN];
+  uchar max_buf[SDI_MAX_KEY_LEN];
+  uchar *min_ptr = NULL;
+  uchar *max_ptr = NULL;
+  uint min_len = 0;
+  uint max_len = 0;
+  long long rows;
+
   DBUG_ENTER("ha_spartan::records_in_range");
-  DBUG_RETURN(10);                         // low number to force index usage
+  /*
+    Both ends become the first entry not before a key, as in
+    index_read_map(): a range that starts after a key or ends with it
+    takes the key with one added to it.
+  */
+  if (min_key != NULL)
+  {
+    memset(min_buf, 0, sizeof(min_buf));
+    min_len = make_search_key(inx, min_buf, min_key->key,
+                              min_key->keypart_map);
+    if ((min_key->flag == HA_READ_AFTER_KEY) &&
+        !next_key_prefix(min_buf, min_len))
+      DBUG_RETURN(1);
+    min_ptr = min_buf;
+  }
+  if (max_key != NULL)
+  {
+    memset(max_buf, 0, sizeof(max_buf));
+    max_len = make_search_key(inx, max_buf, max_key->key,
+                              max_key->keypart_map);
+    if ((max_key->flag != HA_READ_AFTER_KEY) ||
+        next_key_prefix(max_buf, max_len))
+      max_ptr = max_buf;
+  }
+  mysql_mutex_lock(&share->mutex);
+  rows = share->index_class[inx]->range_size(min_ptr, min_len,
+                                             max_ptr, max_len);
+  mysql_mutex_unlock(&share->mutex);
+  /* the optimizer takes 0 to mean the range is certainly empty */
+  DBUG_RETURN((rows > 0) ? (ha_rows)rows : 1);
+}
+
+
+/*
+  A table declared with COMMENT 'spartan_lsm' keeps its indexes as sorted
+  runs (see spartan_lsm.h), which suits tables that take far more inserts
+  than reads.
+*/
+#define SDE_LSM "spartan_lsm"
+
+/* whether word appears anywhere in a table or column comment */
+static bool table_comment_has(LEX_STRING comment, const char *word)
+{
+  size_t length = strlen(word);
+
+  for (size_t i = 0; i + length <= comment.length; i++)
+    if (strncmp(comment.str + i, word, length) == 0)
+      return true;
+  return false;
 }
 
 
@@ -1047,9 +2644,49 @@ int ha_spartan::create(const char *name, TABLE *table_arg,
   DBUG_ENTER("ha_spartan::create");
   char name_buff[FN_REFLEN];
   char name_buff2[FN_REFLEN];
+  uchar organization = table_comment_has(create_info->comment, SDE_LSM) ?
+                       SDI_ORG_LSM : SDI_ORG_BTREE;
+  uint i;
 
   if (!(share = get_share()))
     DBUG_RETURN(1);
+  /* the sortable form of each key and its images have to fit in an entry */
+  for (i = 0; i < table_arg->s->keys; i++)
+  {
+    KEY *key_info = table_arg->key_info + i;
+    Field *images[SDE_MAX_IMAGES];
+    int count = index_image_fields(table_arg->field, key_info, images);
+
+    if (count < 0)
+    {
+      my_error(ER_ILLEGAL_HA_CREATE_OPTION, MYF(0), "SPARTAN",
+               key_info->comment.str);
+      DBUG_RETURN(HA_WRONG_CREATE_OPTION);
+    }
+    if (index_entry_length(key_info, images, (uint)count) >
+        (uint)SDI_MAX_KEY_LEN)
+    {
+      my_error(ER_TOO_LONG_KEY, MYF(0), SDI_MAX_KEY_LEN);
+      DBUG_RETURN(HA_WRONG_CREATE_OPTION);
+    }
+  }
+  /*
+    An n-gram index needs a CHAR or VARCHAR column whose collation LIKE
+    compares byte by byte, and there can be SDE_MAX_NGRAMS of them.
+  */
+  i = 0;
+  for (Field **field = table_arg->field; *field != NULL; field++)
+  {
+    if (((*field)->comment.length == 0) ||
+        !table_comment_has((*field)->comment, SDE_NGRAM))
+      continue;
+    if (!ngram_column(*field) || (++i > SDE_MAX_NGRAMS))
+    {
+      my_error(ER_ILLEGAL_HA_CREATE_OPTION, MYF(0), "SPARTAN",
+               (*field)->comment.str);
+      DBUG_RETURN(HA_WRONG_CREATE_OPTION);
+    }
+  }
   /*
     Call the data class create table method.
     Note: the fn_format() method correctly creates a file name from the
@@ -1061,15 +2698,24 @@ int ha_spartan::create(const char *name, TABLE *table_arg,
   DBUG_PRINT("info", ("hot here -1"));
   share->data_class->close_table();
   DBUG_PRINT("info", ("hot here 2"));
-  if (share->index_class->create_index(fn_format(name_buff2, name, "", SDI_EXT,
-                                      MY_REPLACE_EXT|MY_UNPACK_FILENAME),
-                                      128))
+  for (i = 0; i < share->num_indexes; i++)
   {
-    DBUG_PRINT("info", ("hot here 0"));
-    DBUG_RETURN(-1);
+    if (share->index_class[i]->create_index(index_file_name(name_buff2, name,
+                                                            i),
+                                            SDI_MAX_KEY_LEN, organization))
+    {
+      DBUG_PRINT("info", ("hot here 0"));
+      DBUG_RETURN(-1);
+    }
+    DBUG_PRINT("info", ("hot here 1"));
+    share->index_class[i]->close_index();
+  }
+  for (i = 0; i < share->num_ngrams; i++)
+  {
+    if (share->ngram_class[i]->create_ngram(ngram_file_name(name_buff2, name,
+                                                            i)))
+      DBUG_RETURN(-1);
   }
-  DBUG_PRINT("info", ("hot here 1"));
-  share->index_class->close_index();
   DBUG_PRINT("info", ("hot here 3"));
   DBUG_RETURN(0);
 }
@@ -1110,9 +2756,154 @@ static MYSQL_SYSVAR_ULONG(
   1000,
   0);
 
+static MYSQL_SYSVAR_ULONGLONG(
+  row_cache_size,
+  srv_row_cache_size,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Bytes of row cache given to each open Spartan table (0 = disabled).",
+  NULL,
+  NULL,
+  8 * 1024 * 1024,
+  0,
+  ULONGLONG_MAX,
+  1024);
+
+static MYSQL_SYSVAR_ULONGLONG(
+  index_cache_size,
+  srv_index_cache_size,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Bytes of index page cache given to each open Spartan table.",
+  NULL,
+  NULL,
+  8 * 1024 * 1024,
+  0,
+  ULONGLONG_MAX,
+  8192);
+
+static MYSQL_SYSVAR_ULONGLONG(
+  index_art_size,
+  srv_index_art_size,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Bytes of memory an index may use to be kept as an in-memory radix "
+  "tree (0 = disabled).",
+  NULL,
+  NULL,
+  16 * 1024 * 1024,
+  0,
+  ULONGLONG_MAX,
+  1024);
+
+static MYSQL_SYSVAR_ULONGLONG(
+  index_hash_size,
+  srv_index_hash_size,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Bytes of memory each index may use for a hash table of the keys it "
+  "looks up most often (0 = disabled).",
+  NULL,
+  NULL,
+  1024 * 1024,
+  0,
+  ULONGLONG_MAX,
+  1024);
+
+static MYSQL_SYSVAR_UINT(
+  index_bloom_bits,
+  srv_index_bloom_bits,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Bits per key of the bloom filter each index keeps to answer lookups "
+  "and duplicate checks of missing keys without reading pages "
+  "(0 = disabled).",
+  NULL,
+  NULL,
+  10,
+  0,
+  64,
+  0);
+
+static MYSQL_SYSVAR_ULONGLONG(
+  index_lsm_memtable_size,
+  srv_index_lsm_memtable_size,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Bytes of memory table an index kept as sorted runs fills before it "
+  "is written out as a run.",
+  NULL,
+  NULL,
+  4 * 1024 * 1024,
+  16 * 1024,
+  ULONGLONG_MAX,
+  1024);
+
+static MYSQL_SYSVAR_ULONGLONG(
+  index_build_memory,
+  srv_index_build_memory,
+  PLUGIN_VAR_RQCMDARG,
+  "Bytes of memory used to sort the keys of each index that is written "
+  "as a whole (on a rebuild, REPAIR TABLE or a bulk insert into an empty "
+  "table). Keys that do not fit are sorted in temporary files.",
+  NULL,
+  NULL,
+  64 * 1024 * 1024,
+  1024 * 1024,
+  ULONGLONG_MAX,
+  1024);
+
+static MYSQL_SYSVAR_UINT(
+  index_build_threads,
+  srv_index_build_threads,
+  PLUGIN_VAR_RQCMDARG,
+  "Threads that sort the keys of each index that is written as a whole.",
+  NULL,
+  NULL,
+  4,
+  1,
+  64,
+  0);
+
+static void update_index_memory_limit(MYSQL_THD thd,
+                                      struct st_mysql_sys_var *var,
+                                      void *var_ptr, const void *save)
+{
+  *(ulonglong *)var_ptr= *(const ulonglong *)save;
+  Spartan_slab::set_limit(srv_index_memory_limit);
+}
+
+static MYSQL_SYSVAR_ULONGLONG(
+  index_memory_limit,
+  srv_index_memory_limit,
+  PLUGIN_VAR_RQCMDARG,
+  "Bytes of memory the radix trees and hash indexes of all Spartan "
+  "tables may use together (0 = no limit). Past it radix trees are "
+  "dropped and hash indexes stop growing.",
+  NULL,
+  update_index_memory_limit,
+  0,
+  0,
+  ULONGLONG_MAX,
+  1024);
+
+static MYSQL_SYSVAR_BOOL(
+  index_mmap,
+  srv_index_mmap,
+  PLUGIN_VAR_OPCMDARG | PLUGIN_VAR_READONLY,
+  "Map Spartan index files into memory and use their pages in place, "
+  "copying a page only when it is changed.",
+  NULL,
+  NULL,
+  TRUE);
+
 static struct st_mysql_sys_var* spartan_system_variables[]= {
   MYSQL_SYSVAR(enum_var),
   MYSQL_SYSVAR(ulong_var),
+  MYSQL_SYSVAR(row_cache_size),
+  MYSQL_SYSVAR(index_cache_size),
+  MYSQL_SYSVAR(index_art_size),
+  MYSQL_SYSVAR(index_hash_size),
+  MYSQL_SYSVAR(index_bloom_bits),
+  MYSQL_SYSVAR(index_lsm_memtable_size),
+  MYSQL_SYSVAR(index_build_memory),
+  MYSQL_SYSVAR(index_build_threads),
+  MYSQL_SYSVAR(index_memory_limit),
+  MYSQL_SYSVAR(index_mmap),
   NULL
 };
 
@@ -1128,9 +2919,81 @@ static int show_func_spartan(MYSQL_THD thd, struct st_mysql_show_var *var,
   return 0;
 }
 
+// row cache hit ratio as a percentage with two decimals
+static int show_row_cache_hit_ratio(MYSQL_THD thd,
+                                    struct st_mysql_show_var *var,
+                                    char *buf)
+{
+  ulonglong hits= (ulonglong)my_atomic_load64(&spartan_row_cache_hits);
+  ulonglong misses= (ulonglong)my_atomic_load64(&spartan_row_cache_misses);
+  ulonglong ratio= 0;
+
+  if (hits + misses > 0)
+    ratio= (hits * 10000) / (hits + misses);
+  var->type= SHOW_CHAR;
+  var->value= buf;
+  my_snprintf(buf, SHOW_VAR_FUNC_BUFF_SIZE, "%llu.%02llu",
+              ratio / 100, ratio % 100);
+  return 0;
+}
+
+// share of whole key lookups answered by the adaptive hash index
+static int show_index_hash_hit_ratio(MYSQL_THD thd,
+                                     struct st_mysql_show_var *var,
+                                     char *buf)
+{
+  ulonglong hits= (ulonglong)my_atomic_load64(&spartan_index_hash_hits);
+  ulonglong misses= (ulonglong)my_atomic_load64(&spartan_index_hash_misses);
+  ulonglong ratio= 0;
+
+  if (hits + misses > 0)
+    ratio= (hits * 10000) / (hits + misses);
+  var->type= SHOW_CHAR;
+  var->value= buf;
+  my_snprintf(buf, SHOW_VAR_FUNC_BUFF_SIZE, "%llu.%02llu",
+              ratio / 100, ratio % 100);
+  return 0;
+}
+
+// bytes held by the slab arenas of all Spartan indexes
+static int show_index_memory(MYSQL_THD thd, struct st_mysql_show_var *var,
+                             char *buf)
+{
+  var->type= SHOW_LONGLONG;
+  var->value= buf;
+  *(longlong *)buf= (longlong)Spartan_slab::total_memory();
+  return 0;
+}
+
+// lookups and duplicate checks the bloom filters answered alone
+static int show_index_bloom_negatives(MYSQL_THD thd,
+                                      struct st_mysql_show_var *var,
+                                      char *buf)
+{
+  var->type= SHOW_LONGLONG;
+  var->value= buf;
+  *(longlong *)buf= (longlong)Spartan_bloom::negatives();
+  return 0;
+}
+
 static struct st_mysql_show_var func_status[]=
 {
   {"spartan_func_spartan",  (char *)show_func_spartan, SHOW_FUNC},
+  {"spartan_row_cache_hits", (char *)&spartan_row_cache_hits, SHOW_LONGLONG},
+  {"spartan_row_cache_misses", (char *)&spartan_row_cache_misses,
+   SHOW_LONGLONG},
+  {"spartan_row_cache_hit_ratio", (char *)show_row_cache_hit_ratio,
+   SHOW_FUNC},
+  {"spartan_index_hash_hits", (char *)&spartan_index_hash_hits,
+   SHOW_LONGLONG},
+  {"spartan_index_hash_misses", (char *)&spartan_index_hash_misses,
+   SHOW_LONGLONG},
+  {"spartan_index_hash_hit_ratio", (char *)show_index_hash_hit_ratio,
+   SHOW_FUNC},
+  {"spartan_index_memory", (char *)show_index_memory, SHOW_FUNC},
+  {"spartan_index_bloom_negatives", (char *)show_index_bloom_negatives,
+   SHOW_FUNC},
+  {"spartan_ngram_scans", (char *)&spartan_ngram_scans, SHOW_LONGLONG},
   {0,0,SHOW_UNDEF}
 };
 
@@ -6,15 +6,35 @@
 #include "thr_lock.h"                    /* THR_LOCK, THR_LOCK_DATA */
 #include "handler.h"                     /* handler */
 #include "spartan_data.h"
-#include "spartan_index.h"
+#include "spartan_index_builder.h"     /* and spartan_index.h */
+#include "spartan_ngram_index.h"
+#include "spartan_row_cache.h"
+
+/* most indexes a table can have, each in its own index file */
+const uint SDE_MAX_KEYS = 16;
+/* most columns in an index */
+const uint SDE_MAX_KEY_PARTS = 16;
+/* most column images stored with the entries of an index */
+const uint SDE_MAX_IMAGES = 32;
+/* entries index_next_same() reads from the index at a time */
+const uint SDE_BATCH_SIZE = 64;
+/* fewest rows of a bulk insert that are worth building the indexes for */
+const ha_rows SDE_BULK_MIN_ROWS = 1000;
+/* most columns with an n-gram index */
+const uint SDE_MAX_NGRAMS = 8;
 
 class Spartan_share : public Handler_share {
 public:
   mysql_mutex_t mutex;
   THR_LOCK lock;
   Spartan_data *data_class;
-  Spartan_index *index_class;
-  Spartan_share();
+  Spartan_index *index_class[SDE_MAX_KEYS];
+  uint num_indexes;
+  Spartan_ngram_index *ngram_class[SDE_MAX_NGRAMS];
+  uint num_ngrams;
+  Spartan_row_cache *row_cache;
+  uint use_count;               /* handlers that have the table open */
+  Spartan_share(uint keys, uint ngrams);
   ~Spartan_share()
   {
     thr_lock_delete(&lock);
@@ -22,9 +42,15 @@ public:
     if (data_class != NULL)
       delete data_class;
     data_class = NULL;
-    if (index_class != NULL)
-      delete index_class;
-    index_class = NULL;
+    for (uint i = 0; i < num_indexes; i++)
+      delete index_class[i];
+    num_indexes = 0;
+    for (uint i = 0; i < num_ngrams; i++)
+      delete ngram_class[i];
+    num_ngrams = 0;
+    if (row_cache != NULL)
+      delete row_cache;
+    row_cache = NULL;
   }
 };
 
@@ -37,6 +63,55 @@ class ha_spartan: public handler
   Spartan_share *share;    ///< Shared lock info
   Spartan_share *get_share(); ///< Get the share
   off_t current_position;  /* Current position in the file during a file scan */
+  SDE_SCAN scan_buf;       /* Block buffer used by table scans */
+  SDI_CURSOR cursor;       /* this handler's position in the index */
+  bool key_unique;         /* no other index entry has the key last read */
+  SDE_INDEX *batch;        /* entries read ahead by index_next_same() */
+  uint batch_count;
+  uint batch_next;
+  uint batch_len;          /* key bytes they match, 0 if not reading ahead */
+  bool batch_done;         /* the batch holds the last of the matches */
+  uchar *key_record;       /* row image a search key is restored into */
+  bool keyread;            /* HA_EXTRA_KEYREAD: rows come from the index */
+  uint index_sort_len[SDE_MAX_KEYS]; /* sortable length of each full key */
+  uint index_key_len[SDE_MAX_KEYS];  /* and of the column images after it */
+  uint index_images[SDE_MAX_KEYS];   /* columns stored as images */
+  Field *index_image[SDE_MAX_KEYS][SDE_MAX_IMAGES];
+  /* bulk insert into an empty table: the non-unique indexes are built
+     at the end (builder[i] is NULL for the others) */
+  Spartan_index_builder *builder[SDE_MAX_KEYS];
+  bool building;
+  /* columns with an n-gram index, and their folded values */
+  Field *ngram_field[SDE_MAX_NGRAMS];
+  uchar *ngram_buf[2];
+  /* trigrams of the LIKE patterns pushed down, with their columns */
+  uchar ngram_query[SDN_QUERY_MAX * SDN_GRAM];
+  uint ngram_query_col[SDN_QUERY_MAX];
+  uint ngram_query_count;
+  /* a table scan that reads only the rows the n-gram indexes found */
+  long long *ngram_rows;
+  long long ngram_row_count;
+  long long ngram_row_next;
+  int read_cached_row(uchar *buf, long long pos);
+  int read_index_row(uchar *buf);
+  uint make_index_key(uint keynr, uchar *to, const uchar *record,
+                      key_part_map keypart_map);
+  uint make_entry_key(uint keynr, uchar *to, const uchar *record);
+  uint make_search_key(uint keynr, uchar *to, const uchar *key,
+                       key_part_map keypart_map);
+  void unpack_entry_key(uint keynr, uchar *buf, const uchar *key);
+  bool duplicate_entry(uint keynr, const uchar *record, uchar *key,
+                       uint length);
+  int rebuild_indexes();
+  int build_indexes(bool *build);
+  Spartan_index_builder *new_builder(uint keynr);
+  void free_builders(bool failed);
+  uint ngram_value(uint n, const uchar *record, uchar *to);
+  int build_ngrams(bool *build);
+  void push_like(Item *item);
+  bool start_ngram_scan();
+  void end_ngram_scan();
+  void end_batch() { batch_count = batch_next = batch_len = 0; }
 
 public:
   ha_spartan(handlerton *hton, TABLE_SHARE *table_ar);
@@ -73,11 +148,7 @@ public:
     If all_parts it's set, MySQL want to know the flags for the combined
     index up to and including 'part'.
   */
-  ulong index_flags(uint inx, uint part, bool all_parts) const
-  {
-    return (HA_READ_NEXT | HA_READ_PREV | HA_READ_RANGE |
-            HA_READ_ORDER | HA_KEYREAD_ONLY);
-  }
+  ulong index_flags(uint inx, uint part, bool all_parts) const;
   /*
     unireg.cc will call the following to make sure that the storage engine can
     handle the data it is about to send.
@@ -88,8 +159,8 @@ public:
     There is no need to implement ..._key_... methods if you don't suport
     indexes.
   */
-  uint max_supported_keys()          const { return 1; }
-  uint max_supported_key_parts()     const { return 1; }
+  uint max_supported_keys()          const { return SDE_MAX_KEYS; }
+  uint max_supported_key_parts()     const { return SDE_MAX_KEY_PARTS; }
   uint max_supported_key_length()    const { return 128; }
   /*
     Called in test_quick_select to determine if indexes should be used.
@@ -113,9 +184,11 @@ public:
   int write_row(uchar * buf);
   int update_row(const uchar * old_data, uchar * new_data);
   int delete_row(const uchar * buf);
+  int index_init(uint idx, bool sorted);
   int index_read_map(uchar *buf, const uchar *key,
                      key_part_map keypart_map, enum ha_rkey_function find_flag);
   int index_next(uchar * buf);
+  int index_next_same(uchar *buf, const uchar *key, uint keylen);
   int index_prev(uchar * buf);
   int index_first(uchar * buf);
   int index_last(uchar * buf);
@@ -135,8 +208,15 @@ public:
   int info(uint);                                              //required
 
   int extra(enum ha_extra_function operation);
+  int reset();
+  const Item *cond_push(const Item *cond);
+  void cond_pop();
   int external_lock(THD *thd, int lock_type);                   //required
   int delete_all_rows(void);
+  void start_bulk_insert(ha_rows rows);
+  int end_bulk_insert();
+  int repair(THD *thd, HA_CHECK_OPT *check_opt);
+  bool is_crashed() const;
   int truncate();
   ha_rows records_in_range(uint inx, key_range *min_key,
                            key_range *max_key);
@@ -147,7 +227,5 @@ public:
 
   THR_LOCK_DATA **store_lock(THD *thd, THR_LOCK_DATA **to,
                              enum thr_lock_type lock_type);     //required
-  uchar *get_key();
-  int get_key_len();
 };
 
@@ -0,0 +1,1049 @@
+/*
+  Spartan_art.cc
+
+  This class implements the adaptive radix tree used to keep a small
+  Spartan index in memory. A search consumes one byte of the tree key per
+  inner node after skipping the node's compressed prefix. Only the first
+  SDE_ART_PREFIX bytes of a prefix are kept in the node; when a prefix is
+  longer the bytes are taken from any leaf below the node, since every key
+  below it shares them.
+
+  Child pointers that refer to leaves are tagged in the low bit.
+*/
+#include "spartan_art.h"
+#include <string.h>
+
+static inline bool art_is_leaf(void *p)
+{
+  return (((size_t)p) & 1) != 0;
+}
+
+static inline SDE_ART_LEAF *art_leaf(void *p)
+{
+  return (SDE_ART_LEAF *)(((size_t)p) & ~((size_t)1));
+}
+
+static inline void *art_tag(SDE_ART_LEAF *leaf)
+{
+  return (void *)(((size_t)leaf) | 1);
+}
+
+/* size of a node of each type */
+static size_t art_node_size(uchar type)
+{
+  switch (type)
+  {
+  case SDE_ART_NODE_4:
+    return sizeof(SDE_ART_NODE4);
+  case SDE_ART_NODE_16:
+    return sizeof(SDE_ART_NODE16);
+  case SDE_ART_NODE_48:
+    return sizeof(SDE_ART_NODE48);
+  default:
+    return sizeof(SDE_ART_NODE256);
+  }
+}
+
+/* copy the child count and prefix to a node of another size */
+static void art_copy_header(SDE_ART_NODE *to, SDE_ART_NODE *from)
+{
+  to->count = from->count;
+  to->prefix_len = from->prefix_len;
+  memcpy(to->prefix, from->prefix, SDE_ART_PREFIX);
+}
+
+Spartan_art::Spartan_art(int keylen)
+{
+  limbo = NULL;
+  limbo_count = 0;
+  limbo_size = 0;
+  root = NULL;
+  head = NULL;
+  tail = NULL;
+  max_key_len = keylen;
+  tree_key_len = keylen + sizeof(long long);
+  num_leaves = 0;
+  mem_used = 0;
+}
+
+Spartan_art::~Spartan_art(void)
+{
+  clear();
+  my_free(limbo);
+}
+
+/* build the tree key: the index key padded with zeros, then the position */
+void Spartan_art::make_key(uchar *buf, uchar *key, int key_len,
+                           long long pos)
+{
+  ulonglong p = (pos < 0) ? 0 : (ulonglong)pos;
+  int i;
+
+  if (key_len > max_key_len)
+    key_len = max_key_len;
+  memset(buf, 0, max_key_len);
+  memcpy(buf, key, key_len);
+  for (i = sizeof(long long) - 1; i >= 0; i--, p >>= 8)
+    buf[max_key_len + i] = (uchar)p;
+}
+
+void *Spartan_art::alloc_node(uchar type)
+{
+  SDE_ART_NODE *node;
+
+  node = (SDE_ART_NODE *)slab.alloc(art_node_size(type));
+  if (node != NULL)
+  {
+    memset(node, 0, art_node_size(type));
+    node->type = type;
+    mem_used += art_node_size(type);
+  }
+  return node;
+}
+
+void Spartan_art::free_node(void *node)
+{
+  mem_used -= art_node_size(((SDE_ART_NODE *)node)->type);
+  slab.release(node, art_node_size(((SDE_ART_NODE *)node)->type));
+}
+
+/*
+  Take memory that was unlinked from the tree out of use. An optimistic
+  reader may still be looking at it, so it is only freed by reclaim(),
+  which the caller runs once no reader can hold a pointer into the tree.
+  If the list cannot grow the memory is leaked rather than freed early.
+*/
+void Spartan_art::retire(void *p, size_t size)
+{
+  SDE_ART_RETIRED *list;
+
+  mem_used -= size;
+  if (limbo_count == limbo_size)
+  {
+    list = (SDE_ART_RETIRED *)my_realloc(limbo, (limbo_size + 64) *
+                                         sizeof(SDE_ART_RETIRED),
+                                         MYF(MY_ALLOW_ZERO_PTR));
+    if (list == NULL)
+      return;
+    limbo = list;
+    limbo_size += 64;
+  }
+  limbo[limbo_count].p = p;
+  limbo[limbo_count++].size = size;
+}
+
+/* free the memory given to retire() */
+void Spartan_art::reclaim()
+{
+  uint i;
+
+  for (i = 0; i < limbo_count; i++)
+    slab.release(limbo[i].p, limbo[i].size);
+  limbo_count = 0;
+}
+
+/* free the inner nodes below node (the leaves are freed from the list) */
+void Spartan_art::free_tree(void *node)
+{
+  SDE_ART_NODE *n;
+  void **children;
+  int slots;
+  int i;
+
+  if ((node == NULL) || art_is_leaf(node))
+    return;
+  n = (SDE_ART_NODE *)node;
+  switch (n->type)
+  {
+  case SDE_ART_NODE_4:
+    children = ((SDE_ART_NODE4 *)n)->children;
+    slots = n->count;
+    break;
+  case SDE_ART_NODE_16:
+    children = ((SDE_ART_NODE16 *)n)->children;
+    slots = n->count;
+    break;
+  case SDE_ART_NODE_48:
+    children = ((SDE_ART_NODE48 *)n)->children;
+    slots = 48;
+    break;
+  default:
+    children = ((SDE_ART_NODE256 *)n)->children;
+    slots = 256;
+    break;
+  }
+  for (i = 0; i < slots; i++)
+    free_tree(children[i]);
+  free_node(n);
+}
+
+/* remove every entry (there must be no optimistic readers) */
+void Spartan_art::clear()
+{
+  limbo_count = 0;
+  slab.free_all();
+  root = NULL;
+  head = NULL;
+  tail = NULL;
+  num_leaves = 0;
+  mem_used = 0;
+}
+
+/* the prefix bytes of node, which starts at depth in the tree key */
+uchar *Spartan_art::prefix_bytes(SDE_ART_NODE *node, int depth)
+{
+  if (node->prefix_len <= (uint32)SDE_ART_PREFIX)
+    return node->prefix;
+  return min_leaf(node)->key + depth;
+}
+
+/* number of prefix bytes of node that match key */
+int Spartan_art::check_prefix(SDE_ART_NODE *node, uchar *key, int depth)
+{
+  uchar *p = prefix_bytes(node, depth);
+  int i;
+
+  for (i = 0; i < (int)node->prefix_len; i++)
+    if (p[i] != key[depth + i])
+      break;
+  return i;
+}
+
+/* the child slot for byte or NULL if there is none */
+void **Spartan_art::find_child(SDE_ART_NODE *node, uchar byte)
+{
+  SDE_ART_NODE4 *n4;
+  SDE_ART_NODE16 *n16;
+  SDE_ART_NODE48 *n48;
+  SDE_ART_NODE256 *n256;
+  int i;
+
+  switch (node->type)
+  {
+  case SDE_ART_NODE_4:
+    n4 = (SDE_ART_NODE4 *)node;
+    for (i = 0; i < node->count; i++)
+      if (n4->keys[i] == byte)
+        return &n4->children[i];
+    break;
+  case SDE_ART_NODE_16:
+    n16 = (SDE_ART_NODE16 *)node;
+    for (i = 0; i < node->count; i++)
+      if (n16->keys[i] == byte)
+        return &n16->children[i];
+    break;
+  case SDE_ART_NODE_48:
+    n48 = (SDE_ART_NODE48 *)node;
+    if (n48->index[byte])
+      return &n48->children[n48->index[byte] - 1];
+    break;
+  default:
+    n256 = (SDE_ART_NODE256 *)node;
+    if (n256->children[byte])
+      return &n256->children[byte];
+    break;
+  }
+  return NULL;
+}
+
+/* the first child for a byte greater than byte, or NULL */
+void *Spartan_art::next_child(SDE_ART_NODE *node, uchar byte)
+{
+  SDE_ART_NODE4 *n4;
+  SDE_ART_NODE16 *n16;
+  SDE_ART_NODE48 *n48;
+  SDE_ART_NODE256 *n256;
+  int i;
+
+  switch (node->type)
+  {
+  case SDE_ART_NODE_4:
+    n4 = (SDE_ART_NODE4 *)node;
+    for (i = 0; i < node->count; i++)
+      if (n4->keys[i] > byte)
+        return n4->children[i];
+    break;
+  case SDE_ART_NODE_16:
+    n16 = (SDE_ART_NODE16 *)node;
+    for (i = 0; i < node->count; i++)
+      if (n16->keys[i] > byte)
+        return n16->children[i];
+    break;
+  case SDE_ART_NODE_48:
+    n48 = (SDE_ART_NODE48 *)node;
+    for (i = byte + 1; i < 256; i++)
+      if (n48->index[i])
+        return n48->children[n48->index[i] - 1];
+    break;
+  default:
+    n256 = (SDE_ART_NODE256 *)node;
+    for (i = byte + 1; i < 256; i++)
+      if (n256->children[i])
+        return n256->children[i];
+    break;
+  }
+  return NULL;
+}
+
+/* the smallest leaf below node */
+SDE_ART_LEAF *Spartan_art::min_leaf(void *node)
+{
+  SDE_ART_NODE *n;
+  SDE_ART_NODE48 *n48;
+  int i;
+
+  while (!art_is_leaf(node))
+  {
+    n = (SDE_ART_NODE *)node;
+    switch (n->type)
+    {
+    case SDE_ART_NODE_4:
+      node = ((SDE_ART_NODE4 *)n)->children[0];
+      break;
+    case SDE_ART_NODE_16:
+      node = ((SDE_ART_NODE16 *)n)->children[0];
+      break;
+    case SDE_ART_NODE_48:
+      n48 = (SDE_ART_NODE48 *)n;
+      for (i = 0; !n48->index[i]; i++)
+        ;
+      node = n48->children[n48->index[i] - 1];
+      break;
+    default:
+      for (i = 0; !((SDE_ART_NODE256 *)n)->children[i]; i++)
+        ;
+      node = ((SDE_ART_NODE256 *)n)->children[i];
+      break;
+    }
+  }
+  return art_leaf(node);
+}
+
+/* the largest leaf below node */
+SDE_ART_LEAF *Spartan_art::max_leaf(void *node)
+{
+  SDE_ART_NODE *n;
+  SDE_ART_NODE48 *n48;
+  int i;
+
+  while (!art_is_leaf(node))
+  {
+    n = (SDE_ART_NODE *)node;
+    switch (n->type)
+    {
+    case SDE_ART_NODE_4:
+      node = ((SDE_ART_NODE4 *)n)->children[n->count - 1];
+      break;
+    case SDE_ART_NODE_16:
+      node = ((SDE_ART_NODE16 *)n)->children[n->count - 1];
+      break;
+    case SDE_ART_NODE_48:
+      n48 = (SDE_ART_NODE48 *)n;
+      for (i = 255; !n48->index[i]; i--)
+        ;
+      node = n48->children[n48->index[i] - 1];
+      break;
+    default:
+      for (i = 255; !((SDE_ART_NODE256 *)n)->children[i]; i--)
+        ;
+      node = ((SDE_ART_NODE256 *)n)->children[i];
+      break;
+    }
+  }
+  return art_leaf(node);
+}
+
+/*
+  Add a child for byte to node, replacing the node (through ref) with
+  the next larger type when it is full.
+*/
+int Spartan_art::add_child(void **ref, SDE_ART_NODE *node, uchar byte,
+                           void *child)
+{
+  SDE_ART_NODE4 *n4;
+  SDE_ART_NODE16 *n16;
+  SDE_ART_NODE48 *n48;
+  SDE_ART_NODE256 *n256;
+  uchar *keys;
+  void **children;
+  int i;
+
+  switch (node->type)
+  {
+  case SDE_ART_NODE_4:
+  case SDE_ART_NODE_16:
+    if (node->type == SDE_ART_NODE_4)
+    {
+      n4 = (SDE_ART_NODE4 *)node;
+      if (node->count == 4)
+      {
+        if ((n16 = (SDE_ART_NODE16 *)alloc_node(SDE_ART_NODE_16)) == NULL)
+          return -1;
+        art_copy_header(&n16->n, node);
+        memcpy(n16->keys, n4->keys, 4);
+        memcpy(n16->children, n4->children, 4 * sizeof(void *));
+        *ref = n16;
+        retire(node, art_node_size(node->type));
+        return add_child(ref, &n16->n, byte, child);
+      }
+      keys = n4->keys;
+      children = n4->children;
+    }
+    else
+    {
+      n16 = (SDE_ART_NODE16 *)node;
+      if (node->count == 16)
+      {
+        if ((n48 = (SDE_ART_NODE48 *)alloc_node(SDE_ART_NODE_48)) == NULL)
+          return -1;
+        art_copy_header(&n48->n, node);
+        for (i = 0; i < 16; i++)
+        {
+          n48->index[n16->keys[i]] = i + 1;
+          n48->children[i] = n16->children[i];
+        }
+        *ref = n48;
+        retire(node, art_node_size(node->type));
+        return add_child(ref, &n48->n, byte, child);
+      }
+      keys = n16->keys;
+      children = n16->children;
+    }
+    /* keep the keys sorted so iteration is in order */
+    for (i = 0; (i < node->count) && (keys[i] < byte); i++)
+      ;
+    memmove(keys + i + 1, keys + i, node->count - i);
+    memmove(children + i + 1, children + i,
+            (node->count - i) * sizeof(void *));
+    keys[i] = byte;
+    children[i] = child;
+    node->count++;
+    break;
+  case SDE_ART_NODE_48:
+    n48 = (SDE_ART_NODE48 *)node;
+    if (node->count == 48)
+    {
+      if ((n256 = (SDE_ART_NODE256 *)alloc_node(SDE_ART_NODE_256)) == NULL)
+        return -1;
+      art_copy_header(&n256->n, node);
+      for (i = 0; i < 256; i++)
+        if (n48->index[i])
+          n256->children[i] = n48->children[n48->index[i] - 1];
+      *ref = n256;
+      retire(node, art_node_size(node->type));
+      return add_child(ref, &n256->n, byte, child);
+    }
+    for (i = 0; n48->children[i] != NULL; i++)
+      ;
+    n48->children[i] = child;
+    n48->index[byte] = i + 1;
+    node->count++;
+    break;
+  default:
+    ((SDE_ART_NODE256 *)node)->children[byte] = child;
+    node->count++;
+    break;
+  }
+  return 0;
+}
+
+/*
+  Remove the child for byte from node. A node that becomes sparse is
+  replaced by the next smaller type, and a node4 left with one child is
+  replaced by that child with the prefixes joined.
+*/
+void Spartan_art::remove_child(void **ref, SDE_ART_NODE *node, uchar byte)
+{
+  SDE_ART_NODE4 *n4;
+  SDE_ART_NODE16 *n16;
+  SDE_ART_NODE48 *n48;
+  SDE_ART_NODE256 *n256;
+  SDE_ART_NODE *c;
+  uchar *keys;
+  void **children;
+  uchar buf[SDE_ART_PREFIX];
+  int n;
+  int i;
+  int j;
+
+  switch (node->type)
+  {
+  case SDE_ART_NODE_4:
+  case SDE_ART_NODE_16:
+    if (node->type == SDE_ART_NODE_4)
+    {
+      keys = ((SDE_ART_NODE4 *)node)->keys;
+      children = ((SDE_ART_NODE4 *)node)->children;
+    }
+    else
+    {
+      keys = ((SDE_ART_NODE16 *)node)->keys;
+      children = ((SDE_ART_NODE16 *)node)->children;
+    }
+    for (i = 0; keys[i] != byte; i++)
+      ;
+    memmove(keys + i, keys + i + 1, node->count - i - 1);
+    memmove(children + i, children + i + 1,
+            (node->count - i - 1) * sizeof(void *));
+    node->count--;
+    if ((node->type == SDE_ART_NODE_16) && (node->count == 3))
+    {
+      if ((n4 = (SDE_ART_NODE4 *)alloc_node(SDE_ART_NODE_4)) == NULL)
+        return;
+      art_copy_header(&n4->n, node);
+      memcpy(n4->keys, keys, 3);
+      memcpy(n4->children, children, 3 * sizeof(void *));
+      *ref = n4;
+      retire(node, art_node_size(node->type));
+    }
+    else if ((node->type == SDE_ART_NODE_4) && (node->count == 1))
+    {
+      n4 = (SDE_ART_NODE4 *)node;
+      if (!art_is_leaf(n4->children[0]))
+      {
+        /* child prefix = node prefix + the byte + child prefix */
+        c = (SDE_ART_NODE *)n4->children[0];
+        n = MY_MIN((int)node->prefix_len, SDE_ART_PREFIX);
+        memcpy(buf, node->prefix, n);
+        if (n < SDE_ART_PREFIX)
+          buf[n++] = n4->keys[0];
+        if (n < SDE_ART_PREFIX)
+        {
+          j = MY_MIN((int)c->prefix_len, SDE_ART_PREFIX - n);
+          memcpy(buf + n, c->prefix, j);
+          n += j;
+        }
+        c->prefix_len += node->prefix_len + 1;
+        memcpy(c->prefix, buf, n);
+      }
+      *ref = n4->children[0];
+      retire(node, art_node_size(node->type));
+    }
+    break;
+  case SDE_ART_NODE_48:
+    n48 = (SDE_ART_NODE48 *)node;
+    n48->children[n48->index[byte] - 1] = NULL;
+    n48->index[byte] = 0;
+    node->count--;
+    if (node->count == 12)
+    {
+      if ((n16 = (SDE_ART_NODE16 *)alloc_node(SDE_ART_NODE_16)) == NULL)
+        return;
+      art_copy_header(&n16->n, node);
+      for (i = 0, j = 0; i < 256; i++)
+        if (n48->index[i])
+        {
+          n16->keys[j] = (uchar)i;
+          n16->children[j++] = n48->children[n48->index[i] - 1];
+        }
+      *ref = n16;
+      retire(node, art_node_size(node->type));
+    }
+    break;
+  default:
+    n256 = (SDE_ART_NODE256 *)node;
+    n256->children[byte] = NULL;
+    node->count--;
+    if (node->count == 37)
+    {
+      if ((n48 = (SDE_ART_NODE48 *)alloc_node(SDE_ART_NODE_48)) == NULL)
+        return;
+      art_copy_header(&n48->n, node);
+      for (i = 0, j = 0; i < 256; i++)
+        if (n256->children[i])
+        {
+          n48->children[j] = n256->children[i];
+          n48->index[i] = ++j;
+        }
+      *ref = n48;
+      retire(node, art_node_size(node->type));
+    }
+    break;
+  }
+}
+
+/* add leaf below *ref; returns 1 if the key is already present */
+int Spartan_art::insert_at(void **ref, SDE_ART_LEAF *leaf, int depth)
+{
+  SDE_ART_NODE4 *n4;
+  SDE_ART_NODE *node;
+  SDE_ART_LEAF *l;
+  void **child;
+  uchar byte;
+  int p;
+  int i;
+
+  if (*ref == NULL)
+  {
+    *ref = art_tag(leaf);
+    return 0;
+  }
+  if (art_is_leaf(*ref))
+  {
+    /*
+      Two leaves: a node4 takes over the bytes they share and the
+      first byte where they differ picks the child.
+    */
+    l = art_leaf(*ref);
+    for (i = depth; (i < tree_key_len) && (l->key[i] == leaf->key[i]); i++)
+      ;
+    if (i == tree_key_len)
+      return 1;
+    if ((n4 = (SDE_ART_NODE4 *)alloc_node(SDE_ART_NODE_4)) == NULL)
+      return -1;
+    n4->n.prefix_len = i - depth;
+    memcpy(n4->n.prefix, leaf->key + depth,
+           MY_MIN(i - depth, SDE_ART_PREFIX));
+    add_child(ref, &n4->n, l->key[i], *ref);
+    add_child(ref, &n4->n, leaf->key[i], art_tag(leaf));
+    *ref = n4;
+    return 0;
+  }
+  node = (SDE_ART_NODE *)*ref;
+  if (node->prefix_len > 0)
+  {
+    p = check_prefix(node, leaf->key, depth);
+    if (p < (int)node->prefix_len)
+    {
+      /*
+        The key leaves the prefix at byte p. A new node4 takes the
+        matching part and the old node keeps what follows byte p.
+      */
+      if ((n4 = (SDE_ART_NODE4 *)alloc_node(SDE_ART_NODE_4)) == NULL)
+        return -1;
+      n4->n.prefix_len = p;
+      memcpy(n4->n.prefix, node->prefix, MY_MIN(p, SDE_ART_PREFIX));
+      if (node->prefix_len <= (uint32)SDE_ART_PREFIX)
+      {
+        byte = node->prefix[p];
+        node->prefix_len -= p + 1;
+        memmove(node->prefix, node->prefix + p + 1, node->prefix_len);
+      }
+      else
+      {
+        l = min_leaf(node);
+        byte = l->key[depth + p];
+        node->prefix_len -= p + 1;
+        memcpy(node->prefix, l->key + depth + p + 1,
+               MY_MIN((int)node->prefix_len, SDE_ART_PREFIX));
+      }
+      add_child(ref, &n4->n, byte, node);
+      add_child(ref, &n4->n, leaf->key[depth + p], art_tag(leaf));
+      *ref = n4;
+      return 0;
+    }
+    depth += node->prefix_len;
+  }
+  child = find_child(node, leaf->key[depth]);
+  if (child != NULL)
+    return insert_at(child, leaf, depth + 1);
+  return add_child(ref, node, leaf->key[depth], art_tag(leaf));
+}
+
+/* take the leaf for key out of the tree below *ref */
+SDE_ART_LEAF *Spartan_art::remove_at(void **ref, uchar *key, int depth)
+{
+  SDE_ART_NODE *node;
+  SDE_ART_LEAF *l;
+  void **child;
+
+  if (*ref == NULL)
+    return NULL;
+  if (art_is_leaf(*ref))
+  {
+    l = art_leaf(*ref);
+    if (memcmp(l->key, key, tree_key_len) != 0)
+      return NULL;
+    *ref = NULL;
+    return l;
+  }
+  node = (SDE_ART_NODE *)*ref;
+  if (node->prefix_len > 0)
+  {
+    if (check_prefix(node, key, depth) != (int)node->prefix_len)
+      return NULL;
+    depth += node->prefix_len;
+  }
+  child = find_child(node, key[depth]);
+  if (child == NULL)
+    return NULL;
+  if (art_is_leaf(*child))
+  {
+    l = art_leaf(*child);
+    if (memcmp(l->key, key, tree_key_len) != 0)
+      return NULL;
+    remove_child(ref, node, key[depth]);
+    return l;
+  }
+  return remove_at(child, key, depth + 1);
+}
+
+/*
+  The first leaf not less than key. Once the search leaves the tree the
+  answer is the leaf after the largest leaf of the subtree to the left,
+  which the leaf list gives directly.
+*/
+SDE_ART_LEAF *Spartan_art::lower_at(void *n, uchar *key, int depth)
+{
+  SDE_ART_NODE *node;
+  SDE_ART_LEAF *l;
+  void **child;
+  void *next;
+  uchar *p;
+  int i;
+
+  if (art_is_leaf(n))
+  {
+    l = art_leaf(n);
+    return (memcmp(l->key, key, tree_key_len) >= 0) ? l : l->next;
+  }
+  node = (SDE_ART_NODE *)n;
+  if (node->prefix_len > 0)
+  {
+    p = prefix_bytes(node, depth);
+    for (i = 0; i < (int)node->prefix_len; i++)
+      if (p[i] != key[depth + i])
+        return (p[i] > key[depth + i]) ? min_leaf(node) :
+                                         max_leaf(node)->next;
+    depth += node->prefix_len;
+  }
+  child = find_child(node, key[depth]);
+  if (child != NULL)
+    return lower_at(*child, key, depth + 1);
+  next = next_child(node, key[depth]);
+  return (next != NULL) ? min_leaf(next) : max_leaf(node)->next;
+}
+
+/* allocate a leaf for an entry (not linked or counted) */
+SDE_ART_LEAF *Spartan_art::alloc_leaf(uchar *key, int key_len,
+                                      long long pos)
+{
+  SDE_ART_LEAF *leaf;
+
+  leaf = (SDE_ART_LEAF *)slab.alloc(sizeof(SDE_ART_LEAF) + tree_key_len);
+  if (leaf != NULL)
+  {
+    make_key(leaf->key, key, key_len, pos);
+    leaf->pos = pos;
+    leaf->length = MY_MIN(key_len, max_key_len);
+  }
+  return leaf;
+}
+
+/* add an entry; returns 1 if it is already present, -1 if out of memory */
+int Spartan_art::insert(uchar *key, int key_len, long long pos)
+{
+  SDE_ART_LEAF *leaf;
+  SDE_ART_LEAF *succ;
+  int rc;
+
+  DBUG_ENTER("Spartan_art::insert");
+  if ((leaf = alloc_leaf(key, key_len, pos)) == NULL)
+    DBUG_RETURN(-1);
+  succ = (root != NULL) ? lower_at(root, leaf->key, 0) : NULL;
+  rc = insert_at(&root, leaf, 0);
+  if (rc != 0)
+  {
+    slab.release(leaf, sizeof(SDE_ART_LEAF) + tree_key_len);
+    DBUG_RETURN(rc);
+  }
+  /* link the leaf in front of its successor */
+  leaf->next = succ;
+  leaf->prev = (succ != NULL) ? succ->prev : tail;
+  if (leaf->prev != NULL)
+    leaf->prev->next = leaf;
+  else
+    head = leaf;
+  if (succ != NULL)
+    succ->prev = leaf;
+  else
+    tail = leaf;
+  num_leaves++;
+  mem_used += sizeof(SDE_ART_LEAF) + tree_key_len;
+  DBUG_RETURN(0);
+}
+
+/* remove an entry; returns 1 if it is not present */
+int Spartan_art::remove(uchar *key, int key_len, long long pos)
+{
+  uchar buf[SDE_ART_MAX_KEY];
+  SDE_ART_LEAF *l;
+
+  DBUG_ENTER("Spartan_art::remove");
+  make_key(buf, key, key_len, pos);
+  l = remove_at(&root, buf, 0);
+  if (l == NULL)
+    DBUG_RETURN(1);
+  if (l->next != NULL)
+    l->next->prev = l->prev;
+  else
+    tail = l->prev;
+  if (l->prev != NULL)
+    l->prev->next = l->next;
+  else
+    head = l->next;
+  retire(l, sizeof(SDE_ART_LEAF) + tree_key_len);
+  num_leaves--;
+  DBUG_RETURN(0);
+}
+
+/* the first entry not less than (key, pos); pos -1 finds the first row */
+SDE_ART_LEAF *Spartan_art::lower_bound(uchar *key, int key_len,
+                                       long long pos)
+{
+  uchar buf[SDE_ART_MAX_KEY];
+
+  if (root == NULL)
+    return NULL;
+  make_key(buf, key, key_len, pos);
+  return lower_at(root, buf, 0);
+}
+
+/*
+  Create a leaf for build(). The leaf is kept at the end of the leaf
+  list until build() puts the list in key order, so clear() frees it if
+  the build is abandoned.
+*/
+SDE_ART_LEAF *Spartan_art::add_leaf(uchar *key, int key_len, long long pos)
+{
+  SDE_ART_LEAF *leaf;
+
+  if ((leaf = alloc_leaf(key, key_len, pos)) == NULL)
+    return NULL;
+  leaf->next = NULL;
+  leaf->prev = tail;
+  if (tail != NULL)
+    tail->next = leaf;
+  else
+    head = leaf;
+  tail = leaf;
+  num_leaves++;
+  mem_used += sizeof(SDE_ART_LEAF) + tree_key_len;
+  return leaf;
+}
+
+/*
+  Build the node for the sorted leaves (all distinct) that share the
+  first depth bytes. The bytes shared by the first and the last leaf are
+  shared by all of them and become the node prefix; the leaves are then
+  split into runs on the next byte, one child per run.
+*/
+int Spartan_art::build_at(SDE_ART_LEAF **leaves, long long n, int depth,
+                          void **ref)
+{
+  SDE_ART_NODE *node;
+  uchar *first = leaves[0]->key;
+  uchar *last = leaves[n - 1]->key;
+  void *child;
+  long long i;
+  long long j;
+  int children = 1;
+  int p;
+
+  if (n == 1)
+  {
+    *ref = art_tag(leaves[0]);
+    return 0;
+  }
+  for (p = depth; (p < tree_key_len) && (first[p] == last[p]); p++)
+    ;
+  if (p == tree_key_len)
+    return -1;                          /* the same entry twice */
+  for (i = 1; i < n; i++)
+    if (leaves[i]->key[p] != leaves[i - 1]->key[p])
+      children++;
+  node = (SDE_ART_NODE *)alloc_node((children <= 4) ? SDE_ART_NODE_4 :
+                                    (children <= 16) ? SDE_ART_NODE_16 :
+                                    (children <= 48) ? SDE_ART_NODE_48 :
+                                    SDE_ART_NODE_256);
+  if (node == NULL)
+    return -1;
+  node->prefix_len = p - depth;
+  memcpy(node->prefix, first + depth, MY_MIN(p - depth, SDE_ART_PREFIX));
+  /* the node is large enough for every child, so it is never replaced */
+  *ref = node;
+  for (i = 0; i < n; i = j)
+  {
+    for (j = i + 1; (j < n) && (leaves[j]->key[p] == leaves[i]->key[p]); j++)
+      ;
+    if (build_at(leaves + i, j - i, p + 1, &child))
+    {
+      free_tree(node);
+      *ref = NULL;
+      return -1;
+    }
+    add_child(ref, node, leaves[i]->key[p], child);
+  }
+  return 0;
+}
+
+/*
+  Build the tree over the leaves created by add_leaf(). leaves holds
+  every leaf in key order. Returns -1 (with the tree cleared) if memory
+  runs out.
+*/
+int Spartan_art::build(SDE_ART_LEAF **leaves)
+{
+  long long i;
+
+  DBUG_ENTER("Spartan_art::build");
+  if (num_leaves == 0)
+    DBUG_RETURN(0);
+  for (i = 0; i < num_leaves; i++)
+  {
+    leaves[i]->prev = (i > 0) ? leaves[i - 1] : NULL;
+    leaves[i]->next = (i + 1 < num_leaves) ? leaves[i + 1] : NULL;
+  }
+  head = leaves[0];
+  tail = leaves[num_leaves - 1];
+  if (build_at(leaves, num_leaves, 0, &root))
+  {
+    clear();
+    DBUG_RETURN(-1);
+  }
+  DBUG_RETURN(0);
+}
+
+/*
+  The row position of the entry with key, for a reader that does not hold
+  the mutex while a writer may be changing the tree. Nothing read here is
+  trusted: every pointer is checked, every loop is bounded by the length
+  of the tree key, and the caller throws the answer away unless the tree
+  version is unchanged afterwards. Memory unlinked by the writer is not
+  freed while the reader runs (see retire()).
+
+  Returns 1 if the key was found, 2 if it was found and the next entry
+  has the same key, 0 if it is not in the tree and -1 if the tree was
+  seen in an inconsistent state.
+*/
+int Spartan_art::find_pos(uchar *key, int key_len, long long *pos)
+{
+  uchar buf[SDE_ART_MAX_KEY];
+  SDE_ART_NODE *node;
+  SDE_ART_LEAF *l = NULL;
+  SDE_ART_LEAF *min;
+  uchar *p;
+  void *n;
+  int depth = 0;
+  int levels;
+  int len;
+
+  make_key(buf, key, key_len, 0);
+  n = my_atomic_loadptr((void * volatile *)&root);
+  for (levels = 0; (n != NULL) && (levels <= tree_key_len); levels++)
+  {
+    if (art_is_leaf(n))
+    {
+      l = art_leaf(n);
+      break;
+    }
+    node = (SDE_ART_NODE *)n;
+    if (depth + (int)node->prefix_len >= tree_key_len)
+      return -1;
+    /* only the bytes of the index key have to match, not the position */
+    len = MY_MIN((int)node->prefix_len, max_key_len - depth);
+    if (len > 0)
+    {
+      if (node->prefix_len <= (uint32)SDE_ART_PREFIX)
+        p = node->prefix;
+      else if ((min = read_min_leaf(node)) != NULL)
+        p = min->key + depth;
+      else
+        return -1;
+      if (memcmp(p, buf + depth, len) != 0)
+        return 0;
+    }
+    depth += node->prefix_len;
+    if (depth >= max_key_len)
+    {
+      /* the rest is the position: the smallest is the first row */
+      l = read_min_leaf(node);
+      break;
+    }
+    n = read_child(node, buf[depth++]);
+    if (n == NULL)
+      return 0;
+  }
+  if (l == NULL)
+    return (n == NULL) ? 0 : -1;
+  if (memcmp(l->key, buf, max_key_len) != 0)
+    return 0;
+  *pos = l->pos;
+  min = l->next;
+  return ((min != NULL) && (memcmp(min->key, buf, max_key_len) == 0)) ? 2 : 1;
+}
+
+/* find_child() for find_pos(): the child pointer itself, checked */
+void *Spartan_art::read_child(SDE_ART_NODE *node, uchar byte)
+{
+  SDE_ART_NODE4 *n4;
+  SDE_ART_NODE16 *n16;
+  SDE_ART_NODE48 *n48;
+  int count = node->count;
+  int i;
+
+  switch (node->type)
+  {
+  case SDE_ART_NODE_4:
+    n4 = (SDE_ART_NODE4 *)node;
+    for (i = 0; i < MY_MIN(count, 4); i++)
+      if (n4->keys[i] == byte)
+        return n4->children[i];
+    break;
+  case SDE_ART_NODE_16:
+    n16 = (SDE_ART_NODE16 *)node;
+    for (i = 0; i < MY_MIN(count, 16); i++)
+      if (n16->keys[i] == byte)
+        return n16->children[i];
+    break;
+  case SDE_ART_NODE_48:
+    n48 = (SDE_ART_NODE48 *)node;
+    i = n48->index[byte];
+    if ((i > 0) && (i <= 48))
+      return n48->children[i - 1];
+    break;
+  case SDE_ART_NODE_256:
+    return ((SDE_ART_NODE256 *)node)->children[byte];
+  }
+  return NULL;
+}
+
+/* min_leaf() for find_pos(): NULL if the path cannot be followed */
+SDE_ART_LEAF *Spartan_art::read_min_leaf(void *n)
+{
+  SDE_ART_NODE *node;
+  SDE_ART_NODE48 *n48;
+  int levels;
+  int i;
+
+  for (levels = 0; (n != NULL) && (levels <= tree_key_len); levels++)
+  {
+    if (art_is_leaf(n))
+      return art_leaf(n);
+    node = (SDE_ART_NODE *)n;
+    switch (node->type)
+    {
+    case SDE_ART_NODE_4:
+      n = ((SDE_ART_NODE4 *)node)->children[0];
+      break;
+    case SDE_ART_NODE_16:
+      n = ((SDE_ART_NODE16 *)node)->children[0];
+      break;
+    case SDE_ART_NODE_48:
+      n48 = (SDE_ART_NODE48 *)node;
+      for (i = 0; (i < 256) && !n48->index[i]; i++)
+        ;
+      n = ((i < 256) && (n48->index[i] <= 48)) ?
+          n48->children[n48->index[i] - 1] : NULL;
+      break;
+    case SDE_ART_NODE_256:
+      for (i = 0; (i < 256) && !((SDE_ART_NODE256 *)node)->children[i]; i++)
+        ;
+      n = (i < 256) ? ((SDE_ART_NODE256 *)node)->children[i] : NULL;
+      break;
+    default:
+      return NULL;
+    }
+  }
+  return NULL;
+}
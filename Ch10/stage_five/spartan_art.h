@@ -0,0 +1,149 @@
+/*
+  Spartan_art.h
+
+  This header defines an adaptive radix tree (ART) over the entries of a
+  Spartan index. It is the in-memory form of an index that is small enough
+  to keep in RAM. Inner nodes grow and shrink between four sizes (4, 16, 48
+  and 256 children) so each holds only as many child slots as it uses, and
+  a run of bytes shared by every key below a node is stored once in the
+  node (path compression) instead of as a chain of single-child nodes.
+
+  The tree is keyed on the index key padded to max_key_len followed by the
+  row position in big-endian order, so every entry is unique and all keys
+  have the same length. The leaves are also linked in key order so index
+  cursors step from leaf to leaf.
+
+  An index that is loaded as a whole does not go through insert():
+  add_leaf() creates the leaves in any order and build() links them in
+  key order and builds the nodes bottom-up, one level of partitioning per
+  byte, without a search from the root for each entry.
+
+  Nodes and leaves are allocated from a slab arena of the tree's own
+  (see spartan_slab.h), so clear() frees them all at once.
+
+  The tree does no locking of its own. The caller must hold the share
+  mutex for all calls except find_pos(), which may run while the tree
+  is being changed (see Spartan_index::lookup_pos()). Memory unlinked by
+  a change is kept until reclaim() so such a reader never touches freed
+  memory.
+*/
+#include "my_global.h"
+#include "my_sys.h"
+#include "my_atomic.h"
+#include "spartan_slab.h"
+
+/* prefix bytes kept in a node; longer prefixes are read from a leaf */
+const int SDE_ART_PREFIX = 8;
+/* longest tree key: a 128 byte index key and the row position */
+const int SDE_ART_MAX_KEY = 128 + sizeof(long long);
+
+/* node types */
+const uchar SDE_ART_NODE_4 = 0;
+const uchar SDE_ART_NODE_16 = 1;
+const uchar SDE_ART_NODE_48 = 2;
+const uchar SDE_ART_NODE_256 = 3;
+
+/* a leaf holds one index entry */
+struct SDE_ART_LEAF
+{
+  SDE_ART_LEAF *next;
+  SDE_ART_LEAF *prev;
+  long long pos;
+  int length;            /* length of the index key */
+  uchar key[1];          /* tree key (max_key_len + 8 bytes) */
+};
+
+/* header shared by all inner nodes */
+struct SDE_ART_NODE
+{
+  uchar type;
+  uint16 count;          /* children in use */
+  uint32 prefix_len;     /* bytes skipped by this node */
+  uchar prefix[SDE_ART_PREFIX];
+};
+
+struct SDE_ART_NODE4
+{
+  SDE_ART_NODE n;
+  uchar keys[4];
+  void *children[4];
+};
+
+struct SDE_ART_NODE16
+{
+  SDE_ART_NODE n;
+  uchar keys[16];
+  void *children[16];
+};
+
+struct SDE_ART_NODE48
+{
+  SDE_ART_NODE n;
+  uchar index[256];      /* slot + 1 of the child for each byte (0 = none) */
+  void *children[48];
+};
+
+struct SDE_ART_NODE256
+{
+  SDE_ART_NODE n;
+  void *children[256];
+};
+
+/* memory unlinked from the tree, waiting for reclaim() */
+struct SDE_ART_RETIRED
+{
+  void *p;
+  size_t size;
+};
+
+class Spartan_art
+{
+public:
+  Spartan_art(int keylen);
+  ~Spartan_art(void);
+  int insert(uchar *key, int key_len, long long pos);
+  SDE_ART_LEAF *add_leaf(uchar *key, int key_len, long long pos);
+  int build(SDE_ART_LEAF **leaves);
+  int remove(uchar *key, int key_len, long long pos);
+  SDE_ART_LEAF *lower_bound(uchar *key, int key_len, long long pos);
+  int find_pos(uchar *key, int key_len, long long *pos);
+  SDE_ART_LEAF *first() { return head; }
+  SDE_ART_LEAF *last() { return tail; }
+  long long size() { return num_leaves; }
+  ulonglong memory_used() { return mem_used; }
+  void clear();
+  uint retired() { return limbo_count; }
+  void reclaim();
+private:
+  void *root;
+  Spartan_slab slab;
+  SDE_ART_RETIRED *limbo;   /* unlinked memory waiting for reclaim() */
+  uint limbo_count;
+  uint limbo_size;
+  SDE_ART_LEAF *head;
+  SDE_ART_LEAF *tail;
+  int max_key_len;
+  int tree_key_len;
+  long long num_leaves;
+  ulonglong mem_used;
+  void make_key(uchar *buf, uchar *key, int key_len, long long pos);
+  SDE_ART_LEAF *alloc_leaf(uchar *key, int key_len, long long pos);
+  void *alloc_node(uchar type);
+  void free_node(void *node);
+  void free_tree(void *node);
+  void retire(void *p, size_t size);
+  uchar *prefix_bytes(SDE_ART_NODE *node, int depth);
+  int check_prefix(SDE_ART_NODE *node, uchar *key, int depth);
+  void **find_child(SDE_ART_NODE *node, uchar byte);
+  void *next_child(SDE_ART_NODE *node, uchar byte);
+  SDE_ART_LEAF *min_leaf(void *node);
+  SDE_ART_LEAF *max_leaf(void *node);
+  int add_child(void **ref, SDE_ART_NODE *node, uchar byte, void *child);
+  void remove_child(void **ref, SDE_ART_NODE *node, uchar byte);
+  int insert_at(void **ref, SDE_ART_LEAF *leaf, int depth);
+  SDE_ART_LEAF *remove_at(void **ref, uchar *key, int depth);
+  SDE_ART_LEAF *lower_at(void *node, uchar *key, int depth);
+  int build_at(SDE_ART_LEAF **leaves, long long n, int depth, void **ref);
+  void *read_child(SDE_ART_NODE *node, uchar byte);
+  SDE_ART_LEAF *read_min_leaf(void *node);
+};
@@ -0,0 +1,144 @@
+/*
+  Spartan_bloom.cc
+
+  This class implements the blocked bloom filter of a Spartan index
+  (see spartan_bloom.h).
+*/
+#include "spartan_bloom.h"
+#include "my_base.h"
+#include <string.h>
+
+/* odd constants that pick the bit of each word of a block */
+static const uint32 bloom_salt[SDI_BLOOM_WORDS] =
+{
+  0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+  0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+/* probes the filters of all indexes answered without a search */
+volatile int64 Spartan_bloom::skipped = 0;
+
+Spartan_bloom::Spartan_bloom(void)
+{
+  raw = NULL;
+  blocks = NULL;
+  num_blocks = 0;
+  capacity = 0;
+  added = 0;
+}
+
+Spartan_bloom::~Spartan_bloom(void)
+{
+  destroy_bloom();
+}
+
+/* probes answered by a filter without searching an index */
+ulonglong Spartan_bloom::negatives()
+{
+  return (ulonglong)my_atomic_load64(&skipped);
+}
+
+/* allocate an empty filter for keys keys (bits_per_key 0 = disabled) */
+int Spartan_bloom::init_bloom(ulonglong keys, uint bits_per_key)
+{
+  ulonglong n;
+
+  DBUG_ENTER("Spartan_bloom::init_bloom");
+  destroy_bloom();
+  if (bits_per_key == 0)
+    DBUG_RETURN(0);
+  keys = MY_MAX(keys, SDI_BLOOM_MIN_KEYS);
+  n = (keys * bits_per_key + SDI_BLOOM_BLOCK * 8 - 1) / (SDI_BLOOM_BLOCK * 8);
+  if (n > (1ULL << 31))
+    n = 1ULL << 31;
+  /* the blocks start on a cache line */
+  if ((raw = (uchar *)my_malloc((size_t)(n + 1) * SDI_BLOOM_BLOCK,
+                                MYF(MY_WME | MY_ZEROFILL))) == NULL)
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  blocks = (ulonglong *)(((size_t)raw + SDI_BLOOM_BLOCK - 1) &
+                         ~((size_t)SDI_BLOOM_BLOCK - 1));
+  num_blocks = n;
+  capacity = keys;
+  added = 0;
+  DBUG_RETURN(0);
+}
+
+/* free the filter */
+void Spartan_bloom::destroy_bloom()
+{
+  my_free(raw);
+  raw = NULL;
+  blocks = NULL;
+  num_blocks = 0;
+  capacity = 0;
+  added = 0;
+}
+
+/* drop every key */
+void Spartan_bloom::clear_bloom()
+{
+  if (blocks != NULL)
+    memset(blocks, 0, (size_t)num_blocks * SDI_BLOOM_BLOCK);
+  added = 0;
+}
+
+/* FNV-1a over the key without its trailing zeros, mixed at the end */
+ulonglong Spartan_bloom::hash_key(uchar *key, int key_len)
+{
+  ulonglong h = 0xcbf29ce484222325ULL;
+  int i;
+
+  while ((key_len > 0) && (key[key_len - 1] == 0))
+    key_len--;
+  for (i = 0; i < key_len; i++)
+    h = (h ^ key[i]) * 0x100000001b3ULL;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* set the bits of key */
+void Spartan_bloom::add_key(uchar *key, int key_len)
+{
+  ulonglong hash;
+  ulonglong *block;
+  uint32 low;
+  uint i;
+
+  if (num_blocks == 0)
+    return;
+  hash = hash_key(key, key_len);
+  block = find_block(hash);
+  low = (uint32)hash;
+  for (i = 0; i < SDI_BLOOM_WORDS; i++)
+    block[i] |= 1ULL << ((uint32)(low * bloom_salt[i]) >> 26);
+  added++;
+}
+
+/*
+  False if key is certainly not in the index, true if it may be (or
+  there is no filter).
+*/
+bool Spartan_bloom::may_contain(uchar *key, int key_len)
+{
+  ulonglong hash;
+  ulonglong *block;
+  ulonglong missing = 0;
+  uint32 low;
+  uint i;
+
+  if (num_blocks == 0)
+    return true;
+  hash = hash_key(key, key_len);
+  block = find_block(hash);
+  low = (uint32)hash;
+  for (i = 0; i < SDI_BLOOM_WORDS; i++)
+    missing |= ~block[i] & (1ULL << ((uint32)(low * bloom_salt[i]) >> 26));
+  if (missing == 0)
+    return true;
+  my_atomic_add64(&skipped, 1);
+  return false;
+}
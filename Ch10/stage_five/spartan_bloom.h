@@ -0,0 +1,71 @@
+/*
+  Spartan_bloom.h
+
+  This header defines the bloom filter of a Spartan index: a bit array
+  that answers "the key is certainly not in the index" without reading
+  a page. A unique index checks it before it searches for a duplicate
+  of a key being inserted, and lookups of a whole key check it before
+  they descend the tree, so keys that are not there cost no page reads.
+
+  The filter is blocked. The bits are split into blocks of
+  SDI_BLOOM_BLOCK bytes (a cache line) of SDI_BLOOM_WORDS 64 bit words,
+  aligned in memory. A key picks one block with the high half of its
+  hash and sets one bit in each word of it, chosen by the low half of
+  the hash times a different odd constant per word. A probe therefore
+  touches one cache line, and the loop over the words has no branches
+  so the compiler can do the words side by side.
+
+  Keys compare as if padded with zeros, so they are hashed without
+  their trailing zero bytes.
+
+  Bits cannot be taken out, so deleted keys stay in the filter and only
+  make it answer "maybe" more often. The index builds the filter from
+  its leaves when it is loaded, with room for twice as many keys as it
+  has, adds every key it inserts, and builds it again when it holds more
+  keys than it has room for or after many deletes (see
+  Spartan_index::build_bloom()).
+
+  The class does no locking of its own. The caller must hold the share
+  mutex for all calls.
+*/
+#include "my_global.h"
+#include "my_sys.h"
+#include "my_atomic.h"
+
+/* bytes of a block, the size of a cache line */
+const uint SDI_BLOOM_BLOCK = 64;
+/* words of a block; a key sets one bit in each */
+const uint SDI_BLOOM_WORDS = SDI_BLOOM_BLOCK / sizeof(ulonglong);
+/* default bits of filter per key */
+const uint SDI_BLOOM_BITS = 10;
+/* fewest keys a filter is sized for */
+const ulonglong SDI_BLOOM_MIN_KEYS = 1024;
+
+class Spartan_bloom
+{
+public:
+  Spartan_bloom(void);
+  ~Spartan_bloom(void);
+  int init_bloom(ulonglong keys, uint bits_per_key);
+  void destroy_bloom();
+  void clear_bloom();
+  void add_key(uchar *key, int key_len);
+  bool may_contain(uchar *key, int key_len);
+  bool is_enabled() { return (num_blocks > 0); }
+  bool is_full() { return (added > capacity); }
+  ulonglong memory_used() { return (ulonglong)num_blocks * SDI_BLOOM_BLOCK; }
+  static ulonglong negatives();
+private:
+  uchar *raw;               /* as allocated, before alignment */
+  ulonglong *blocks;
+  ulonglong num_blocks;
+  ulonglong capacity;       /* keys the filter was sized for */
+  ulonglong added;          /* keys added since it was cleared */
+  static volatile int64 skipped;
+  static ulonglong hash_key(uchar *key, int key_len);
+  ulonglong *find_block(ulonglong hash)
+  {
+    /* the high half of the hash scaled to the number of blocks */
+    return blocks + ((hash >> 32) * num_blocks >> 32) * SDI_BLOOM_WORDS;
+  }
+};
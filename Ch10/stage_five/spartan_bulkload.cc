@@ -0,0 +1,1061 @@
+/*
+  spartan_bulkload.cc
+
+  Offline bulk loader for the Spartan storage engine. It reads a CSV file
+  and writes the Spartan data (.sde) and index (.sdi) files directly using
+  the Spartan_data and Spartan_index classes, bypassing the SQL layer and
+  the per row handler calls.
+
+  Usage:
+    spartan_bulkload --columns="int not null,varchar(20),int" --key=1
+                     [options] <table path> <csv file>
+
+  The table path is the path of the table files without an extension
+  (for example /var/lib/mysql/test/t1). Create the table with CREATE
+  TABLE ... ENGINE=SPARTAN first and make sure the server does not have
+  it open (FLUSH TABLES) while the loader runs. The existing data and
+  index files are replaced. The loader writes the first index (the one
+  --key names); the files of any other indexes are removed and the
+  server rebuilds them when it next opens the table.
+
+  The --columns list gives the column types in table order so the
+  loader can lay out rows the way the server does: TINYINT, SMALLINT,
+  MEDIUMINT, INT, BIGINT (optionally UNSIGNED), FLOAT, DOUBLE, CHAR(n)
+  and VARCHAR(n) in a single byte character set, each optionally
+  followed by NOT NULL. If the computed record length does not match
+  the server's (see rec_buff_length), pass it with --reclength.
+
+  Index keys are written in the sortable form ha_spartan uses (see
+  ha_spartan::make_index_key()). For a CHAR or VARCHAR key that form
+  depends on the collation of the column, which is given with
+  --collation (default latin1_swedish_ci).
+
+  CSV fields are separated by --fields-terminated-by (default ','), may
+  be enclosed in double quotes ("" inside quotes is a literal quote) and
+  \N is NULL. Quoted fields may not contain line breaks.
+
+  The load runs in batches of --threads chunks. The chunks of a batch
+  are parsed in parallel, appended to the data file in input order, and
+  then the index keys of each chunk are sorted in parallel and written
+  to a temporary run file. When the input is exhausted the runs are
+  merged and streamed into the index in key order, so memory use is
+  bounded by the chunk size and thread count, not by the table size.
+*/
+#include "my_global.h"
+#include "my_sys.h"
+#include "my_getopt.h"
+#include "m_string.h"
+#include "spartan_data.h"
+#include "spartan_index.h"
+#include <pthread.h>
+
+#define SDE_EXT ".sde"
+#define SDI_EXT ".sdi"
+#define LOAD_MAX_COLUMNS 1024
+#define LOAD_KEY_LEN 128
+#define LOAD_MAX_INDEXES 16      /* SDE_MAX_KEYS in ha_spartan.h */
+#define LOAD_RUN_BUFFER 65536
+
+enum options_bulkload
+{
+  OPT_CHUNK_SIZE= 256,
+  OPT_COLLATION
+};
+
+enum load_col_type
+{
+  LOAD_TINY, LOAD_SHORT, LOAD_INT24, LOAD_LONG, LOAD_LONGLONG,
+  LOAD_FLOAT, LOAD_DOUBLE, LOAD_CHAR, LOAD_VARCHAR
+};
+
+/* one column of the table definition and its place in the record */
+struct LOAD_COLUMN
+{
+  load_col_type type;
+  bool is_unsigned;
+  bool nullable;
+  int length;            /* declared length of CHAR and VARCHAR */
+  int offset;            /* offset of the field in the record */
+  int pack_length;       /* bytes used by the field in the record */
+  int null_byte;         /* offset of the null flag byte */
+  uchar null_bit;        /* null flag within null_byte */
+};
+
+/* a piece of the CSV file (whole lines) and the rows parsed from it */
+struct LOAD_CHUNK
+{
+  char *text;
+  size_t text_len;
+  uchar *rows;
+  long long num_rows;
+  long long max_rows;
+  long long first_pos;
+  long long lines;
+  long long error_line;
+  const char *error;
+  int run;               /* index of the run file written for the chunk */
+};
+
+/* a sorted run being read back during the final merge */
+struct LOAD_RUN
+{
+  File file;
+  uchar *buf;
+  size_t len;
+  size_t off;
+};
+
+static char *opt_columns= NULL;
+static char *opt_separator= NULL;
+static char *opt_tmpdir= NULL;
+static char *opt_collation= NULL;
+static uint opt_key= 0;
+static uint opt_threads= 4;
+static uint opt_reclength= 0;
+static ulong opt_ignore_lines= 0;
+static ulonglong opt_chunk_size= 64 * 1024 * 1024;
+
+static LOAD_COLUMN columns[LOAD_MAX_COLUMNS];
+static int num_columns= 0;
+static int reclength= 0;
+static uchar *default_record= NULL;
+static char separator= ',';
+static LOAD_COLUMN *key_col= NULL;
+static const CHARSET_INFO *key_cs= NULL;
+static int key_len= 0;
+static int entry_len= 0;
+static int row_size= 0;
+static int num_runs= 0;
+
+static struct my_option my_long_options[]=
+{
+  {"help", '?', "Display this help and exit.",
+   0, 0, 0, GET_NO_ARG, NO_ARG, 0, 0, 0, 0, 0, 0},
+  {"columns", 'c', "Comma separated list of the column types in table "
+   "order, e.g. \"int not null,varchar(20),int\".",
+   &opt_columns, &opt_columns, 0, GET_STR, REQUIRED_ARG, 0, 0, 0, 0, 0, 0},
+  {"key", 'k', "Column number (starting at 1) of the indexed column. "
+   "0 writes an empty index.",
+   &opt_key, &opt_key, 0, GET_UINT, REQUIRED_ARG, 0, 0, LOAD_MAX_COLUMNS,
+   0, 0, 0},
+  {"threads", 't', "Number of threads used to parse and sort.",
+   &opt_threads, &opt_threads, 0, GET_UINT, REQUIRED_ARG, 4, 1, 256,
+   0, 0, 0},
+  {"chunk-size", OPT_CHUNK_SIZE,
+   "Bytes of CSV input handled by one thread at a time.",
+   &opt_chunk_size, &opt_chunk_size, 0, GET_ULL, REQUIRED_ARG,
+   64 * 1024 * 1024, 1024 * 1024, ~(ulonglong)0, 0, 1024, 0},
+  {"fields-terminated-by", 'f', "Field separator character (default ',').",
+   &opt_separator, &opt_separator, 0, GET_STR, REQUIRED_ARG,
+   0, 0, 0, 0, 0, 0},
+  {"ignore-lines", 'i', "Skip this many lines at the start of the file.",
+   &opt_ignore_lines, &opt_ignore_lines, 0, GET_ULONG, REQUIRED_ARG,
+   0, 0, ~0UL, 0, 0, 0},
+  {"reclength", 'r', "Record buffer length of the table if it differs "
+   "from the one computed from --columns.",
+   &opt_reclength, &opt_reclength, 0, GET_UINT, REQUIRED_ARG,
+   0, 0, 65536, 0, 0, 0},
+  {"collation", OPT_COLLATION, "Collation of a CHAR or VARCHAR key "
+   "column (default latin1_swedish_ci).",
+   &opt_collation, &opt_collation, 0, GET_STR, REQUIRED_ARG,
+   0, 0, 0, 0, 0, 0},
+  {"tmpdir", 'T', "Directory for the temporary sort runs.",
+   &opt_tmpdir, &opt_tmpdir, 0, GET_STR, REQUIRED_ARG, 0, 0, 0, 0, 0, 0},
+  {0, 0, 0, 0, 0, 0, GET_NO_ARG, NO_ARG, 0, 0, 0, 0, 0, 0}
+};
+
+static void usage()
+{
+  printf("Usage: %s [OPTIONS] table_path csv_file\n", my_progname);
+  printf("Build Spartan data and index files from a CSV file.\n\n");
+  my_print_help(my_long_options);
+  my_print_variables(my_long_options);
+}
+
+static my_bool get_one_option(int optid,
+                              const struct my_option *opt
+                              __attribute__((unused)),
+                              char *argument __attribute__((unused)))
+{
+  if (optid == '?')
+  {
+    usage();
+    exit(0);
+  }
+  return 0;
+}
+
+/*
+  Parse the --columns list and lay out the record the way the server
+  does: null flags first (bit 0 is reserved unless the table has
+  VARCHAR columns), then the fields in order.
+*/
+static int parse_columns(const char *spec)
+{
+  char buf[256];
+  const char *p = spec;
+  const char *end;
+  int len;
+  int null_bit;
+  int null_fields = 0;
+  int null_bytes;
+  bool pack_record = false;
+  LOAD_COLUMN *col;
+  int i;
+
+  while (*p)
+  {
+    if (num_columns == LOAD_MAX_COLUMNS)
+      return 1;
+    end = strchr(p, ',');
+    if (end == NULL)
+      end = p + strlen(p);
+    len = (int)(end - p);
+    if (len >= (int)sizeof(buf))
+      return 1;
+    for (i = 0; i < len; i++)
+      buf[i] = my_tolower(&my_charset_latin1, p[i]);
+    buf[len] = 0;
+    col = &columns[num_columns++];
+    memset(col, 0, sizeof(LOAD_COLUMN));
+    col->nullable = (strstr(buf, "not null") == NULL);
+    col->is_unsigned = (strstr(buf, "unsigned") != NULL);
+    if (!strncmp(buf, "tinyint", 7))
+    {
+      col->type = LOAD_TINY;
+      col->pack_length = 1;
+    }
+    else if (!strncmp(buf, "smallint", 8))
+    {
+      col->type = LOAD_SHORT;
+      col->pack_length = 2;
+    }
+    else if (!strncmp(buf, "mediumint", 9))
+    {
+      col->type = LOAD_INT24;
+      col->pack_length = 3;
+    }
+    else if (!strncmp(buf, "bigint", 6))
+    {
+      col->type = LOAD_LONGLONG;
+      col->pack_length = 8;
+    }
+    else if (!strncmp(buf, "int", 3))
+    {
+      col->type = LOAD_LONG;
+      col->pack_length = 4;
+    }
+    else if (!strncmp(buf, "float", 5))
+    {
+      col->type = LOAD_FLOAT;
+      col->pack_length = 4;
+    }
+    else if (!strncmp(buf, "double", 6))
+    {
+      col->type = LOAD_DOUBLE;
+      col->pack_length = 8;
+    }
+    else if (!strncmp(buf, "char(", 5))
+    {
+      col->type = LOAD_CHAR;
+      col->length = atoi(buf + 5);
+      col->pack_length = col->length;
+    }
+    else if (!strncmp(buf, "varchar(", 8))
+    {
+      col->type = LOAD_VARCHAR;
+      col->length = atoi(buf + 8);
+      col->pack_length = col->length + ((col->length < 256) ? 1 : 2);
+      pack_record = true;
+    }
+    else
+    {
+      fprintf(stderr, "%s: unsupported column type '%s'\n", my_progname, buf);
+      return 1;
+    }
+    if (((col->type == LOAD_CHAR) || (col->type == LOAD_VARCHAR)) &&
+        (col->length <= 0))
+      return 1;
+    if (col->nullable)
+      null_fields++;
+    p = (*end == ',') ? end + 1 : end;
+  }
+  if (num_columns == 0)
+    return 1;
+  null_bit = pack_record ? 0 : 1;
+  null_bytes = (null_fields + null_bit + 7) / 8;
+  reclength = null_bytes;
+  for (i = 0; i < num_columns; i++)
+  {
+    col = &columns[i];
+    if (col->nullable)
+    {
+      col->null_byte = null_bit / 8;
+      col->null_bit = (uchar)(1 << (null_bit % 8));
+      null_bit++;
+    }
+    col->offset = reclength;
+    reclength += col->pack_length;
+  }
+  /*
+    The row image starts as the server's empty record: the reserved
+    bit and the unused null bits are set.
+  */
+  if (opt_reclength)
+    reclength = MY_MAX((int)opt_reclength, reclength);
+  else
+    reclength = ALIGN_SIZE(reclength + 1);
+  default_record = (uchar *)my_malloc(reclength, MYF(MY_ZEROFILL | MY_WME));
+  if (default_record == NULL)
+    return 1;
+  if (!pack_record)
+    default_record[0] |= 1;
+  if (null_bit & 7)
+    default_record[null_bit / 8] |= (uchar)~((1 << (null_bit & 7)) - 1);
+  for (i = 0; i < num_columns; i++)
+    if (columns[i].type == LOAD_CHAR)
+      memset(default_record + columns[i].offset, ' ', columns[i].length);
+  return 0;
+}
+
+/* store one CSV value into its field, returns an error message or NULL */
+static const char *store_field(LOAD_COLUMN *col, uchar *rec,
+                               const char *val, int len, bool is_null)
+{
+  char num[64];
+  char *end;
+  uchar *to = rec + col->offset;
+  longlong l;
+  ulonglong u;
+  double d;
+  float f;
+
+  if (is_null)
+  {
+    if (!col->nullable)
+      return "NULL value in NOT NULL column";
+    rec[col->null_byte] |= col->null_bit;
+    return NULL;
+  }
+  if (col->type == LOAD_CHAR)
+  {
+    if (len > col->length)
+      return "value too long for CHAR column";
+    memcpy(to, val, len);
+    return NULL;
+  }
+  if (col->type == LOAD_VARCHAR)
+  {
+    if (len > col->length)
+      return "value too long for VARCHAR column";
+    if (col->length < 256)
+    {
+      to[0] = (uchar)len;
+      memcpy(to + 1, val, len);
+    }
+    else
+    {
+      int2store(to, len);
+      memcpy(to + 2, val, len);
+    }
+    return NULL;
+  }
+  if ((len == 0) || (len >= (int)sizeof(num)))
+    return "bad numeric value";
+  memcpy(num, val, len);
+  num[len] = 0;
+  errno = 0;
+  switch (col->type) {
+  case LOAD_FLOAT:
+    f = (float)strtod(num, &end);
+    float4store(to, f);
+    break;
+  case LOAD_DOUBLE:
+    d = strtod(num, &end);
+    float8store(to, d);
+    break;
+  default:
+    if (col->is_unsigned)
+    {
+      if (num[0] == '-')
+        return "negative value in UNSIGNED column";
+      u = strtoull(num, &end, 10);
+      l = (longlong)u;
+    }
+    else
+    {
+      l = strtoll(num, &end, 10);
+      u = (ulonglong)l;
+    }
+    if (col->type == LOAD_TINY)
+    {
+      if (col->is_unsigned ? (u > 255) : (l < -128 || l > 127))
+        return "value out of range";
+      to[0] = (uchar)l;
+    }
+    else if (col->type == LOAD_SHORT)
+    {
+      if (col->is_unsigned ? (u > 65535) : (l < -32768 || l > 32767))
+        return "value out of range";
+      int2store(to, l);
+    }
+    else if (col->type == LOAD_INT24)
+    {
+      if (col->is_unsigned ? (u > 16777215) :
+          (l < -8388608 || l > 8388607))
+        return "value out of range";
+      int3store(to, l);
+    }
+    else if (col->type == LOAD_LONG)
+    {
+      if (col->is_unsigned ? (u > 4294967295ULL) :
+          (l < INT_MIN32 || l > INT_MAX32))
+        return "value out of range";
+      int4store(to, l);
+    }
+    else
+      int8store(to, l);
+    break;
+  }
+  if ((*end != 0) || (errno == ERANGE))
+    return "bad numeric value";
+  return NULL;
+}
+
+/* parse one CSV line into rec, returns an error message or NULL */
+static const char *parse_line(char *line, char *line_end, uchar *rec,
+                              char *scratch)
+{
+  const char *err;
+  char *p = line;
+  char *val;
+  int len;
+  bool is_null;
+  int i;
+
+  memcpy(rec, default_record, reclength);
+  for (i = 0; i < num_columns; i++)
+  {
+    if (p > line_end)
+      return "too few fields";
+    is_null = false;
+    if ((p < line_end) && (*p == '"'))
+    {
+      /* enclosed value, "" stands for a quote */
+      val = scratch;
+      len = 0;
+      p++;
+      for (;;)
+      {
+        if (p >= line_end)
+          return "unterminated quoted field";
+        if (*p == '"')
+        {
+          if ((p + 1 < line_end) && (p[1] == '"'))
+          {
+            scratch[len++] = '"';
+            p += 2;
+            continue;
+          }
+          p++;
+          break;
+        }
+        scratch[len++] = *p++;
+      }
+      if ((p < line_end) && (*p != separator))
+        return "garbage after quoted field";
+    }
+    else
+    {
+      val = p;
+      while ((p < line_end) && (*p != separator))
+        p++;
+      len = (int)(p - val);
+      is_null = ((len == 2) && (val[0] == '\\') && (val[1] == 'N'));
+    }
+    if ((err = store_field(&columns[i], rec, val, len, is_null)))
+      return err;
+    p++;                                  /* skip the separator */
+  }
+  if (p <= line_end)
+    return "too many fields";
+  return NULL;
+}
+
+/* thread body: parse the lines of a chunk into rows */
+static void *parse_chunk(void *arg)
+{
+  LOAD_CHUNK *chunk = (LOAD_CHUNK *)arg;
+  char *p = chunk->text;
+  char *end = chunk->text + chunk->text_len;
+  char *line_end;
+  char *scratch;
+  uchar *rows;
+  const char *err;
+
+  scratch = (char *)my_malloc(chunk->text_len + 1, MYF(MY_WME));
+  if (scratch == NULL)
+  {
+    chunk->error = "out of memory";
+    return NULL;
+  }
+  while (p < end)
+  {
+    line_end = (char *)memchr(p, '\n', end - p);
+    if (line_end == NULL)
+      line_end = end;
+    chunk->lines++;
+    if ((line_end > p) && (line_end[-1] == '\r'))
+      line_end--;
+    if (line_end > p)
+    {
+      if (chunk->num_rows == chunk->max_rows)
+      {
+        chunk->max_rows = chunk->max_rows ? chunk->max_rows * 2 : 4096;
+        rows = (uchar *)my_realloc(chunk->rows, chunk->max_rows * reclength,
+                                   MYF(MY_WME | MY_ALLOW_ZERO_PTR));
+        if (rows == NULL)
+        {
+          chunk->error = "out of memory";
+          break;
+        }
+        chunk->rows = rows;
+      }
+      err = parse_line(p, line_end,
+                       chunk->rows + chunk->num_rows * reclength, scratch);
+      if (err)
+      {
+        chunk->error = err;
+        chunk->error_line = chunk->lines;
+        break;
+      }
+      chunk->num_rows++;
+    }
+    p = line_end + 1;
+  }
+  my_free(scratch);
+  return NULL;
+}
+
+/* length of the sortable key of a column, not counting the NULL marker */
+static int sort_length(LOAD_COLUMN *col)
+{
+  if ((col->type == LOAD_CHAR) || (col->type == LOAD_VARCHAR))
+    return (int)key_cs->coll->strnxfrmlen(key_cs, col->length);
+  return col->pack_length;
+}
+
+/*
+  Store a FLOAT or DOUBLE (len bytes, exp_dig exponent bits) so that
+  it sorts bytewise, as Field_float::make_sort_key() does.
+*/
+static void sort_float(uchar *to, const uchar *from, int len, int exp_dig)
+{
+  ushort exp_part;
+  bool zero = true;
+  int i;
+
+  for (i = 0; i < len; i++)
+  {
+    to[i] = from[len - 1 - i];
+    if (to[i] & ((i == 0) ? 127 : 255))
+      zero = false;
+  }
+  if (zero)
+  {
+    to[0] = 128;
+    memset(to + 1, 0, len - 1);
+  }
+  else if (to[0] & 128)
+  {
+    for (i = 0; i < len; i++)
+      to[i] ^= 255;
+  }
+  else
+  {
+    exp_part = (ushort)(((ushort)to[0] << 8) | (ushort)to[1] | 32768);
+    exp_part += (ushort)1 << (16 - 1 - exp_dig);
+    to[0] = (uchar)(exp_part >> 8);
+    to[1] = (uchar)exp_part;
+  }
+}
+
+/*
+  Write the key of a record in the sortable form of
+  ha_spartan::make_index_key(): a NULL marker for a nullable column,
+  then integers big-endian with the sign bit flipped, floating point
+  values as filesort stores them and strings as collation weights.
+*/
+static void make_key(uchar *to, const uchar *rec)
+{
+  const uchar *from = rec + key_col->offset;
+  int length = sort_length(key_col);
+  uint str_len;
+  int i;
+
+  if (key_col->nullable)
+  {
+    if (rec[key_col->null_byte] & key_col->null_bit)
+    {
+      memset(to, 0, length + 1);
+      return;
+    }
+    *to++ = 1;
+  }
+  switch (key_col->type) {
+  case LOAD_FLOAT:
+    sort_float(to, from, 4, sizeof(float) * 8 - FLT_MANT_DIG);
+    break;
+  case LOAD_DOUBLE:
+    sort_float(to, from, 8, sizeof(double) * 8 - DBL_MANT_DIG);
+    break;
+  case LOAD_CHAR:
+    key_cs->coll->strnxfrm(key_cs, to, length, key_col->length, from,
+                           key_col->length,
+                           MY_STRXFRM_PAD_WITH_SPACE |
+                           MY_STRXFRM_PAD_TO_MAXLEN);
+    break;
+  case LOAD_VARCHAR:
+    str_len = (key_col->length < 256) ? from[0] : uint2korr(from);
+    from += (key_col->length < 256) ? 1 : 2;
+    key_cs->coll->strnxfrm(key_cs, to, length, key_col->length, from,
+                           str_len,
+                           MY_STRXFRM_PAD_WITH_SPACE |
+                           MY_STRXFRM_PAD_TO_MAXLEN);
+    break;
+  default:
+    for (i = 0; i < length; i++)
+      to[i] = from[length - 1 - i];
+    if (!key_col->is_unsigned)
+      to[0] ^= 128;
+    break;
+  }
+}
+
+/* compare two sort entries: key bytes, then row position */
+static int cmp_entry(const void *arg __attribute__((unused)), const void *a,
+                     const void *b)
+{
+  int i = memcmp(a, b, key_len);
+  long long pa;
+  long long pb;
+
+  if (i)
+    return i;
+  memcpy(&pa, (const uchar *)a + key_len, sizeof(long long));
+  memcpy(&pb, (const uchar *)b + key_len, sizeof(long long));
+  return (pa < pb) ? -1 : ((pa > pb) ? 1 : 0);
+}
+
+static char *run_name(char *buf, int run)
+{
+  char name[64];
+
+  my_snprintf(name, sizeof(name), "spartan_bulkload_%lu_%d",
+              (ulong)getpid(), run);
+  return fn_format(buf, name, opt_tmpdir ? opt_tmpdir : P_tmpdir, ".run",
+                   MY_UNPACK_FILENAME);
+}
+
+/* thread body: extract and sort the keys of a chunk into a run file */
+static void *sort_chunk(void *arg)
+{
+  LOAD_CHUNK *chunk = (LOAD_CHUNK *)arg;
+  char name[FN_REFLEN];
+  uchar *entries;
+  uchar *e;
+  long long pos;
+  long long i;
+  File file;
+
+  entries = (uchar *)my_malloc(chunk->num_rows * entry_len, MYF(MY_WME));
+  if (entries == NULL)
+  {
+    chunk->error = "out of memory";
+    return NULL;
+  }
+  for (i = 0, e = entries; i < chunk->num_rows; i++, e += entry_len)
+  {
+    pos = chunk->first_pos + i * row_size;
+    make_key(e, chunk->rows + i * reclength);
+    memcpy(e + key_len, &pos, sizeof(long long));
+  }
+  my_qsort2(entries, (size_t)chunk->num_rows, entry_len, cmp_entry, NULL);
+  file = my_create(run_name(name, chunk->run), 0, O_RDWR | O_TRUNC | O_BINARY,
+                   MYF(MY_WME));
+  if ((file < 0) ||
+      my_write(file, entries, chunk->num_rows * entry_len, MYF(MY_NABP)))
+    chunk->error = "cannot write sort run";
+  if (file >= 0)
+    my_close(file, MYF(0));
+  my_free(entries);
+  return NULL;
+}
+
+/* run func over the chunks, one thread per chunk */
+static int run_parallel(void *(*func)(void *), LOAD_CHUNK *chunks, int n)
+{
+  pthread_t threads[256];
+  int i;
+  int started = 0;
+  int error = 0;
+
+  for (i = 0; i < n; i++, started++)
+  {
+    if (pthread_create(&threads[i], NULL, func, &chunks[i]))
+    {
+      error = 1;
+      break;
+    }
+  }
+  for (i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  return error;
+}
+
+/*
+  Read the next chunk of the CSV file. Every chunk ends on a line
+  boundary; the partial line at the end of a read is carried over to
+  the next chunk. Returns 1 at end of input, -1 on error.
+*/
+static int read_chunk(File csv, LOAD_CHUNK *chunk, char *carry,
+                      size_t *carry_len)
+{
+  size_t len = *carry_len;
+  size_t n;
+  char *nl;
+
+  memset(chunk, 0, sizeof(LOAD_CHUNK));
+  chunk->text = (char *)my_malloc(opt_chunk_size + len + 1, MYF(MY_WME));
+  if (chunk->text == NULL)
+    return -1;
+  memcpy(chunk->text, carry, len);
+  n = my_read(csv, (uchar *)chunk->text + len, opt_chunk_size, MYF(0));
+  if (n == (size_t)-1)
+    return -1;
+  len += n;
+  *carry_len = 0;
+  if (n > 0)
+  {
+    for (nl = chunk->text + len - 1; (nl >= chunk->text) && (*nl != '\n');
+         nl--)
+      ;
+    if (nl < chunk->text)
+    {
+      fprintf(stderr, "%s: a line is longer than --chunk-size\n",
+              my_progname);
+      return -1;
+    }
+    *carry_len = len - (nl + 1 - chunk->text);
+    memcpy(carry, nl + 1, *carry_len);
+    len = nl + 1 - chunk->text;
+  }
+  chunk->text_len = len;
+  return (len == 0) ? 1 : 0;
+}
+
+/* skip the first opt_ignore_lines lines of the first chunk */
+static void ignore_lines(LOAD_CHUNK *chunk, long long *lines)
+{
+  char *p = chunk->text;
+  char *end = chunk->text + chunk->text_len;
+  char *nl;
+
+  while ((opt_ignore_lines > 0) && (p < end) &&
+         ((nl = (char *)memchr(p, '\n', end - p)) != NULL))
+  {
+    p = nl + 1;
+    opt_ignore_lines--;
+    (*lines)++;
+  }
+  chunk->text_len = end - p;
+  memmove(chunk->text, p, chunk->text_len);
+}
+
+/* refill the read buffer of a run, returns false when it is exhausted */
+static bool fill_run(LOAD_RUN *run)
+{
+  if (run->off + entry_len <= run->len)
+    return true;
+  run->len = my_read(run->file, run->buf,
+                     (LOAD_RUN_BUFFER / entry_len) * entry_len, MYF(0));
+  run->off = 0;
+  return ((run->len != (size_t)-1) && (run->len >= (size_t)entry_len));
+}
+
+/* restore the heap order below slot i */
+static void sift_down(LOAD_RUN *runs, int *heap, int n, int i)
+{
+  int c;
+  int t;
+
+  for (;;)
+  {
+    c = 2 * i + 1;
+    if (c >= n)
+      break;
+    if ((c + 1 < n) &&
+        (cmp_entry(NULL, runs[heap[c + 1]].buf + runs[heap[c + 1]].off,
+                   runs[heap[c]].buf + runs[heap[c]].off) < 0))
+      c++;
+    if (cmp_entry(NULL, runs[heap[c]].buf + runs[heap[c]].off,
+                  runs[heap[i]].buf + runs[heap[i]].off) >= 0)
+      break;
+    t = heap[i];
+    heap[i] = heap[c];
+    heap[c] = t;
+    i = c;
+  }
+}
+
+/*
+  Merge the sorted runs and stream the keys into the index. Like
+  Spartan_index::insert_key(ndx, false), only the first row of a
+  duplicate key is indexed.
+*/
+static int merge_runs(Spartan_index *index, long long *dupes)
+{
+  char name[FN_REFLEN];
+  uchar last[LOAD_KEY_LEN];
+  bool have_last = false;
+  LOAD_RUN *runs;
+  int *heap;
+  int n = 0;
+  int i;
+  int error = 0;
+  long long pos;
+  uchar *e;
+
+  runs = (LOAD_RUN *)my_malloc(sizeof(LOAD_RUN) * (num_runs + 1),
+                               MYF(MY_ZEROFILL | MY_WME));
+  heap = (int *)my_malloc(sizeof(int) * (num_runs + 1), MYF(MY_WME));
+  if ((runs == NULL) || (heap == NULL))
+    return 1;
+  for (i = 0; i < num_runs; i++)
+  {
+    runs[i].file = my_open(run_name(name, i), O_RDONLY | O_BINARY,
+                           MYF(MY_WME));
+    runs[i].buf = (uchar *)my_malloc(LOAD_RUN_BUFFER, MYF(MY_WME));
+    if ((runs[i].file < 0) || (runs[i].buf == NULL))
+    {
+      error = 1;
+      break;
+    }
+    if (fill_run(&runs[i]))
+      heap[n++] = i;
+  }
+  for (i = n / 2 - 1; !error && (i >= 0); i--)
+    sift_down(runs, heap, n, i);
+  if (!error)
+    error = index->bulk_start();
+  while (!error && (n > 0))
+  {
+    e = runs[heap[0]].buf + runs[heap[0]].off;
+    if (have_last && (memcmp(last, e, key_len) == 0))
+      (*dupes)++;
+    else
+    {
+      memcpy(&pos, e + key_len, sizeof(long long));
+      error = index->bulk_add(e, key_len, pos);
+      memcpy(last, e, key_len);
+      have_last = true;
+    }
+    runs[heap[0]].off += entry_len;
+    if (!fill_run(&runs[heap[0]]))
+      heap[0] = heap[--n];
+    sift_down(runs, heap, n, 0);
+  }
+  if (index->bulk_end())
+    error = 1;
+  for (i = 0; i < num_runs; i++)
+  {
+    if (runs[i].file > 0)
+      my_close(runs[i].file, MYF(0));
+    my_free(runs[i].buf);
+    my_delete(run_name(name, i), MYF(0));
+  }
+  my_free(runs);
+  my_free(heap);
+  return error;
+}
+
+static void free_chunk(LOAD_CHUNK *chunk)
+{
+  my_free(chunk->text);
+  my_free(chunk->rows);
+  chunk->text = NULL;
+  chunk->rows = NULL;
+}
+
+int main(int argc, char **argv)
+{
+  char data_name[FN_REFLEN];
+  char index_name[FN_REFLEN];
+  Spartan_data data;
+  Spartan_index index;
+  LOAD_CHUNK *chunks;
+  char *carry;
+  size_t carry_len = 0;
+  long long lines = 0;
+  long long rows = 0;
+  long long dupes = 0;
+  bool at_eof = false;
+  bool first = true;
+  int error = 0;
+  int n;
+  int i;
+  File csv;
+
+  MY_INIT(argv[0]);
+  if (handle_options(&argc, &argv, my_long_options, get_one_option))
+    exit(1);
+  if ((argc != 2) || (opt_columns == NULL))
+  {
+    usage();
+    exit(1);
+  }
+  if (opt_separator && opt_separator[0])
+    separator = opt_separator[0];
+  if (parse_columns(opt_columns))
+  {
+    fprintf(stderr, "%s: cannot parse --columns\n", my_progname);
+    exit(1);
+  }
+  if (opt_key > (uint)num_columns)
+  {
+    fprintf(stderr, "%s: --key is not a column\n", my_progname);
+    exit(1);
+  }
+  if (opt_key > 0)
+  {
+    key_col = &columns[opt_key - 1];
+    key_cs = get_charset_by_name(opt_collation ? opt_collation :
+                                 "latin1_swedish_ci", MYF(MY_WME));
+    if (key_cs == NULL)
+      exit(1);
+    key_len = sort_length(key_col) + (key_col->nullable ? 1 : 0);
+    if (key_len > LOAD_KEY_LEN)
+    {
+      fprintf(stderr, "%s: --key column is too long for the index\n",
+              my_progname);
+      exit(1);
+    }
+  }
+  entry_len = key_len + sizeof(long long);
+
+  csv = my_open(argv[1], O_RDONLY | O_BINARY, MYF(MY_WME));
+  if (csv < 0)
+    exit(1);
+  fn_format(data_name, argv[0], "", SDE_EXT,
+            MY_REPLACE_EXT | MY_UNPACK_FILENAME);
+  fn_format(index_name, argv[0], "", SDI_EXT,
+            MY_REPLACE_EXT | MY_UNPACK_FILENAME);
+  my_delete(data_name, MYF(0));
+  my_delete(index_name, MYF(0));
+  /*
+    The files of the other indexes no longer match the data. Without
+    them the server rebuilds those indexes when it opens the table.
+  */
+  for (i = 1; i < LOAD_MAX_INDEXES; i++)
+  {
+    char ext[16];
+    my_snprintf(ext, sizeof(ext), "%s%d", SDI_EXT, i);
+    my_delete(fn_format(index_name, argv[0], "", ext,
+                        MY_REPLACE_EXT | MY_UNPACK_FILENAME), MYF(0));
+  }
+  fn_format(index_name, argv[0], "", SDI_EXT,
+            MY_REPLACE_EXT | MY_UNPACK_FILENAME);
+  if (data.create_table(data_name) ||
+      data.set_fixed_length(reclength) ||
+      index.create_index(index_name, LOAD_KEY_LEN))
+  {
+    fprintf(stderr, "%s: cannot create %s\n", my_progname, argv[0]);
+    exit(1);
+  }
+  row_size = data.row_size(reclength);
+
+  chunks = (LOAD_CHUNK *)my_malloc(sizeof(LOAD_CHUNK) * opt_threads,
+                                   MYF(MY_ZEROFILL | MY_WME));
+  carry = (char *)my_malloc(opt_chunk_size, MYF(MY_WME));
+  if ((chunks == NULL) || (carry == NULL))
+    exit(1);
+  while (!at_eof && !error)
+  {
+    /* read a batch of chunks */
+    for (n = 0; n < (int)opt_threads; n++)
+    {
+      i = read_chunk(csv, &chunks[n], carry, &carry_len);
+      if (i < 0)
+        error = 1;
+      if (i != 0)
+      {
+        free_chunk(&chunks[n]);
+        at_eof = true;
+        break;
+      }
+      if (first)
+      {
+        ignore_lines(&chunks[n], &lines);
+        first = (opt_ignore_lines > 0);
+      }
+    }
+    if (error || (n == 0))
+      break;
+    /* parse in parallel, then append the rows in input order */
+    error = run_parallel(parse_chunk, chunks, n);
+    for (i = 0; !error && (i < n); i++)
+    {
+      if (chunks[i].error)
+      {
+        fprintf(stderr, "%s: line %lld: %s\n", my_progname,
+                lines + chunks[i].error_line, chunks[i].error);
+        error = 1;
+        break;
+      }
+      lines += chunks[i].lines;
+      chunks[i].first_pos = data.write_rows(chunks[i].rows,
+                                            chunks[i].num_rows, reclength);
+      if (chunks[i].first_pos == -1)
+      {
+        fprintf(stderr, "%s: cannot write %s\n", my_progname, data_name);
+        error = 1;
+      }
+      rows += chunks[i].num_rows;
+      chunks[i].run = num_runs++;
+    }
+    /* sort the keys of each chunk into a run file in parallel */
+    if (!error && (opt_key > 0))
+    {
+      error = run_parallel(sort_chunk, chunks, n);
+      for (i = 0; i < n; i++)
+        if (chunks[i].error)
+        {
+          fprintf(stderr, "%s: %s\n", my_progname, chunks[i].error);
+          error = 1;
+        }
+    }
+    for (i = 0; i < n; i++)
+      free_chunk(&chunks[i]);
+  }
+  if (!error && (opt_key == 0))
+    num_runs = 0;
+  if (!error)
+    error = merge_runs(&index, &dupes);
+  else
+    merge_runs(&index, &dupes);            /* removes the run files */
+  data.close_table();
+  index.close_index();
+  my_close(csv, MYF(0));
+  my_free(chunks);
+  my_free(carry);
+  my_free(default_record);
+  if (!error)
+  {
+    printf("%lld rows loaded", rows);
+    if (dupes)
+      printf(", %lld duplicate keys not indexed", dupes);
+    printf("\n");
+  }
+  my_end(0);
+  return error ? 1 : 0;
+}
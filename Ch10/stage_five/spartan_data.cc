@@ -8,9 +8,62 @@
   store in an uncompressed, unoptimized fashion.
 */
 #include "spartan_data.h"
+#include "my_base.h"
 #include <my_dir.h>
+#include <my_bit.h>
 #include <string.h>
 
+/*
+  Largest row slot (status byte, length and row) that the fixed-width
+  path assembles on the stack to read or write with a single call.
+*/
+#define SDE_FIXED_SLOT_MAX 1024
+
+/*
+  Row copy routines. The sized versions are instantiated for the common
+  (8 byte aligned) record lengths so the compiler can replace the memcpy
+  with a few register moves. copy_any_row handles all other lengths.
+*/
+template <int N>
+static void copy_fixed_row(uchar *to, const uchar *from,
+                           int length __attribute__((unused)))
+{
+  memcpy(to, from, N);
+}
+
+static void copy_any_row(uchar *to, const uchar *from, int length)
+{
+  memcpy(to, from, length);
+}
+
+/*
+  Bit helpers for the live row bitmap. With GCC and Clang these compile
+  to single POPCNT and TZCNT/BSF instructions.
+*/
+static inline int sde_ctz64(ulonglong w)
+{
+#if defined(__GNUC__)
+  return __builtin_ctzll(w);
+#else
+  int n = 0;
+  while (!(w & 1))
+  {
+    w >>= 1;
+    n++;
+  }
+  return n;
+#endif
+}
+
+static inline int sde_popcount64(ulonglong w)
+{
+#if defined(__GNUC__)
+  return __builtin_popcountll(w);
+#else
+  return my_count_bits(w);
+#endif
+}
+
 Spartan_data::Spartan_data(void)
 {
   data_file = -1;
@@ -18,6 +71,16 @@ Spartan_data::Spartan_data(void)
   number_del_records = -1;
   header_size = sizeof(bool) + sizeof(int) + sizeof(int);
   record_header_size = sizeof(uchar) + sizeof(int);
+  fixed_len = 0;
+  fixed_row_size = 0;
+  data_end = -1;
+  copy_row = copy_any_row;
+  live_map = NULL;
+  live_map_words = 0;
+  live_rows = 0;
+  live_file = -1;
+  live_lo = 0;
+  live_hi = -1;
 }
 
 Spartan_data::~Spartan_data(void)
@@ -33,6 +96,9 @@ int Spartan_data::create_table(char *path)
   number_del_records = 0;
   crashed = false;
   write_header();  
+  /* a bitmap left by a table of the same name is no use */
+  if (live_file != -1)
+    my_chsize(live_file, 0, 0, MYF(MY_WME));
   DBUG_RETURN(0);
 }
 
@@ -49,6 +115,7 @@ int Spartan_data::open_table(char *path)
   if(data_file == -1)
     DBUG_RETURN(errno);
   read_header();
+  open_live_map(path);
   DBUG_RETURN(0);
 }
 
@@ -61,6 +128,21 @@ long long Spartan_data::write_row(uchar *buf, int length)
   uchar deleted = 0;
 
   DBUG_ENTER("Spartan_data::write_row");
+  /*
+    Fixed-width rows are appended at the known end of the file with a
+    single positional write.
+  */
+  if ((fixed_len > 0) && (length == fixed_len))
+  {
+    pos = data_end;
+    if (write_fixed_slot(deleted, buf, pos))
+      DBUG_RETURN(-1);
+    data_end += fixed_row_size;
+    set_live(pos, true);
+    sync_live();
+    number_records++;
+    DBUG_RETURN(pos);
+  }
   /*
     Write the deleted status byte and the length of the record.
     Note: my_write() returns the bytes written or -1 on error
@@ -86,6 +168,70 @@ long long Spartan_data::write_row(uchar *buf, int length)
   DBUG_RETURN(pos);
 }
 
+/*
+  Append count rows of length bytes stored back to back in buf and return
+  the position of the first one (the others follow at row_size(length)
+  intervals). Fixed-width rows are assembled into blocks and written with
+  one call per block; this is the path used by the bulk loader.
+*/
+long long Spartan_data::write_rows(uchar *buf, long long count, int length)
+{
+  long long first;
+  long long n;
+  long long i;
+  long long rows;
+  size_t j;
+  uchar *block;
+  uchar *p;
+
+  DBUG_ENTER("Spartan_data::write_rows");
+  if ((fixed_len == 0) || (length != fixed_len))
+  {
+    first = -1;
+    for (i = 0; i < count; i++)
+    {
+      n = write_row(buf + i * length, length);
+      if (n == -1)
+        DBUG_RETURN(-1);
+      if (i == 0)
+        first = n;
+    }
+    DBUG_RETURN(first);
+  }
+  rows = SDE_SCAN_BLOCK / fixed_row_size;
+  if (rows < 1)
+    rows = 1;
+  block = (uchar *)my_malloc(rows * fixed_row_size, MYF(MY_WME));
+  if (block == NULL)
+    DBUG_RETURN(-1);
+  first = data_end;
+  for (i = 0; i < count; i += n)
+  {
+    n = (count - i < rows) ? count - i : rows;
+    for (p = block, j = 0; j < (size_t)n; j++, p += fixed_row_size)
+    {
+      p[0] = 0;
+      memcpy(p + sizeof(uchar), &fixed_len, sizeof(int));
+      copy_row(p + record_header_size, buf + (i + j) * length, fixed_len);
+    }
+    if (my_pwrite(data_file, block, n * fixed_row_size, data_end,
+                  MYF(MY_NABP)))
+    {
+      my_free(block);
+      DBUG_RETURN(-1);
+    }
+    for (j = 0; j < (size_t)n; j++)
+    {
+      set_live(data_end, true);
+      data_end += fixed_row_size;
+    }
+    number_records += (int)n;
+  }
+  my_free(block);
+  sync_live();
+  DBUG_RETURN(first);
+}
+
 /* update a record in place */
 long long Spartan_data::update_row(uchar *old_rec, uchar *new_rec,
                                    int length, long long position)
@@ -120,7 +266,7 @@ long long Spartan_data::update_row(uchar *old_rec, uchar *new_rec,
     while ((cur_pos != -1) && (pos != -1))
     {
       pos = read_row(cmp_rec, length, cur_pos);
-      if (memcmp(old_rec, cmp_rec, length) == 0)
+      if ((pos == 0) && (memcmp(old_rec, cmp_rec, length) == 0))
       {
         pos = cur_pos;      //found it!
         cur_pos = -1;       //stop loop gracefully
@@ -133,7 +279,17 @@ long long Spartan_data::update_row(uchar *old_rec, uchar *new_rec,
   /*
     If position found or provided, write the row.
   */
-  if (pos != -1)
+  if ((pos != -1) && (fixed_len > 0) && (length == fixed_len))
+  {
+    if (write_fixed_slot(deleted, new_rec, pos))
+      pos = -1;
+    else
+    {
+      set_live(pos, true);
+      sync_live();
+    }
+  }
+  else if (pos != -1)
   {
     /*
       Write the deleted byte, the length of the row, and the data
@@ -183,7 +339,7 @@ int Spartan_data::delete_row(uchar *old_rec, int length,
     while ((cur_pos != -1) && (pos != -1))
     {
       pos = read_row(cmp_rec, length, cur_pos);
-      if (memcmp(old_rec, cmp_rec, length) == 0)
+      if ((pos == 0) && (memcmp(old_rec, cmp_rec, length) == 0))
       {
         number_records--;
         number_del_records++;
@@ -208,11 +364,21 @@ int Spartan_data::delete_row(uchar *old_rec, int length,
     pos = my_seek(data_file, pos, MY_SEEK_SET, MYF(0));
     i = my_write(data_file, &deleted, sizeof(uchar), MYF(0));
     i = (i > 1) ? 0 : i;
+    if ((i != -1) && (fixed_len > 0))
+    {
+      set_live(pos, false);
+      sync_live();
+    }
   }
   DBUG_RETURN(i);
 }
 
-/* read a row of length bytes from file at position */
+/*
+  Read the row of length bytes at position. Returns 0, or
+  HA_ERR_RECORD_DELETED if the row at position is deleted (the caller
+  asked for that row, so no other is read), or -1 at the end of the
+  file or on an error. Scans step over deleted rows in scan_row().
+*/
 int Spartan_data::read_row(uchar *buf, int length, long long position)
 {
   int i;
@@ -223,33 +389,116 @@ int Spartan_data::read_row(uchar *buf, int length, long long position)
   DBUG_ENTER("Spartan_data::read_row");
   if (position <= 0)
     position = header_size; //move past header
+  if ((fixed_len > 0) && (length == fixed_len))
+    DBUG_RETURN(read_fixed_row(buf, position));
   pos = my_seek(data_file, position, MY_SEEK_SET, MYF(0));
+  if (pos == -1L)
+    DBUG_RETURN(-1);
   /*
-    If my_seek found the position, read the deleted byte.
+    Read the deleted byte.
     Note: my_read() returns bytes read or -1 on error
   */
-  if (pos != -1L)
+  i = my_read(data_file, &deleted, sizeof(uchar), MYF(0));
+  if ((i == 0) || (i == -1))
+    DBUG_RETURN(-1);
+  if (deleted != 0) /* 0 = not deleted, 1 = deleted */
+    DBUG_RETURN(HA_ERR_RECORD_DELETED);
+  /* read the record length then read the row */
+  i = my_read(data_file, (uchar *)&rec_len, sizeof(int), MYF(0));
+  i = my_read(data_file, buf, 
+             (length < rec_len) ? length : rec_len, MYF(0));
+  DBUG_RETURN(0);
+}
+
+/*
+  Read the fixed-width row at position. The live row bitmap says
+  whether it is deleted, so only the row body is read from the file.
+*/
+int Spartan_data::read_fixed_row(uchar *buf, long long position)
+{
+  long long row;
+  size_t i;
+
+  DBUG_ENTER("Spartan_data::read_fixed_row");
+  if ((position < header_size) || (position >= data_end))
+    DBUG_RETURN(HA_ERR_KEY_NOT_FOUND);
+  row = (position - header_size) / fixed_row_size;
+  if ((header_size + row * fixed_row_size != position) ||
+      ((row >> 6) >= live_map_words) ||
+      !(live_map[row >> 6] & (1ULL << (row & 63))))
+    DBUG_RETURN(HA_ERR_RECORD_DELETED);
+  i = my_pread(data_file, buf, fixed_len, position + record_header_size,
+               MYF(MY_NABP));
+  DBUG_RETURN((i == 0) ? 0 : -1);
+}
+
+/*
+  Read the fixed-width row at position without the share mutex. Only
+  the data file is read, never the live row bitmap or anything else a
+  writer changes: the status byte read along with the row tells whether
+  it is deleted, and a slot past the end of the file is not found. The
+  file descriptor and the row size only change when the table is opened
+  or closed.
+*/
+int Spartan_data::pread_row(uchar *buf, long long position)
+{
+  uchar slot[SDE_FIXED_SLOT_MAX];
+  size_t i;
+
+  DBUG_ENTER("Spartan_data::pread_row");
+  if ((fixed_len == 0) || (position < header_size))
+    DBUG_RETURN(HA_ERR_KEY_NOT_FOUND);
+  if ((position - header_size) % fixed_row_size != 0)
+    DBUG_RETURN(HA_ERR_RECORD_DELETED);
+  if (fixed_row_size <= SDE_FIXED_SLOT_MAX)
   {
-    i = my_read(data_file, &deleted, sizeof(uchar), MYF(0));
-    /*
-      If not deleted (deleted == 0), read the record length then
-      read the row.
-    */
-    if (deleted == 0) /* 0 = not deleted, 1 = deleted */
-    {
-      i = my_read(data_file, (uchar *)&rec_len, sizeof(int), MYF(0));
-      i = my_read(data_file, buf, 
-                 (length < rec_len) ? length : rec_len, MYF(0));
-    }
-    else if (i == 0)
-      DBUG_RETURN(-1);      
-    else
-      DBUG_RETURN(read_row(buf, length, cur_position() + 
-                           length + (record_header_size - sizeof(uchar))));
+    i = my_pread(data_file, slot, fixed_row_size, position, MYF(0));
+    if (i != (size_t)fixed_row_size)
+      DBUG_RETURN(HA_ERR_KEY_NOT_FOUND);
+    if (slot[0] != 0)
+      DBUG_RETURN(HA_ERR_RECORD_DELETED);
+    memcpy(buf, slot + record_header_size, fixed_len);
+    DBUG_RETURN(0);
+  }
+  i = my_pread(data_file, slot, record_header_size, position, MYF(0));
+  if (i != (size_t)record_header_size)
+    DBUG_RETURN(HA_ERR_KEY_NOT_FOUND);
+  if (slot[0] != 0)
+    DBUG_RETURN(HA_ERR_RECORD_DELETED);
+  i = my_pread(data_file, buf, fixed_len, position + record_header_size,
+               MYF(MY_NABP));
+  DBUG_RETURN((i == 0) ? 0 : -1);
+}
+
+/*
+  Write a complete fixed-width row slot (status byte, length and row) at
+  position. Small slots are assembled first so it takes a single write.
+*/
+int Spartan_data::write_fixed_slot(uchar deleted, uchar *buf,
+                                   long long position)
+{
+  uchar slot[SDE_FIXED_SLOT_MAX];
+  size_t i;
+
+  DBUG_ENTER("Spartan_data::write_fixed_slot");
+  if (fixed_row_size <= SDE_FIXED_SLOT_MAX)
+  {
+    slot[0] = deleted;
+    memcpy(slot + sizeof(uchar), &fixed_len, sizeof(int));
+    copy_row(slot + record_header_size, buf, fixed_len);
+    i = my_pwrite(data_file, slot, fixed_row_size, position, MYF(MY_NABP));
   }
   else
-    DBUG_RETURN(-1);
-  DBUG_RETURN(0);
+  {
+    slot[0] = deleted;
+    memcpy(slot + sizeof(uchar), &fixed_len, sizeof(int));
+    i = my_pwrite(data_file, slot, record_header_size, position,
+                  MYF(MY_NABP));
+    if (i == 0)
+      i = my_pwrite(data_file, buf, fixed_len,
+                    position + record_header_size, MYF(MY_NABP));
+  }
+  DBUG_RETURN((i == 0) ? 0 : -1);
 }
 
 /* close file */
@@ -261,6 +510,22 @@ int Spartan_data::close_table()
     my_close(data_file, MYF(0));
     data_file = -1;
   }
+  /* the bitmap matches the data file again */
+  if (live_file != -1)
+  {
+    if ((fixed_len > 0) && (live_map != NULL) && (sync_live() == 0))
+      write_live_header(data_end);
+    my_close(live_file, MYF(0));
+    live_file = -1;
+  }
+  /* the fixed-width path is selected again by the next open */
+  my_free(live_map);
+  live_map = NULL;
+  live_map_words = 0;
+  live_rows = 0;
+  fixed_len = 0;
+  fixed_row_size = 0;
+  copy_row = copy_any_row;
   DBUG_RETURN(0);
 }
 
@@ -268,6 +533,12 @@ int Spartan_data::close_table()
 int Spartan_data::records()
 {
   DBUG_ENTER("Spartan_data::num_records");
+  /*
+    With a live row bitmap the count is exact: the bits set in it, kept
+    up to date by set_live().
+  */
+  if (live_map != NULL)
+    DBUG_RETURN((int)live_rows);
   DBUG_RETURN(number_records);
 }
 
@@ -335,6 +606,18 @@ int Spartan_data::trunc_table()
   {
     my_chsize(data_file, 0, 0, MYF(MY_WME));
     write_header();
+    if (fixed_len > 0)
+    {
+      data_end = header_size;
+      memset(live_map, 0, live_map_words * sizeof(ulonglong));
+      live_rows = 0;
+    }
+    if (live_file != -1)
+    {
+      my_chsize(live_file, 0, 0, MYF(MY_WME));
+      if (fixed_len > 0)
+        write_live_header(-1);
+    }
   }
   DBUG_RETURN(0);
 }
@@ -345,3 +628,379 @@ int Spartan_data::row_size(int length)
   DBUG_ENTER("Spartan_data::row_size");
   DBUG_RETURN(length + record_header_size);
 }
+
+/*
+  Switch the data file to the fixed-width row path. Called when the
+  table is opened with the length of its rows. Row offsets are then
+  computed from the row size, rows are read and written with a single
+  positional call and scans decode rows from a block buffer.
+*/
+int Spartan_data::set_fixed_length(int length)
+{
+  DBUG_ENTER("Spartan_data::set_fixed_length");
+  if (data_file == -1 || length <= 0)
+    DBUG_RETURN(-1);
+  if ((fixed_len == length) && (live_map != NULL))
+    DBUG_RETURN(0);
+  fixed_len = length;
+  fixed_row_size = length + record_header_size;
+  data_end = my_seek(data_file, 0L, MY_SEEK_END, MYF(0));
+  if (data_end < header_size)
+    data_end = header_size;
+  if (load_live_map())
+  {
+    fixed_len = 0;
+    fixed_row_size = 0;
+    DBUG_RETURN(-1);
+  }
+  switch (length) {
+  case 8:   copy_row = copy_fixed_row<8>;   break;
+  case 16:  copy_row = copy_fixed_row<16>;  break;
+  case 24:  copy_row = copy_fixed_row<24>;  break;
+  case 32:  copy_row = copy_fixed_row<32>;  break;
+  case 40:  copy_row = copy_fixed_row<40>;  break;
+  case 48:  copy_row = copy_fixed_row<48>;  break;
+  case 56:  copy_row = copy_fixed_row<56>;  break;
+  case 64:  copy_row = copy_fixed_row<64>;  break;
+  case 96:  copy_row = copy_fixed_row<96>;  break;
+  case 128: copy_row = copy_fixed_row<128>; break;
+  case 256: copy_row = copy_fixed_row<256>; break;
+  default:  copy_row = copy_any_row;        break;
+  }
+  DBUG_RETURN(0);
+}
+
+/* prepare a scan buffer for a table scan */
+int Spartan_data::init_scan(SDE_SCAN *scan)
+{
+  int rows;
+
+  DBUG_ENTER("Spartan_data::init_scan");
+  scan->block_start = -1;
+  scan->block_len = 0;
+  if ((fixed_len > 0) && (scan->block == NULL))
+  {
+    rows = SDE_SCAN_BLOCK / fixed_row_size;
+    if (rows < 1)
+      rows = 1;
+    scan->block = (uchar *)my_malloc(rows * fixed_row_size, MYF(MY_WME));
+  }
+  DBUG_RETURN(0);
+}
+
+/* release a scan buffer */
+int Spartan_data::end_scan(SDE_SCAN *scan)
+{
+  DBUG_ENTER("Spartan_data::end_scan");
+  my_free(scan->block);
+  scan->block = NULL;
+  scan->block_start = -1;
+  scan->block_len = 0;
+  DBUG_RETURN(0);
+}
+
+/*
+  Read the next row that is not deleted at or after position into buf.
+  Returns the position just past that row (where the scan continues) or
+  -1 at end of file. Fixed-width rows are served from the scan block,
+  which is refilled with one read whenever the scan moves past it.
+*/
+long long Spartan_data::scan_row(SDE_SCAN *scan, uchar *buf, int length,
+                                 long long position)
+{
+  long long end;
+  size_t i;
+  uchar *p;
+  int rc;
+
+  DBUG_ENTER("Spartan_data::scan_row");
+  if (position <= 0)
+    position = header_size; //move past header
+  if ((fixed_len == 0) || (length != fixed_len) || (scan->block == NULL))
+  {
+    /* step over deleted rows one at a time */
+    while ((rc = read_row(buf, length, position)) == HA_ERR_RECORD_DELETED)
+      position = position + record_header_size + length;
+    if (rc != 0)
+      DBUG_RETURN(-1);
+    DBUG_RETURN(cur_position());
+  }
+  for (;;)
+  {
+    /*
+      Jump straight to the next live row. Runs of deleted rows are
+      never read from the file.
+    */
+    position = next_live(position);
+    if (position == -1)
+      DBUG_RETURN(-1);
+    end = scan->block_start + scan->block_len;
+    if ((position < scan->block_start) || (position + fixed_row_size > end))
+    {
+      i = (SDE_SCAN_BLOCK / fixed_row_size) * fixed_row_size;
+      if (i == 0)
+        i = fixed_row_size;
+      if ((long long)i > data_end - position)
+        i = (size_t)(data_end - position);
+      i = my_pread(data_file, scan->block, i, position, MYF(0));
+      if ((i == (size_t)-1) || (i < (size_t)fixed_row_size))
+        DBUG_RETURN(-1);
+      scan->block_start = position;
+      scan->block_len = (int)(i - (i % fixed_row_size));
+    }
+    p = scan->block + (position - scan->block_start);
+    position += fixed_row_size;
+    if (p[0] == 0)
+    {
+      copy_row(buf, p + record_header_size, fixed_len);
+      DBUG_RETURN(position);
+    }
+  }
+}
+
+/* open (or create) the live row bitmap file of the data file at path */
+int Spartan_data::open_live_map(char *path)
+{
+  char name[FN_REFLEN];
+
+  DBUG_ENTER("Spartan_data::open_live_map");
+  live_file = my_open(fn_format(name, path, "", SDE_LIVE_EXT,
+                                MY_REPLACE_EXT | MY_UNPACK_FILENAME),
+                      O_RDWR | O_CREAT | O_BINARY | O_SHARE, MYF(0));
+  DBUG_RETURN((live_file == -1) ? errno : 0);
+}
+
+/*
+  Read the live row bitmap from its file, or build it from the rows if
+  the file does not match the data file. The file is then marked open
+  until close_table() stores the end of the data file again.
+*/
+int Spartan_data::load_live_map()
+{
+  uchar header[SDE_LIVE_HEADER];
+  long long nrows;
+  long long end;
+  long long words;
+  uint32 magic;
+  int row_size_saved;
+
+  DBUG_ENTER("Spartan_data::load_live_map");
+  nrows = (data_end - header_size) / fixed_row_size;
+  words = (nrows + 63) / 64;
+  if ((live_file == -1) ||
+      my_pread(live_file, header, SDE_LIVE_HEADER, 0, MYF(MY_NABP)))
+    DBUG_RETURN(build_live_map());
+  memcpy(&magic, header, sizeof(uint32));
+  memcpy(&row_size_saved, header + 4, sizeof(int));
+  memcpy(&end, header + 8, sizeof(long long));
+  if ((magic != SDE_LIVE_MAGIC) || (row_size_saved != fixed_row_size) ||
+      (end != data_end))
+    DBUG_RETURN(build_live_map());
+  my_free(live_map);
+  live_map_words = (words < 16) ? 16 : words;
+  live_map = (ulonglong *)my_malloc(live_map_words * sizeof(ulonglong),
+                                    MYF(MY_ZEROFILL | MY_WME));
+  if (live_map == NULL)
+  {
+    live_map_words = 0;
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  }
+  if ((words > 0) &&
+      my_pread(live_file, (uchar *)live_map, words * sizeof(ulonglong),
+               SDE_LIVE_HEADER, MYF(MY_NABP)))
+    DBUG_RETURN(build_live_map());
+  count_live();
+  live_lo = live_map_words;
+  live_hi = -1;
+  DBUG_RETURN(write_live_header(-1));
+}
+
+/*
+  Build the live row bitmap from the status bytes of the data file. The
+  bitmap has one bit per fixed-width row slot (1 = live) and is kept
+  apart from the row bodies so that scans and positioned reads can skip
+  deleted rows without reading them. The whole bitmap is written to its
+  file.
+*/
+int Spartan_data::build_live_map()
+{
+  long long nrows;
+  long long row;
+  long long n;
+  long long i;
+  size_t len;
+  uchar *block;
+
+  DBUG_ENTER("Spartan_data::build_live_map");
+  my_free(live_map);
+  nrows = (data_end - header_size) / fixed_row_size;
+  live_map_words = (nrows + 63) / 64;
+  if (live_map_words < 16)
+    live_map_words = 16;
+  live_map = (ulonglong *)my_malloc(live_map_words * sizeof(ulonglong),
+                                    MYF(MY_ZEROFILL | MY_WME));
+  n = SDE_SCAN_BLOCK / fixed_row_size;
+  if (n < 1)
+    n = 1;
+  block = (uchar *)my_malloc(n * fixed_row_size, MYF(MY_WME));
+  if ((live_map == NULL) || (block == NULL))
+  {
+    my_free(block);
+    my_free(live_map);
+    live_map = NULL;
+    live_map_words = 0;
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  }
+  for (row = 0; row < nrows; row += n)
+  {
+    if (row + n > nrows)
+      n = nrows - row;
+    len = my_pread(data_file, block, n * fixed_row_size,
+                   header_size + row * fixed_row_size, MYF(MY_NABP));
+    if (len != 0)
+      break;
+    for (i = 0; i < n; i++)
+      if (block[i * fixed_row_size] == 0)
+        live_map[(row + i) >> 6] |= 1ULL << ((row + i) & 63);
+  }
+  my_free(block);
+  count_live();
+  if (live_file == -1)
+    DBUG_RETURN(0);
+  my_chsize(live_file, 0, 0, MYF(MY_WME));
+  live_lo = 0;
+  live_hi = (nrows + 63) / 64 - 1;
+  if (sync_live())
+    DBUG_RETURN(-1);
+  DBUG_RETURN(write_live_header(-1));
+}
+
+/* count the live rows of a bitmap that was read or built */
+void Spartan_data::count_live()
+{
+  live_rows = 0;
+  for (long long w = 0; w < live_map_words; w++)
+    live_rows += sde_popcount64(live_map[w]);
+}
+
+/*
+  Write the header of the live row bitmap file: the end of the data file
+  the bitmap matches, or -1 while the table is open.
+*/
+int Spartan_data::write_live_header(long long end)
+{
+  uchar header[SDE_LIVE_HEADER];
+  uint32 magic = SDE_LIVE_MAGIC;
+
+  if (live_file == -1)
+    return 0;
+  memcpy(header, &magic, sizeof(uint32));
+  memcpy(header + 4, &fixed_row_size, sizeof(int));
+  memcpy(header + 8, &end, sizeof(long long));
+  return my_pwrite(live_file, header, SDE_LIVE_HEADER, 0, MYF(MY_NABP)) ?
+         -1 : 0;
+}
+
+/* write the bitmap words changed since the last sync to the file */
+int Spartan_data::sync_live()
+{
+  size_t i = 0;
+
+  if ((live_file != -1) && (live_lo <= live_hi))
+    i = my_pwrite(live_file, (uchar *)(live_map + live_lo),
+                  (live_hi - live_lo + 1) * sizeof(ulonglong),
+                  SDE_LIVE_HEADER + live_lo * sizeof(ulonglong),
+                  MYF(MY_NABP));
+  live_lo = live_map_words;
+  live_hi = -1;
+  return (i == 0) ? 0 : -1;
+}
+
+/* set or clear the live bit for the row slot at position */
+int Spartan_data::set_live(long long position, bool live)
+{
+  long long row;
+  long long words;
+  ulonglong *map;
+  ulonglong bit;
+
+  if ((live_map == NULL) || (position < header_size))
+    return -1;
+  row = (position - header_size) / fixed_row_size;
+  if ((row >> 6) >= live_map_words)
+  {
+    if (!live)
+      return 0;
+    words = live_map_words * 2;
+    while ((row >> 6) >= words)
+      words *= 2;
+    map = (ulonglong *)my_realloc(live_map, words * sizeof(ulonglong),
+                                  MYF(MY_WME));
+    if (map == NULL)
+      return -1;
+    memset(map + live_map_words, 0,
+           (words - live_map_words) * sizeof(ulonglong));
+    live_map = map;
+    live_map_words = words;
+  }
+  bit = 1ULL << (row & 63);
+  if (live && !(live_map[row >> 6] & bit))
+  {
+    live_map[row >> 6] |= bit;
+    live_rows++;
+  }
+  else if (!live && (live_map[row >> 6] & bit))
+  {
+    live_map[row >> 6] &= ~bit;
+    live_rows--;
+  }
+  if ((row >> 6) < live_lo)
+    live_lo = row >> 6;
+  if ((row >> 6) > live_hi)
+    live_hi = row >> 6;
+  return 0;
+}
+
+/*
+  Return the position of the first live row slot at or after position,
+  or -1 if there is none. Empty words are tested four at a time (256
+  rows) so long runs of deleted rows are passed over quickly, then the
+  trailing zero count of the first non-empty word locates the row.
+*/
+long long Spartan_data::next_live(long long position)
+{
+  long long nrows;
+  long long nwords;
+  long long row;
+  long long w;
+  ulonglong word;
+
+  nrows = (data_end - header_size) / fixed_row_size;
+  if (position < header_size)
+    position = header_size;
+  row = (position - header_size + fixed_row_size - 1) / fixed_row_size;
+  if (row >= nrows)
+    return -1;
+  nwords = (nrows + 63) >> 6;
+  if (nwords > live_map_words)
+    nwords = live_map_words;
+  w = row >> 6;
+  if (w >= nwords)
+    return -1;
+  word = live_map[w] & (~0ULL << (row & 63));
+  while (word == 0)
+  {
+    w++;
+    while ((w + 4 <= nwords) &&
+           ((live_map[w] | live_map[w + 1] |
+             live_map[w + 2] | live_map[w + 3]) == 0))
+      w += 4;
+    if (w >= nwords)
+      return -1;
+    word = live_map[w];
+  }
+  row = (w << 6) + sde_ctz64(word);
+  if (row >= nrows)
+    return -1;
+  return header_size + row * fixed_row_size;
+}
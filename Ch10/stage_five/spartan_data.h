@@ -9,6 +9,37 @@
 #include "my_global.h"
 #include "my_sys.h"
 
+/* Size of the block read at a time by a table scan over fixed rows */
+const int SDE_SCAN_BLOCK = 65536;
+
+/*
+  The live row bitmap of a table with fixed-width rows is kept in its
+  own file next to the data file: a header of SDE_LIVE_HEADER bytes (a
+  magic number, the row size and the end of the data file it matches,
+  -1 while the table is open) and then the bitmap words. Each change to
+  the bitmap is written through, and the end is stored when the table
+  is closed, so an open reads the bitmap instead of the rows. A bitmap
+  that does not match the data file (or one left open by a crash) is
+  built again from the status bytes of the rows.
+*/
+#define SDE_LIVE_EXT ".sdl"
+const int SDE_LIVE_HEADER = 16;
+const uint32 SDE_LIVE_MAGIC = 0x314c4453;       /* "SDL1" */
+
+/*
+  This is the scan buffer used by a handler during a table scan. It holds
+  a block of whole rows read from the data file with a single read.
+*/
+struct SDE_SCAN
+{
+  uchar *block;
+  long long block_start;
+  int block_len;
+};
+
+/* routine used to copy a row body of a given length */
+typedef void (*sde_copy_row_t)(uchar *to, const uchar *from, int length);
+
 class Spartan_data
 {
 public:
@@ -17,9 +48,11 @@ public:
   int create_table(char *path);
   int open_table(char *path);
   long long write_row(uchar *buf, int length);
+  long long write_rows(uchar *buf, long long count, int length);
   long long update_row(uchar *old_rec, uchar *new_rec,
                        int length, long long position);
   int read_row(uchar *buf, int length, long long position);
+  int pread_row(uchar *buf, long long position);
   int delete_row(uchar *old_rec, int length, long long position);
   int close_table();
   long long cur_position();
@@ -27,6 +60,12 @@ public:
   int del_records();
   int trunc_table();
   int row_size(int length);
+  int set_fixed_length(int length);
+  bool is_fixed() { return (fixed_len > 0); }
+  int init_scan(SDE_SCAN *scan);
+  int end_scan(SDE_SCAN *scan);
+  long long scan_row(SDE_SCAN *scan, uchar *buf, int length,
+                     long long position);
 private:
   File data_file;
   int header_size;
@@ -34,6 +73,26 @@ private:
   bool crashed;
   int number_records;
   int number_del_records;
+  int fixed_len;
+  int fixed_row_size;
+  long long data_end;
+  sde_copy_row_t copy_row;
+  ulonglong *live_map;
+  long long live_map_words;
+  long long live_rows;        /* bits set in live_map */
+  File live_file;
+  long long live_lo;          /* words changed since the last sync */
+  long long live_hi;
+  int open_live_map(char *path);
+  int load_live_map();
+  int build_live_map();
+  void count_live();
+  int write_live_header(long long end);
+  int set_live(long long position, bool live);
+  int sync_live();
+  long long next_live(long long position);
+  int read_fixed_row(uchar *buf, long long position);
+  int write_fixed_slot(uchar deleted, uchar *buf, long long position);
   int read_header();
   int write_header();
 };
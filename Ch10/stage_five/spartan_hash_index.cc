@@ -0,0 +1,258 @@
+/*
+  Spartan_hash_index.cc
+
+  This class implements the adaptive hash index of a Spartan index (see
+  spartan_hash_index.h). It is a chained hash table with a power of two
+  number of buckets, fixed when the table is created from its budget.
+  Index keys compare as if padded with zeros, so keys are hashed and
+  stored without their trailing zero bytes and a key is found whatever
+  length it is searched with.
+*/
+#include "spartan_slab.h"
+#include "spartan_hash_index.h"
+#include "my_base.h"
+#include <string.h>
+
+Spartan_hash_index::Spartan_hash_index(void)
+{
+  buckets = NULL;
+  num_buckets = 0;
+  budget = 0;
+  used = 0;
+  clock_hand = 0;
+  heat = NULL;
+  lookups = 0;
+}
+
+Spartan_hash_index::~Spartan_hash_index(void)
+{
+  destroy_hash();
+}
+
+/* allocate the buckets for a hash index of budget bytes (0 = disabled) */
+int Spartan_hash_index::init_hash(ulonglong size)
+{
+  ulonglong n;
+
+  DBUG_ENTER("Spartan_hash_index::init_hash");
+  destroy_hash();
+  /*
+    A budget too small to hold the buckets and a few entries leaves
+    the hash index disabled.
+  */
+  n = size / SDI_HASH_BUCKET_BYTES;
+  if (n < 16)
+    DBUG_RETURN(0);
+  for (num_buckets = 16; (num_buckets < n) && (num_buckets < (1U << 30));
+       num_buckets <<= 1)
+    ;
+  if (num_buckets > n)
+    num_buckets >>= 1;
+  buckets = (SDI_HASH_ENTRY **)my_malloc(num_buckets *
+                                         sizeof(SDI_HASH_ENTRY *),
+                                         MYF(MY_WME | MY_ZEROFILL));
+  heat = (uint16 *)my_malloc(SDI_HASH_HEAT_SLOTS * sizeof(uint16),
+                             MYF(MY_WME | MY_ZEROFILL));
+  if ((buckets == NULL) || (heat == NULL))
+  {
+    destroy_hash();
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  }
+  budget = size;
+  used = num_buckets * sizeof(SDI_HASH_ENTRY *);
+  DBUG_RETURN(0);
+}
+
+/* free the hash index */
+int Spartan_hash_index::destroy_hash()
+{
+  DBUG_ENTER("Spartan_hash_index::destroy_hash");
+  clear_hash();
+  my_free(buckets);
+  my_free(heat);
+  buckets = NULL;
+  heat = NULL;
+  num_buckets = 0;
+  budget = 0;
+  used = 0;
+  DBUG_RETURN(0);
+}
+
+/* drop every key and forget the lookup counts */
+void Spartan_hash_index::clear_hash()
+{
+  if (buckets != NULL)
+    memset(buckets, 0, num_buckets * sizeof(SDI_HASH_ENTRY *));
+  used = num_buckets * sizeof(SDI_HASH_ENTRY *);
+  slab.free_all();
+  if (heat != NULL)
+    memset(heat, 0, SDI_HASH_HEAT_SLOTS * sizeof(uint16));
+  lookups = 0;
+  clock_hand = 0;
+}
+
+/* FNV-1a over the key, with the bits mixed at the end */
+uint32 Spartan_hash_index::hash_key(uchar *key, uint key_len)
+{
+  ulonglong h = 0xcbf29ce484222325ULL;
+  uint i;
+
+  for (i = 0; i < key_len; i++)
+    h = (h ^ key[i]) * 0x100000001b3ULL;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return (uint32)h;
+}
+
+/* the link that points to the entry for key, or to NULL at the end */
+SDI_HASH_ENTRY **Spartan_hash_index::find_link(uchar *key, uint key_len,
+                                               uint32 hash)
+{
+  SDI_HASH_ENTRY **link = &buckets[hash & (num_buckets - 1)];
+
+  while ((*link != NULL) &&
+         (((*link)->hash != hash) || ((*link)->key_len != key_len) ||
+          (memcmp((*link)->key, key, key_len) != 0)))
+    link = &(*link)->next;
+  return link;
+}
+
+/* unlink and free the entry link points to */
+void Spartan_hash_index::free_entry(SDI_HASH_ENTRY **link)
+{
+  SDI_HASH_ENTRY *entry = *link;
+
+  *link = entry->next;
+  used -= sizeof(SDI_HASH_ENTRY) + entry->key_len;
+  slab.release(entry, sizeof(SDI_HASH_ENTRY) + entry->key_len);
+}
+
+/*
+  Drop entries until need more bytes fit in the budget. The hand moves
+  a bucket at a time; an entry found since it last passed is kept once.
+*/
+void Spartan_hash_index::evict(ulonglong need)
+{
+  SDI_HASH_ENTRY **link;
+  uint swept = 0;
+
+  while ((used + need > budget) && (swept <= 2 * num_buckets))
+  {
+    link = &buckets[clock_hand];
+    while (*link != NULL)
+    {
+      if ((*link)->referenced)
+      {
+        (*link)->referenced = false;
+        link = &(*link)->next;
+      }
+      else
+        free_entry(link);
+    }
+    clock_hand = (clock_hand + 1) & (num_buckets - 1);
+    swept++;
+  }
+}
+
+/*
+  Look up key (padded with zeros) and return the position and key
+  length of its first entry. Returns false if the key is not hashed.
+*/
+bool Spartan_hash_index::find_key(uchar *key, int key_len, long long *pos,
+                                  int *length)
+{
+  SDI_HASH_ENTRY *entry;
+
+  if (num_buckets == 0)
+    return false;
+  while ((key_len > 0) && (key[key_len - 1] == 0))
+    key_len--;
+  entry = *find_link(key, key_len, hash_key(key, key_len));
+  if (entry == NULL)
+    return false;
+  entry->referenced = true;
+  *pos = entry->pos;
+  *length = entry->length;
+  return true;
+}
+
+/* hash key (an entry of length key_len) to the row at pos */
+int Spartan_hash_index::add_key(uchar *key, int key_len, long long pos)
+{
+  SDI_HASH_ENTRY **link;
+  SDI_HASH_ENTRY *entry;
+  uint32 hash;
+  uint len = key_len;
+
+  DBUG_ENTER("Spartan_hash_index::add_key");
+  if (num_buckets == 0)
+    DBUG_RETURN(0);
+  while ((len > 0) && (key[len - 1] == 0))
+    len--;
+  hash = hash_key(key, len);
+  link = find_link(key, len, hash);
+  if (*link != NULL)
+  {
+    (*link)->pos = pos;
+    (*link)->length = key_len;
+    DBUG_RETURN(0);
+  }
+  evict(sizeof(SDI_HASH_ENTRY) + len);
+  if ((used + sizeof(SDI_HASH_ENTRY) + len > budget) ||
+      Spartan_slab::over_limit())
+    DBUG_RETURN(0);
+  if ((entry = (SDI_HASH_ENTRY *)slab.alloc(sizeof(SDI_HASH_ENTRY) +
+                                            len)) == NULL)
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  entry->pos = pos;
+  entry->hash = hash;
+  entry->length = key_len;
+  entry->key_len = (uchar)len;
+  entry->referenced = false;
+  memcpy(entry->key, key, len);
+  /* a new entry goes at the front of its bucket */
+  link = &buckets[hash & (num_buckets - 1)];
+  entry->next = *link;
+  *link = entry;
+  used += sizeof(SDI_HASH_ENTRY) + len;
+  DBUG_RETURN(0);
+}
+
+/* forget key (called when an entry with the key is added or removed) */
+void Spartan_hash_index::remove_key(uchar *key, int key_len)
+{
+  SDI_HASH_ENTRY **link;
+
+  if (num_buckets == 0)
+    return;
+  while ((key_len > 0) && (key[key_len - 1] == 0))
+    key_len--;
+  link = find_link(key, key_len, hash_key(key, key_len));
+  if (*link != NULL)
+    free_entry(link);
+}
+
+/*
+  Count a lookup that ended on leaf page. Returns true when the leaf
+  has become hot and its keys should be added.
+*/
+bool Spartan_hash_index::note_lookup(uint32 page)
+{
+  uint16 *count;
+  uint i;
+
+  if (num_buckets == 0)
+    return false;
+  if (++lookups >= SDI_HASH_DECAY)
+  {
+    for (i = 0; i < SDI_HASH_HEAT_SLOTS; i++)
+      heat[i] >>= 1;
+    lookups = 0;
+  }
+  count = &heat[page % SDI_HASH_HEAT_SLOTS];
+  if (++*count < SDI_HASH_HOT)
+    return false;
+  *count = 0;
+  return true;
+}
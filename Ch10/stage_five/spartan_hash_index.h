@@ -0,0 +1,79 @@
+/*
+  Spartan_hash_index.h
+
+  This header defines an adaptive hash index over the keys of a Spartan
+  index: a hash table that maps a key to the row position of its first
+  entry, so a lookup of a whole key that is repeated often is answered
+  without descending the B+tree. Nothing is hashed up front. Lookups are
+  counted by the leaf page they end on, and when a leaf has been looked
+  up SDI_HASH_HOT times all of the keys on it are added (see
+  Spartan_index::hash_leaf()). The counts are halved from time to time
+  so only recent lookups make a leaf hot.
+
+  The table is sized by a byte budget covering its buckets and entries.
+  Entries are allocated from a slab arena (see spartan_slab.h), and no
+  more are added while the engine is over spartan_index_memory_limit.
+  When it is full the CLOCK hand sweeps the buckets, gives each entry
+  that has been found since the last sweep a second chance and drops
+  the rest.
+
+  The hash index is never written to disk. The index removes a key from
+  it whenever an entry with that key is added or removed, and empties it
+  when the whole index is replaced.
+
+  The class does no locking of its own. The caller must hold the share
+  mutex for all calls.
+*/
+#include "my_global.h"
+#include "my_sys.h"
+/* Spartan_slab (spartan_slab.h) must be declared before this header */
+
+/* bytes of budget per bucket of the hash table */
+const uint SDI_HASH_BUCKET_BYTES = 64;
+/* lookups counted per leaf (by page number modulo this) */
+const uint SDI_HASH_HEAT_SLOTS = 1024;
+/* lookups that make a leaf hot */
+const uint SDI_HASH_HOT = 8;
+/* lookups after which the counts are halved */
+const uint SDI_HASH_DECAY = SDI_HASH_HEAT_SLOTS * SDI_HASH_HOT;
+
+/* one key of the hash index, stored without its trailing zero bytes */
+struct SDI_HASH_ENTRY
+{
+  SDI_HASH_ENTRY *next;   /* next entry in the bucket */
+  long long pos;          /* row of the first entry with the key */
+  uint32 hash;
+  int length;             /* key length of the entry */
+  uchar key_len;          /* bytes stored in key */
+  bool referenced;        /* CLOCK reference bit */
+  uchar key[1];
+};
+
+class Spartan_hash_index
+{
+public:
+  Spartan_hash_index(void);
+  ~Spartan_hash_index(void);
+  int init_hash(ulonglong size);
+  int destroy_hash();
+  bool find_key(uchar *key, int key_len, long long *pos, int *length);
+  int add_key(uchar *key, int key_len, long long pos);
+  void remove_key(uchar *key, int key_len);
+  void clear_hash();
+  bool note_lookup(uint32 page);
+  bool is_enabled() { return (num_buckets > 0); }
+  ulonglong memory_used() { return used; }
+private:
+  Spartan_slab slab;        /* the entries */
+  SDI_HASH_ENTRY **buckets;
+  uint num_buckets;
+  ulonglong budget;
+  ulonglong used;          /* bytes of the buckets and entries */
+  uint clock_hand;
+  uint16 *heat;            /* lookups per leaf slot */
+  uint lookups;            /* since the counts were last halved */
+  uint32 hash_key(uchar *key, uint key_len);
+  SDI_HASH_ENTRY **find_link(uchar *key, uint key_len, uint32 hash);
+  void free_entry(SDI_HASH_ENTRY **link);
+  void evict(ulonglong need);
+};
@@ -1,55 +1,162 @@
 /*
   Spartan_index.cc
 
-  This class reads and writes an index file for use with the Spartan data 
-  class. The file format is a simple binary storage of the 
-  Spartan_index::SDE_INDEX structure. The size of the key can be set via 
-  the constructor.
+  This class reads and writes an index file for use with the Spartan data
+  class. The index is a B+tree of fixed size pages (see spartan_index.h for
+  the layout) read and written through a page cache. The entries of each
+  page are packed, with the key bytes they share stored once. Lookups,
+  inserts and deletes descend from the root and touch one page per level.
+  Full pages are split and pages that fall below a quarter full are merged
+  with a sibling when the two fit in one page. The size of the key can be
+  set via the constructor.
+
+  When the radix tree is present every change is applied to it as well,
+  and reads use it instead of descending through the page cache.
+  Otherwise the keys of leaves that lookups keep ending on are hashed,
+  and a change to a key drops it from the hash index.
+
+  The public calls of an index kept as sorted runs go to Spartan_lsm.
 */
-#include "spartan_index.h"
+#include "spartan_lsm.h"                 /* and spartan_index.h */
+#include "m_string.h"
+#include "my_base.h"
 #include <my_dir.h>
 #include <string.h>
 
 /* constuctor takes the maximum key length for the keys */
 Spartan_index::Spartan_index(int keylen)
 {
-  root = NULL;
   crashed = false;
+  legacy = false;
+  fixed_pages = false;
+  key_form = SDI_KEY_SORTABLE;
+  organization = SDI_ORG_BTREE;
+  index_path[0] = 0;
+  lsm = NULL;
   max_key_len = keylen;
   index_file = -1;
-  block_size = max_key_len + sizeof(long long) + sizeof(int);
+  set_sizes();
+  first_leaf = 0;
+  tail_leaf = 0;
+  num_pages = 1;
+  free_page = 0;
+  num_keys = 0;
+  root_page = 0;
+  height = 0;
+  cache_size = SDI_DEFAULT_CACHE;
+  changes = 1;
+  page_buf = NULL;
+  split_buf = NULL;
+  split_size = 0;
+  bulk_page = 0;
+  format_init(&bulk_fmt, false);
+  bulk_seps = NULL;
+  bulk_seps_count = 0;
+  bulk_seps_size = 0;
+  art = NULL;
+  art_limit = SDI_DEFAULT_ART;
+  art_version = 0;
+  art_readers = 0;
+  hash_size = SDI_DEFAULT_HASH;
+  bloom_bits = SDI_BLOOM_BITS;
+  bloom_deletes = 0;
+  lsm_memtable = 0;
 }
 
 /* constuctor (overloaded) assumes existing file */
 Spartan_index::Spartan_index()
 {
-  root = NULL;
   crashed = false;
+  legacy = false;
+  fixed_pages = false;
+  key_form = SDI_KEY_SORTABLE;
+  organization = SDI_ORG_BTREE;
+  index_path[0] = 0;
+  lsm = NULL;
   max_key_len = -1;
   index_file = -1;
   block_size = -1;
+  node_size = -1;
+  first_leaf = 0;
+  tail_leaf = 0;
+  num_pages = 1;
+  free_page = 0;
+  num_keys = 0;
+  root_page = 0;
+  height = 0;
+  cache_size = SDI_DEFAULT_CACHE;
+  changes = 1;
+  page_buf = NULL;
+  split_buf = NULL;
+  split_size = 0;
+  bulk_page = 0;
+  format_init(&bulk_fmt, false);
+  bulk_seps = NULL;
+  bulk_seps_count = 0;
+  bulk_seps_size = 0;
+  art = NULL;
+  art_limit = SDI_DEFAULT_ART;
+  art_version = 0;
+  art_readers = 0;
+  hash_size = SDI_DEFAULT_HASH;
+  bloom_bits = SDI_BLOOM_BITS;
+  bloom_deletes = 0;
+  lsm_memtable = 0;
 }
 
 /* destructor */
 Spartan_index::~Spartan_index(void)
 {
+  my_free(page_buf);
+  my_free(split_buf);
+  my_free(bulk_seps);
+  delete art;
+  delete lsm;
+}
+
+/* compute the entry sizes from the maximum key length */
+void Spartan_index::set_sizes()
+{
+  /*
+    Block size is the key length plus the size of the file
+    position and the key length variable: the size of an
+    entry unpacked from a page. Unpacked entries of the
+    inner nodes also hold the child page number.
+  */
+  block_size = max_key_len + sizeof(long long) + sizeof(int);
+  node_size = block_size + sizeof(uint32);
 }
 
-/* create the index file */
-int Spartan_index::create_index(char *path, int keylen)
+/* create the index file, kept as a B+tree or as sorted runs */
+int Spartan_index::create_index(char *path, int keylen, uchar org)
 {
   DBUG_ENTER("Spartan_index::create_index");
   DBUG_PRINT("info", ("path: %s", path));
   open_index(path);
+  legacy = false;
+  fixed_pages = false;
+  key_form = SDI_KEY_SORTABLE;
   max_key_len = keylen;
-  /* 
-    Block size is the key length plus the size of the index
-    length variable.
-  */
-  block_size = max_key_len + sizeof(long long);
-  DBUG_PRINT("info", ("test 1"));
-  write_header();  
-  DBUG_PRINT("info", ("test 2"));
+  set_sizes();
+  first_leaf = 0;
+  tail_leaf = 0;
+  num_pages = 1;
+  free_page = 0;
+  num_keys = 0;
+  root_page = 0;
+  height = 0;
+  organization = org;
+  if (write_header())
+    DBUG_RETURN(-1);
+  delete lsm;
+  lsm = NULL;
+  if (org == SDI_ORG_LSM)
+  {
+    lsm = new Spartan_lsm(index_file, index_path, max_key_len);
+    if (lsm_memtable > 0)
+      lsm->set_memtable_size(lsm_memtable);
+    DBUG_RETURN(lsm->write_manifest());
+  }
   DBUG_RETURN(0);
 }
 
@@ -59,12 +166,20 @@ int Spartan_index::open_index(char *path)
   DBUG_ENTER("Spartan_index::open_index");
   /*
     Open the file with read/write mode,
-    create the file if not found, 
+    create the file if not found,
     treat file as binary, and use default flags.
   */
   index_file = my_open(path, O_RDWR | O_CREAT | O_BINARY | O_SHARE, MYF(0));
   if(index_file == -1)
     DBUG_RETURN(errno);
+  strmake(index_path, path, sizeof(index_path) - 1);
+  if (page_buf == NULL)
+    page_buf = (uchar *)my_malloc(SDI_PAGE_SIZE, MYF(MY_WME));
+  if ((page_buf == NULL) ||
+      cache.init_cache(index_file, SDI_PAGE_SIZE, cache_size) ||
+      hash.init_hash(hash_size))
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  changes++;
   read_header();
   DBUG_RETURN(0);
 }
@@ -72,27 +187,57 @@ int Spartan_index::open_index(char *path)
 /* read header from file */
 int Spartan_index::read_header()
 {
-  int i;
+  uchar hdr[SDI_HEADER_SIZE];
+  size_t i;
 
   DBUG_ENTER("Spartan_index::read_header");
-  if (block_size == -1)
-  {  
-    /*
-      Seek the start of the file.
-      Read the maximum key length value.
-    */
-    my_seek(index_file, 0l, MY_SEEK_SET, MYF(0));
-    i = my_read(index_file, (uchar *)&max_key_len, sizeof(int), MYF(0));
+  i = my_pread(index_file, hdr, sizeof(hdr), 0L, MYF(0));
+  /*
+    A new (empty) file has no header yet. Keep whatever the
+    constructor or create_index() set, except that it is not known
+    to hold the keys of the rows (the file may have been missing).
+  */
+  if ((i == (size_t)-1) || (i < METADATA_SIZE))
+  {
+    key_form = SDI_KEY_RAW;
+    DBUG_RETURN(0);
+  }
+  if ((i >= 32) &&
+      ((uint4korr(hdr) == SDI_MAGIC) || (uint4korr(hdr) == SDI_MAGIC_FIXED)))
+  {
+    legacy = false;
+    fixed_pages = (uint4korr(hdr) == SDI_MAGIC_FIXED);
+    max_key_len = (int)uint4korr(hdr + 4);
+    crashed = (hdr[8] != 0);
+    key_form = hdr[9];
+    organization = hdr[10];
+    first_leaf = uint4korr(hdr + 12);
+    tail_leaf = 0;
+    num_pages = uint4korr(hdr + 16);
+    free_page = uint4korr(hdr + 20);
+    num_keys = sint8korr(hdr + 24);
+    /* files with leaf pages only end the header here */
+    root_page = (i == sizeof(hdr)) ? uint4korr(hdr + 32) : 0;
+    height = (i == sizeof(hdr)) ? uint4korr(hdr + 36) : 0;
+  }
+  else
+  {
     /*
-      Calculate block size as maximum key length plus
-      the size of the key plus the crashed status byte.
+      Original layout: the maximum key length followed by the
+      crashed status byte and then the entries.
     */
-    block_size = max_key_len + sizeof(long long) + sizeof(int);
-    i = my_read(index_file, (uchar *)&crashed, sizeof(bool), MYF(0));
+    legacy = true;
+    key_form = SDI_KEY_RAW;
+    memcpy(&max_key_len, hdr, sizeof(int));
+    memcpy(&crashed, hdr + sizeof(int), sizeof(bool));
   }
-  else
+  set_sizes();
+  if ((organization == SDI_ORG_LSM) && (lsm == NULL))
   {
-    i = (int)my_seek(index_file, sizeof(int) + sizeof(bool), MY_SEEK_SET, MYF(0));
+    lsm = new Spartan_lsm(index_file, index_path, max_key_len);
+    if (lsm_memtable > 0)
+      lsm->set_memtable_size(lsm_memtable);
+    DBUG_RETURN(lsm->open_runs());
   }
   DBUG_RETURN(0);
 }
@@ -100,472 +245,2072 @@ int Spartan_index::read_header()
 /* write header to file */
 int Spartan_index::write_header()
 {
-  int i;
+  uchar hdr[SDI_HEADER_SIZE];
 
   DBUG_ENTER("Spartan_index::write_header");
-  if (block_size != -1)
+  /* a file with fixed size entries keeps its header until converted */
+  if ((block_size != -1) && (index_file != -1) && !fixed_pages)
   {
-    /*
-      Seek the start of the file and write the maximum key length
-      then write the crashed status byte.
-    */
-    my_seek(index_file, 0l, MY_SEEK_SET, MYF(0));
-    i = my_write(index_file, (uchar *)&max_key_len, sizeof(int), MYF(0));
-    i = my_write(index_file, (uchar *)&crashed, sizeof(bool), MYF(0));
+    memset(hdr, 0, sizeof(hdr));
+    int4store(hdr, SDI_MAGIC);
+    int4store(hdr + 4, max_key_len);
+    hdr[8] = crashed ? 1 : 0;
+    hdr[9] = key_form;
+    hdr[10] = organization;
+    int4store(hdr + 12, first_leaf);
+    int4store(hdr + 16, num_pages);
+    int4store(hdr + 20, free_page);
+    int8store(hdr + 24, num_keys);
+    int4store(hdr + 32, root_page);
+    int4store(hdr + 36, height);
+    if (my_pwrite(index_file, hdr, sizeof(hdr), 0L, MYF(MY_NABP)))
+      DBUG_RETURN(-1);
   }
   DBUG_RETURN(0);
 }
 
-/* write a row (SDE_INDEX struct) to the index file */
-long long Spartan_index::write_row(SDE_INDEX *ndx)
+/*
+  Set the size the memory table of an index kept as sorted runs grows
+  to before it is written out (0 for SDI_LSM_MEMTABLE).
+*/
+void Spartan_index::set_lsm_memtable_size(ulonglong size)
 {
-  long long pos;
-  int i;
-  int len;
+  lsm_memtable = size;
+  if ((lsm != NULL) && (size > 0))
+    lsm->set_memtable_size(size);
+}
 
-  DBUG_ENTER("Spartan_index::write_row");
-  /* 
-     Seek the end of the file (always append)
-  */
-  pos = my_seek(index_file, 0l, MY_SEEK_END, MYF(0));
-  /*
-    Write the key value.
-  */
-  i = my_write(index_file, ndx->key, max_key_len, MYF(0));
-  memcpy(&pos, &ndx->pos, sizeof(long long));
-  /*
-    Write the file position for the key value.
-  */
-  i = i + my_write(index_file, (uchar *)&pos, sizeof(long long), MYF(0));
-  memcpy(&len, &ndx->length, sizeof(int));
-  /*
-    Write the length of the key.
-  */
-  i = i + my_write(index_file, (uchar *)&len, sizeof(int), MYF(0));
-  if (i == -1)
-    pos = i; 
-  DBUG_RETURN(pos);
+/*
+  Mark the index as not matching the rows any more (an entry could not
+  be written or removed). The mark is kept in the header until the
+  index is written again as a whole (see bulk_start()).
+*/
+void Spartan_index::mark_crashed()
+{
+  DBUG_ENTER("Spartan_index::mark_crashed");
+  crashed = true;
+  write_header();
+  DBUG_VOID_RETURN;
 }
 
-/* read a row (SDE_INDEX struct) from the index file */
-SDE_INDEX *Spartan_index::read_row(long long Position)
+/*
+  Page format.
+
+  The entries of a page are packed to one width chosen for the page (see
+  spartan_index.h): the key bytes shared by every entry are stored once
+  in front of them, the zero bytes at the end of the keys are left out,
+  the key length is stored once when all entries have the same length
+  and the row position is stored as its delta from the smallest one on
+  the page in steps of the largest common difference, in only the bytes
+  the largest delta needs. Searches work on the packed entries. An entry
+  is unpacked to the layout of make_entry() (and for a node the child
+  page after it) when it has to be moved to another page or packed in
+  another format.
+*/
+
+/* bytes needed to store a value */
+static uint value_width(ulonglong v)
 {
-  int i;
-  long long pos;
-  SDE_INDEX *ndx = NULL;
-  
-  DBUG_ENTER("Spartan_index::read_row");
-  /*
-    Seek the position in the file (Position).
-  */
-  pos = my_seek(index_file,(ulong) Position, MY_SEEK_SET, MYF(0));
-  if (pos != -1L)
-  {
-    ndx = new SDE_INDEX();
-    /*
-      Read the key value.
-    */
-    i = my_read(index_file, ndx->key, max_key_len, MYF(0));
-    /*
-      Read the key value. If error, return NULL.
-    */
-    i = my_read(index_file, (uchar *)&ndx->pos, sizeof(long long), MYF(0));
-    if (i == -1)
-    {
-        delete ndx;
-        ndx = NULL;
-    }
-  }
-  DBUG_RETURN(ndx);
+  uint width = 0;
+
+  for (; v != 0; v >>= 8)
+    width++;
+  return width;
 }
 
+/* read a value stored in width bytes, low byte first */
+static ulonglong read_value(uchar *from, uint width)
+{
+  ulonglong v = 0;
 
-/* insert a key into the index in memory */
-int Spartan_index::insert_key(SDE_INDEX *ndx, bool allow_dupes)
+  while (width > 0)
+    v = (v << 8) | from[--width];
+  return v;
+}
+
+/* store a value in width bytes, low byte first */
+static void store_value(uchar *to, ulonglong v, uint width)
 {
-  SDE_NDX_NODE *p = NULL;
-  SDE_NDX_NODE *n = NULL;
-  SDE_NDX_NODE *o = NULL;
-  int i = -1;
-  int icmp;
-  bool dupe = false;
-  bool done = false;
+  for (uint i = 0; i < width; i++, v >>= 8)
+    to[i] = (uchar)v;
+}
 
-  DBUG_ENTER("Spartan_index::insert_key");
-  /*
-    If this is a new index, insert first key as the root node.
-  */
-  if (root == NULL)
+static ulonglong gcd(ulonglong a, ulonglong b)
+{
+  while (b != 0)
   {
-    root = new SDE_NDX_NODE();
-    root->next = NULL;
-    root->prev = NULL;
-    memcpy(root->key_ndx.key, ndx->key, max_key_len);
-    root->key_ndx.pos = ndx->pos;
-    root->key_ndx.length = ndx->length;
+    ulonglong t = a % b;
+    a = b;
+    b = t;
   }
-  else //set pointer to root
-    p = root;
-  /*
-    Loop through the linked list until a value greater than the
-    key to be inserted, then insert new key before that one.
-  */
-  while ((p != NULL) && !done)
+  return a;
+}
+
+/* the step between the stored positions of a format */
+static inline ulonglong pos_step(SDI_FORMAT *fmt)
+{
+  return (fmt->pos_step != 0) ? fmt->pos_step : 1;
+}
+
+/* read the format of a page from its header */
+void Spartan_index::read_format(uchar *frame, SDI_FORMAT *fmt)
+{
+  uchar *from;
+  ulonglong deltas;
+
+  fmt->count = uint2korr(frame + 2);
+  fmt->prefix = frame[1];
+  fmt->width = frame[12];
+  fmt->key_len = frame[13];
+  fmt->pos_width = frame[14];
+  fmt->base_width = frame[15] & 15;
+  fmt->step_width = frame[15] >> 4;
+  fmt->node = (frame[0] == SDI_PAGE_NODE);
+  from = frame + SDI_PAGE_HEADER + fmt->prefix;
+  fmt->pos_base = read_value(from, fmt->base_width);
+  fmt->pos_step = (fmt->step_width != 0) ?
+                  read_value(from + fmt->base_width, fmt->step_width) : 0;
+  if (fmt->pos_step == 0)
+    fmt->pos_step = 1;
+  /* the largest position the page can take without being packed again */
+  deltas = (fmt->pos_width >= sizeof(ulonglong)) ? ~0ULL :
+           (1ULL << (8 * fmt->pos_width)) - 1;
+  if (deltas > (~0ULL - fmt->pos_base) / fmt->pos_step)
+    fmt->pos_top = ~0ULL;
+  else
+    fmt->pos_top = fmt->pos_base + deltas * fmt->pos_step;
+}
+
+/* the format of a page with no entries */
+void Spartan_index::format_init(SDI_FORMAT *fmt, bool node)
+{
+  fmt->count = 0;
+  fmt->prefix = 0;
+  fmt->width = 0;
+  fmt->key_len = 0;
+  fmt->pos_width = 0;
+  fmt->pos_base = 0;
+  fmt->pos_step = 0;
+  fmt->pos_top = 0;
+  fmt->base_width = 0;
+  fmt->step_width = 0;
+  fmt->node = node;
+}
+
+/*
+  Widen a format to take one more unpacked entry. first holds at least
+  the prefix bytes of the entries already in the format.
+*/
+void Spartan_index::format_add(SDI_FORMAT *fmt, uchar *first, uchar *entry)
+{
+  ulonglong p = (ulonglong)(sint8korr(entry + max_key_len) + 1);
+  uint len = uint4korr(entry + max_key_len + sizeof(long long));
+  uint width = max_key_len;
+  uint i;
+
+  while ((width > 0) && (entry[width - 1] == 0))
+    width--;
+  if (fmt->count == 0)
   {
-    icmp = memcmp(ndx->key, p->key_ndx.key, 
-                 (ndx->length > p->key_ndx.length) ? 
-                  ndx->length : p->key_ndx.length);
-    if (icmp > 0) // key is greater than current key in list
-    {
-      n = p;
-      p = p->next;
-    }
-    /*
-      If dupes not allowed, stop and return NULL
-    */
-    else if (!allow_dupes && (icmp == 0))
-    {
-      p = NULL;
-      dupe = true; 
-    }
-    else
-    {
-      n = p->prev; //stop, insert at n->prev
-      done = true;
-    }
+    fmt->prefix = width;
+    fmt->width = width;
+    fmt->key_len = len;
+    fmt->pos_base = p;
+    fmt->pos_step = 0;
+    fmt->pos_top = p;
   }
-  /*
-    If position found (n != NULL) and dupes permitted,
-    insert key. If p is NULL insert at end else insert in middle
-    of list.
-  */
-  if ((n != NULL) && !dupe)
+  else
   {
-    if (p == NULL) //insert at end
+    for (i = 0; (i < fmt->prefix) && (first[i] == entry[i]); i++)
+      ;
+    fmt->prefix = i;
+    fmt->width = MY_MAX(fmt->width, width);
+    if (fmt->key_len != len)
+      fmt->key_len = SDI_VAR_LEN;
+    /* every delta stays a multiple of the step when the base moves down */
+    if (p < fmt->pos_base)
     {
-      p = new SDE_NDX_NODE();
-      n->next = p;
-      p->prev = n;
-      memcpy(p->key_ndx.key, ndx->key, max_key_len);
-      p->key_ndx.pos = ndx->pos;
-      p->key_ndx.length = ndx->length;
+      fmt->pos_step = gcd(fmt->pos_step, fmt->pos_base - p);
+      fmt->pos_base = p;
     }
     else
-    {
-      o = new SDE_NDX_NODE();
-      memcpy(o->key_ndx.key, ndx->key, max_key_len);
-      o->key_ndx.pos = ndx->pos;
-      o->key_ndx.length = ndx->length;
-      o->next = p;
-      o->prev = n;
-      n->next = o;
-      p->prev = o;
-    }
-    i = 1;
+      fmt->pos_step = gcd(fmt->pos_step, p - fmt->pos_base);
+    fmt->pos_top = MY_MAX(fmt->pos_top, p);
   }
-  DBUG_RETURN(i);
+  fmt->pos_width = value_width((fmt->pos_top - fmt->pos_base) /
+                               pos_step(fmt));
+  fmt->base_width = value_width(fmt->pos_base);
+  fmt->step_width = (fmt->pos_step > 1) ? value_width(fmt->pos_step) : 0;
+  fmt->count++;
 }
 
-/* delete a key from the index in memory. Note:
-   position is included for indexes that allow dupes */
-int Spartan_index::delete_key(uchar *buf, long long pos, int key_len)
+/* bytes taken by one packed entry */
+int Spartan_index::entry_width(SDI_FORMAT *fmt)
 {
-  SDE_NDX_NODE *p;
-  int icmp;
-  int buf_len;
-  bool done = false;
+  return (fmt->width - fmt->prefix) + ((fmt->key_len == SDI_VAR_LEN) ? 1 : 0) +
+         fmt->pos_width + (fmt->node ? sizeof(uint32) : 0);
+}
 
-  DBUG_ENTER("Spartan_index::delete_key");
-  p = root;
-  /*
-    Search for the key in the list. If found, delete it!
-  */
-  while ((p != NULL) && !done)
-  {
-    buf_len = p->key_ndx.length;
-    icmp = memcmp(buf, p->key_ndx.key, 
-                 (buf_len > key_len) ? buf_len : key_len);
-    if (icmp == 0)
-    {
-      if (pos != -1)
-      {
-        if (pos == p->key_ndx.pos)
-          done = true;
-      }
-      else
-        done = true;
-    }
-    else
-      p = p->next;
-  }
-  if (p != NULL)
-  {
-    /*
-      Reset pointers for deleted node in list.
-    */
-    if (p->next != NULL)
-      p->next->prev = p->prev;
-    if (p->prev != NULL)
-      p->prev->next = p->next;
-    else
-      root = p->next;
-    delete p;
-  }
-  DBUG_RETURN(0);
+/* bytes taken by a page in this format */
+int Spartan_index::format_size(SDI_FORMAT *fmt)
+{
+  return SDI_PAGE_HEADER + fmt->prefix + fmt->base_width + fmt->step_width +
+         fmt->count * entry_width(fmt);
 }
 
-/* update key in place (so if key changes!) */
-int Spartan_index::update_key(uchar *buf, long long pos, int key_len)
+/* find the format for count unpacked entries and the bytes they need */
+int Spartan_index::packed_size(uchar *entries, int count, bool node,
+                               SDI_FORMAT *fmt)
 {
-  SDE_NDX_NODE *p;
-  bool done = false;
+  int i;
 
-  DBUG_ENTER("Spartan_index::update_key");
-  p = root;
-  /*
-    Search for the key.
-  */
-  while ((p != NULL) && !done)
-  {
-    if (p->key_ndx.pos == pos)
-      done = true;
-    else
-      p = p->next;
-  }
-  /*
-    If key found, overwrite key value in node.
-  */
-  if (p != NULL)
-  {
-    memcpy(p->key_ndx.key, buf, key_len);
-  }
-  DBUG_RETURN(0);
+  format_init(fmt, node);
+  for (i = 0; i < count; i++)
+    format_add(fmt, entries, entries + (size_t)i * node_size);
+  return format_size(fmt);
 }
 
-/* get the current position of the key in the index file */
-long long Spartan_index::get_index_pos(uchar *buf, int key_len)
+/* pack one unpacked entry */
+void Spartan_index::pack_entry(uchar *to, uchar *entry, SDI_FORMAT *fmt)
 {
-  long long pos = -1;
+  ulonglong p = (ulonglong)(sint8korr(entry + max_key_len) + 1);
 
-  DBUG_ENTER("Spartan_index::get_index_pos");
-  SDE_INDEX *ndx;
-  ndx = seek_index(buf, key_len);
-  if (ndx != NULL)
-    pos = ndx->pos;
-  DBUG_RETURN(pos);
+  memcpy(to, entry + fmt->prefix, fmt->width - fmt->prefix);
+  to += fmt->width - fmt->prefix;
+  if (fmt->key_len == SDI_VAR_LEN)
+    *to++ = (uchar)uint4korr(entry + max_key_len + sizeof(long long));
+  store_value(to, (p - fmt->pos_base) / pos_step(fmt), fmt->pos_width);
+  to += fmt->pos_width;
+  if (fmt->node)
+    int4store(to, uint4korr(entry + block_size));
 }
 
-/* get next key in list */
-uchar *Spartan_index::get_next_key()
+/* replace the entries of a page with unpacked entries in format fmt */
+void Spartan_index::pack_page(uchar *frame, uchar *entries, SDI_FORMAT *fmt)
 {
-  uchar *key = 0;
+  uchar *to;
+  int width = entry_width(fmt);
+  uint i;
 
-  DBUG_ENTER("Spartan_index::get_next_key");
-  if (range_ptr != NULL)
-  {
-    key = (uchar *)my_malloc(max_key_len, MYF(MY_ZEROFILL | MY_WME));
-    memcpy(key, range_ptr->key_ndx.key, range_ptr->key_ndx.length);
-    range_ptr = range_ptr->next;
-  }
-  DBUG_RETURN(key);
+  frame[1] = (uchar)fmt->prefix;
+  int2store(frame + 2, fmt->count);
+  frame[12] = (uchar)fmt->width;
+  frame[13] = (uchar)fmt->key_len;
+  frame[14] = (uchar)fmt->pos_width;
+  frame[15] = (uchar)(fmt->base_width | (fmt->step_width << 4));
+  memcpy(frame + SDI_PAGE_HEADER, entries, fmt->prefix);
+  to = frame + SDI_PAGE_HEADER + fmt->prefix;
+  store_value(to, fmt->pos_base, fmt->base_width);
+  store_value(to + fmt->base_width, fmt->pos_step, fmt->step_width);
+  to += fmt->base_width + fmt->step_width;
+  for (i = 0; i < fmt->count; i++, to += width)
+    pack_entry(to, entries + (size_t)i * node_size, fmt);
+}
+
+/* read a row position stored as a delta in a format */
+static long long read_pos(uchar *from, SDI_FORMAT *fmt)
+{
+  return (long long)(fmt->pos_base +
+                     read_value(from, fmt->pos_width) * pos_step(fmt)) - 1;
 }
 
-/* get prev key in list */
-uchar *Spartan_index::get_prev_key()
+/* unpack the key (padded with zeros), length and pos of entry i */
+void Spartan_index::read_entry(uchar *frame, SDI_FORMAT *fmt, int i,
+                               uchar *key, int *length, long long *pos)
 {
-  uchar *key = 0;
+  uchar *from = page_entry(frame, fmt, i);
+  uint suffix = fmt->width - fmt->prefix;
 
-  DBUG_ENTER("Spartan_index::get_prev_key");
-  if (range_ptr != NULL)
-  {
-    key = (uchar *)my_malloc(max_key_len, MYF(MY_ZEROFILL | MY_WME));
-    memcpy(key, range_ptr->key_ndx.key, range_ptr->key_ndx.length);
-    range_ptr = range_ptr->prev;
-  }
-  DBUG_RETURN(key);
+  memcpy(key, frame + SDI_PAGE_HEADER, fmt->prefix);
+  memcpy(key + fmt->prefix, from, suffix);
+  memset(key + fmt->width, 0, max_key_len - fmt->width);
+  from += suffix;
+  *length = (fmt->key_len == SDI_VAR_LEN) ? *from++ : fmt->key_len;
+  *pos = read_pos(from, fmt);
+}
+
+/* the row position of entry i */
+long long Spartan_index::entry_pos(uchar *frame, SDI_FORMAT *fmt, int i)
+{
+  uchar *from = page_entry(frame, fmt, i) + (fmt->width - fmt->prefix);
+
+  if (fmt->key_len == SDI_VAR_LEN)
+    from++;
+  return read_pos(from, fmt);
+}
+
+/* unpack entry i to the layout of make_entry() (and its child) */
+void Spartan_index::unpack_entry(uchar *frame, SDI_FORMAT *fmt, int i,
+                                 uchar *entry)
+{
+  long long pos;
+  int length;
+
+  read_entry(frame, fmt, i, entry, &length, &pos);
+  int8store(entry + max_key_len, pos);
+  int4store(entry + max_key_len + sizeof(long long), length);
+  if (fmt->node)
+    int4store(entry + block_size,
+              uint4korr(page_entry(frame, fmt, i) + entry_width(fmt) -
+                        sizeof(uint32)));
+}
+
+/* unpack every entry of a page, returning the number of entries */
+int Spartan_index::unpack_page(uchar *frame, uchar *entries)
+{
+  SDI_FORMAT fmt;
+  uint i;
+
+  read_format(frame, &fmt);
+  for (i = 0; i < fmt.count; i++)
+    unpack_entry(frame, &fmt, i, entries + (size_t)i * node_size);
+  return fmt.count;
+}
+
+/* make room in split_buf for count unpacked entries */
+int Spartan_index::reserve_split(int count)
+{
+  uchar *p;
+
+  if (count <= split_size)
+    return 0;
+  count = MY_MAX(count, 2 * split_size);
+  p = (uchar *)my_realloc(split_buf, (size_t)count * node_size,
+                          MYF(MY_WME | MY_ALLOW_ZERO_PTR));
+  if (p == NULL)
+    return -1;
+  split_buf = p;
+  split_size = count;
+  return 0;
 }
 
-/* get first key in list */
-uchar *Spartan_index::get_first_key()
+/*
+  Add an unpacked entry to a page at slot. It is packed in place if it
+  fits the format of the page; otherwise the page is packed again in a
+  format wide enough for it. Returns 1 if the entries no longer fit on
+  one page, in which case they are left unpacked in split_buf with the
+  new one at slot and the page is unchanged, and -1 on error.
+*/
+int Spartan_index::insert_slot(uchar *frame, int slot, uchar *entry)
 {
-  SDE_NDX_NODE *n = root;
-  uchar *key = 0;
+  SDI_FORMAT fmt;
+  SDI_FORMAT wide;
+  uchar *to;
+  int width;
+  int i;
 
-  DBUG_ENTER("Spartan_index::get_first_key");
-  if (root != NULL)
+  read_format(frame, &fmt);
+  wide = fmt;
+  format_add(&wide, frame + SDI_PAGE_HEADER, entry);
+  if ((fmt.count > 0) && (wide.prefix == fmt.prefix) &&
+      (wide.width == fmt.width) && (wide.key_len == fmt.key_len) &&
+      (wide.pos_width == fmt.pos_width) && (wide.pos_base == fmt.pos_base) &&
+      (wide.pos_step == fmt.pos_step) &&
+      (format_size(&wide) <= SDI_PAGE_SIZE))
   {
-    key = (uchar *)my_malloc(max_key_len, MYF(MY_ZEROFILL | MY_WME));
-    memcpy(key, n->key_ndx.key, n->key_ndx.length);
-    range_ptr = n->next;
+    width = entry_width(&fmt);
+    to = page_entry(frame, &fmt, slot);
+    memmove(to + width, to, (fmt.count - slot) * width);
+    pack_entry(to, entry, &fmt);
+    int2store(frame + 2, fmt.count + 1);
+    return 0;
   }
-  DBUG_RETURN(key);
+  if (reserve_split(fmt.count + 1))
+    return -1;
+  for (i = 0; i < (int)fmt.count; i++)
+    unpack_entry(frame, &fmt, i,
+                 split_buf + (size_t)(i < slot ? i : i + 1) * node_size);
+  memcpy(split_buf + (size_t)slot * node_size, entry,
+         fmt.node ? node_size : block_size);
+  if (packed_size(split_buf, fmt.count + 1, fmt.node, &wide) > SDI_PAGE_SIZE)
+    return 1;
+  pack_page(frame, split_buf, &wide);
+  return 0;
+}
+
+/* remove entry slot from a page (the format still fits the rest) */
+void Spartan_index::delete_slot(uchar *frame, int slot)
+{
+  SDI_FORMAT fmt;
+  uchar *to;
+  int width;
+
+  read_format(frame, &fmt);
+  width = entry_width(&fmt);
+  to = page_entry(frame, &fmt, slot);
+  memmove(to, to + width, (fmt.count - slot - 1) * width);
+  int2store(frame + 2, fmt.count - 1);
 }
 
-/* get last key in list */
-uchar *Spartan_index::get_last_key()
+/*
+  The packed size of the first k unpacked entries grows with k and that
+  of the last total - k shrinks with k, so the split points that leave
+  both sides fitting on a page form a range found by binary search.
+*/
+
+/* the largest k in lo..hi for which the first k entries fit on a page */
+int Spartan_index::fit_front(uchar *entries, int lo, int hi, bool node)
 {
-  SDE_NDX_NODE *n = root;
-  uchar *key = 0;
+  SDI_FORMAT fmt;
+  int mid;
 
-  DBUG_ENTER("Spartan_index::get_last_key");
-  while (n->next != NULL)
-    n = n->next;
-  if (n != NULL)
+  while (lo < hi)
   {
-    key = (uchar *)my_malloc(max_key_len, MYF(MY_ZEROFILL | MY_WME));
-    memcpy(key, n->key_ndx.key, n->key_ndx.length);
+    mid = (lo + hi + 1) / 2;
+    if (packed_size(entries, mid, node, &fmt) <= SDI_PAGE_SIZE)
+      lo = mid;
+    else
+      hi = mid - 1;
   }
-  DBUG_RETURN(key);
+  return lo;
 }
 
-/* just close the index */
-int Spartan_index::close_index()
+/* the smallest k in lo..hi for which entries k..total fit on a page */
+int Spartan_index::fit_back(uchar *entries, int total, int lo, int hi,
+                            bool node)
 {
-  SDE_NDX_NODE *p;
+  SDI_FORMAT fmt;
+  int mid;
 
-  DBUG_ENTER("Spartan_index::close_index");
-  if (index_file != -1)
+  while (lo < hi)
   {
-    my_close(index_file, MYF(0));
-    index_file = -1;
+    mid = (lo + hi) / 2;
+    if (packed_size(entries + (size_t)mid * node_size, total - mid, node,
+                    &fmt) <= SDI_PAGE_SIZE)
+      hi = mid;
+    else
+      lo = mid + 1;
   }
-  while (root != NULL)
+  return lo;
+}
+
+/*
+  Make the separator for a split between the unpacked entries left and
+  right: the key of right cut short after the first byte that differs
+  from the key of left, with a position before every row. Keys that are
+  the same need all of right.
+*/
+void Spartan_index::make_separator(uchar *sep, uchar *left, uchar *right)
+{
+  int i;
+
+  memcpy(sep, right, block_size);
+  for (i = 0; (i < max_key_len) && (left[i] == right[i]); i++)
+    ;
+  if (i < max_key_len)
   {
-    p = root;
-    root = root->next;
-    delete p;     
+    memset(sep + i + 1, 0, max_key_len - i - 1);
+    int8store(sep + max_key_len, -1LL);
   }
-  DBUG_RETURN(0);
 }
 
-/* find a key in the index */
-SDE_INDEX *Spartan_index::seek_index(uchar *key, int key_len)
+/* child page i of an inner node (0 is the child before the first entry) */
+uint32 Spartan_index::node_child(uchar *frame, int i)
 {
-  SDE_INDEX *ndx = NULL;
-  SDE_NDX_NODE *n = root;
-  int buf_len;
-  bool done = false;
+  SDI_FORMAT fmt;
+
+  if (i == 0)
+    return uint4korr(frame + 4);
+  read_format(frame, &fmt);
+  return uint4korr(page_entry(frame, &fmt, i - 1) + entry_width(&fmt) -
+                   sizeof(uint32));
+}
+
+/* compare a search key with a key padded with zeros to max_key_len */
+int Spartan_index::compare_key(uchar *key, int key_len, uchar *entry_key,
+                               int entry_len)
+{
+  int len = (key_len > entry_len) ? key_len : entry_len;
+
+  if (len > max_key_len)
+    len = max_key_len;
+  return memcmp(key, entry_key, len);
+}
+
+/* compare a search key with the key of entry i of a page */
+int Spartan_index::compare_slot_key(uchar *frame, SDI_FORMAT *fmt, int i,
+                                    uchar *key, int key_len)
+{
+  uchar *from = page_entry(frame, fmt, i);
+  int len;
+  int n;
+  int icmp;
+
+  len = (fmt->key_len == SDI_VAR_LEN) ? from[fmt->width - fmt->prefix] :
+                                        fmt->key_len;
+  if (key_len > len)
+    len = key_len;
+  if (len > max_key_len)
+    len = max_key_len;
+  n = MY_MIN(len, (int)fmt->prefix);
+  if ((icmp = memcmp(key, frame + SDI_PAGE_HEADER, n)) != 0)
+    return icmp;
+  n = MY_MIN(len, (int)fmt->width) - (int)fmt->prefix;
+  if ((n > 0) && ((icmp = memcmp(key + fmt->prefix, from, n)) != 0))
+    return icmp;
+  /* the key of the entry is zero from width on */
+  for (n = fmt->width; n < len; n++)
+    if (key[n] != 0)
+      return 1;
+  return 0;
+}
+
+/*
+  Compare a search key with entry i of a page. Equal keys are ordered by
+  row position; a position of -1 sorts before every row.
+*/
+int Spartan_index::compare_slot(uchar *frame, SDI_FORMAT *fmt, int i,
+                                uchar *key, int key_len, long long pos)
+{
+  long long entry_p;
+  int icmp;
+
+  icmp = compare_slot_key(frame, fmt, i, key, key_len);
+  if (icmp != 0)
+    return icmp;
+  entry_p = entry_pos(frame, fmt, i);
+  if (pos < entry_p)
+    return -1;
+  return (pos > entry_p) ? 1 : 0;
+}
+
+/*
+  Binary search a page. For a leaf return the first slot whose entry is
+  not less than the search key, for an inner node return the child that
+  covers the search key.
+*/
+int Spartan_index::search_page(uchar *frame, uchar *key, int key_len,
+                               long long pos)
+{
+  SDI_FORMAT fmt;
+  int lo = 0;
+  int hi;
+  int mid;
 
-  DBUG_ENTER("Spartan_index::seek_index");
-  if (n != NULL)
+  read_format(frame, &fmt);
+  hi = fmt.count;
+  if (!fmt.node)
   {
-    while((n != NULL) && !done)
+    while (lo < hi)
     {
-      buf_len = n->key_ndx.length;
-      if (memcmp(n->key_ndx.key, key, 
-          (buf_len > key_len) ? buf_len : key_len) == 0)
-        done = true;
+      mid = (lo + hi) / 2;
+      if (compare_slot(frame, &fmt, mid, key, key_len, pos) > 0)
+        lo = mid + 1;
       else
-        n = n->next;
-    } 
+        hi = mid;
+    }
   }
-  if (n != NULL)
+  else
   {
-    ndx = &n->key_ndx;
-    range_ptr = n;
+    while (lo < hi)
+    {
+      mid = (lo + hi) / 2;
+      if (compare_slot(frame, &fmt, mid, key, key_len, pos) >= 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
   }
-  DBUG_RETURN(ndx);
+  return lo;
 }
 
-/* find a key in the index and return position too */
-SDE_NDX_NODE *Spartan_index::seek_index_pos(uchar *key, int key_len)
+/* walk from the root to the leaf that covers the search key */
+uint32 Spartan_index::find_leaf(uchar *key, int key_len, long long pos,
+                                SDI_PATH *path)
 {
-  SDE_NDX_NODE *n = root;
-  int buf_len; 
-  bool done = false;
+  uint32 page = root_page;
+  uchar *frame;
+  int level = 0;
+  int c;
 
-  DBUG_ENTER("Spartan_index::seek_index_pos");
-  if (n != NULL)
+  DBUG_ENTER("Spartan_index::find_leaf");
+  path->depth = 0;
+  while ((page != 0) && (level < SDI_MAX_HEIGHT))
   {
-    while((n->next != NULL) && !done)
+    frame = cache.get_page(page, false);
+    if (frame == NULL)
+      break;
+    path->page[level] = page;
+    if (frame[0] != SDI_PAGE_NODE)
     {
-      buf_len = n->key_ndx.length;
-      if (memcmp(n->key_ndx.key, key, 
-          (buf_len > key_len) ? buf_len : key_len) == 0)
-        done = true;
-      else if (n->next != NULL)
-        n = n->next;
-    } 
+      cache.release_page(frame, false);
+      path->depth = level + 1;
+      DBUG_RETURN(page);
+    }
+    c = search_page(frame, key, key_len, pos);
+    path->child[level++] = c;
+    page = node_child(frame, c);
+    cache.release_page(frame, false);
   }
-  DBUG_RETURN(n);
+  DBUG_RETURN(0);
 }
 
-/* read the index file from disk and store in memory */
-int Spartan_index::load_index()
+/*
+  Position on the first entry not less than the search key, following
+  the leaf chain if the leaf that covers the key ends before it. Returns
+  false if there is no such entry.
+*/
+bool Spartan_index::find_entry(uchar *key, int key_len, long long pos,
+                               uint32 *page, int *slot)
 {
-  SDE_INDEX *ndx;
-  int i = 1;
+  SDI_PATH path;
+  uchar *frame;
+  uint32 p;
+  int s;
 
-  DBUG_ENTER("Spartan_index::load_index");
-  if (root != NULL)
-    destroy_index();
-  /*
-    First, read the metadata at the front of the index.
-  */
-  read_header();
-  while(i != 0)
+  p = find_leaf(key, key_len, pos, &path);
+  if ((p == 0) || ((frame = cache.get_page(p, false)) == NULL))
+    return false;
+  s = search_page(frame, key, key_len, pos);
+  while (s >= uint2korr(frame + 2))
   {
-    ndx = new SDE_INDEX();
-    i = my_read(index_file, (uchar *)&ndx->key, max_key_len, MYF(0));
-    i = my_read(index_file, (uchar *)&ndx->pos, sizeof(long long), MYF(0));
-    i = my_read(index_file, (uchar *)&ndx->length, sizeof(int), MYF(0));
-    if (i != 0)
-      insert_key(ndx, false);
+    p = uint4korr(frame + 4);
+    cache.release_page(frame, false);
+    if ((p == 0) || ((frame = cache.get_page(p, false)) == NULL))
+      return false;
+    s = 0;
   }
-  DBUG_RETURN(0);
+  cache.release_page(frame, false);
+  *page = p;
+  *slot = s;
+  return true;
 }
 
-/* get current position of index file */
-long long Spartan_index::curfpos()
+/* build a leaf entry (the key is padded with zeros) */
+void Spartan_index::make_entry(uchar *entry, uchar *key, int key_len,
+                               long long pos)
 {
-  long long pos = 0;
-
-  DBUG_ENTER("Spartan_index::curfpos");
-  pos = my_seek(index_file, 0l, MY_SEEK_CUR, MYF(0));
-  DBUG_RETURN(pos);
+  if (key_len > max_key_len)
+    key_len = max_key_len;
+  memset(entry, 0, block_size);
+  memcpy(entry, key, key_len);
+  int8store(entry + max_key_len, pos);
+  int4store(entry + max_key_len + sizeof(long long), key_len);
 }
 
-/* write the index back to disk */
-int Spartan_index::save_index()
+/* get a page for the tree, reusing a free page when there is one */
+uint32 Spartan_index::alloc_page()
 {
-  SDE_NDX_NODE *n = NULL;
-  int i;
-  
-  DBUG_ENTER("Spartan_index::save_index");
-  i = my_chsize(index_file, 0L, '\n', MYF(MY_WME));
-  write_header();
-  n = root;
-  while (n != NULL)
+  uchar *frame;
+  uint32 page;
+
+  DBUG_ENTER("Spartan_index::alloc_page");
+  if (free_page != 0)
   {
-    write_row(&n->key_ndx);
-    n = n->next;
+    frame = cache.get_page(free_page, false);
+    if (frame == NULL)
+      DBUG_RETURN(0);
+    page = free_page;
+    free_page = uint4korr(frame + 4);
+    cache.release_page(frame, false);
+    DBUG_RETURN(page);
   }
-  DBUG_RETURN(0);
+  DBUG_RETURN(num_pages++);
 }
 
-int Spartan_index::destroy_index()
+/* put a page that is no longer used on the free list */
+int Spartan_index::free_index_page(uint32 page)
 {
-  SDE_NDX_NODE *n = root;
-  
-  DBUG_ENTER("Spartan_index::destroy_index");
-  while (root != NULL)
-  {
-    n = root;
-    root = n->next;    
-    delete n;
-  }
-  root = NULL;
+  uchar *frame;
+
+  DBUG_ENTER("Spartan_index::free_index_page");
+  frame = cache.get_page(page, true);
+  if (frame == NULL)
+    DBUG_RETURN(-1);
+  frame[0] = SDI_PAGE_FREE;
+  int4store(frame + 4, free_page);
+  cache.release_page(frame, true);
+  free_page = page;
   DBUG_RETURN(0);
 }
 
-/* Get the file position of the first key in index */
-long long Spartan_index::get_first_pos()
+/*
+  Split a leaf that an entry does not fit on. The entries, with the new
+  one at slot, are in split_buf. The upper part moves to a new leaf
+  linked in after this one, cut near the middle where both parts fit.
+  When the entry goes at the end of the last leaf nothing moves, so
+  ascending inserts fill their pages. If no cut leaves both parts
+  fitting (a new entry much wider than the rest) the entry gets a leaf
+  of its own between the two halves. The frame of the leaf is released
+  here.
+*/
+int Spartan_index::split_leaf(SDI_PATH *path, uchar *frame, int slot)
 {
-  long long pos = -1;
+  uchar seps[2][sizeof(SDE_INDEX)];
+  SDI_FORMAT fmt;
+  SDI_PATH next_path;
+  uchar *frames[3];
+  uint32 pages[3];
+  uint32 next;
+  int count = uint2korr(frame + 2);
+  int total = count + 1;
+  int cut[4];
+  int pieces = 2;
+  int lo;
+  int hi;
+  int i;
+
+  DBUG_ENTER("Spartan_index::split_leaf");
+  next = uint4korr(frame + 4);
+  cut[0] = 0;
+  if ((slot == count) && (next == 0))
+    cut[1] = count;
+  else
+  {
+    lo = fit_back(split_buf, total, 1, total - 1, false);
+    hi = fit_front(split_buf, 1, total - 1, false);
+    if (lo <= hi)
+      cut[1] = MY_MIN(MY_MAX(total / 2, lo), hi);
+    else
+    {
+      cut[1] = slot;
+      cut[2] = slot + 1;
+      pieces = 3;
+    }
+  }
+  cut[pieces] = total;
+  pages[0] = path->page[path->depth - 1];
+  frames[0] = frame;
+  for (i = 1; i < pieces; i++)
+  {
+    pages[i] = alloc_page();
+    if ((pages[i] == 0) ||
+        ((frames[i] = cache.get_page(pages[i], true)) == NULL))
+    {
+      while (--i >= 0)
+        cache.release_page(frames[i], false);
+      DBUG_RETURN(-1);
+    }
+  }
+  for (i = 0; i < pieces; i++)
+  {
+    frames[i][0] = SDI_PAGE_LEAF;
+    int4store(frames[i] + 4, (i + 1 < pieces) ? pages[i + 1] : next);
+    if (i > 0)
+    {
+      int4store(frames[i] + 8, pages[i - 1]);
+      make_separator(seps[i - 1],
+                     split_buf + (size_t)(cut[i] - 1) * node_size,
+                     split_buf + (size_t)cut[i] * node_size);
+    }
+    packed_size(split_buf + (size_t)cut[i] * node_size, cut[i + 1] - cut[i],
+                false, &fmt);
+    pack_page(frames[i], split_buf + (size_t)cut[i] * node_size, &fmt);
+    cache.release_page(frames[i], true);
+  }
+  if (next != 0)
+  {
+    if ((frame = cache.get_page(next, false)) == NULL)
+      DBUG_RETURN(-1);
+    int4store(frame + 8, pages[pieces - 1]);
+    cache.release_page(frame, true);
+  }
+  else
+    tail_leaf = pages[pieces - 1];
+  if (insert_in_parent(path, path->depth - 2, seps[0], pages[1]))
+    DBUG_RETURN(-1);
+  if (pieces == 2)
+    DBUG_RETURN(0);
+  /*
+    The parent may have split, so find the path to the entry's leaf
+    again to add the leaf after it.
+  */
+  if (find_leaf(seps[1], uint4korr(seps[1] + max_key_len + sizeof(long long)),
+                sint8korr(seps[1] + max_key_len), &next_path) != pages[1])
+    DBUG_RETURN(-1);
+  DBUG_RETURN(insert_in_parent(&next_path, next_path.depth - 2, seps[1],
+                               pages[2]));
+}
+
+/*
+  Add the separator for a new child (created by a split of the child
+  taken at path level) to the inner node at that level. A full node is
+  split in turn and an entry near the middle moves up; a split of the
+  root grows the tree by one level.
+*/
+int Spartan_index::insert_in_parent(SDI_PATH *path, int level, uchar *sep,
+                                    uint32 child)
+{
+  uchar entry[sizeof(SDE_INDEX) + sizeof(uint32)];
+  SDI_FORMAT fmt;
+  uchar *frame;
+  uchar *nframe;
+  uint32 page;
+  uint32 new_page;
+  int total;
+  int slot;
+  int lo;
+  int hi;
+  int m;
+  int rc;
+
+  DBUG_ENTER("Spartan_index::insert_in_parent");
+  memcpy(entry, sep, block_size);
+  int4store(entry + block_size, child);
+  if (level < 0)
+  {
+    page = alloc_page();
+    if ((page == 0) || ((frame = cache.get_page(page, true)) == NULL))
+      DBUG_RETURN(-1);
+    frame[0] = SDI_PAGE_NODE;
+    int4store(frame + 4, root_page);
+    packed_size(entry, 1, true, &fmt);
+    pack_page(frame, entry, &fmt);
+    cache.release_page(frame, true);
+    root_page = page;
+    height++;
+    DBUG_RETURN(0);
+  }
+  page = path->page[level];
+  if ((frame = cache.get_page(page, false)) == NULL)
+    DBUG_RETURN(-1);
+  slot = path->child[level];
+  if ((rc = insert_slot(frame, slot, entry)) <= 0)
+  {
+    cache.release_page(frame, rc == 0);
+    DBUG_RETURN(rc);
+  }
+  new_page = alloc_page();
+  if ((new_page == 0) || ((nframe = cache.get_page(new_page, true)) == NULL))
+  {
+    cache.release_page(frame, false);
+    DBUG_RETURN(-1);
+  }
+  total = uint2korr(frame + 2) + 1;
+  /*
+    Entry m moves up. Its child becomes the first child of the new node.
+    Moving the new entry up always leaves two parts that fit, as each is
+    part of the old node.
+  */
+  lo = fit_back(split_buf, total, 2, total - 1, true) - 1;
+  hi = fit_front(split_buf, 1, total - 2, true);
+  m = (lo <= hi) ? MY_MIN(MY_MAX(total / 2, lo), hi) : slot;
+  packed_size(split_buf, m, true, &fmt);
+  pack_page(frame, split_buf, &fmt);
+  memcpy(entry, split_buf + (size_t)m * node_size, node_size);
+  nframe[0] = SDI_PAGE_NODE;
+  int4store(nframe + 4, uint4korr(entry + block_size));
+  packed_size(split_buf + (size_t)(m + 1) * node_size, total - m - 1, true,
+              &fmt);
+  pack_page(nframe, split_buf + (size_t)(m + 1) * node_size, &fmt);
+  cache.release_page(frame, true);
+  cache.release_page(nframe, true);
+  DBUG_RETURN(insert_in_parent(path, level - 1, entry, new_page));
+}
+
+/* insert a key into the index */
+int Spartan_index::insert_key(SDE_INDEX *ndx, bool allow_dupes)
+{
+  uchar entry[sizeof(SDE_INDEX)];
+  SDI_FORMAT fmt;
+  SDI_PATH path;
+  uchar *frame;
+  uint32 page;
+  int slot;
+  int dupe;
+  int rc;
+  bool check;
+
+  DBUG_ENTER("Spartan_index::insert_key");
+  if (lsm != NULL)
+    DBUG_RETURN(lsm->insert_key(ndx, allow_dupes));
+  /*
+    If dupes not allowed, stop and return -1 when the key is found. A
+    key the bloom filter has not seen is not looked for.
+  */
+  check = !allow_dupes && !bloom_excludes(ndx->key, ndx->length);
+  if (check && (art != NULL))
+  {
+    if (compare_leaf(ndx->key, ndx->length,
+                     art->lower_bound(ndx->key, ndx->length, -1)) == 0)
+      DBUG_RETURN(-1);
+  }
+  else if (check &&
+           find_entry(ndx->key, ndx->length, -1, &page, &slot))
+  {
+    if ((frame = cache.get_page(page, false)) == NULL)
+      DBUG_RETURN(-1);
+    read_format(frame, &fmt);
+    dupe = (compare_slot_key(frame, &fmt, slot, ndx->key, ndx->length) == 0);
+    cache.release_page(frame, false);
+    if (dupe)
+      DBUG_RETURN(-1);
+  }
+  /*
+    If this is a new index, the first key goes in a root leaf.
+  */
+  if (root_page == 0)
+  {
+    page = alloc_page();
+    if ((page == 0) || ((frame = cache.get_page(page, true)) == NULL))
+      DBUG_RETURN(-1);
+    frame[0] = SDI_PAGE_LEAF;
+    cache.release_page(frame, true);
+    root_page = page;
+    first_leaf = page;
+    tail_leaf = page;
+    height = 1;
+  }
+  /* the key's first entry may be the new one */
+  hash.remove_key(ndx->key, ndx->length);
+  make_entry(entry, ndx->key, ndx->length, ndx->pos);
+  page = find_leaf(ndx->key, ndx->length, ndx->pos, &path);
+  if ((page == 0) || ((frame = cache.get_page(page, false)) == NULL))
+    DBUG_RETURN(-1);
+  slot = search_page(frame, ndx->key, ndx->length, ndx->pos);
+  if ((rc = insert_slot(frame, slot, entry)) < 0)
+  {
+    cache.release_page(frame, false);
+    DBUG_RETURN(-1);
+  }
+  if (rc == 0)
+    cache.release_page(frame, true);
+  else if (split_leaf(&path, frame, slot))
+    DBUG_RETURN(-1);
+  num_keys++;
+  changes++;
+  bloom.add_key(ndx->key, MY_MIN(ndx->length, max_key_len));
+  if (bloom.is_full())
+    build_bloom();
+  if (art != NULL)
+  {
+    art_write_begin();
+    rc = art->insert(ndx->key, ndx->length, ndx->pos);
+    art_write_end();
+    if ((rc < 0) || (art->memory_used() > art_limit) ||
+        Spartan_slab::over_limit())
+      drop_art();
+  }
+  DBUG_RETURN(1);
+}
+
+/*
+  Merge the page at path level with a sibling if it has fallen below a
+  quarter full and the two fit in one page, then check the parent. A
+  root node left with a single child is removed.
+*/
+int Spartan_index::rebalance(SDI_PATH *path, int level)
+{
+  SDI_FORMAT fmt;
+  uchar *frame;
+  uchar *pframe;
+  uchar *lframe;
+  uchar *rframe;
+  uint32 page = path->page[level];
+  uint32 left;
+  uint32 right;
+  uint32 next;
+  bool is_leaf;
+  int used;
+  int pcount;
+  int sep;
+  int c;
+  int n;
+
+  DBUG_ENTER("Spartan_index::rebalance");
+  if ((frame = cache.get_page(page, false)) == NULL)
+    DBUG_RETURN(-1);
+  read_format(frame, &fmt);
+  used = format_size(&fmt);
+  is_leaf = !fmt.node;
+  if (level == 0)
+  {
+    if (!is_leaf && (fmt.count == 0))
+    {
+      root_page = node_child(frame, 0);
+      height--;
+      cache.release_page(frame, false);
+      DBUG_RETURN(free_index_page(page));
+    }
+    cache.release_page(frame, false);
+    DBUG_RETURN(0);
+  }
+  cache.release_page(frame, false);
+  if (used * 4 >= SDI_PAGE_SIZE)
+    DBUG_RETURN(0);
+  if ((pframe = cache.get_page(path->page[level - 1], false)) == NULL)
+    DBUG_RETURN(-1);
+  pcount = uint2korr(pframe + 2);
+  c = path->child[level - 1];
+  if (pcount == 0)
+  {
+    cache.release_page(pframe, false);
+    DBUG_RETURN(0);
+  }
+  /*
+    Merge into the left sibling, or pull the right sibling into the
+    first child. sep is the parent entry in front of the right page.
+  */
+  if (c > 0)
+  {
+    sep = c - 1;
+    left = node_child(pframe, c - 1);
+    right = page;
+  }
+  else
+  {
+    sep = 0;
+    left = page;
+    right = node_child(pframe, 1);
+  }
+  lframe = cache.get_page(left, false);
+  rframe = (lframe != NULL) ? cache.get_page(right, false) : NULL;
+  if ((rframe == NULL) ||
+      reserve_split(uint2korr(lframe + 2) + uint2korr(rframe + 2) + 1))
+  {
+    if (rframe != NULL)
+      cache.release_page(rframe, false);
+    if (lframe != NULL)
+      cache.release_page(lframe, false);
+    cache.release_page(pframe, false);
+    DBUG_RETURN(-1);
+  }
+  n = unpack_page(lframe, split_buf);
+  if (!is_leaf)
+  {
+    /* the separator comes down in front of the right page's children */
+    read_format(pframe, &fmt);
+    unpack_entry(pframe, &fmt, sep, split_buf + (size_t)n * node_size);
+    int4store(split_buf + (size_t)n * node_size + block_size,
+              node_child(rframe, 0));
+    n++;
+  }
+  n += unpack_page(rframe, split_buf + (size_t)n * node_size);
+  if (packed_size(split_buf, n, !is_leaf, &fmt) > SDI_PAGE_SIZE)
+  {
+    cache.release_page(rframe, false);
+    cache.release_page(lframe, false);
+    cache.release_page(pframe, false);
+    DBUG_RETURN(0);
+  }
+  pack_page(lframe, split_buf, &fmt);
+  if (is_leaf)
+  {
+    next = uint4korr(rframe + 4);
+    int4store(lframe + 4, next);
+  }
+  else
+    next = 0;
+  delete_slot(pframe, sep);
+  cache.release_page(rframe, false);
+  cache.release_page(lframe, true);
+  cache.release_page(pframe, true);
+  if (next != 0)
+  {
+    if ((frame = cache.get_page(next, false)) == NULL)
+      DBUG_RETURN(-1);
+    int4store(frame + 8, left);
+    cache.release_page(frame, true);
+  }
+  else if (is_leaf)
+    tail_leaf = left;
+  if (free_index_page(right))
+    DBUG_RETURN(-1);
+  DBUG_RETURN(rebalance(path, level - 1));
+}
+
+/* remove the entry that matches key and pos exactly */
+int Spartan_index::remove_entry(uchar *key, int key_len, long long pos)
+{
+  SDI_FORMAT fmt;
+  SDI_PATH path;
+  uchar *frame;
+  uint32 page;
+  int slot;
+  int rc;
+
+  DBUG_ENTER("Spartan_index::remove_entry");
+  page = find_leaf(key, key_len, pos, &path);
+  if ((page == 0) || ((frame = cache.get_page(page, false)) == NULL))
+    DBUG_RETURN(-1);
+  slot = search_page(frame, key, key_len, pos);
+  read_format(frame, &fmt);
+  if ((slot >= (int)fmt.count) ||
+      (compare_slot(frame, &fmt, slot, key, key_len, pos) != 0))
+  {
+    cache.release_page(frame, false);
+    DBUG_RETURN(-1);
+  }
+  delete_slot(frame, slot);
+  cache.release_page(frame, true);
+  num_keys--;
+  changes++;
+  hash.remove_key(key, key_len);
+  if (art != NULL)
+    art_remove(key, key_len, pos);
+  rc = rebalance(&path, path.depth - 1);
+  /* deleted keys stay in the filter until it is built again */
+  if (bloom.is_enabled() &&
+      (++bloom_deletes > (ulonglong)MY_MAX(num_keys, 2048) / 2))
+    build_bloom();
+  DBUG_RETURN(rc);
+}
+
+/* delete a key from the index. Note:
+   position is included for indexes that allow dupes.
+   Returns -1 if the entry for the row at pos is not there or cannot
+   be removed; a key without a position that is not there is no error */
+int Spartan_index::delete_key(uchar *buf, long long pos, int key_len)
+{
+  SDE_ART_LEAF *leaf;
+  SDI_FORMAT fmt;
+  uchar *frame;
+  uint32 page;
+  int slot;
+  bool found;
+
+  DBUG_ENTER("Spartan_index::delete_key");
+  if (lsm != NULL)
+    DBUG_RETURN(lsm->delete_key(buf, pos, key_len));
+  /*
+    Without a position delete the first entry with the key.
+  */
+  if ((pos == -1) && (art != NULL))
+  {
+    leaf = art->lower_bound(buf, key_len, -1);
+    if (compare_leaf(buf, key_len, leaf) != 0)
+      DBUG_RETURN(0);
+    pos = leaf->pos;
+  }
+  else if (pos == -1)
+  {
+    if (!find_entry(buf, key_len, -1, &page, &slot) ||
+        ((frame = cache.get_page(page, false)) == NULL))
+      DBUG_RETURN(0);
+    read_format(frame, &fmt);
+    found = (compare_slot_key(frame, &fmt, slot, buf, key_len) == 0);
+    if (found)
+      pos = entry_pos(frame, &fmt, slot);
+    cache.release_page(frame, false);
+    if (!found)
+      DBUG_RETURN(0);
+  }
+  DBUG_RETURN(remove_entry(buf, key_len, pos));
+}
+
+/*
+  Change the key of the entry for the row at pos. The entry with the old
+  key is removed and the new key is inserted in its place in key order.
+  Returns -1 if either step fails.
+*/
+int Spartan_index::update_key(uchar *old_key, uchar *buf, long long pos,
+                              int key_len)
+{
+  SDE_INDEX ndx;
+
+  DBUG_ENTER("Spartan_index::update_key");
+  if (lsm != NULL)
+  {
+    if (lsm->delete_key(old_key, pos, key_len))
+      DBUG_RETURN(-1);
+    key_len = MY_MIN(key_len, max_key_len);
+    memcpy(ndx.key, buf, key_len);
+    ndx.pos = pos;
+    ndx.length = key_len;
+    DBUG_RETURN((lsm->insert_key(&ndx, true) < 0) ? -1 : 0);
+  }
+  if (remove_entry(old_key, key_len, pos))
+    DBUG_RETURN(-1);
+  if (key_len > max_key_len)
+    key_len = max_key_len;
+  memcpy(ndx.key, buf, key_len);
+  ndx.pos = pos;
+  ndx.length = key_len;
+  DBUG_RETURN((insert_key(&ndx, true) < 0) ? -1 : 0);
+}
+
+/*
+  Estimate the share of the entries that sort before key (padded with
+  zeros). The key is looked up from the root and on each page narrows
+  the part of the index it lies in to the share of the child it falls
+  in, taking the subtrees of a node to hold equal numbers of entries.
+  The leaf and slot the key falls on are returned as well.
+*/
+double Spartan_index::key_fraction(uchar *key, int key_len, uint32 *leaf,
+                                   int *slot)
+{
+  double lo = 0.0;
+  double width = 1.0;
+  uint32 page = root_page;
+  uchar *frame;
+  int level;
+  int count;
+  int i;
+
+  *leaf = 0;
+  *slot = 0;
+  for (level = 0; (page != 0) && (level < SDI_MAX_HEIGHT); level++)
+  {
+    if ((frame = cache.get_page(page, false)) == NULL)
+      break;
+    count = uint2korr(frame + 2);
+    i = search_page(frame, key, key_len, -1);
+    if (frame[0] != SDI_PAGE_NODE)
+    {
+      if (count > 0)
+        lo += width * i / count;
+      *leaf = page;
+      *slot = i;
+      cache.release_page(frame, false);
+      break;
+    }
+    width /= count + 1;
+    lo += width * i;
+    page = node_child(frame, i);
+    cache.release_page(frame, false);
+  }
+  return lo;
+}
+
+/*
+  Estimate the number of entries from the first entry not before
+  min_key up to the first entry not before max_key, where a NULL key
+  stands for the start or the end of the index. This reads one page per
+  level for each key. Keys that fall on the same leaf are counted
+  exactly.
+*/
+long long Spartan_index::range_size(uchar *min_key, int min_len,
+                                    uchar *max_key, int max_len)
+{
+  uint32 min_leaf = 0;
+  uint32 max_leaf = 0;
+  int min_slot = 0;
+  int max_slot = 0;
+  double lo = 0.0;
+  double hi = 1.0;
+
+  DBUG_ENTER("Spartan_index::range_size");
+  if (lsm != NULL)
+    DBUG_RETURN(lsm->range_size(min_key, min_len, max_key, max_len));
+  if (min_key != NULL)
+    lo = key_fraction(min_key, min_len, &min_leaf, &min_slot);
+  if (max_key != NULL)
+    hi = key_fraction(max_key, max_len, &max_leaf, &max_slot);
+  if ((min_key != NULL) && (max_key != NULL) && (min_leaf == max_leaf))
+    DBUG_RETURN((max_slot > min_slot) ? max_slot - min_slot : 0);
+  if (hi <= lo)
+    DBUG_RETURN(0);
+  DBUG_RETURN((long long)((hi - lo) * num_keys + 0.5));
+}
+
+/*
+  Estimate how many entries share each of the key prefixes whose lengths
+  are given (shortest first). SDI_SAMPLE_PAGES leaves spread evenly over
+  the index are read, and on each the entries that start a new prefix
+  are counted. per_prefix[j] is set to the entries per distinct value of
+  the first prefix_len[j] bytes, at least 1.
+*/
+void Spartan_index::sample_prefixes(uint *prefix_len, uint parts,
+                                    double *per_prefix)
+{
+  uchar key[2][sizeof(SDE_INDEX)];
+  double *distinct = per_prefix;   /* counted in place */
+  double entries = 0.0;
+  SDI_FORMAT fmt;
+  long long pos;
+  uint32 page;
+  uchar *frame;
+  double t;
+  int count;
+  int len;
+  int level;
+  int s;
+  int i;
+  uint j;
+
+  DBUG_ENTER("Spartan_index::sample_prefixes");
+  if (lsm != NULL)
+  {
+    lsm->sample_prefixes(prefix_len, parts, per_prefix);
+    DBUG_VOID_RETURN;
+  }
+  for (j = 0; j < parts; j++)
+    distinct[j] = 0.0;
+  for (s = 0; (s < SDI_SAMPLE_PAGES) && (root_page != 0); s++)
+  {
+    /* leaf s of SDI_SAMPLE_PAGES evenly spaced through the index */
+    t = (s + 0.5) / SDI_SAMPLE_PAGES;
+    page = root_page;
+    for (level = 0; (page != 0) && (level < SDI_MAX_HEIGHT); level++)
+    {
+      if ((frame = cache.get_page(page, false)) == NULL)
+        DBUG_VOID_RETURN;
+      if (frame[0] != SDI_PAGE_NODE)
+        break;
+      count = uint2korr(frame + 2) + 1;
+      i = MY_MIN((int)(t * count), count - 1);
+      t = t * count - i;
+      page = node_child(frame, i);
+      cache.release_page(frame, false);
+    }
+    if ((page == 0) || (level == SDI_MAX_HEIGHT))
+      break;
+    read_format(frame, &fmt);
+    for (i = 0; i < (int)fmt.count; i++)
+    {
+      read_entry(frame, &fmt, i, key[i & 1], &len, &pos);
+      for (j = 0; j < parts; j++)
+        if ((i == 0) ||
+            (memcmp(key[i & 1], key[(i - 1) & 1], prefix_len[j]) != 0))
+          distinct[j]++;
+    }
+    entries += fmt.count;
+    cache.release_page(frame, false);
+  }
+  for (j = 0; j < parts; j++)
+    per_prefix[j] = (distinct[j] > 0.0) ? entries / distinct[j] : 1.0;
+  DBUG_VOID_RETURN;
+}
+
+/* get the file position of the first row with the key, -1 if none */
+long long Spartan_index::get_index_pos(uchar *buf, int key_len)
+{
+  SDE_ART_LEAF *leaf;
+  SDI_FORMAT fmt;
+  uchar *frame;
+  uint32 page;
+  int slot;
+  long long pos = -1;
+
+  DBUG_ENTER("Spartan_index::get_index_pos");
+  if (lsm != NULL)
+  {
+    SDI_CURSOR cursor;
+    SDE_INDEX *ndx = lsm->cursor_seek(&cursor, buf, key_len);
+    DBUG_RETURN((ndx != NULL) ? ndx->pos : -1);
+  }
+  if (bloom_excludes(buf, key_len))
+    DBUG_RETURN(-1);
+  if (art != NULL)
+  {
+    leaf = art->lower_bound(buf, key_len, -1);
+    if (compare_leaf(buf, key_len, leaf) == 0)
+      pos = leaf->pos;
+    DBUG_RETURN(pos);
+  }
+  if (find_entry(buf, key_len, -1, &page, &slot) &&
+      ((frame = cache.get_page(page, false)) != NULL))
+  {
+    read_format(frame, &fmt);
+    if (compare_slot_key(frame, &fmt, slot, buf, key_len) == 0)
+      pos = entry_pos(frame, &fmt, slot);
+    cache.release_page(frame, false);
+  }
+  DBUG_RETURN(pos);
+}
+
+/*
+  Index cursors.
+
+  A cursor belongs to its caller, not to the index, so any number of
+  scans can be open at once. It remembers the entry it is on and where
+  that entry was found: a leaf of the radix tree, or a leaf page and
+  slot of the B+tree. The location is trusted only while the index has
+  not changed since it was found (cursor->version == changes). After a
+  change the entry is looked up again by key and row position, which
+  also copes with the entry itself having been deleted.
+
+  Every cursor call returns the entry the cursor moved to, copied into
+  the cursor, or NULL when there is no such entry. Nothing is allocated.
+*/
+
+/* unpack the entry at the cursor's location into the cursor */
+SDE_INDEX *Spartan_index::cursor_entry(SDI_CURSOR *cursor, uchar *frame,
+                                       int slot)
+{
+  SDI_FORMAT fmt;
+
+  read_format(frame, &fmt);
+  read_entry(frame, &fmt, slot, cursor->ndx.key, &cursor->ndx.length,
+             &cursor->ndx.pos);
+  return &cursor->ndx;
+}
+
+/*
+  Find the cursor's entry again after the index has changed. The cursor
+  is left on the first entry not less than it (or past the end). Returns
+  true if that is the entry itself.
+*/
+bool Spartan_index::cursor_locate(SDI_CURSOR *cursor)
+{
+  SDE_INDEX *ndx = &cursor->ndx;
+  SDI_FORMAT fmt;
+  uchar *frame;
+  bool found = false;
+
+  cursor->version = changes;
+  if (art != NULL)
+  {
+    cursor->leaf = art->lower_bound(ndx->key, ndx->length, ndx->pos);
+    return (cursor->leaf != NULL) && (cursor->leaf->pos == ndx->pos) &&
+           (compare_leaf(ndx->key, ndx->length, cursor->leaf) == 0);
+  }
+  if (!find_entry(ndx->key, ndx->length, ndx->pos, &cursor->page,
+                  &cursor->slot))
+  {
+    cursor->page = 0;
+    return false;
+  }
+  if ((frame = cache.get_page(cursor->page, false)) != NULL)
+  {
+    read_format(frame, &fmt);
+    found = (compare_slot(frame, &fmt, cursor->slot, ndx->key, ndx->length,
+                          ndx->pos) == 0);
+    cache.release_page(frame, false);
+  }
+  return found;
+}
+
+/*
+  Move the cursor by step entries (-1, 0 or 1) from its location and
+  return the entry it lands on. A step of 0 only skips forward over the
+  end of a page. Stepping back from past the end gives the last entry.
+*/
+SDE_INDEX *Spartan_index::cursor_move(SDI_CURSOR *cursor, int step)
+{
+  SDE_INDEX *ndx = NULL;
+  uchar *frame;
+  uint32 page;
+
+  if (art != NULL)
+  {
+    if (step > 0)
+      cursor->leaf = (cursor->leaf != NULL) ? cursor->leaf->next : NULL;
+    else if (step < 0)
+      cursor->leaf = (cursor->leaf != NULL) ? cursor->leaf->prev :
+                                              art->last();
+    if (cursor->leaf == NULL)
+    {
+      cursor->version = 0;
+      return NULL;
+    }
+    memcpy(cursor->ndx.key, cursor->leaf->key, max_key_len);
+    cursor->ndx.pos = cursor->leaf->pos;
+    cursor->ndx.length = cursor->leaf->length;
+    return &cursor->ndx;
+  }
+  if ((cursor->page == 0) && (step < 0))
+  {
+    cursor->page = last_leaf();
+    cursor->slot = INT_MAX;
+  }
+  if ((cursor->page == 0) ||
+      ((frame = cache.get_page(cursor->page, false)) == NULL))
+  {
+    cursor->version = 0;
+    return NULL;
+  }
+  cursor->slot = MY_MIN(cursor->slot, (int)uint2korr(frame + 2)) + step;
+  while (cursor->slot >= uint2korr(frame + 2))
+  {
+    page = uint4korr(frame + 4);
+    cache.release_page(frame, false);
+    if ((page == 0) || ((frame = cache.get_page(page, false)) == NULL))
+    {
+      cursor->page = 0;
+      cursor->version = 0;
+      return NULL;
+    }
+    cursor->page = page;
+    cursor->slot = 0;
+  }
+  while (cursor->slot < 0)
+  {
+    page = uint4korr(frame + 8);
+    cache.release_page(frame, false);
+    if ((page == 0) || ((frame = cache.get_page(page, false)) == NULL))
+    {
+      cursor->page = 0;
+      cursor->version = 0;
+      return NULL;
+    }
+    cursor->page = page;
+    cursor->slot = uint2korr(frame + 2) - 1;
+  }
+  ndx = cursor_entry(cursor, frame, cursor->slot);
+  cache.release_page(frame, false);
+  return ndx;
+}
+
+/*
+  The rightmost leaf page of the tree. It is kept in tail_leaf as splits
+  and merges change it; if that is not known, or is no longer a leaf
+  at the end of the chain, the tree is descended along its right edge.
+*/
+uint32 Spartan_index::last_leaf()
+{
+  uchar *frame;
+  uint32 page = root_page;
+  uint32 child;
+  bool tail;
+
+  if ((tail_leaf != 0) && (tail_leaf < num_pages) &&
+      ((frame = cache.get_page(tail_leaf, false)) != NULL))
+  {
+    tail = (frame[0] == SDI_PAGE_LEAF) && (uint4korr(frame + 4) == 0);
+    cache.release_page(frame, false);
+    if (tail)
+      return tail_leaf;
+  }
+  tail_leaf = 0;
+  while ((page != 0) && ((frame = cache.get_page(page, false)) != NULL))
+  {
+    if (frame[0] == SDI_PAGE_LEAF)
+    {
+      cache.release_page(frame, false);
+      tail_leaf = page;
+      return page;
+    }
+    child = node_child(frame, uint2korr(frame + 2));
+    cache.release_page(frame, false);
+    page = child;
+  }
+  return 0;
+}
+
+/*
+  Position the cursor on the first entry whose key is not before key
+  (padded with zeros), NULL if there is none.
+*/
+SDE_INDEX *Spartan_index::cursor_lower_bound(SDI_CURSOR *cursor, uchar *key,
+                                             int key_len)
+{
+  DBUG_ENTER("Spartan_index::cursor_lower_bound");
+  if (lsm != NULL)
+    DBUG_RETURN(lsm->cursor_lower_bound(cursor, key, key_len));
+  cursor_set(cursor, key, key_len, -1);
+  cursor_locate(cursor);
+  DBUG_RETURN(cursor_move(cursor, 0));
+}
+
+/*
+  Add the keys of a leaf that lookups keep ending on to the hash index,
+  each with the position of its first entry. A key that goes on from
+  the previous leaf starts there and is left out.
+*/
+void Spartan_index::hash_leaf(uint32 page)
+{
+  uchar key[SDI_MAX_KEY_LEN];
+  uchar last[SDI_MAX_KEY_LEN];
+  SDI_FORMAT fmt;
+  uchar *frame;
+  uint32 prev;
+  long long pos;
+  int last_len = -1;
+  int length;
+  uint i;
+
+  if ((frame = cache.get_page(page, false)) == NULL)
+    return;
+  prev = uint4korr(frame + 8);
+  cache.release_page(frame, false);
+  if ((prev != 0) && ((frame = cache.get_page(prev, false)) != NULL))
+  {
+    read_format(frame, &fmt);
+    if (fmt.count > 0)
+      read_entry(frame, &fmt, fmt.count - 1, last, &last_len, &pos);
+    cache.release_page(frame, false);
+  }
+  if ((frame = cache.get_page(page, false)) == NULL)
+    return;
+  read_format(frame, &fmt);
+  for (i = 0; i < fmt.count; i++)
+  {
+    read_entry(frame, &fmt, i, key, &length, &pos);
+    if ((last_len < 0) || (compare_key(key, length, last, last_len) != 0))
+      hash.add_key(key, length, pos);
+    memcpy(last, key, max_key_len);
+    last_len = length;
+  }
+  cache.release_page(frame, false);
+}
+
+/*
+  Build the bloom filter from the keys of the leaves, sized for twice
+  as many keys as the index has so it can grow before it is built
+  again. The leaves are read in the order they are chained. If there is
+  no memory for it the index goes without a filter.
+*/
+int Spartan_index::build_bloom()
+{
+  uchar key[SDI_MAX_KEY_LEN];
+  SDI_FORMAT fmt;
+  uchar *frame;
+  uint32 page;
+  uint32 next;
+  long long pos;
+  int length;
+  uint i;
+
+  DBUG_ENTER("Spartan_index::build_bloom");
+  bloom_deletes = 0;
+  if ((lsm != NULL) || (bloom_bits == 0) ||
+      bloom.init_bloom((ulonglong)num_keys * 2, bloom_bits))
+  {
+    bloom.destroy_bloom();
+    DBUG_RETURN(0);
+  }
+  for (page = (root_page != 0) ? first_leaf : 0; page != 0; page = next)
+  {
+    if ((page >= num_pages) || ((frame = cache.get_page(page, false)) == NULL))
+    {
+      bloom.destroy_bloom();
+      DBUG_RETURN(-1);
+    }
+    read_format(frame, &fmt);
+    for (i = 0; i < fmt.count; i++)
+    {
+      read_entry(frame, &fmt, i, key, &length, &pos);
+      bloom.add_key(key, length);
+    }
+    next = uint4korr(frame + 4);
+    cache.release_page(frame, false);
+  }
+  DBUG_RETURN(0);
+}
+
+/* true if the bloom filter says key (padded with zeros) is not indexed */
+bool Spartan_index::bloom_excludes(uchar *key, int key_len)
+{
+  return (lsm == NULL) && !bloom.may_contain(key, MY_MIN(key_len,
+                                                         max_key_len));
+}
+
+/*
+  Position the cursor on the first entry with key. A key in the hash
+  index puts the cursor on its entry without a search (cursor->hashed);
+  the entry is found in the tree if the cursor is moved.
+*/
+SDE_INDEX *Spartan_index::cursor_seek(SDI_CURSOR *cursor, uchar *key,
+                                      int key_len)
+{
+  SDE_INDEX *ndx;
+  long long pos;
+  int length;
+
+  DBUG_ENTER("Spartan_index::cursor_seek");
+  cursor->hashed = false;
+  if (lsm != NULL)
+    DBUG_RETURN(lsm->cursor_seek(cursor, key, key_len));
+  if (bloom_excludes(key, key_len))
+  {
+    cursor_set(cursor, key, key_len, -1);
+    DBUG_RETURN(NULL);
+  }
+  if (hash_enabled() && hash.find_key(key, key_len, &pos, &length))
+  {
+    cursor_set(cursor, key, key_len, pos);
+    cursor->ndx.length = length;
+    cursor->hashed = true;
+    DBUG_RETURN(&cursor->ndx);
+  }
+  ndx = cursor_lower_bound(cursor, key, key_len);
+  if ((ndx != NULL) &&
+      (compare_key(key, key_len, ndx->key, ndx->length) != 0))
+  {
+    cursor->version = 0;
+    ndx = NULL;
+  }
+  if ((ndx != NULL) && hash_enabled() && hash.note_lookup(cursor->page))
+    hash_leaf(cursor->page);
+  DBUG_RETURN(ndx);
+}
+
+/*
+  Put the cursor on the entry (key, pos) without looking it up, for a
+  caller that found the entry some other way (see lookup_pos()). The
+  next cursor_next() or cursor_prev() finds it.
+*/
+void Spartan_index::cursor_set(SDI_CURSOR *cursor, uchar *key, int key_len,
+                               long long pos)
+{
+  if (key_len > max_key_len)
+    key_len = max_key_len;
+  memset(cursor->ndx.key, 0, max_key_len);
+  memcpy(cursor->ndx.key, key, key_len);
+  cursor->ndx.pos = pos;
+  cursor->ndx.length = key_len;
+  cursor->version = 0;
+}
+
+/* position the cursor on the first entry of the index */
+SDE_INDEX *Spartan_index::cursor_first(SDI_CURSOR *cursor)
+{
+  DBUG_ENTER("Spartan_index::cursor_first");
+  if (lsm != NULL)
+    DBUG_RETURN(lsm->cursor_first(cursor));
+  cursor->version = changes;
+  cursor->leaf = (art != NULL) ? art->first() : NULL;
+  cursor->page = first_leaf;
+  cursor->slot = 0;
+  DBUG_RETURN(cursor_move(cursor, 0));
+}
+
+/* position the cursor on the last entry of the index */
+SDE_INDEX *Spartan_index::cursor_last(SDI_CURSOR *cursor)
+{
+  DBUG_ENTER("Spartan_index::cursor_last");
+  if (lsm != NULL)
+    DBUG_RETURN(lsm->cursor_last(cursor));
+  cursor->version = changes;
+  cursor->leaf = NULL;
+  cursor->page = 0;
+  DBUG_RETURN(cursor_move(cursor, -1));
+}
+
+/* move the cursor to the next entry */
+SDE_INDEX *Spartan_index::cursor_next(SDI_CURSOR *cursor)
+{
+  DBUG_ENTER("Spartan_index::cursor_next");
+  if (lsm != NULL)
+    DBUG_RETURN(lsm->cursor_next(cursor));
+  /*
+    If the entry is gone the cursor is already on the one after it.
+  */
+  if ((cursor->version != changes) && !cursor_locate(cursor))
+    DBUG_RETURN(cursor_move(cursor, 0));
+  DBUG_RETURN(cursor_move(cursor, 1));
+}
+
+/* move the cursor to the previous entry */
+SDE_INDEX *Spartan_index::cursor_prev(SDI_CURSOR *cursor)
+{
+  DBUG_ENTER("Spartan_index::cursor_prev");
+  if (lsm != NULL)
+    DBUG_RETURN(lsm->cursor_prev(cursor));
+  if (cursor->version != changes)
+    cursor_locate(cursor);
+  DBUG_RETURN(cursor_move(cursor, -1));
+}
+
+/*
+  Copy up to max of the entries after the cursor whose keys start with
+  the first key_len bytes of the cursor's key, such as the rest of the
+  rows of a non-unique key, and return how many were copied. The cursor
+  is left on the last entry looked at; a caller that goes on from one
+  of the copies puts the cursor on it with cursor_set().
+*/
+int Spartan_index::cursor_fetch(SDI_CURSOR *cursor, int key_len,
+                                SDE_INDEX *to, int max)
+{
+  uchar key[SDI_MAX_KEY_LEN];
+  SDE_INDEX *ndx;
+  int n = 0;
+
+  DBUG_ENTER("Spartan_index::cursor_fetch");
+  if (key_len > max_key_len)
+    key_len = max_key_len;
+  memcpy(key, cursor->ndx.key, key_len);
+  while ((n < max) && ((ndx = cursor_next(cursor)) != NULL) &&
+         (memcmp(ndx->key, key, key_len) == 0))
+    memcpy(to + n++, ndx, sizeof(SDE_INDEX));
+  DBUG_RETURN(n);
+}
+
+/* close the index writing back any changed pages */
+int Spartan_index::close_index()
+{
+  DBUG_ENTER("Spartan_index::close_index");
+  if (index_file != -1)
+  {
+    save_index();
+    delete lsm;
+    lsm = NULL;
+    drop_art();
+    hash.destroy_hash();
+    bloom.destroy_bloom();
+    cache.destroy_cache();
+    my_close(index_file, MYF(0));
+    index_file = -1;
+  }
+  my_free(page_buf);
+  page_buf = NULL;
+  my_free(split_buf);
+  split_buf = NULL;
+  split_size = 0;
+  DBUG_RETURN(0);
+}
+
+/* remember the first entry of a page for the level above it */
+int Spartan_index::add_separator(uchar *entry, uint32 page)
+{
+  uchar *p;
+  uint32 n;
+
+  DBUG_ENTER("Spartan_index::add_separator");
+  if (bulk_seps_count == bulk_seps_size)
+  {
+    n = bulk_seps_size ? bulk_seps_size * 2 : 256;
+    p = (uchar *)my_realloc(bulk_seps, (size_t)n * node_size,
+                            MYF(MY_WME | MY_ALLOW_ZERO_PTR));
+    if (p == NULL)
+      DBUG_RETURN(-1);
+    bulk_seps = p;
+    bulk_seps_size = n;
+  }
+  p = bulk_seps + (size_t)bulk_seps_count++ * node_size;
+  memcpy(p, entry, block_size);
+  int4store(p + block_size, page);
+  DBUG_RETURN(0);
+}
+
+/*
+  Build the inner nodes bottom up from the separators of the leaves
+  collected by add_separator(). Each level is packed into full nodes and
+  written to new pages until a single page (the root) remains.
+*/
+int Spartan_index::build_levels()
+{
+  SDI_FORMAT fmt;
+  SDI_FORMAT wide;
+  uchar *sep;
+  uint32 n = bulk_seps_count;
+  uint32 out;
+  uint32 i;
+  uint32 group;
+  uint32 page;
+
+  DBUG_ENTER("Spartan_index::build_levels");
+  root_page = 0;
+  height = 0;
+  if (n == 0)
+    DBUG_RETURN(0);
+  height = 1;
+  while (n > 1)
+  {
+    for (i = 0, out = 0; i < n; i += group)
+    {
+      /* the node takes as many of the following separators as fit */
+      sep = bulk_seps + (size_t)i * node_size;
+      format_init(&fmt, true);
+      for (group = 1; i + group < n; group++)
+      {
+        wide = fmt;
+        format_add(&wide, sep + node_size, sep + (size_t)group * node_size);
+        if (format_size(&wide) > SDI_PAGE_SIZE)
+          break;
+        fmt = wide;
+      }
+      page = num_pages++;
+      memset(page_buf, 0, SDI_PAGE_SIZE);
+      page_buf[0] = SDI_PAGE_NODE;
+      int4store(page_buf + 4, uint4korr(sep + block_size));
+      pack_page(page_buf, sep + node_size, &fmt);
+      if (my_pwrite(index_file, page_buf, SDI_PAGE_SIZE,
+                    (my_off_t)page * SDI_PAGE_SIZE, MYF(MY_NABP)))
+        DBUG_RETURN(-1);
+      /* the node is known to the next level by its first separator */
+      memmove(bulk_seps + (size_t)out * node_size, sep, block_size);
+      int4store(bulk_seps + (size_t)out * node_size + block_size, page);
+      out++;
+    }
+    n = out;
+    height++;
+  }
+  root_page = uint4korr(bulk_seps + block_size);
+  bulk_seps_count = 0;
+  DBUG_RETURN(0);
+}
+
+/* rebuild the index from n unpacked entries in key order */
+int Spartan_index::bulk_load(uchar *entries, long long n)
+{
+  uchar *e;
+  long long i;
+  int rc;
+
+  DBUG_ENTER("Spartan_index::bulk_load");
+  rc = bulk_start();
+  for (i = 0, e = entries; (rc == 0) && (i < n); i++, e += block_size)
+    rc = bulk_add(e, (int)uint4korr(e + max_key_len + sizeof(long long)),
+                  sint8korr(e + max_key_len));
+  if (rc == 0)
+    rc = bulk_end();
+  DBUG_RETURN(rc);
+}
+
+/*
+  Read an index file in the original layout and rebuild it as a tree.
+  The entries were saved in key order so they are bulk loaded.
+*/
+int Spartan_index::load_legacy()
+{
+  uchar *entries;
+  uchar *e;
+  my_off_t size;
+  long long pos;
+  long long n;
+  long long i;
+  int len;
+  int rc;
+
+  DBUG_ENTER("Spartan_index::load_legacy");
+  size = my_seek(index_file, 0L, MY_SEEK_END, MYF(0));
+  n = (size > (my_off_t)METADATA_SIZE) ?
+      (long long)(size - METADATA_SIZE) / block_size : 0;
+  entries = (uchar *)my_malloc((size_t)(n * block_size) + 1, MYF(MY_WME));
+  if (entries == NULL)
+    DBUG_RETURN(-1);
+  if ((n > 0) && my_pread(index_file, entries, (size_t)(n * block_size),
+                          METADATA_SIZE, MYF(MY_NABP)))
+  {
+    my_free(entries);
+    DBUG_RETURN(-1);
+  }
+  /* the position and length were written in machine order */
+  for (i = 0, e = entries; i < n; i++, e += block_size)
+  {
+    memcpy(&pos, e + max_key_len, sizeof(long long));
+    memcpy(&len, e + max_key_len + sizeof(long long), sizeof(int));
+    int8store(e + max_key_len, pos);
+    int4store(e + max_key_len + sizeof(long long), len);
+  }
+  rc = bulk_load(entries, n);
+  my_free(entries);
+  legacy = false;
+  DBUG_RETURN(rc);
+}
+
+/*
+  Read the entries of a file written with fixed size entries by walking
+  its leaves and rebuild it with packed pages.
+*/
+int Spartan_index::convert_fixed()
+{
+  uchar *entries;
+  uint32 page;
+  long long n = 0;
+  int count;
+  int rc;
+
+  DBUG_ENTER("Spartan_index::convert_fixed");
+  entries = (uchar *)my_malloc((size_t)(num_keys * block_size) + 1,
+                               MYF(MY_WME));
+  if (entries == NULL)
+    DBUG_RETURN(-1);
+  for (page = first_leaf; page != 0; page = uint4korr(page_buf + 4))
+  {
+    if ((page >= num_pages) ||
+        my_pread(index_file, page_buf, SDI_PAGE_SIZE,
+                 (my_off_t)page * SDI_PAGE_SIZE, MYF(MY_NABP)) ||
+        (n + (count = uint2korr(page_buf + 2)) > num_keys))
+    {
+      crashed = true;
+      my_free(entries);
+      DBUG_RETURN(-1);
+    }
+    memcpy(entries + (size_t)(n * block_size), page_buf + SDI_FIXED_HEADER,
+           (size_t)count * block_size);
+    n += count;
+  }
+  fixed_pages = false;
+  rc = bulk_load(entries, n);
+  my_free(entries);
+  DBUG_RETURN(rc);
+}
+
+/*
+  Prepare the index for use. Only the header is read; the pages of the
+  tree are mapped or read through the page cache as they are needed,
+  unless the index is small enough to load into the radix tree. Older
+  files are converted here.
+*/
+int Spartan_index::load_index()
+{
+  DBUG_ENTER("Spartan_index::load_index");
+  destroy_index();
+  /*
+    First, read the metadata at the front of the index.
+  */
+  read_header();
+  if ((block_size == -1) || (index_file == -1) || (lsm != NULL))
+    DBUG_RETURN(0);
+  if (legacy && load_legacy())
+    DBUG_RETURN(-1);
+  if (fixed_pages && convert_fixed())
+    DBUG_RETURN(-1);
+  cache.map_file();
+  build_bloom();
+  DBUG_RETURN(build_art());
+}
+
+/*
+  Write the index back to disk. The changed pages in the page cache
+  and the header are written.
+*/
+int Spartan_index::save_index()
+{
+  int rc;
+
+  DBUG_ENTER("Spartan_index::save_index");
+  rc = (lsm != NULL) ? lsm->flush_memtable() : cache.flush_cache();
+  if (write_header())
+    rc = -1;
+  DBUG_RETURN(rc);
+}
+
+/* drop the cached pages without writing them */
+int Spartan_index::destroy_index()
+{
+  DBUG_ENTER("Spartan_index::destroy_index");
+  if (lsm != NULL)
+    lsm->clear_memtable();
+  drop_art();
+  hash.clear_hash();
+  bloom.destroy_bloom();
+  cache.discard_cache();
+  tail_leaf = 0;
+  changes++;
+  DBUG_RETURN(0);
+}
+
+/* number of entries in the index */
+long long Spartan_index::key_count()
+{
+  return (lsm != NULL) ? lsm->key_count() : num_keys;
+}
+
+/* remove the run files of an index file kept as sorted runs */
+void Spartan_index::delete_runs(char *path)
+{
+  Spartan_lsm::delete_runs(path);
+}
+
+/* rename the run files of an index file that is being renamed */
+void Spartan_index::rename_runs(char *from, char *to)
+{
+  Spartan_lsm::rename_runs(from, to);
+}
+
+/* Get the file position of the first key in index */
+long long Spartan_index::get_first_pos()
+{
+  SDI_FORMAT fmt;
+  long long pos = -1;
+  uchar *frame;
+  uint32 page = first_leaf;
 
   DBUG_ENTER("Spartan_index::get_first_pos");
-  if (root != NULL)
-    pos = root->key_ndx.pos;
+  if (lsm != NULL)
+  {
+    SDI_CURSOR cursor;
+    SDE_INDEX *ndx = lsm->cursor_first(&cursor);
+    DBUG_RETURN((ndx != NULL) ? ndx->pos : -1);
+  }
+  if (art != NULL)
+    DBUG_RETURN((art->first() != NULL) ? art->first()->pos : pos);
+  while ((page != 0) && ((frame = cache.get_page(page, false)) != NULL))
+  {
+    if (uint2korr(frame + 2) > 0)
+    {
+      read_format(frame, &fmt);
+      pos = entry_pos(frame, &fmt, 0);
+      page = 0;
+    }
+    else
+      page = uint4korr(frame + 4);
+    cache.release_page(frame, false);
+  }
   DBUG_RETURN(pos);
 }
 
@@ -573,10 +2318,368 @@ long long Spartan_index::get_first_pos()
 int Spartan_index::trunc_index()
 {
   DBUG_ENTER("Spartan_data::trunc_table");
+  crashed = false;
+  if (lsm != NULL)
+    DBUG_RETURN(lsm->truncate());
   if (index_file != -1)
   {
+    cache.discard_cache();
+    hash.clear_hash();
+    bloom.clear_bloom();
+    bloom_deletes = 0;
+    changes++;
+    if (art != NULL)
+    {
+      drop_art();
+      set_art(new Spartan_art(max_key_len));
+    }
     my_chsize(index_file, 0, 0, MYF(MY_WME));
+    key_form = SDI_KEY_SORTABLE;
+    first_leaf = 0;
+    tail_leaf = 0;
+    num_pages = 1;
+    free_page = 0;
+    num_keys = 0;
+    root_page = 0;
+    height = 0;
     write_header();
   }
   DBUG_RETURN(0);
 }
+
+/*
+  Start writing the index file from keys supplied in sorted order by
+  bulk_add(). Any keys in the file are discarded. The keys are packed
+  onto full leaf pages that are written one at a time and the inner
+  nodes are built over them by bulk_end().
+*/
+int Spartan_index::bulk_start()
+{
+  DBUG_ENTER("Spartan_index::bulk_start");
+  crashed = false;
+  /* sorted runs take bulk loads through the memory table */
+  if (lsm != NULL)
+    DBUG_RETURN(lsm->truncate());
+  destroy_index();
+  if ((index_file == -1) || (page_buf == NULL))
+    DBUG_RETURN(-1);
+  my_chsize(index_file, 0L, 0, MYF(MY_WME));
+  key_form = SDI_KEY_SORTABLE;
+  first_leaf = 0;
+  tail_leaf = 0;
+  num_pages = 1;
+  free_page = 0;
+  num_keys = 0;
+  root_page = 0;
+  height = 0;
+  bulk_page = 0;
+  format_init(&bulk_fmt, false);
+  bulk_seps_count = 0;
+  DBUG_RETURN(write_header());
+}
+
+/*
+  Write the leaf being filled by bulk_add(), whose entries are unpacked
+  in split_buf. Leaves are written to consecutive pages.
+*/
+int Spartan_index::bulk_write(uint32 next)
+{
+  DBUG_ENTER("Spartan_index::bulk_write");
+  memset(page_buf, 0, SDI_PAGE_SIZE);
+  page_buf[0] = SDI_PAGE_LEAF;
+  int4store(page_buf + 4, next);
+  int4store(page_buf + 8, (bulk_page == first_leaf) ? 0 : bulk_page - 1);
+  pack_page(page_buf, split_buf, &bulk_fmt);
+  if (my_pwrite(index_file, page_buf, SDI_PAGE_SIZE,
+                (my_off_t)bulk_page * SDI_PAGE_SIZE, MYF(MY_NABP)))
+    DBUG_RETURN(-1);
+  DBUG_RETURN(0);
+}
+
+/* append the next key (keys must arrive in index order) */
+int Spartan_index::bulk_add(uchar *key, int key_len, long long pos)
+{
+  uchar sep[sizeof(SDE_INDEX)];
+  SDI_FORMAT fmt;
+  uchar *entry;
+
+  DBUG_ENTER("Spartan_index::bulk_add");
+  if (lsm != NULL)
+  {
+    SDE_INDEX ndx;
+
+    ndx.length = MY_MIN(key_len, max_key_len);
+    memcpy(ndx.key, key, ndx.length);
+    ndx.pos = pos;
+    DBUG_RETURN((lsm->insert_key(&ndx, true) < 0) ? -1 : 0);
+  }
+  if (reserve_split(bulk_fmt.count + 1))
+    DBUG_RETURN(-1);
+  entry = split_buf + (size_t)bulk_fmt.count * node_size;
+  make_entry(entry, key, key_len, pos);
+  fmt = bulk_fmt;
+  format_add(&fmt, split_buf, entry);
+  if ((bulk_page != 0) && (format_size(&fmt) <= SDI_PAGE_SIZE))
+  {
+    bulk_fmt = fmt;
+    num_keys++;
+    DBUG_RETURN(0);
+  }
+  /*
+    The page being filled is full; it links forward to the page that
+    is allocated next, which starts with this entry.
+  */
+  if (bulk_page != 0)
+  {
+    if (bulk_write(num_pages))
+      DBUG_RETURN(-1);
+    make_separator(sep, entry - node_size, entry);
+    memcpy(split_buf, entry, block_size);
+  }
+  else
+  {
+    first_leaf = num_pages;
+    memcpy(sep, entry, block_size);
+  }
+  bulk_page = num_pages++;
+  if (add_separator(sep, bulk_page))
+    DBUG_RETURN(-1);
+  format_init(&bulk_fmt, false);
+  format_add(&bulk_fmt, split_buf, split_buf);
+  num_keys++;
+  DBUG_RETURN(0);
+}
+
+/* write the last leaf, build the inner nodes and write the header */
+int Spartan_index::bulk_end()
+{
+  DBUG_ENTER("Spartan_index::bulk_end");
+  if (lsm != NULL)
+    DBUG_RETURN(lsm->flush_memtable());
+  if ((bulk_page != 0) && bulk_write(0))
+    DBUG_RETURN(-1);
+  tail_leaf = bulk_page;
+  bulk_page = 0;
+  format_init(&bulk_fmt, false);
+  if (build_levels())
+    DBUG_RETURN(-1);
+  DBUG_RETURN(write_header());
+}
+
+/*
+  Load the entries into the radix tree if they are expected to fit in
+  the memory limit. The file is read front to back in blocks of
+  SDI_LOAD_PAGES pages whatever order the leaves are chained in. The
+  leaves of each page are remembered by page, then the chain is walked
+  to put them in key order and the tree is built bottom-up.
+*/
+int Spartan_index::build_art()
+{
+  Spartan_art *tree;
+  SDE_ART_LEAF **leaves = NULL;
+  SDE_ART_LEAF **sorted = NULL;
+  long long *page_start = NULL;
+  uint32 *page_next = NULL;
+  uint16 *page_count = NULL;
+  uchar *block = NULL;
+  uchar *frame;
+  SDI_FORMAT fmt;
+  SDE_INDEX ndx;
+  long long n = 0;
+  long long m = 0;
+  uint32 page;
+  uint32 count;
+  uint32 i;
+  uint32 j;
+  bool ok = false;
+
+  DBUG_ENTER("Spartan_index::build_art");
+  drop_art();
+  if (((ulonglong)num_keys * (sizeof(SDE_ART_LEAF) + block_size +
+                              2 * sizeof(void *)) > art_limit) ||
+      Spartan_slab::over_limit() ||
+      (cache.flush_cache() != 0) ||
+      ((tree = new Spartan_art(max_key_len)) == NULL))
+    DBUG_RETURN(0);
+  leaves = (SDE_ART_LEAF **)my_malloc((size_t)(num_keys + 1) *
+                                      sizeof(SDE_ART_LEAF *), MYF(MY_WME));
+  sorted = (SDE_ART_LEAF **)my_malloc((size_t)(num_keys + 1) *
+                                      sizeof(SDE_ART_LEAF *), MYF(MY_WME));
+  page_start = (long long *)my_malloc(num_pages * sizeof(long long),
+                                      MYF(MY_ZEROFILL | MY_WME));
+  page_next = (uint32 *)my_malloc(num_pages * sizeof(uint32),
+                                  MYF(MY_ZEROFILL | MY_WME));
+  page_count = (uint16 *)my_malloc(num_pages * sizeof(uint16),
+                                   MYF(MY_ZEROFILL | MY_WME));
+  block = (uchar *)my_malloc(SDI_LOAD_PAGES * SDI_PAGE_SIZE, MYF(MY_WME));
+  if (!leaves || !sorted || !page_start || !page_next || !page_count ||
+      !block)
+    goto end;
+  for (page = 1; page < num_pages; page += count)
+  {
+    count = MY_MIN(num_pages - page, (uint32)SDI_LOAD_PAGES);
+    if (my_pread(index_file, block, (size_t)count * SDI_PAGE_SIZE,
+                 (my_off_t)page * SDI_PAGE_SIZE, MYF(MY_NABP)))
+      goto end;
+    for (i = 0, frame = block; i < count; i++, frame += SDI_PAGE_SIZE)
+    {
+      if (frame[0] != SDI_PAGE_LEAF)
+        continue;
+      read_format(frame, &fmt);
+      page_start[page + i] = n;
+      page_next[page + i] = uint4korr(frame + 4);
+      page_count[page + i] = fmt.count;
+      if (n + fmt.count > num_keys)
+        goto end;
+      for (j = 0; j < fmt.count; j++)
+      {
+        read_entry(frame, &fmt, j, ndx.key, &ndx.length, &ndx.pos);
+        leaves[n] = tree->add_leaf(ndx.key, ndx.length, ndx.pos);
+        if (leaves[n++] == NULL)
+          goto end;
+      }
+    }
+    if ((tree->memory_used() > art_limit) || Spartan_slab::over_limit())
+      goto end;
+  }
+  /* the leaf chain gives the order of the pages */
+  for (page = first_leaf; (page != 0) && (page < num_pages);
+       page = page_next[page])
+  {
+    if (m + page_count[page] > n)
+      break;
+    memcpy(sorted + m, leaves + page_start[page],
+           page_count[page] * sizeof(SDE_ART_LEAF *));
+    m += page_count[page];
+  }
+  ok = (page == 0) && (m == n) && (tree->build(sorted) == 0);
+end:
+  /* the tree is only seen by readers once it is complete */
+  if (ok)
+    set_art(tree);
+  else
+    delete tree;
+  my_free(leaves);
+  my_free(sorted);
+  my_free(page_start);
+  my_free(page_next);
+  my_free(page_count);
+  my_free(block);
+  DBUG_RETURN(0);
+}
+
+/*
+  Free the radix tree. Open cursors find their entries again in the
+  B+tree, as set_art() counts as a change.
+*/
+void Spartan_index::drop_art()
+{
+  Spartan_art *tree = art;
+
+  if (tree == NULL)
+    return;
+  set_art(NULL);
+  wait_for_readers();
+  delete tree;
+}
+
+/* remove an entry from the radix tree */
+void Spartan_index::art_remove(uchar *key, int key_len, long long pos)
+{
+  art_write_begin();
+  art->remove(key, key_len, pos);
+  art_write_end();
+}
+
+/* compare a search key with the key of a leaf (NULL never matches) */
+int Spartan_index::compare_leaf(uchar *key, int key_len, SDE_ART_LEAF *leaf)
+{
+  if (leaf == NULL)
+    return -1;
+  return compare_key(key, key_len, leaf->key, leaf->length);
+}
+
+/*
+  Optimistic reads of the radix tree.
+
+  A change to the tree (always made under the share mutex) makes
+  art_version odd while it runs and even again when it is done. A reader
+  that does not take the mutex registers in art_readers, notes an even
+  version, searches the tree and keeps the answer only if the version
+  has not moved. Memory unlinked by a change is retired by the tree and
+  only freed once art_readers has been seen at zero after the change, so
+  a reader never follows a pointer into freed memory.
+*/
+void Spartan_index::art_write_begin()
+{
+  my_atomic_add64(&art_version, 1);
+}
+
+void Spartan_index::art_write_end()
+{
+  my_atomic_add64(&art_version, 1);
+  if ((art == NULL) || (art->retired() == 0))
+    return;
+  /* a steady stream of readers must not let retired memory pile up */
+  if (art->retired() > SDI_ART_RETIRED_MAX)
+    wait_for_readers();
+  if (my_atomic_load32(&art_readers) == 0)
+    art->reclaim();
+}
+
+/* wait until no optimistic reader is inside the tree */
+void Spartan_index::wait_for_readers()
+{
+  while (my_atomic_load32(&art_readers) != 0)
+    my_sleep(1);
+}
+
+/* make tree the radix tree seen by readers */
+void Spartan_index::set_art(Spartan_art *tree)
+{
+  art_write_begin();
+  my_atomic_storeptr((void * volatile *)&art, tree);
+  art_write_end();
+  changes++;
+}
+
+/*
+  Find the row position for key without the share mutex. Returns true
+  with pos set (-1 if the key is not in the index) when the radix tree
+  gave a consistent answer; false if there is no tree or the tree kept
+  changing, in which case the caller uses get_index_pos() under the
+  mutex. unique is set if no other entry has the key.
+*/
+bool Spartan_index::lookup_pos(uchar *key, int key_len, long long *pos,
+                               bool *unique)
+{
+  Spartan_art *tree;
+  int64 version;
+  long long p = -1;
+  int found;
+  int i;
+
+  /* sorted runs are only read under the share mutex */
+  if (lsm != NULL)
+    return false;
+  for (i = 0; i < SDI_OPTIMISTIC_TRIES; i++)
+  {
+    my_atomic_add32(&art_readers, 1);
+    version = my_atomic_load64(&art_version);
+    tree = (Spartan_art *)my_atomic_loadptr((void * volatile *)&art);
+    found = -1;
+    if (((version & 1) == 0) && (tree != NULL))
+      found = tree->find_pos(key, key_len, &p);
+    if ((found >= 0) && (my_atomic_load64(&art_version) == version))
+    {
+      my_atomic_add32(&art_readers, -1);
+      *pos = found ? p : -1;
+      *unique = (found != 2);
+      return true;
+    }
+    my_atomic_add32(&art_readers, -1);
+    if (tree == NULL)
+      break;
+  }
+  return false;
+}
@@ -1,42 +1,215 @@
 /*
   Spartan_index.h
- 
+
   This header file defines a simple index class that can
-  be used to store file pointer indexes (long long). The 
-  class keeps the entire index in memory for fast access.
-  The internal memory structure is a linked list. While
-  not as efficient as a btree, it should be usable for
-  most testing environments. The constructor accepts the 
-  max key length. This is used for all nodes in the index.
+  be used to store file pointer indexes (long long). The
+  index is a B+tree stored in fixed size pages in the index
+  file. Pages are read through a page cache on demand so the
+  size of the index is not limited by memory, or used in place
+  from a private mapping of the file (see spartan_page_cache.h),
+  so opening an index reads nothing but its header. The leaves are
+  linked in both directions for range scans, and the last leaf is
+  remembered as it changes, so a scan from the end of the index
+  (cursor_last(), then cursor_prev()) starts without a search and
+  steps back a page at a time as a forward scan does. The constructor
+  accepts the max key length. This is used for all keys in
+  the index.
+
+  Entries are ordered by key and then by the file position of
+  the row, so every entry is unique even when keys repeat. Keys
+  are compared bytewise (memcmp), so the caller must store them in
+  a form that sorts that way. The header records whether it does
+  (SDI_KEY_SORTABLE); files written before that have the raw
+  column bytes (SDI_KEY_RAW) and must be rebuilt by the caller, as
+  must a file that was opened without a header.
 
   File Layout:
-    SOF                              max_key_len (int)
-    SOF + sizeof(int)                crashed (bool)
-    SOF + sizeof(int) + sizeof(bool) DATA BEGINS HERE
+    Page 0 (header)
+      +0   magic "SDI3" (uint32)
+      +4   max_key_len (int)
+      +8   crashed (bool)
+      +9   key form (uchar, see below)
+      +10  organization (uchar): SDI_ORG_BTREE, or SDI_ORG_LSM for
+           an index kept as sorted runs (see spartan_lsm.h), whose
+           file holds only this header and the list of runs
+      +12  first leaf page (uint32)
+      +16  number of pages in file (uint32)
+      +20  first free page (uint32)
+      +24  number of keys (long long)
+      +32  root page (uint32)
+      +36  height of the tree (uint32)
+    Page n (leaf, node or free)
+      +0   page type (uchar)
+      +1   prefix: key bytes shared by every entry (uchar)
+      +2   number of entries (uint16)
+      +4   leaf: next leaf page, node: first child page,
+           free: next free page (uint32)
+      +8   leaf: previous leaf page (uint32)
+      +12  width: key bytes up to the last non-zero byte of the
+           widest key (uchar)
+      +13  key length of every entry, or SDI_VAR_LEN if each entry
+           stores its own (uchar)
+      +14  bytes used for a row position (uchar)
+      +15  bytes of the position base (low 4 bits) and of the
+           position step (high 4 bits, 0 for a step of 1)
+      +16  the prefix bytes, the base and the step (low byte
+           first), then the entries
+           leaf: key bytes prefix..width, [length (uchar)],
+                 (pos + 1 - base) / step (pos bytes, low byte first)
+           node: as a leaf, then child page (uint32)
+
+  Every entry of a page has the same packed size, so a page is
+  searched by slot as if its entries were unpacked, and an entry is
+  unpacked (key padded with zeros to max_key_len, pos, length) when it
+  has to be moved or changed. The key bytes past width are zero and are
+  not stored. A page is packed again in a wider format when an entry
+  that does not fit its format is added.
+
+  Row positions are stored as deltas from the smallest position on the
+  page, divided by the largest step all of them are apart by. A run of
+  entries with one key, as a non-unique index has for each value of a
+  low-cardinality column, is therefore a sorted posting list: the key
+  is in the page prefix once and each row takes only the bytes of its
+  delta, which are few when rows of the same size lie close together
+  in the data file. Pages written before this have no base or step
+  (byte 15 is zero) and read the same way.
+
+  A node with n entries has n + 1 children. The entry in front of a
+  child sorts after every entry in the subtree to its left and not
+  after any entry in the child's subtree. It is cut short after the
+  first byte that differs from the last key on the left (suffix
+  truncation), the rest zero and its position -1, so that separators
+  take few key bytes and no position bytes.
+
+  An index whose entries fit within the radix tree limit is also kept
+  in memory as an adaptive radix tree (see spartan_art.h). Changes are
+  made to both; lookups and scans are served from the tree, which is
+  dropped if the index outgrows the limit or the engine outgrows
+  spartan_index_memory_limit (see spartan_slab.h).
+
+  The class does no locking; the caller holds the share mutex for every
+  call except lookup_pos(), which reads the radix tree optimistically
+  and may run alongside one writer.
+
+  Whole keys that are looked up often are also kept in an adaptive hash
+  index (see spartan_hash_index.h) when there is no radix tree, so
+  cursor_seek() finds them without descending the tree.
+
+  A B+tree index also keeps a blocked bloom filter of its keys (see
+  spartan_bloom.h). A key the filter has never seen is not looked for
+  in the pages: the duplicate check of insert_key(), get_index_pos()
+  and cursor_seek() answer at once that it is not there.
+
+  An index created with SDI_ORG_LSM hands every call to Spartan_lsm and
+  has no pages of its own.
+
+  Files written in the original layout (max_key_len, crashed, then
+  the entries) and files with fixed size entries ("SDI2", a 12 byte
+  page header and unpacked entries) are converted the first time they
+  are loaded.
 */
 #include "my_global.h"
 #include "my_sys.h"
+#include "spartan_page_cache.h"
+#include "spartan_art.h"
+#include "spartan_hash_index.h"
+#include "spartan_bloom.h"
 
 const long METADATA_SIZE = sizeof(int) + sizeof(bool);
+/* size of a page in the index file */
+const int SDI_PAGE_SIZE = 8192;
+/* size of the page header that precedes the prefix and entries */
+const int SDI_PAGE_HEADER = 16;
+/* size of the page header in files with fixed size entries */
+const int SDI_FIXED_HEADER = 12;
+/* size of the header stored in page 0 */
+const int SDI_HEADER_SIZE = 40;
+/* identifies the paged file layout ("SDI3") */
+const uint32 SDI_MAGIC = 0x33494453;
+/* identifies the layout with fixed size entries ("SDI2") */
+const uint32 SDI_MAGIC_FIXED = 0x32494453;
+/* key length byte of a page whose entries store their own lengths */
+const uchar SDI_VAR_LEN = 255;
+/* longest key an entry can hold */
+const int SDI_MAX_KEY_LEN = 128;
+/* key forms (header byte 9) */
+const uchar SDI_KEY_RAW = 0;
+const uchar SDI_KEY_SORTABLE = 1;
+/* organizations (header byte 10) */
+const uchar SDI_ORG_BTREE = 0;
+const uchar SDI_ORG_LSM = 1;
+/* page types */
+const uchar SDI_PAGE_FREE = 0;
+const uchar SDI_PAGE_LEAF = 1;
+const uchar SDI_PAGE_NODE = 2;
+/* deepest tree supported (far more than 2^32 keys) */
+const int SDI_MAX_HEIGHT = 16;
+/* default size of the page cache */
+const ulonglong SDI_DEFAULT_CACHE = 8 * 1024 * 1024;
+/* optimistic attempts before a reader falls back to the mutex */
+const int SDI_OPTIMISTIC_TRIES = 4;
+/* retired radix tree memory that makes a writer wait for readers */
+const uint SDI_ART_RETIRED_MAX = 4096;
+/* pages read at once when an index is loaded */
+const int SDI_LOAD_PAGES = 64;
+/* default memory limit for the in-memory radix tree */
+const ulonglong SDI_DEFAULT_ART = 16 * 1024 * 1024;
+/* default memory limit for the adaptive hash index */
+const ulonglong SDI_DEFAULT_HASH = 1024 * 1024;
+/* leaves read to estimate the number of distinct keys */
+const int SDI_SAMPLE_PAGES = 16;
 /*
-  This is the node that stores the key and the file 
+  This is the node that stores the key and the file
   position for the data row.
 */
 struct SDE_INDEX
 {
-  uchar key[128];        
-  long long pos;    
+  uchar key[SDI_MAX_KEY_LEN];
+  long long pos;
   int length;
 };
 
-/* defines (doubly) linked list for internal list */
-struct SDE_NDX_NODE
+/*
+  A scan position in the index, owned by the caller (see cursor_first()).
+  version is the change count of the index when the location was found,
+  0 if the cursor is not positioned. An SDI_ORG_LSM index uses only ndx.
+*/
+struct SDI_CURSOR
+{
+  SDE_INDEX ndx;               /* entry the cursor is on */
+  ulonglong version;
+  uint32 page;                 /* B+tree leaf page and slot of ndx */
+  int slot;
+  SDE_ART_LEAF *leaf;          /* radix tree leaf of ndx */
+  bool hashed;                 /* cursor_seek() found ndx by hash */
+};
+
+/* how the entries of a page are packed (see the file layout above) */
+struct SDI_FORMAT
 {
-  SDE_INDEX key_ndx;  
-  SDE_NDX_NODE *next;
-  SDE_NDX_NODE *prev;
+  uint count;
+  uint prefix;
+  uint width;
+  uint key_len;
+  uint pos_width;
+  ulonglong pos_base;          /* smallest pos + 1 on the page */
+  ulonglong pos_step;          /* gcd of the deltas from it, 0 if none */
+  ulonglong pos_top;           /* largest pos + 1 the format can hold */
+  uint base_width;             /* bytes of the base and step in the page */
+  uint step_width;
+  bool node;
 };
 
+/* the pages visited from the root to a leaf */
+struct SDI_PATH
+{
+  uint32 page[SDI_MAX_HEIGHT];
+  int child[SDI_MAX_HEIGHT];   /* child taken at each node */
+  int depth;
+};
+
+class Spartan_lsm;
+
 class Spartan_index
 {
 public:
@@ -44,33 +217,152 @@ public:
   Spartan_index();
   ~Spartan_index(void);
   int open_index(char *path);
-  int create_index(char *path, int keylen);
+  int create_index(char *path, int keylen, uchar org = SDI_ORG_BTREE);
   int insert_key(SDE_INDEX *ndx, bool allow_dupes);
   int delete_key(uchar *buf, long long pos, int key_len);
-  int update_key(uchar *buf, long long pos, int key_len);
+  int update_key(uchar *old_key, uchar *buf, long long pos, int key_len);
   long long get_index_pos(uchar *buf, int key_len);
+  bool lookup_pos(uchar *key, int key_len, long long *pos, bool *unique);
   long long get_first_pos();
-  uchar *get_first_key();
-  uchar *get_last_key();
-  uchar *get_next_key();
-  uchar *get_prev_key();
+  SDE_INDEX *cursor_first(SDI_CURSOR *cursor);
+  SDE_INDEX *cursor_last(SDI_CURSOR *cursor);
+  SDE_INDEX *cursor_next(SDI_CURSOR *cursor);
+  SDE_INDEX *cursor_prev(SDI_CURSOR *cursor);
+  SDE_INDEX *cursor_seek(SDI_CURSOR *cursor, uchar *key, int key_len);
+  SDE_INDEX *cursor_lower_bound(SDI_CURSOR *cursor, uchar *key, int key_len);
+  int cursor_fetch(SDI_CURSOR *cursor, int key_len, SDE_INDEX *to, int max);
+  long long range_size(uchar *min_key, int min_len, uchar *max_key,
+                       int max_len);
+  void sample_prefixes(uint *prefix_len, uint parts, double *per_prefix);
+  long long key_count();
+  void cursor_set(SDI_CURSOR *cursor, uchar *key, int key_len, long long pos);
   int close_index();
   int load_index();
   int destroy_index();
-  SDE_INDEX *seek_index(uchar *key, int key_len);
-  SDE_NDX_NODE *seek_index_pos(uchar *key, int key_len);
   int save_index();
   int trunc_index();
+  int bulk_start();
+  int bulk_add(uchar *key, int key_len, long long pos);
+  int bulk_end();
+  void set_cache_size(ulonglong size) { cache_size = size; }
+  void set_art_limit(ulonglong size) { art_limit = size; }
+  void set_mmap(bool on) { cache.set_mmap(on); }
+  void set_hash_size(ulonglong size) { hash_size = size; }
+  void set_bloom_bits(uint bits) { bloom_bits = bits; }
+  void set_lsm_memtable_size(ulonglong size);
+  bool hash_enabled()
+  {
+    return hash.is_enabled() && (art == NULL) && (lsm == NULL);
+  }
+  bool sortable_keys() { return (key_form == SDI_KEY_SORTABLE); }
+  bool is_crashed() { return crashed; }
+  void mark_crashed();
+  static void delete_runs(char *path);
+  static void rename_runs(char *from, char *to);
 private:
   File index_file;
   int max_key_len;
-  SDE_NDX_NODE *root;
-  SDE_NDX_NODE *range_ptr;
   int block_size;
+  int node_size;
   bool crashed;
+  bool legacy;
+  bool fixed_pages;            /* "SDI2" file not yet converted */
+  uchar key_form;
+  uchar organization;
+  char index_path[FN_REFLEN];
+  Spartan_lsm *lsm;            /* SDI_ORG_LSM: the index is kept by lsm */
+  uint32 first_leaf;
+  uint32 tail_leaf;            /* last leaf page, 0 if not known */
+  uint32 num_pages;
+  uint32 free_page;
+  long long num_keys;
+  uint32 root_page;
+  uint32 height;
+  Spartan_page_cache cache;
+  ulonglong cache_size;
+  ulonglong changes;            /* bumped by every change to the index */
+  uchar *page_buf;
+  uchar *split_buf;            /* unpacked entries of a page being changed */
+  int split_size;              /* entries split_buf has room for */
+  uint32 bulk_page;
+  SDI_FORMAT bulk_fmt;         /* format of the leaf bulk_add() is filling */
+  uchar *bulk_seps;
+  uint32 bulk_seps_count;
+  uint32 bulk_seps_size;
+  Spartan_art *art;
+  ulonglong art_limit;
+  volatile int64 art_version;
+  volatile int32 art_readers;
+  Spartan_hash_index hash;
+  ulonglong hash_size;
+  Spartan_bloom bloom;
+  uint bloom_bits;             /* bits of filter per key, 0 for none */
+  ulonglong lsm_memtable;      /* memory table size of lsm, 0 = default */
+  ulonglong bloom_deletes;     /* entries removed since it was built */
   int read_header();
   int write_header();
-  long long write_row(SDE_INDEX *ndx);
-  SDE_INDEX *read_row(long long Position);
-  long long curfpos();
+  void set_sizes();
+  void read_format(uchar *frame, SDI_FORMAT *fmt);
+  void format_init(SDI_FORMAT *fmt, bool node);
+  void format_add(SDI_FORMAT *fmt, uchar *first, uchar *entry);
+  int format_size(SDI_FORMAT *fmt);
+  int entry_width(SDI_FORMAT *fmt);
+  uchar *page_entry(uchar *frame, SDI_FORMAT *fmt, int i)
+  {
+    return frame + SDI_PAGE_HEADER + fmt->prefix + fmt->base_width +
+           fmt->step_width + i * entry_width(fmt);
+  }
+  int packed_size(uchar *entries, int count, bool node, SDI_FORMAT *fmt);
+  void pack_entry(uchar *to, uchar *entry, SDI_FORMAT *fmt);
+  void pack_page(uchar *frame, uchar *entries, SDI_FORMAT *fmt);
+  void read_entry(uchar *frame, SDI_FORMAT *fmt, int i, uchar *key,
+                  int *length, long long *pos);
+  long long entry_pos(uchar *frame, SDI_FORMAT *fmt, int i);
+  void unpack_entry(uchar *frame, SDI_FORMAT *fmt, int i, uchar *entry);
+  int unpack_page(uchar *frame, uchar *entries);
+  int insert_slot(uchar *frame, int slot, uchar *entry);
+  void delete_slot(uchar *frame, int slot);
+  int reserve_split(int count);
+  int fit_front(uchar *entries, int lo, int hi, bool node);
+  int fit_back(uchar *entries, int total, int lo, int hi, bool node);
+  void make_separator(uchar *sep, uchar *left, uchar *right);
+  uint32 node_child(uchar *frame, int i);
+  int compare_key(uchar *key, int key_len, uchar *entry_key, int entry_len);
+  int compare_slot_key(uchar *frame, SDI_FORMAT *fmt, int i, uchar *key,
+                       int key_len);
+  int compare_slot(uchar *frame, SDI_FORMAT *fmt, int i, uchar *key,
+                   int key_len, long long pos);
+  int search_page(uchar *frame, uchar *key, int key_len, long long pos);
+  uint32 find_leaf(uchar *key, int key_len, long long pos, SDI_PATH *path);
+  double key_fraction(uchar *key, int key_len, uint32 *leaf, int *slot);
+  bool find_entry(uchar *key, int key_len, long long pos,
+                  uint32 *page, int *slot);
+  void make_entry(uchar *entry, uchar *key, int key_len, long long pos);
+  uint32 alloc_page();
+  int free_index_page(uint32 page);
+  int split_leaf(SDI_PATH *path, uchar *frame, int slot);
+  int insert_in_parent(SDI_PATH *path, int level, uchar *sep, uint32 child);
+  int remove_entry(uchar *key, int key_len, long long pos);
+  int rebalance(SDI_PATH *path, int level);
+  uint32 last_leaf();
+  void hash_leaf(uint32 page);
+  int build_bloom();
+  bool bloom_excludes(uchar *key, int key_len);
+  SDE_INDEX *cursor_entry(SDI_CURSOR *cursor, uchar *frame, int slot);
+  bool cursor_locate(SDI_CURSOR *cursor);
+  SDE_INDEX *cursor_move(SDI_CURSOR *cursor, int step);
+  int add_separator(uchar *entry, uint32 page);
+  int bulk_write(uint32 next);
+  int bulk_load(uchar *entries, long long n);
+  int build_levels();
+  int load_legacy();
+  int convert_fixed();
+  int build_art();
+  void drop_art();
+  void set_art(Spartan_art *tree);
+  void art_write_begin();
+  void art_write_end();
+  void wait_for_readers();
+  void art_remove(uchar *key, int key_len, long long pos);
+  int compare_leaf(uchar *key, int key_len, SDE_ART_LEAF *leaf);
 };
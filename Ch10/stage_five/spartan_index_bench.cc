@@ -0,0 +1,206 @@
+/*
+  spartan_index_bench.cc
+
+  Micro benchmark for the Spartan index. The same set of random keys is
+  loaded into two indexes through the Spartan_index API, one served from
+  the paged B+tree only and one that also keeps the adaptive radix tree
+  in memory, and the time taken by each phase is reported:
+
+    insert  insert_key() of every key in random order
+    lookup  get_index_pos() of every key in a different order
+    scan    cursor_first() then cursor_next() over the whole index
+    reopen  close_index(), open_index() and load_index()
+
+  The size of the index file after the inserts is reported as well.
+
+  Usage:
+    spartan_index_bench [--keys=N] [--key-length=N] [--tmpdir=DIR]
+
+  The index files are created in --tmpdir and removed at the end.
+*/
+#include "my_global.h"
+#include "my_sys.h"
+#include "my_getopt.h"
+#include "m_string.h"
+#include <my_dir.h>
+#include "spartan_index.h"
+
+#define SDI_EXT ".sdi"
+#define BENCH_PHASES 4
+
+static char *opt_tmpdir= NULL;
+static uint opt_key_length= 16;
+static ulonglong opt_keys= 1000000;
+
+static const char *phase_names[BENCH_PHASES]=
+{
+  "insert", "lookup", "scan", "reopen"
+};
+
+static struct my_option my_long_options[]=
+{
+  {"help", '?', "Display this help and exit.",
+   0, 0, 0, GET_NO_ARG, NO_ARG, 0, 0, 0, 0, 0, 0},
+  {"keys", 'n', "Number of keys to load.",
+   &opt_keys, &opt_keys, 0, GET_ULL, REQUIRED_ARG,
+   1000000, 1, ~(ulonglong)0, 0, 0, 0},
+  {"key-length", 'l', "Length of each key in bytes.",
+   &opt_key_length, &opt_key_length, 0, GET_UINT, REQUIRED_ARG,
+   16, 8, 128, 0, 0, 0},
+  {"tmpdir", 'T', "Directory for the index files.",
+   &opt_tmpdir, &opt_tmpdir, 0, GET_STR, REQUIRED_ARG, 0, 0, 0, 0, 0, 0},
+  {0, 0, 0, 0, 0, 0, GET_NO_ARG, NO_ARG, 0, 0, 0, 0, 0, 0}
+};
+
+static void usage()
+{
+  printf("Usage: %s [OPTIONS]\n", my_progname);
+  printf("Compare the paged and the in-memory Spartan index.\n\n");
+  my_print_help(my_long_options);
+  my_print_variables(my_long_options);
+}
+
+static my_bool get_one_option(int optid,
+                              const struct my_option *opt
+                              __attribute__((unused)),
+                              char *argument __attribute__((unused)))
+{
+  if (optid == '?')
+  {
+    usage();
+    exit(0);
+  }
+  return 0;
+}
+
+/* scramble a number (the finalizer of splitmix64) */
+static ulonglong mix(ulonglong x)
+{
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+/* the i-th key: random bytes, the same on every call */
+static void make_key(uchar *key, ulonglong i)
+{
+  ulonglong v = 0;
+  uint j;
+
+  for (j = 0; j < opt_key_length; j++)
+  {
+    if ((j % 8) == 0)
+      v = mix(i * 16 + j / 8);
+    key[j] = (uchar)(v >> 56);
+    v <<= 8;
+  }
+}
+
+/* run every phase against one index, storing the times in usec */
+static int run_bench(const char *path, ulonglong art_limit,
+                     ulonglong *usec, ulonglong *file_size)
+{
+  MY_STAT stat_info;
+  Spartan_index index;
+  SDE_INDEX ndx;
+  SDE_INDEX *entry;
+  SDI_CURSOR cursor;
+  ulonglong start;
+  ulonglong step;
+  ulonglong i;
+  ulonglong n = 0;
+
+  my_delete(path, MYF(0));
+  index.set_art_limit(art_limit);
+  if (index.create_index((char *)path, opt_key_length))
+    return 1;
+  index.load_index();
+
+  start = my_micro_time();
+  ndx.length = opt_key_length;
+  for (i = 0; i < opt_keys; i++)
+  {
+    make_key(ndx.key, i);
+    ndx.pos = (long long)i;
+    index.insert_key(&ndx, true);
+  }
+  usec[0] = my_micro_time() - start;
+
+  /* visit the keys in a different order than they were inserted */
+  step = 7919;
+  while ((opt_keys % step) == 0)
+    step += 2;
+  start = my_micro_time();
+  for (i = 0; i < opt_keys; i++)
+  {
+    make_key(ndx.key, (i * step) % opt_keys);
+    if (index.get_index_pos(ndx.key, opt_key_length) < 0)
+      n++;
+  }
+  usec[1] = my_micro_time() - start;
+  if (n > 0)
+    fprintf(stderr, "%s: %llu keys not found\n", my_progname, n);
+
+  start = my_micro_time();
+  for (n = 0, entry = index.cursor_first(&cursor); entry != NULL;
+       entry = index.cursor_next(&cursor))
+    n++;
+  usec[2] = my_micro_time() - start;
+  if (n != opt_keys)
+    fprintf(stderr, "%s: scan returned %llu keys\n", my_progname, n);
+
+  start = my_micro_time();
+  index.close_index();
+  index.open_index((char *)path);
+  index.load_index();
+  usec[3] = my_micro_time() - start;
+  *file_size = my_stat(path, &stat_info, MYF(0)) ?
+               (ulonglong)stat_info.st_size : 0;
+
+  index.close_index();
+  my_delete(path, MYF(0));
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  char path[FN_REFLEN];
+  ulonglong btree[BENCH_PHASES];
+  ulonglong art[BENCH_PHASES];
+  ulonglong btree_size;
+  ulonglong art_size;
+  int i;
+
+  MY_INIT(argv[0]);
+  if (handle_options(&argc, &argv, my_long_options, get_one_option))
+    exit(1);
+  if (argc != 0)
+  {
+    usage();
+    exit(1);
+  }
+  fn_format(path, "spartan_index_bench", opt_tmpdir ? opt_tmpdir : "",
+            SDI_EXT, MY_UNPACK_FILENAME);
+  if (run_bench(path, 0, btree, &btree_size) ||
+      run_bench(path, ~(ulonglong)0, art, &art_size))
+  {
+    fprintf(stderr, "%s: cannot create %s\n", my_progname, path);
+    exit(1);
+  }
+  printf("%llu keys of %u bytes\n\n", opt_keys, opt_key_length);
+  printf("%-8s %14s %14s %14s %14s\n", "phase", "btree usec", "art usec",
+         "btree ops/s", "art ops/s");
+  for (i = 0; i < BENCH_PHASES; i++)
+    printf("%-8s %14llu %14llu %14.0f %14.0f\n", phase_names[i],
+           btree[i], art[i],
+           opt_keys * 1e6 / (btree[i] ? btree[i] : 1),
+           opt_keys * 1e6 / (art[i] ? art[i] : 1));
+  printf("\n%-8s %14llu %14llu\n", "bytes", btree_size, art_size);
+  printf("%-8s %14.1f %14.1f\n", "per key", (double)btree_size / opt_keys,
+         (double)art_size / opt_keys);
+  my_end(0);
+  return 0;
+}
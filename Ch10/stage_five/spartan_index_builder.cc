@@ -0,0 +1,448 @@
+/*
+  Spartan_index_builder.cc
+
+  This class builds a Spartan index from unsorted entries with an external
+  merge sort (see spartan_index_builder.h). Full buffers are sorted and
+  spilled to temporary files by worker threads while the caller fills the
+  next one; the last buffer stays in memory and is sorted in slices. The
+  runs are then merged into the index with its bulk load calls, so the
+  leaves are written once, in order, and the nodes are built over them.
+*/
+#include "spartan_index_builder.h"
+#include "my_base.h"
+#include "m_string.h"
+#include <string.h>
+
+Spartan_index_builder::Spartan_index_builder(Spartan_index *ndx, int key_len,
+                                             int unique, ulonglong memory,
+                                             uint num_threads,
+                                             const char *dir)
+{
+  index = ndx;
+  width = MY_MIN(key_len, SDI_MAX_KEY_LEN);
+  entry_len = width + 1 + sizeof(long long);
+  unique_len = MY_MIN((uint)unique, width);
+  num_nulls = 0;
+  threads = MY_MAX(num_threads, 1);
+  /*
+    Each of the threads buffers being sorted and the one being filled
+    get an equal share of the memory.
+  */
+  run_entries = memory / ((threads + 1) * entry_len);
+  if (run_entries < SDI_BUILD_MIN_SLICE)
+    run_entries = SDI_BUILD_MIN_SLICE;
+  strmake(tmpdir, dir ? dir : P_tmpdir, sizeof(tmpdir) - 1);
+  runs = NULL;
+  num_runs = 0;
+  runs_size = 0;
+  joined = 0;
+  current = NULL;
+  count = 0;
+  total = 0;
+  dupes = 0;
+  error = 0;
+  build_rc = 0;
+}
+
+Spartan_index_builder::~Spartan_index_builder(void)
+{
+  free_runs();
+}
+
+/* compare two entries: key bytes, then row position */
+int Spartan_index_builder::compare_entries(const void *arg, const void *a,
+                                           const void *b)
+{
+  uint width = *(const uint *)arg;
+  int i = memcmp(a, b, width);
+  long long pa;
+  long long pb;
+
+  if (i)
+    return i;
+  memcpy(&pa, (const uchar *)a + width + 1, sizeof(long long));
+  memcpy(&pb, (const uchar *)b + width + 1, sizeof(long long));
+  return (pa < pb) ? -1 : ((pa > pb) ? 1 : 0);
+}
+
+/* mark the key byte at offset as the NULL marker of a key part */
+void Spartan_index_builder::add_null_marker(uint offset)
+{
+  if ((offset < unique_len) && (num_nulls < SDI_BUILD_MAX_NULLS))
+    null_at[num_nulls++] = offset;
+}
+
+/* add the entry for the row at pos */
+int Spartan_index_builder::add_entry(uchar *key, int key_len, long long pos)
+{
+  uchar *e;
+
+  DBUG_ENTER("Spartan_index_builder::add_entry");
+  if (error)
+    DBUG_RETURN(error);
+  if ((current == NULL) &&
+      ((current = (uchar *)my_malloc((size_t)(run_entries * entry_len),
+                                     MYF(MY_WME))) == NULL))
+    DBUG_RETURN(error = HA_ERR_OUT_OF_MEM);
+  key_len = MY_MIN((uint)key_len, width);
+  e = current + (size_t)count * entry_len;
+  memcpy(e, key, key_len);
+  memset(e + key_len, 0, width - key_len);
+  e[width] = (uchar)key_len;
+  memcpy(e + width + 1, &pos, sizeof(long long));
+  total++;
+  /*
+    A full buffer is sorted and spilled in the background once fewer
+    than threads other buffers are.
+  */
+  if (++count == run_entries)
+  {
+    join_runs(threads - 1);
+    if (new_run(current, count, true) == NULL)
+      DBUG_RETURN(error);
+    current = NULL;
+    count = 0;
+    start_sort(runs[num_runs - 1]);
+  }
+  DBUG_RETURN(error);
+}
+
+/* add a run of n entries; the run owns entries */
+SDI_BUILD_RUN *Spartan_index_builder::new_run(uchar *entries, ulonglong n,
+                                              bool spill)
+{
+  SDI_BUILD_RUN **p;
+  SDI_BUILD_RUN *run;
+  uint size;
+
+  if (num_runs == runs_size)
+  {
+    size = runs_size ? runs_size * 2 : 16;
+    p = (SDI_BUILD_RUN **)my_realloc(runs, size * sizeof(SDI_BUILD_RUN *),
+                                     MYF(MY_WME | MY_ALLOW_ZERO_PTR));
+    if (p == NULL)
+    {
+      error = HA_ERR_OUT_OF_MEM;
+      return NULL;
+    }
+    runs = p;
+    runs_size = size;
+  }
+  if ((run = (SDI_BUILD_RUN *)my_malloc(sizeof(SDI_BUILD_RUN),
+                                        MYF(MY_WME | MY_ZEROFILL))) == NULL)
+  {
+    error = HA_ERR_OUT_OF_MEM;
+    return NULL;
+  }
+  run->builder = this;
+  run->entries = entries;
+  run->count = n;
+  run->spill = spill;
+  run->file = -1;
+  runs[num_runs++] = run;
+  return run;
+}
+
+/*
+  Sort a run and, if it is to be spilled, write it to a temporary file
+  that is removed as soon as it is created (it goes when it is closed).
+*/
+void Spartan_index_builder::sort_run(SDI_BUILD_RUN *run)
+{
+  Spartan_index_builder *b = run->builder;
+  char name[FN_REFLEN];
+
+  my_qsort2(run->entries, (size_t)run->count, b->entry_len,
+            compare_entries, &b->width);
+  if (!run->spill)
+    return;
+  run->file = create_temp_file(name, b->tmpdir, "sdi",
+                               O_RDWR | O_BINARY | O_TRUNC | O_TEMPORARY |
+                               O_SHORT_LIVED, MYF(MY_WME));
+  if (run->file < 0)
+  {
+    run->error = HA_ERR_INTERNAL_ERROR;
+    return;
+  }
+#if !defined(__WIN__)
+  my_delete(name, MYF(0));
+#endif
+  if (my_write(run->file, run->entries, (size_t)run->count * b->entry_len,
+               MYF(MY_NABP | MY_WME)))
+    run->error = HA_ERR_INTERNAL_ERROR;
+  my_free(run->entries);
+  run->entries = NULL;
+}
+
+/* body of a sort thread */
+void *Spartan_index_builder::sort_main(void *arg)
+{
+  my_thread_init();
+  sort_run((SDI_BUILD_RUN *)arg);
+  my_thread_end();
+  return NULL;
+}
+
+/* sort a run in a thread of its own, or here if none can be started */
+void Spartan_index_builder::start_sort(SDI_BUILD_RUN *run)
+{
+  run->threaded = (pthread_create(&run->thread, NULL, sort_main, run) == 0);
+  if (!run->threaded)
+    sort_run(run);
+}
+
+/* wait for sorts until no more than busy are running */
+void Spartan_index_builder::join_runs(uint busy)
+{
+  SDI_BUILD_RUN *run;
+
+  while (joined + busy < num_runs)
+  {
+    run = runs[joined++];
+    if (run->threaded)
+      pthread_join(run->thread, NULL);
+    run->threaded = false;
+    if (run->error && !error)
+      error = run->error;
+  }
+}
+
+/* make the next entry of a run readable, returns false when it is used up */
+bool Spartan_index_builder::fill_run(SDI_BUILD_RUN *run)
+{
+  size_t n;
+
+  if (run->off + entry_len <= run->len)
+    return true;
+  if (run->file < 0)
+    return false;
+  n = my_pread(run->file, run->buf, (SDI_BUILD_READ / entry_len) * entry_len,
+               run->read_at, MYF(0));
+  if ((n == (size_t)-1) || (n < entry_len))
+    return false;
+  run->read_at += n;
+  run->len = n;
+  run->off = 0;
+  return true;
+}
+
+/* restore the heap order below slot i */
+void Spartan_index_builder::sift_down(uint *heap, uint n, uint i)
+{
+  SDI_BUILD_RUN *a;
+  SDI_BUILD_RUN *b;
+  uint c;
+  uint t;
+
+  for (;;)
+  {
+    c = 2 * i + 1;
+    if (c >= n)
+      break;
+    a = runs[heap[c]];
+    if (c + 1 < n)
+    {
+      b = runs[heap[c + 1]];
+      if (compare_entries(&width, b->buf + b->off, a->buf + a->off) < 0)
+        a = runs[heap[++c]];
+    }
+    b = runs[heap[i]];
+    if (compare_entries(&width, a->buf + a->off, b->buf + b->off) >= 0)
+      break;
+    t = heap[i];
+    heap[i] = heap[c];
+    heap[c] = t;
+    i = c;
+  }
+}
+
+/* whether an entry has a NULL in its unique bytes */
+bool Spartan_index_builder::has_null(const uchar *e)
+{
+  for (uint i = 0; i < num_nulls; i++)
+  {
+    if (e[null_at[i]] == 0)
+      return true;
+  }
+  return false;
+}
+
+/* merge the sorted runs into the index */
+int Spartan_index_builder::merge_runs()
+{
+  uchar last[SDI_MAX_KEY_LEN];
+  bool have_last = false;
+  SDI_BUILD_RUN *run;
+  long long pos;
+  uint *heap;
+  uint n = 0;
+  uint i;
+  uchar *e;
+  int rc = 0;
+
+  DBUG_ENTER("Spartan_index_builder::merge_runs");
+  if ((heap = (uint *)my_malloc((num_runs + 1) * sizeof(uint),
+                                MYF(MY_WME))) == NULL)
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  for (i = 0; i < num_runs; i++)
+  {
+    run = runs[i];
+    if (run->file < 0)
+    {
+      run->buf = run->entries;
+      run->len = (size_t)run->count * entry_len;
+    }
+    else if ((run->buf = (uchar *)my_malloc(SDI_BUILD_READ,
+                                            MYF(MY_WME))) == NULL)
+    {
+      my_free(heap);
+      DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+    }
+    if (fill_run(run))
+      heap[n++] = i;
+  }
+  for (i = n / 2; i-- > 0; )
+    sift_down(heap, n, i);
+  if (index->bulk_start())
+    rc = HA_ERR_INTERNAL_ERROR;
+  while (!rc && (n > 0))
+  {
+    run = runs[heap[0]];
+    e = run->buf + run->off;
+    if (have_last && (unique_len > 0) &&
+        (memcmp(last, e, unique_len) == 0) && !has_null(e))
+      dupes++;
+    else
+    {
+      memcpy(&pos, e + width + 1, sizeof(long long));
+      if (index->bulk_add(e, e[width], pos))
+        rc = HA_ERR_INTERNAL_ERROR;
+      memcpy(last, e, width);
+      have_last = true;
+    }
+    run->off += entry_len;
+    if (!fill_run(run))
+      heap[0] = heap[--n];
+    sift_down(heap, n, 0);
+  }
+  if (index->bulk_end() && !rc)
+    rc = HA_ERR_INTERNAL_ERROR;
+  my_free(heap);
+  DBUG_RETURN(rc);
+}
+
+/*
+  Sort the entries not yet spilled, merge every run into the index and
+  load the index again so it is used as written (mapped, or kept as a
+  radix tree if it is small enough).
+*/
+int Spartan_index_builder::end_build()
+{
+  ulonglong slice;
+  ulonglong at;
+  uint first;
+
+  DBUG_ENTER("Spartan_index_builder::end_build");
+  /*
+    The last buffer is cut into slices of at least SDI_BUILD_MIN_SLICE
+    entries, one per thread, that are sorted in place. The last slice
+    is sorted by this thread.
+  */
+  if (!error && (count > 0))
+  {
+    slice = MY_MAX(count / threads, SDI_BUILD_MIN_SLICE);
+    first = num_runs;
+    for (at = 0; !error && (at < count); at += slice)
+      new_run(current + (size_t)at * entry_len, MY_MIN(slice, count - at),
+              false);
+    for (uint i = first; i + 1 < num_runs; i++)
+      start_sort(runs[i]);
+    if (!error)
+      sort_run(runs[num_runs - 1]);
+  }
+  join_runs(0);
+  if (!error)
+    error = merge_runs();
+  if (!error && index->load_index())
+    error = HA_ERR_INTERNAL_ERROR;
+  free_runs();
+  DBUG_RETURN(error);
+}
+
+/* body of a thread that finishes one build of end_builds() */
+void *Spartan_index_builder::build_main(void *arg)
+{
+  Spartan_index_builder *b = (Spartan_index_builder *)arg;
+
+  my_thread_init();
+  b->build_rc = b->end_build();
+  my_thread_end();
+  return NULL;
+}
+
+/*
+  Finish several builds, each in a thread of its own (the last one, and
+  any beyond SDI_BUILD_MAX_PARALLEL, in this thread). Returns the first
+  error.
+*/
+int Spartan_index_builder::end_builds(Spartan_index_builder **builders,
+                                      uint n)
+{
+  pthread_t thread[SDI_BUILD_MAX_PARALLEL];
+  bool threaded[SDI_BUILD_MAX_PARALLEL];
+  uint threads = MY_MIN((n > 0) ? n - 1 : 0, SDI_BUILD_MAX_PARALLEL);
+  int rc = 0;
+  uint i;
+
+  DBUG_ENTER("Spartan_index_builder::end_builds");
+  for (i = 0; i < threads; i++)
+  {
+    threaded[i] = (pthread_create(&thread[i], NULL, build_main,
+                                  builders[i]) == 0);
+    if (!threaded[i])
+      builders[i]->build_rc = builders[i]->end_build();
+  }
+  /* the builds left over, the last one included, run in this thread */
+  for (; i < n; i++)
+    builders[i]->build_rc = builders[i]->end_build();
+  for (i = 0; i < threads; i++)
+  {
+    if (threaded[i])
+      pthread_join(thread[i], NULL);
+  }
+  for (i = 0; i < n; i++)
+  {
+    if (builders[i]->build_rc && !rc)
+      rc = builders[i]->build_rc;
+  }
+  DBUG_RETURN(rc);
+}
+
+/* wait for the sorts and free the runs and buffers */
+void Spartan_index_builder::free_runs()
+{
+  SDI_BUILD_RUN *run;
+  uint i;
+
+  join_runs(0);
+  for (i = 0; i < num_runs; i++)
+  {
+    run = runs[i];
+    if (run->file >= 0)
+    {
+      my_close(run->file, MYF(0));
+      my_free(run->buf);
+    }
+    if (run->spill)
+      my_free(run->entries);
+    my_free(run);
+  }
+  my_free(runs);
+  my_free(current);
+  runs = NULL;
+  num_runs = 0;
+  runs_size = 0;
+  joined = 0;
+  current = NULL;
+  count = 0;
+}
@@ -0,0 +1,123 @@
+/*
+  Spartan_index_builder.h
+
+  This header defines the parallel builder of a Spartan index, used when
+  a whole index is written from the rows of the data file (a rebuild, a
+  REPAIR TABLE or a bulk insert into an empty table) instead of inserting
+  the keys one at a time.
+
+  The caller extracts the key of every row and hands it over with
+  add_entry(). Entries are collected in a buffer; each full buffer is
+  sorted by a worker thread and written to a temporary file as a sorted
+  run, while the caller goes on filling the next buffer. end_build()
+  sorts what is left in slices, one thread each, merges all of the runs
+  (a k-way merge over a heap) and streams the entries in key order into
+  Spartan_index::bulk_add(), which writes the leaves and then the nodes
+  above them bottom-up. end_builds() does that for several indexes at
+  once, each in its own thread.
+
+  At most threads buffers are being sorted at a time, so memory use is
+  bounded by the budget given to the builder, not by the size of the
+  table.
+
+  Entries are stored as the key padded with zeros to the widest key, the
+  key length (uchar) and the row position, and sort by key and then row
+  position as they do in the index. When unique_len is not 0 only the
+  first row of each value of the first unique_len key bytes is indexed,
+  as Spartan_index::insert_key() does for an index without duplicates;
+  the rows left out are counted by duplicates(), which the caller of a
+  unique index reports as an error. The offsets of the NULL markers in
+  the key are given with add_null_marker(): an entry with a 0 marker in
+  its unique bytes holds a NULL, which equals no other value, so it is
+  always indexed.
+
+  A builder belongs to the one caller that feeds it, and the worker
+  threads touch nothing but their run. A rebuild or a REPAIR holds the
+  share mutex from the first add_entry() until end_build() returns. A
+  bulk insert only holds it for each add_entry() (in write_row()) and
+  for end_builds(), and releases it in between. The index itself is
+  only written by end_build(), which is always called with the mutex
+  held.
+*/
+#include "my_global.h"
+#include "my_sys.h"
+#include "my_pthread.h"
+#include "spartan_index.h"
+
+/* default memory for the buffers of one build */
+const ulonglong SDI_BUILD_MEMORY = 64 * 1024 * 1024;
+/* default number of threads that sort at a time */
+const uint SDI_BUILD_THREADS = 4;
+/* most builds end_builds() runs at once; the rest run one by one */
+const uint SDI_BUILD_MAX_PARALLEL = 64;
+/* bytes of a run file read at a time during the merge */
+const uint SDI_BUILD_READ = 65536;
+/* fewest entries worth sorting in a thread of their own */
+const ulonglong SDI_BUILD_MIN_SLICE = 4096;
+/* most NULL markers in a key (one per key part) */
+const uint SDI_BUILD_MAX_NULLS = 16;
+
+class Spartan_index_builder;
+
+/* a sorted run: a sorted buffer or a temporary file written from one */
+struct SDI_BUILD_RUN
+{
+  Spartan_index_builder *builder;
+  uchar *entries;
+  ulonglong count;
+  bool spill;                 /* write to a file once sorted */
+  File file;                  /* -1 while the run is in memory */
+  pthread_t thread;
+  bool threaded;              /* being sorted by thread */
+  int error;
+  uchar *buf;                 /* merge: the entries read and not used */
+  size_t len;
+  size_t off;
+  my_off_t read_at;
+};
+
+class Spartan_index_builder
+{
+public:
+  Spartan_index_builder(Spartan_index *index, int key_len, int unique_len,
+                        ulonglong memory, uint threads, const char *tmpdir);
+  ~Spartan_index_builder(void);
+  void add_null_marker(uint offset);
+  int add_entry(uchar *key, int key_len, long long pos);
+  int end_build();
+  static int end_builds(Spartan_index_builder **builders, uint count);
+  ulonglong entries() { return total; }
+  ulonglong duplicates() { return dupes; }
+private:
+  Spartan_index *index;
+  uint width;                 /* key bytes stored per entry */
+  uint entry_len;
+  uint unique_len;
+  uint null_at[SDI_BUILD_MAX_NULLS]; /* NULL markers in the unique bytes */
+  uint num_nulls;
+  uint threads;
+  ulonglong run_entries;      /* entries a buffer holds */
+  char tmpdir[FN_REFLEN];
+  SDI_BUILD_RUN **runs;
+  uint num_runs;
+  uint runs_size;
+  uint joined;                /* runs before this are sorted */
+  uchar *current;             /* the buffer being filled */
+  ulonglong count;            /* entries in it */
+  ulonglong total;
+  ulonglong dupes;            /* entries left out by unique_len */
+  int error;
+  int build_rc;               /* result of end_build() for end_builds() */
+  static int compare_entries(const void *arg, const void *a, const void *b);
+  static void *sort_main(void *arg);
+  static void *build_main(void *arg);
+  static void sort_run(SDI_BUILD_RUN *run);
+  SDI_BUILD_RUN *new_run(uchar *entries, ulonglong n, bool spill);
+  void start_sort(SDI_BUILD_RUN *run);
+  void join_runs(uint busy);
+  bool fill_run(SDI_BUILD_RUN *run);
+  void sift_down(uint *heap, uint n, uint i);
+  bool has_null(const uchar *e);
+  int merge_runs();
+  void free_runs();
+};
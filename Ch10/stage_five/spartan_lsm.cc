@@ -0,0 +1,1096 @@
+/*
+  Spartan_lsm.cc
+
+  This class keeps a Spartan index as a log-structured merge tree (see
+  spartan_lsm.h): a memory table in front of immutable sorted runs that
+  a background thread merges level by level. Spartan_index hands every
+  call of an index created with SDI_ORG_LSM to this class.
+*/
+#include "spartan_lsm.h"
+#include "my_base.h"
+#include "m_string.h"
+#include "my_atomic.h"
+#include <string.h>
+
+/* bytes of a run entry: the key, its length and the stored position */
+static inline uint entry_size(uint width)
+{
+  return width + 1 + sizeof(long long);
+}
+
+static inline uchar *run_entry(SDI_RUN *run, ulonglong i)
+{
+  return run->entries + (size_t)i * entry_size(run->width);
+}
+
+/* stored position of a run entry: pos * 2 + deleted */
+static inline long long run_pos(SDI_RUN *run, ulonglong i)
+{
+  return (long long)uint8korr(run_entry(run, i) + run->width + 1);
+}
+
+/* compare two keys as if both were padded with zeros */
+static int compare_padded(uchar *a, uint a_len, uchar *b, uint b_len)
+{
+  uint n = MY_MIN(a_len, b_len);
+  int rc;
+
+  if ((rc = memcmp(a, b, n)) != 0)
+    return rc;
+  for (; n < a_len; n++)
+    if (a[n] != 0)
+      return 1;
+  for (; n < b_len; n++)
+    if (b[n] != 0)
+      return -1;
+  return 0;
+}
+
+/* order two entries by key and row, whatever their deleted flags */
+static int compare_entries(uchar *a, uint a_len, long long a_pos,
+                           uchar *b, uint b_len, long long b_pos)
+{
+  int rc = compare_padded(a, a_len, b, b_len);
+
+  if (rc != 0)
+    return rc;
+  a_pos >>= 1;
+  b_pos >>= 1;
+  return (a_pos < b_pos) ? -1 : (a_pos > b_pos) ? 1 : 0;
+}
+
+/*
+  Hash of a key for the bloom filters: FNV-1a over the key without its
+  trailing zeros (keys compare as if padded with them), then mixed so
+  that both halves can serve as hash functions.
+*/
+static ulonglong key_hash(uchar *key, int key_len)
+{
+  ulonglong h = 14695981039346656037ULL;
+  int i;
+
+  while ((key_len > 0) && (key[key_len - 1] == 0))
+    key_len--;
+  for (i = 0; i < key_len; i++)
+  {
+    h ^= key[i];
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* set or test the bits of a key (double hashing) */
+static bool bloom_bits(uchar *bloom, ulonglong bits, uint hashes,
+                       ulonglong h, bool set)
+{
+  ulonglong h2 = ((h >> 32) | (h << 32)) | 1;
+  ulonglong bit;
+  uint i;
+
+  for (i = 0; i < hashes; i++, h += h2)
+  {
+    bit = h % bits;
+    if (set)
+      bloom[bit >> 3] |= (uchar)(1 << (bit & 7));
+    else if (!(bloom[bit >> 3] & (1 << (bit & 7))))
+      return false;
+  }
+  return true;
+}
+
+Spartan_lsm::Spartan_lsm(File file, const char *path, int keylen)
+{
+  index_file = file;
+  strmake(index_path, path, sizeof(index_path) - 1);
+  max_key_len = keylen;
+  memtable = new Spartan_art(keylen);
+  memtable_size = SDI_LSM_MEMTABLE;
+  memtable_dead = 0;
+  num_runs = 0;
+  next_run = 1;
+  merging = false;
+  threaded = false;
+  memset(&job, 0, sizeof(job));
+}
+
+Spartan_lsm::~Spartan_lsm(void)
+{
+  close_runs();
+  delete memtable;
+}
+
+/* name of run id of the index file path */
+char *Spartan_lsm::run_name(char *buff, const char *path, uint32 id)
+{
+  my_snprintf(buff, FN_REFLEN, "%s.%u", path, (uint)id);
+  return buff;
+}
+
+/*
+  Read the run list from an index file, returning the number of runs
+  (0 if the file is not a log-structured index).
+*/
+uint Spartan_lsm::read_manifest(File file, uint32 *next, uint32 *ids,
+                                uint *levels)
+{
+  uchar buf[SDI_HEADER_SIZE + 8 + SDI_LSM_MAX_RUNS * 8];
+  uchar *p = buf + SDI_HEADER_SIZE;
+  size_t len;
+  uint count;
+  uint i;
+
+  len = my_pread(file, buf, sizeof(buf), 0L, MYF(0));
+  if ((len == (size_t)-1) || (len < SDI_HEADER_SIZE + 8) ||
+      (uint4korr(buf) != SDI_MAGIC) || (buf[10] != SDI_ORG_LSM))
+    return 0;
+  *next = uint4korr(p);
+  count = uint4korr(p + 4);
+  if ((count > SDI_LSM_MAX_RUNS) ||
+      (len < SDI_HEADER_SIZE + 8 + (size_t)count * 8))
+    return 0;
+  for (i = 0; i < count; i++)
+  {
+    ids[i] = uint4korr(p + 8 + i * 8);
+    levels[i] = uint4korr(p + 12 + i * 8);
+  }
+  return count;
+}
+
+/* write the run list after the header of the index file */
+int Spartan_lsm::write_manifest()
+{
+  uchar buf[8 + SDI_LSM_MAX_RUNS * 8];
+  uint i;
+
+  DBUG_ENTER("Spartan_lsm::write_manifest");
+  int4store(buf, next_run);
+  int4store(buf + 4, num_runs);
+  for (i = 0; i < num_runs; i++)
+  {
+    int4store(buf + 8 + i * 8, runs[i]->id);
+    int4store(buf + 12 + i * 8, runs[i]->level);
+  }
+  if (my_pwrite(index_file, buf, 8 + num_runs * 8, SDI_HEADER_SIZE,
+                MYF(MY_NABP)))
+    DBUG_RETURN(-1);
+  DBUG_RETURN(0);
+}
+
+/* open the runs listed in the index file */
+int Spartan_lsm::open_runs()
+{
+  uint32 ids[SDI_LSM_MAX_RUNS];
+  uint levels[SDI_LSM_MAX_RUNS];
+  uint32 next = 1;
+  SDI_RUN *run;
+  uint count;
+  uint i;
+  int rc = 0;
+
+  DBUG_ENTER("Spartan_lsm::open_runs");
+  close_runs();
+  count = read_manifest(index_file, &next, ids, levels);
+  next_run = MY_MAX(next, 1);
+  for (i = 0; i < count; i++)
+  {
+    if ((run = open_run(index_path, ids[i])) == NULL)
+    {
+      rc = -1;
+      continue;
+    }
+    run->level = levels[i];
+    runs[num_runs++] = run;
+  }
+  DBUG_RETURN(rc);
+}
+
+/* wait for the merge thread and close the runs */
+int Spartan_lsm::close_runs()
+{
+  DBUG_ENTER("Spartan_lsm::close_runs");
+  install_merge(true);
+  while (num_runs > 0)
+    free_run(runs[--num_runs]);
+  DBUG_RETURN(0);
+}
+
+/*
+  Open run id of an index. The file is mapped where the platform has
+  mmap(), otherwise read into memory; either way it is used in place.
+*/
+SDI_RUN *Spartan_lsm::open_run(const char *path, uint32 id)
+{
+  char name[FN_REFLEN];
+  SDI_RUN *run;
+  my_off_t size;
+  uchar *data = NULL;
+  bool mapped = false;
+  File file;
+
+  DBUG_ENTER("Spartan_lsm::open_run");
+  if ((file = my_open(run_name(name, path, id), O_RDONLY | O_BINARY,
+                      MYF(0))) == -1)
+    DBUG_RETURN(NULL);
+  size = my_seek(file, 0L, MY_SEEK_END, MYF(0));
+  if ((size == MY_FILEPOS_ERROR) || (size < (my_off_t)SDI_LSM_HEADER))
+  {
+    my_close(file, MYF(0));
+    DBUG_RETURN(NULL);
+  }
+#ifdef HAVE_MMAP
+  data = (uchar *)my_mmap(0, (size_t)size, PROT_READ, MAP_SHARED, file, 0L);
+  if (data == (uchar *)MAP_FAILED)
+    data = NULL;
+  else
+    mapped = true;
+#endif
+  if ((data == NULL) &&
+      ((data = (uchar *)my_malloc((size_t)size, MYF(MY_WME))) != NULL) &&
+      my_pread(file, data, (size_t)size, 0L, MYF(MY_NABP)))
+  {
+    my_free(data);
+    data = NULL;
+  }
+  my_close(file, MYF(0));
+  if ((data == NULL) ||
+      ((run = (SDI_RUN *)my_malloc(sizeof(SDI_RUN), MYF(MY_WME))) == NULL))
+  {
+#ifdef HAVE_MMAP
+    if (mapped)
+      my_munmap((char *)data, (size_t)size);
+    else
+#endif
+      my_free(data);
+    DBUG_RETURN(NULL);
+  }
+  run->id = id;
+  run->data = data;
+  run->size = (size_t)size;
+  run->mapped = mapped;
+  run->width = uint4korr(data + 4);
+  run->level = uint4korr(data + 8);
+  run->hashes = uint4korr(data + 12);
+  run->count = uint8korr(data + 16);
+  run->dead = uint8korr(data + 24);
+  run->bloom_bits = uint8korr(data + 32) * 8;
+  run->entries = data + SDI_LSM_HEADER;
+  run->bloom = run->entries + (size_t)run->count * entry_size(run->width);
+  if ((uint4korr(data) != SDI_LSM_MAGIC) ||
+      (run->width > (uint)SDI_MAX_KEY_LEN) || (run->bloom_bits == 0) ||
+      (SDI_LSM_HEADER + run->count * entry_size(run->width) +
+       run->bloom_bits / 8 != size))
+  {
+    free_run(run);
+    DBUG_RETURN(NULL);
+  }
+  DBUG_RETURN(run);
+}
+
+void Spartan_lsm::free_run(SDI_RUN *run)
+{
+#ifdef HAVE_MMAP
+  if (run->mapped)
+    my_munmap((char *)run->data, run->size);
+  else
+#endif
+    my_free(run->data);
+  my_free(run);
+}
+
+/* the first entry of a run not less than (key, stored position pos) */
+ulonglong Spartan_lsm::run_search(SDI_RUN *run, uchar *key, int key_len,
+                                  long long pos)
+{
+  ulonglong lo = 0;
+  ulonglong hi = run->count;
+  ulonglong mid;
+  long long p;
+  int rc;
+
+  while (lo < hi)
+  {
+    mid = lo + (hi - lo) / 2;
+    rc = compare_padded(run_entry(run, mid), run->width, key, key_len);
+    if (rc == 0)
+    {
+      p = run_pos(run, mid);
+      rc = (p < pos) ? -1 : (p > pos) ? 1 : 0;
+    }
+    if (rc < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* false if the run certainly holds no entry with the key */
+bool Spartan_lsm::bloom_test(SDI_RUN *run, uchar *key, int key_len)
+{
+  return bloom_bits(run->bloom, run->bloom_bits, run->hashes,
+                    key_hash(key, key_len), false);
+}
+
+/* start writing run id with room in its bloom filter for entries */
+int Spartan_lsm::begin_run(SDI_RUN_WRITER *w, const char *path, uint32 id,
+                           uint width, ulonglong entries)
+{
+  char name[FN_REFLEN];
+
+  DBUG_ENTER("Spartan_lsm::begin_run");
+  w->width = width;
+  w->count = 0;
+  w->dead = 0;
+  w->used = 0;
+  w->bloom_bits = MY_MAX(entries * SDI_LSM_BLOOM_BITS, 64);
+  w->bloom_bits = (w->bloom_bits + 63) & ~(ulonglong)63;
+  w->bloom = (uchar *)my_malloc((size_t)(w->bloom_bits / 8),
+                                MYF(MY_ZEROFILL | MY_WME));
+  w->buf = (uchar *)my_malloc(SDI_LSM_WRITE_ENTRIES * entry_size(width),
+                              MYF(MY_WME));
+  w->file = my_open(run_name(name, path, id),
+                    O_RDWR | O_CREAT | O_TRUNC | O_BINARY, MYF(0));
+  if ((w->bloom == NULL) || (w->buf == NULL) || (w->file == -1) ||
+      (my_seek(w->file, SDI_LSM_HEADER, MY_SEEK_SET, MYF(0)) ==
+       MY_FILEPOS_ERROR))
+  {
+    if (w->file != -1)
+    {
+      my_close(w->file, MYF(0));
+      my_delete(name, MYF(0));
+    }
+    w->file = -1;
+    my_free(w->bloom);
+    my_free(w->buf);
+    w->bloom = w->buf = NULL;
+    DBUG_RETURN(-1);
+  }
+  DBUG_RETURN(0);
+}
+
+/*
+  Append an entry (entries must arrive in order). key holds key_width
+  bytes; the entry is padded with zeros to the width of the run. pos is
+  the stored position, pos * 2 + deleted.
+*/
+int Spartan_lsm::add_run_entry(SDI_RUN_WRITER *w, uchar *key, uint key_width,
+                               int length, long long pos)
+{
+  uchar *e = w->buf + (size_t)w->used * entry_size(w->width);
+
+  key_width = MY_MIN(key_width, w->width);
+  memcpy(e, key, key_width);
+  memset(e + key_width, 0, w->width - key_width);
+  e[w->width] = (uchar)length;
+  int8store(e + w->width + 1, (ulonglong)pos);
+  bloom_bits(w->bloom, w->bloom_bits, SDI_LSM_BLOOM_HASHES,
+             key_hash(e, w->width), true);
+  w->count++;
+  if (pos & 1)
+    w->dead++;
+  if (++w->used < SDI_LSM_WRITE_ENTRIES)
+    return 0;
+  w->used = 0;
+  return my_write(w->file, w->buf, SDI_LSM_WRITE_ENTRIES * entry_size(w->width),
+                  MYF(MY_NABP)) ? -1 : 0;
+}
+
+/*
+  Write what is left of the entries, the bloom filter and the header,
+  and open the finished run. A run that could not be written is
+  removed and NULL returned.
+*/
+SDI_RUN *Spartan_lsm::end_run(SDI_RUN_WRITER *w, const char *path, uint32 id,
+                              uint level, bool failed)
+{
+  uchar hdr[SDI_LSM_HEADER];
+  char name[FN_REFLEN];
+  SDI_RUN *run = NULL;
+
+  DBUG_ENTER("Spartan_lsm::end_run");
+  memset(hdr, 0, sizeof(hdr));
+  int4store(hdr, SDI_LSM_MAGIC);
+  int4store(hdr + 4, w->width);
+  int4store(hdr + 8, level);
+  int4store(hdr + 12, SDI_LSM_BLOOM_HASHES);
+  int8store(hdr + 16, w->count);
+  int8store(hdr + 24, w->dead);
+  int8store(hdr + 32, w->bloom_bits / 8);
+  if (failed ||
+      ((w->used > 0) &&
+       my_write(w->file, w->buf, w->used * entry_size(w->width),
+                MYF(MY_NABP))) ||
+      my_write(w->file, w->bloom, (size_t)(w->bloom_bits / 8), MYF(MY_NABP)) ||
+      my_pwrite(w->file, hdr, sizeof(hdr), 0L, MYF(MY_NABP)))
+    failed = true;
+  my_close(w->file, MYF(0));
+  my_free(w->bloom);
+  my_free(w->buf);
+  w->bloom = w->buf = NULL;
+  if (failed || ((run = open_run(path, id)) == NULL))
+  {
+    my_delete(run_name(name, path, id), MYF(0));
+    DBUG_RETURN(NULL);
+  }
+  DBUG_RETURN(run);
+}
+
+/*
+  Whether the newest source that holds the entry (key, pos) has it live
+  (1) or deleted (0); -1 if none holds it.
+*/
+int Spartan_lsm::state(uchar *key, int key_len, long long pos)
+{
+  SDE_ART_LEAF *leaf;
+  SDI_RUN *run;
+  ulonglong i;
+  uint r;
+
+  leaf = memtable->lower_bound(key, key_len, pos * 2);
+  if ((leaf != NULL) && ((leaf->pos >> 1) == pos) &&
+      (compare_padded(leaf->key, max_key_len, key, key_len) == 0))
+    return (leaf->pos & 1) ? 0 : 1;
+  for (r = 0; r < num_runs; r++)
+  {
+    run = runs[r];
+    if (!bloom_test(run, key, key_len))
+      continue;
+    i = run_search(run, key, key_len, pos * 2);
+    if ((i < run->count) && ((run_pos(run, i) >> 1) == pos) &&
+        (compare_padded(run_entry(run, i), run->width, key, key_len) == 0))
+      return (run_pos(run, i) & 1) ? 0 : 1;
+  }
+  return -1;
+}
+
+/*
+  Move the cursor to the first live entry after its entry, or the last
+  one before it. Every source is searched for its nearest entry on that
+  side and the nearest of those is taken; if it is deleted the search
+  goes on from it. A seek looks only for entries with the cursor's key,
+  so it skips the runs whose bloom filter does not have the key.
+*/
+SDE_INDEX *Spartan_lsm::step(SDI_CURSOR *cursor, bool forward, bool seek)
+{
+  uchar key[SDI_MAX_KEY_LEN];
+  uchar best[SDI_MAX_KEY_LEN];
+  int key_len = cursor->ndx.length;
+  long long pos = cursor->ndx.pos;
+  int best_len = 0;
+  long long best_pos = 0;
+  bool found;
+  SDE_ART_LEAF *leaf;
+  SDI_RUN *run;
+  long long bound;
+  long long p;
+  ulonglong i;
+  uchar *e;
+  uint r;
+  int rc;
+
+  memcpy(key, cursor->ndx.key, max_key_len);
+  for (;;)
+  {
+    found = false;
+    bound = forward ? pos * 2 + 2 : pos * 2;
+    leaf = memtable->lower_bound(key, key_len, bound);
+    if (!forward)
+      leaf = (leaf != NULL) ? leaf->prev : memtable->last();
+    if (leaf != NULL)
+    {
+      memcpy(best, leaf->key, max_key_len);
+      best_len = leaf->length;
+      best_pos = leaf->pos >> 1;
+      found = true;
+    }
+    for (r = 0; r < num_runs; r++)
+    {
+      run = runs[r];
+      if (seek && !bloom_test(run, key, key_len))
+        continue;
+      i = run_search(run, key, key_len, bound);
+      if (forward ? (i == run->count) : (i-- == 0))
+        continue;
+      e = run_entry(run, i);
+      p = run_pos(run, i);
+      if (found)
+      {
+        rc = compare_entries(e, run->width, p, best, max_key_len,
+                             best_pos * 2);
+        if (forward ? (rc >= 0) : (rc <= 0))
+          continue;
+      }
+      memset(best, 0, max_key_len);
+      memcpy(best, e, run->width);
+      best_len = e[run->width];
+      best_pos = p >> 1;
+      found = true;
+    }
+    if (!found ||
+        (seek && (compare_padded(best, max_key_len, key, key_len) != 0)))
+      return NULL;
+    if (state(best, max_key_len, best_pos) == 1)
+      break;
+    memcpy(key, best, max_key_len);
+    if (!seek)
+      key_len = max_key_len;
+    pos = best_pos;
+  }
+  memcpy(cursor->ndx.key, best, max_key_len);
+  cursor->ndx.length = best_len;
+  cursor->ndx.pos = best_pos;
+  return &cursor->ndx;
+}
+
+/* put the cursor on (key, pos) without looking anything up */
+static void cursor_place(SDI_CURSOR *cursor, uchar *key, int key_len,
+                         int max_key_len, long long pos)
+{
+  if (key_len > max_key_len)
+    key_len = max_key_len;
+  memset(cursor->ndx.key, 0, max_key_len);
+  memcpy(cursor->ndx.key, key, key_len);
+  cursor->ndx.length = key_len;
+  cursor->ndx.pos = pos;
+  cursor->version = 0;
+}
+
+SDE_INDEX *Spartan_lsm::cursor_first(SDI_CURSOR *cursor)
+{
+  DBUG_ENTER("Spartan_lsm::cursor_first");
+  install_merge(false);
+  memset(cursor->ndx.key, 0, max_key_len);
+  cursor->ndx.length = 0;
+  cursor->ndx.pos = -1;
+  cursor->version = 0;
+  DBUG_RETURN(step(cursor, true, false));
+}
+
+/*
+  Position the cursor on the last entry: the last one before a key of
+  all 0xff bytes and a row past any in a data file.
+*/
+SDE_INDEX *Spartan_lsm::cursor_last(SDI_CURSOR *cursor)
+{
+  DBUG_ENTER("Spartan_lsm::cursor_last");
+  install_merge(false);
+  memset(cursor->ndx.key, 0xff, max_key_len);
+  cursor->ndx.length = max_key_len;
+  cursor->ndx.pos = LONGLONG_MAX / 2;
+  cursor->version = 0;
+  DBUG_RETURN(step(cursor, false, false));
+}
+
+SDE_INDEX *Spartan_lsm::cursor_next(SDI_CURSOR *cursor)
+{
+  DBUG_ENTER("Spartan_lsm::cursor_next");
+  install_merge(false);
+  DBUG_RETURN(step(cursor, true, false));
+}
+
+SDE_INDEX *Spartan_lsm::cursor_prev(SDI_CURSOR *cursor)
+{
+  DBUG_ENTER("Spartan_lsm::cursor_prev");
+  install_merge(false);
+  DBUG_RETURN(step(cursor, false, false));
+}
+
+/*
+  Position the cursor on the first entry not before key. When there is
+  none the cursor stays on the key, so cursor_prev() gives the last
+  entry.
+*/
+SDE_INDEX *Spartan_lsm::cursor_lower_bound(SDI_CURSOR *cursor, uchar *key,
+                                           int key_len)
+{
+  DBUG_ENTER("Spartan_lsm::cursor_lower_bound");
+  install_merge(false);
+  cursor_place(cursor, key, key_len, max_key_len, -1);
+  DBUG_RETURN(step(cursor, true, false));
+}
+
+/* position the cursor on the first entry with key */
+SDE_INDEX *Spartan_lsm::cursor_seek(SDI_CURSOR *cursor, uchar *key,
+                                    int key_len)
+{
+  DBUG_ENTER("Spartan_lsm::cursor_seek");
+  install_merge(false);
+  cursor_place(cursor, key, key_len, max_key_len, -1);
+  DBUG_RETURN(step(cursor, true, true));
+}
+
+/* add an entry to the memory table, writing it out when it is full */
+int Spartan_lsm::insert_key(SDE_INDEX *ndx, bool allow_dupes)
+{
+  SDI_CURSOR probe;
+
+  DBUG_ENTER("Spartan_lsm::insert_key");
+  install_merge(false);
+  if (!allow_dupes && (cursor_seek(&probe, ndx->key, ndx->length) != NULL))
+    DBUG_RETURN(-1);
+  /*
+    The entry may come back after a delete. Its tombstone hid the same
+    entry in a run, which is seen again once the tombstone is gone.
+  */
+  if (memtable->remove(ndx->key, ndx->length, ndx->pos * 2 + 1) == 0)
+    memtable_dead--;
+  else if (memtable->insert(ndx->key, ndx->length, ndx->pos * 2) < 0)
+    DBUG_RETURN(-1);
+  memtable->reclaim();
+  if ((memtable->memory_used() >= memtable_size) && flush_memtable())
+    DBUG_RETURN(-1);
+  DBUG_RETURN(1);
+}
+
+/*
+  Delete an entry (the first with the key if pos is -1). An entry in the
+  memory table is only there, so it is removed in place; otherwise a
+  tombstone is added for it if a run may hold it.
+*/
+int Spartan_lsm::delete_key(uchar *key, long long pos, int key_len)
+{
+  SDI_CURSOR probe;
+  SDE_INDEX *ndx;
+  uint r;
+
+  DBUG_ENTER("Spartan_lsm::delete_key");
+  install_merge(false);
+  if (pos == -1)
+  {
+    if ((ndx = cursor_seek(&probe, key, key_len)) == NULL)
+      DBUG_RETURN(0);
+    pos = ndx->pos;
+  }
+  if (memtable->remove(key, key_len, pos * 2) != 0)
+  {
+    for (r = 0; r < num_runs; r++)
+    {
+      if (bloom_test(runs[r], key, key_len))
+      {
+        if (memtable->insert(key, key_len, pos * 2 + 1) == 0)
+          memtable_dead++;
+        break;
+      }
+    }
+  }
+  memtable->reclaim();
+  if ((memtable->memory_used() >= memtable_size) && flush_memtable())
+    DBUG_RETURN(-1);
+  DBUG_RETURN(0);
+}
+
+/*
+  Estimate the number of entries from the first entry not before
+  min_key up to the first entry not before max_key (NULL for either end
+  of the index). Runs are counted by searching them for the two keys,
+  the memory table by walking it. Tombstones are counted as entries.
+*/
+long long Spartan_lsm::range_size(uchar *min_key, int min_len,
+                                  uchar *max_key, int max_len)
+{
+  SDE_ART_LEAF *leaf;
+  long long n = 0;
+  ulonglong lo;
+  ulonglong hi;
+  uint r;
+
+  DBUG_ENTER("Spartan_lsm::range_size");
+  install_merge(false);
+  for (r = 0; r < num_runs; r++)
+  {
+    lo = (min_key != NULL) ? run_search(runs[r], min_key, min_len, 0) : 0;
+    hi = (max_key != NULL) ? run_search(runs[r], max_key, max_len, 0) :
+                             runs[r]->count;
+    if (hi > lo)
+      n += (long long)(hi - lo);
+  }
+  leaf = (min_key != NULL) ? memtable->lower_bound(min_key, min_len, 0) :
+                             memtable->first();
+  for (; (leaf != NULL) &&
+         ((max_key == NULL) ||
+          (compare_padded(leaf->key, max_key_len, max_key, max_len) < 0));
+       leaf = leaf->next)
+    n++;
+  DBUG_RETURN(n);
+}
+
+/*
+  Estimate how many entries share each of the key prefixes whose lengths
+  are given (shortest first), as Spartan_index::sample_prefixes() does.
+  The samples are SDI_SAMPLE_PAGES stretches of SDI_LSM_SAMPLE_ENTRIES
+  entries spread over the largest run, or the whole memory table when
+  no run is larger.
+*/
+void Spartan_lsm::sample_prefixes(uint *prefix_len, uint parts,
+                                  double *per_prefix)
+{
+  uchar key[2][SDI_MAX_KEY_LEN];
+  double *distinct = per_prefix;   /* counted in place */
+  double entries = 0.0;
+  SDE_ART_LEAF *leaf;
+  SDI_RUN *run = NULL;
+  ulonglong start;
+  ulonglong i;
+  ulonglong n;
+  uint r;
+  uint s;
+  uint j;
+
+  DBUG_ENTER("Spartan_lsm::sample_prefixes");
+  install_merge(false);
+  for (j = 0; j < parts; j++)
+    distinct[j] = 0.0;
+  for (r = 0; r < num_runs; r++)
+    if ((run == NULL) || (runs[r]->count > run->count))
+      run = runs[r];
+  if ((run != NULL) && (run->count >= (ulonglong)memtable->size()))
+  {
+    for (s = 0; s < (uint)SDI_SAMPLE_PAGES; s++)
+    {
+      start = (ulonglong)((s + 0.5) / SDI_SAMPLE_PAGES * run->count);
+      n = MY_MIN(run->count - start, SDI_LSM_SAMPLE_ENTRIES);
+      for (i = 0; i < n; i++)
+      {
+        memset(key[i & 1], 0, max_key_len);
+        memcpy(key[i & 1], run_entry(run, start + i), run->width);
+        for (j = 0; j < parts; j++)
+          if ((i == 0) ||
+              (memcmp(key[i & 1], key[(i - 1) & 1], prefix_len[j]) != 0))
+            distinct[j]++;
+      }
+      entries += n;
+    }
+  }
+  else
+  {
+    for (i = 0, leaf = memtable->first(); leaf != NULL;
+         leaf = leaf->next, i++)
+    {
+      for (j = 0; j < parts; j++)
+        if ((leaf->prev == NULL) ||
+            (memcmp(leaf->key, leaf->prev->key, prefix_len[j]) != 0))
+          distinct[j]++;
+    }
+    entries = (double)i;
+  }
+  for (j = 0; j < parts; j++)
+    per_prefix[j] = (distinct[j] > 0.0) ? entries / distinct[j] : 1.0;
+  DBUG_VOID_RETURN;
+}
+
+/* live entries: each tombstone hides one entry in an older source */
+long long Spartan_lsm::key_count()
+{
+  long long n;
+  uint r;
+
+  n = memtable->size() - 2 * (long long)memtable_dead;
+  for (r = 0; r < num_runs; r++)
+    n += (long long)(runs[r]->count - 2 * runs[r]->dead);
+  return MY_MAX(n, 0);
+}
+
+/*
+  Write the memory table out as the newest run of level 0 and start a
+  merge if that fills the level. With the list of runs full the merge
+  under way is waited for first.
+*/
+int Spartan_lsm::flush_memtable()
+{
+  SDI_RUN_WRITER w;
+  SDE_ART_LEAF *leaf;
+  SDI_RUN *run;
+  uint width = 0;
+  int rc = 0;
+
+  DBUG_ENTER("Spartan_lsm::flush_memtable");
+  install_merge(num_runs == SDI_LSM_MAX_RUNS);
+  if (memtable->size() == 0)
+    DBUG_RETURN(0);
+  if (num_runs == SDI_LSM_MAX_RUNS)
+    DBUG_RETURN(-1);
+  for (leaf = memtable->first(); leaf != NULL; leaf = leaf->next)
+    width = MY_MAX(width, (uint)leaf->length);
+  if (begin_run(&w, index_path, next_run, width, memtable->size()))
+    DBUG_RETURN(-1);
+  for (leaf = memtable->first(); (leaf != NULL) && (rc == 0);
+       leaf = leaf->next)
+    rc = add_run_entry(&w, leaf->key, width, leaf->length, leaf->pos);
+  if ((run = end_run(&w, index_path, next_run, 0, rc != 0)) == NULL)
+    DBUG_RETURN(-1);
+  next_run++;
+  memmove(runs + 1, runs, num_runs * sizeof(SDI_RUN *));
+  runs[0] = run;
+  num_runs++;
+  if (write_manifest())
+    DBUG_RETURN(-1);
+  clear_memtable();
+  start_merge();
+  DBUG_RETURN(0);
+}
+
+/* drop the memory table without writing it */
+void Spartan_lsm::clear_memtable()
+{
+  memtable->clear();
+  memtable_dead = 0;
+}
+
+/* remove every entry of the index */
+int Spartan_lsm::truncate()
+{
+  char name[FN_REFLEN];
+  SDI_RUN *run;
+
+  DBUG_ENTER("Spartan_lsm::truncate");
+  install_merge(true);
+  clear_memtable();
+  while (num_runs > 0)
+  {
+    run = runs[--num_runs];
+    run_name(name, index_path, run->id);
+    free_run(run);
+    my_delete(name, MYF(0));
+  }
+  DBUG_RETURN(write_manifest());
+}
+
+/* size a run of level may grow to before it is merged into the next */
+ulonglong Spartan_lsm::level_limit(uint level)
+{
+  ulonglong limit = SDI_LSM_LEVEL0_RUNS * memtable_size;
+
+  while (level-- > 1)
+    limit *= SDI_LSM_FANOUT;
+  return limit;
+}
+
+/*
+  Start a merge if one is due and none is under way: the runs of level
+  0 when there are SDI_LSM_LEVEL0_RUNS of them, or else the first level
+  that is over its limit, in each case with the run of the level below.
+  The merge runs in its own thread, or here if none can be started.
+*/
+void Spartan_lsm::start_merge()
+{
+  uint first = 0;
+  uint end = 0;
+  uint level;
+  uint r;
+
+  if (merging)
+    return;
+  while ((end < num_runs) && (runs[end]->level == 0))
+    end++;
+  if (end >= SDI_LSM_LEVEL0_RUNS)
+    level = 1;
+  else
+  {
+    for (first = end; first < num_runs; first++)
+      if ((runs[first]->size > level_limit(runs[first]->level)) &&
+          (runs[first]->level < SDI_LSM_MAX_LEVEL))
+        break;
+    if (first == num_runs)
+      return;
+    level = runs[first]->level + 1;
+    end = first + 1;
+  }
+  if ((end < num_runs) && (runs[end]->level == level))
+    end++;
+  job.lsm = this;
+  job.inputs = 0;
+  for (r = first; r < end; r++)
+    job.input[job.inputs++] = runs[r];
+  job.id = next_run++;
+  job.level = level;
+  job.last = (end == num_runs);
+  job.output = NULL;
+  job.done = 0;
+  merging = true;
+  threaded = (pthread_create(&merge_thread, NULL, merge_main, &job) == 0);
+  if (!threaded)
+  {
+    merge_runs(&job, index_path);
+    job.done = 1;
+  }
+}
+
+/* body of the merge thread */
+void *Spartan_lsm::merge_main(void *arg)
+{
+  SDI_LSM_JOB *j = (SDI_LSM_JOB *)arg;
+
+  my_thread_init();
+  merge_runs(j, j->lsm->index_path);
+  my_atomic_store32(&j->done, 1);
+  my_thread_end();
+  return NULL;
+}
+
+/*
+  Merge the input runs of a job into one run. Where several inputs hold
+  the same entry only the one from the newest input is kept, and when
+  the result is the last level tombstones are left out altogether.
+  Only the inputs, which no one changes, are read.
+*/
+void Spartan_lsm::merge_runs(SDI_LSM_JOB *j, const char *path)
+{
+  ulonglong at[SDI_LSM_MAX_RUNS];
+  ulonglong total = 0;
+  SDI_RUN_WRITER w;
+  SDI_RUN *best_run;
+  SDI_RUN *run;
+  long long best_pos;
+  uint width = 0;
+  uchar *best;
+  int rc = 0;
+  uint k;
+
+  for (k = 0; k < j->inputs; k++)
+  {
+    at[k] = 0;
+    total += j->input[k]->count;
+    width = MY_MAX(width, j->input[k]->width);
+  }
+  if (begin_run(&w, path, j->id, width, total))
+    return;
+  while (rc == 0)
+  {
+    best_run = NULL;
+    best = NULL;
+    best_pos = 0;
+    for (k = 0; k < j->inputs; k++)
+    {
+      run = j->input[k];
+      if (at[k] == run->count)
+        continue;
+      /* ties go to the earlier, newer, input */
+      if ((best_run == NULL) ||
+          (compare_entries(run_entry(run, at[k]), run->width,
+                           run_pos(run, at[k]), best, best_run->width,
+                           best_pos) < 0))
+      {
+        best_run = run;
+        best = run_entry(run, at[k]);
+        best_pos = run_pos(run, at[k]);
+      }
+    }
+    if (best_run == NULL)
+      break;
+    if (!(j->last && (best_pos & 1)))
+      rc = add_run_entry(&w, best, best_run->width, best[best_run->width],
+                         best_pos);
+    /* step every input that holds the entry past it */
+    for (k = j->inputs; k-- > 0;)
+    {
+      run = j->input[k];
+      if ((at[k] < run->count) &&
+          (compare_entries(run_entry(run, at[k]), run->width,
+                           run_pos(run, at[k]), best, best_run->width,
+                           best_pos) == 0))
+        at[k]++;
+    }
+  }
+  j->output = end_run(&w, path, j->id, j->level, rc != 0);
+}
+
+/*
+  Put the result of a finished merge in place of its inputs, which are
+  then removed, and start the next merge if one is due. Unless wait is
+  set a merge still under way is left to finish.
+*/
+void Spartan_lsm::install_merge(bool wait)
+{
+  char name[FN_REFLEN];
+  uint kept = 0;
+  uint r;
+  uint k;
+
+  if (!merging)
+    return;
+  if (threaded)
+  {
+    if (!wait && !my_atomic_load32(&job.done))
+      return;
+    pthread_join(merge_thread, NULL);
+  }
+  merging = false;
+  threaded = false;
+  if (job.output == NULL)
+    return;
+  for (r = 0; r < num_runs; r++)
+  {
+    for (k = 0; (k < job.inputs) && (job.input[k] != runs[r]); k++)
+      ;
+    if (k == job.inputs)
+      runs[kept++] = runs[r];
+  }
+  /* the levels stay in order, level 0 first */
+  for (r = kept; (r > 0) && (runs[r - 1]->level > job.level); r--)
+    runs[r] = runs[r - 1];
+  runs[r] = job.output;
+  num_runs = kept + 1;
+  job.output = NULL;
+  if (write_manifest() == 0)
+  {
+    for (k = 0; k < job.inputs; k++)
+    {
+      run_name(name, index_path, job.input[k]->id);
+      free_run(job.input[k]);
+      my_delete(name, MYF(0));
+    }
+  }
+  else
+  {
+    for (k = 0; k < job.inputs; k++)
+      free_run(job.input[k]);
+  }
+  job.inputs = 0;
+  start_merge();
+}
+
+/* remove the run files of the index file path */
+void Spartan_lsm::delete_runs(const char *path)
+{
+  uint32 ids[SDI_LSM_MAX_RUNS];
+  uint levels[SDI_LSM_MAX_RUNS];
+  char name[FN_REFLEN];
+  uint32 next;
+  uint count;
+  File file;
+
+  if ((file = my_open(path, O_RDONLY | O_BINARY, MYF(0))) == -1)
+    return;
+  count = read_manifest(file, &next, ids, levels);
+  my_close(file, MYF(0));
+  while (count > 0)
+    my_delete(run_name(name, path, ids[--count]), MYF(0));
+}
+
+/* give the run files of the index file from the names for index file to */
+void Spartan_lsm::rename_runs(const char *from, const char *to)
+{
+  uint32 ids[SDI_LSM_MAX_RUNS];
+  uint levels[SDI_LSM_MAX_RUNS];
+  char name_from[FN_REFLEN];
+  char name_to[FN_REFLEN];
+  uint32 next;
+  uint count;
+  File file;
+
+  if ((file = my_open(from, O_RDONLY | O_BINARY, MYF(0))) == -1)
+    return;
+  count = read_manifest(file, &next, ids, levels);
+  my_close(file, MYF(0));
+  while (count > 0)
+  {
+    count--;
+    my_rename(run_name(name_from, from, ids[count]),
+              run_name(name_to, to, ids[count]), MYF(0));
+  }
+}
@@ -0,0 +1,189 @@
+/*
+  Spartan_lsm.h
+
+  This header defines the log-structured form of a Spartan index (an LSM
+  tree), for tables that take many more inserts than reads. Nothing on
+  disk is changed in place. Inserts and deletes go to a memory table, an
+  adaptive radix tree (see spartan_art.h), and when that is full it is
+  written out in key order as a sorted run: an immutable file of fixed
+  width entries followed by a bloom filter over their keys.
+
+  Runs are merged in the background (leveled compaction). Runs written
+  from the memory table make up level 0. Every deeper level holds a
+  single run, SDI_LSM_FANOUT times larger than the level above it may
+  grow. When level 0 has SDI_LSM_LEVEL0_RUNS runs they are merged with
+  the run of level 1, and a level that outgrows its size is merged into
+  the next. One merge runs at a time, in its own thread, reading only
+  runs that no one changes; the finished run replaces its inputs the
+  next time the index is used.
+
+  A delete is recorded as a tombstone: the entry again with a deleted
+  flag, which hides the entry in older runs. Entries are stored with
+  their row position times two plus that flag, so an entry and its
+  tombstone sort next to each other. Tombstones are dropped when they
+  are merged into the last level. Whether an entry is live is decided by
+  the newest source that holds it: the memory table, then the runs from
+  the newest to the oldest.
+
+  Reads merge the memory table and all the runs. A cursor holds nothing
+  but the entry it is on (see SDI_CURSOR): the next entry is the
+  smallest one after it in any source, so a flush or a merge never
+  leaves a cursor stale. A search for a whole key skips the runs whose
+  bloom filter rules the key out.
+
+  The runs of an index are listed in its index file after the header
+  (see spartan_index.h), newest first:
+      +0   next run number (uint32)
+      +4   number of runs (uint32)
+      +8   for each run: run number (uint32), level (uint32)
+  Run n of the index file "t1.sdi" is the file "t1.sdi.n".
+
+  Run File Layout:
+      +0   magic "SDL1" (uint32)
+      +4   key bytes stored per entry (uint32)
+      +8   level (uint32)
+      +12  hash functions of the bloom filter (uint32)
+      +16  number of entries (ulonglong)
+      +24  number of tombstones among them (ulonglong)
+      +32  bytes of the bloom filter (ulonglong)
+      +40  the entries: key bytes, key length (uchar),
+           pos * 2 + deleted (8 bytes, low byte first)
+           then the bloom filter
+
+  The class does no locking of its own; the caller holds the share mutex
+  for every call. The merge thread touches nothing but its job.
+*/
+#include "my_global.h"
+#include "my_sys.h"
+#include "my_pthread.h"
+#include "spartan_index.h"
+
+/* identifies a sorted run file ("SDL1") */
+const uint32 SDI_LSM_MAGIC = 0x314c4453;
+/* size of the header of a run file */
+const int SDI_LSM_HEADER = 40;
+/* most runs an index can have */
+const uint SDI_LSM_MAX_RUNS = 32;
+/* level 0 runs that start a merge into level 1 */
+const uint SDI_LSM_LEVEL0_RUNS = 4;
+/* growth in size from one level to the next */
+const uint SDI_LSM_FANOUT = 10;
+/* deepest level */
+const uint SDI_LSM_MAX_LEVEL = 8;
+/* memory table size that makes it be written out as a run (default) */
+const ulonglong SDI_LSM_MEMTABLE = 4 * 1024 * 1024;
+/* bloom filter bits per entry and hash functions */
+const uint SDI_LSM_BLOOM_BITS = 10;
+const uint SDI_LSM_BLOOM_HASHES = 7;
+/* entries written to a run file at a time */
+const uint SDI_LSM_WRITE_ENTRIES = 1024;
+/* entries read for each sample of sample_prefixes() */
+const uint SDI_LSM_SAMPLE_ENTRIES = 256;
+
+/* an immutable sorted run, mapped or read into memory as a whole */
+struct SDI_RUN
+{
+  uint32 id;
+  uint level;
+  uint width;                 /* key bytes of each entry */
+  uint hashes;
+  ulonglong count;
+  ulonglong dead;             /* tombstones among the entries */
+  ulonglong bloom_bits;
+  uchar *entries;
+  uchar *bloom;
+  uchar *data;                /* the whole file */
+  size_t size;
+  bool mapped;
+};
+
+/* a run being written, in key order */
+struct SDI_RUN_WRITER
+{
+  File file;
+  uint width;
+  ulonglong count;
+  ulonglong dead;
+  ulonglong bloom_bits;
+  uchar *bloom;
+  uchar *buf;                 /* entries not yet written */
+  uint used;
+};
+
+class Spartan_lsm;
+
+/* a merge handed to the merge thread */
+struct SDI_LSM_JOB
+{
+  Spartan_lsm *lsm;
+  SDI_RUN *input[SDI_LSM_MAX_RUNS];  /* newest first */
+  uint inputs;
+  uint32 id;                  /* run number of the result */
+  uint level;
+  bool last;                  /* the result is the last level */
+  SDI_RUN *output;            /* NULL if the merge failed */
+  volatile int32 done;
+};
+
+class Spartan_lsm
+{
+public:
+  Spartan_lsm(File file, const char *path, int keylen);
+  ~Spartan_lsm(void);
+  int open_runs();
+  int close_runs();
+  int write_manifest();
+  int insert_key(SDE_INDEX *ndx, bool allow_dupes);
+  int delete_key(uchar *key, long long pos, int key_len);
+  SDE_INDEX *cursor_first(SDI_CURSOR *cursor);
+  SDE_INDEX *cursor_last(SDI_CURSOR *cursor);
+  SDE_INDEX *cursor_next(SDI_CURSOR *cursor);
+  SDE_INDEX *cursor_prev(SDI_CURSOR *cursor);
+  SDE_INDEX *cursor_lower_bound(SDI_CURSOR *cursor, uchar *key, int key_len);
+  SDE_INDEX *cursor_seek(SDI_CURSOR *cursor, uchar *key, int key_len);
+  long long range_size(uchar *min_key, int min_len, uchar *max_key,
+                       int max_len);
+  void sample_prefixes(uint *prefix_len, uint parts, double *per_prefix);
+  long long key_count();
+  int flush_memtable();
+  void clear_memtable();
+  void set_memtable_size(ulonglong size) { memtable_size = size; }
+  int truncate();
+  static void delete_runs(const char *path);
+  static void rename_runs(const char *from, const char *to);
+private:
+  File index_file;
+  char index_path[FN_REFLEN];
+  int max_key_len;
+  Spartan_art *memtable;
+  ulonglong memtable_size;    /* bytes that make it be written out */
+  ulonglong memtable_dead;    /* tombstones in the memory table */
+  SDI_RUN *runs[SDI_LSM_MAX_RUNS];   /* newest first */
+  uint num_runs;
+  uint32 next_run;
+  SDI_LSM_JOB job;
+  bool merging;               /* job has been started */
+  bool threaded;              /* and is running in merge_thread */
+  pthread_t merge_thread;
+  static void *merge_main(void *arg);
+  static uint read_manifest(File file, uint32 *next, uint32 *ids,
+                            uint *levels);
+  static char *run_name(char *buff, const char *path, uint32 id);
+  static SDI_RUN *open_run(const char *path, uint32 id);
+  static void free_run(SDI_RUN *run);
+  static ulonglong run_search(SDI_RUN *run, uchar *key, int key_len,
+                              long long pos);
+  static bool bloom_test(SDI_RUN *run, uchar *key, int key_len);
+  static int begin_run(SDI_RUN_WRITER *w, const char *path, uint32 id,
+                       uint width, ulonglong entries);
+  static int add_run_entry(SDI_RUN_WRITER *w, uchar *key, uint key_width,
+                           int length, long long pos);
+  static SDI_RUN *end_run(SDI_RUN_WRITER *w, const char *path, uint32 id,
+                          uint level, bool failed);
+  static void merge_runs(SDI_LSM_JOB *j, const char *path);
+  int state(uchar *key, int key_len, long long pos);
+  SDE_INDEX *step(SDI_CURSOR *cursor, bool forward, bool seek);
+  void install_merge(bool wait);
+  void start_merge();
+  ulonglong level_limit(uint level);
+};
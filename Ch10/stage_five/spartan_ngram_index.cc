@@ -0,0 +1,377 @@
+/*
+  Spartan_ngram_index.cc
+
+  This class implements the n-gram index of a text column (see
+  spartan_ngram_index.h).
+*/
+#include "spartan_index.h"
+#include "spartan_ngram_index.h"
+#include "my_base.h"
+#include <string.h>
+#include <stdlib.h>
+
+Spartan_ngram_index::Spartan_ngram_index(void)
+{
+  grams[0] = grams[1] = NULL;
+  grams_size[0] = grams_size[1] = 0;
+}
+
+Spartan_ngram_index::~Spartan_ngram_index(void)
+{
+  my_free(grams[0]);
+  my_free(grams[1]);
+}
+
+/* create the index file (left closed) */
+int Spartan_ngram_index::create_ngram(char *path)
+{
+  int rc;
+
+  DBUG_ENTER("Spartan_ngram_index::create_ngram");
+  rc = index.create_index(path, SDN_GRAM);
+  index.close_index();
+  DBUG_RETURN(rc);
+}
+
+/*
+  Open and load the index file. A file that was missing is created, and
+  fresh is set: the caller has to add the text of the rows to it.
+*/
+int Spartan_ngram_index::open_ngram(char *path, bool *fresh)
+{
+  int rc;
+
+  DBUG_ENTER("Spartan_ngram_index::open_ngram");
+  *fresh = false;
+  if ((rc = index.open_index(path)) != 0)
+    DBUG_RETURN(rc);
+  if (!index.sortable_keys())
+  {
+    index.close_index();
+    if (index.create_index(path, SDN_GRAM))
+      DBUG_RETURN(-1);
+    *fresh = true;
+  }
+  DBUG_RETURN(index.load_index());
+}
+
+/* write back and close the index file */
+int Spartan_ngram_index::close_ngram()
+{
+  DBUG_ENTER("Spartan_ngram_index::close_ngram");
+  index.save_index();
+  index.destroy_index();
+  DBUG_RETURN(index.close_index());
+}
+
+/* drop every entry */
+int Spartan_ngram_index::trunc_ngram()
+{
+  DBUG_ENTER("Spartan_ngram_index::trunc_ngram");
+  index.destroy_index();
+  DBUG_RETURN(index.trunc_index());
+}
+
+/* scratch room for the trigrams of a value of len bytes */
+uchar *Spartan_ngram_index::reserve_grams(int which, uint len)
+{
+  size_t need = (size_t)MY_MAX(len, SDN_GRAM) * SDN_GRAM;
+  uchar *to;
+
+  if (need <= grams_size[which])
+    return grams[which];
+  if ((to = (uchar *)my_realloc(grams[which], need,
+                                MYF(MY_WME | MY_ALLOW_ZERO_PTR))) == NULL)
+    return NULL;
+  grams[which] = to;
+  grams_size[which] = need;
+  return to;
+}
+
+static int compare_grams(const void *a, const void *b)
+{
+  return memcmp(a, b, SDN_GRAM);
+}
+
+/*
+  Store the distinct trigrams of text in to, in sorted order, and
+  return how many there are. to has room for len trigrams.
+*/
+uint Spartan_ngram_index::make_grams(const uchar *text, uint len, uchar *to)
+{
+  uint count;
+  uint n = 0;
+  uint i;
+
+  if (len < SDN_GRAM)
+    return 0;
+  count = len - SDN_GRAM + 1;
+  for (i = 0; i < count; i++)
+    memcpy(to + i * SDN_GRAM, text + i, SDN_GRAM);
+  qsort(to, count, SDN_GRAM, compare_grams);
+  for (i = 0; i < count; i++)
+  {
+    if ((n == 0) ||
+        (memcmp(to + (n - 1) * SDN_GRAM, to + i * SDN_GRAM, SDN_GRAM) != 0))
+      memmove(to + n++ * SDN_GRAM, to + i * SDN_GRAM, SDN_GRAM);
+  }
+  return n;
+}
+
+/* index the trigrams of text for the row at pos */
+int Spartan_ngram_index::add_text(const uchar *text, uint len, long long pos)
+{
+  SDE_INDEX ndx;
+  uchar *to;
+  uint n;
+  uint i;
+
+  DBUG_ENTER("Spartan_ngram_index::add_text");
+  if ((to = reserve_grams(0, len)) == NULL)
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  n = make_grams(text, len, to);
+  ndx.length = SDN_GRAM;
+  ndx.pos = pos;
+  for (i = 0; i < n; i++)
+  {
+    memcpy(ndx.key, to + i * SDN_GRAM, SDN_GRAM);
+    if (index.insert_key(&ndx, true) < 0)
+      DBUG_RETURN(-1);
+  }
+  DBUG_RETURN(0);
+}
+
+/* remove the trigrams of text for the row at pos */
+int Spartan_ngram_index::remove_text(const uchar *text, uint len,
+                                     long long pos)
+{
+  uchar *to;
+  uint n;
+  uint i;
+
+  DBUG_ENTER("Spartan_ngram_index::remove_text");
+  if ((to = reserve_grams(0, len)) == NULL)
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  n = make_grams(text, len, to);
+  for (i = 0; i < n; i++)
+    index.delete_key(to + i * SDN_GRAM, pos, SDN_GRAM);
+  DBUG_RETURN(0);
+}
+
+/*
+  Change the text of the row at pos. Only the trigrams found in one of
+  the values and not in the other are removed or added.
+*/
+int Spartan_ngram_index::update_text(const uchar *old_text, uint old_len,
+                                     const uchar *text, uint len,
+                                     long long pos)
+{
+  SDE_INDEX ndx;
+  uchar *from;
+  uchar *to;
+  uint n_old;
+  uint n_new;
+  uint i = 0;
+  uint j = 0;
+  int cmp;
+
+  DBUG_ENTER("Spartan_ngram_index::update_text");
+  if (((from = reserve_grams(0, old_len)) == NULL) ||
+      ((to = reserve_grams(1, len)) == NULL))
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  n_old = make_grams(old_text, old_len, from);
+  n_new = make_grams(text, len, to);
+  ndx.length = SDN_GRAM;
+  ndx.pos = pos;
+  while ((i < n_old) || (j < n_new))
+  {
+    if (i == n_old)
+      cmp = 1;
+    else if (j == n_new)
+      cmp = -1;
+    else
+      cmp = memcmp(from + i * SDN_GRAM, to + j * SDN_GRAM, SDN_GRAM);
+    if (cmp < 0)
+      index.delete_key(from + i++ * SDN_GRAM, pos, SDN_GRAM);
+    else if (cmp > 0)
+    {
+      memcpy(ndx.key, to + j++ * SDN_GRAM, SDN_GRAM);
+      if (index.insert_key(&ndx, true) < 0)
+        DBUG_RETURN(-1);
+    }
+    else
+      i++, j++;
+  }
+  DBUG_RETURN(0);
+}
+
+/* estimated number of rows with gram */
+long long Spartan_ngram_index::gram_rows(const uchar *gram)
+{
+  uchar next[SDN_GRAM];
+  int i;
+
+  /* the first key after every key that starts with gram */
+  memcpy(next, gram, SDN_GRAM);
+  for (i = SDN_GRAM - 1; (i >= 0) && (++next[i] == 0); i--) ;
+  return index.range_size((uchar *)gram, SDN_GRAM, (i >= 0) ? next : NULL,
+                          (i >= 0) ? SDN_GRAM : 0);
+}
+
+/* read the whole posting list of gram into *rows (size entries long) */
+int Spartan_ngram_index::read_postings(const uchar *gram, long long **rows,
+                                       long long *size, long long *found)
+{
+  SDI_CURSOR cursor;
+  SDE_INDEX *ndx;
+  long long *to;
+  long long n = 0;
+
+  memset(&cursor, 0, sizeof(cursor));
+  for (ndx = index.cursor_lower_bound(&cursor, (uchar *)gram, SDN_GRAM);
+       (ndx != NULL) && (memcmp(ndx->key, gram, SDN_GRAM) == 0);
+       ndx = index.cursor_next(&cursor))
+  {
+    if (n == *size)
+    {
+      *size = MY_MAX(*size * 2, 1024);
+      if ((to = (long long *)my_realloc(*rows, (size_t)*size *
+                                        sizeof(long long),
+                                        MYF(MY_WME | MY_ALLOW_ZERO_PTR))) ==
+          NULL)
+        return HA_ERR_OUT_OF_MEM;
+      *rows = to;
+    }
+    (*rows)[n++] = ndx->pos;
+  }
+  *found = n;
+  return 0;
+}
+
+/* keep the n rows (in order) that gram's list has, looking each one up */
+long long Spartan_ngram_index::probe_postings(const uchar *gram,
+                                              long long *rows, long long n)
+{
+  SDI_CURSOR cursor;
+  SDE_INDEX *ndx;
+  long long kept = 0;
+  long long i;
+
+  memset(&cursor, 0, sizeof(cursor));
+  for (i = 0; i < n; i++)
+  {
+    /* the first entry after (gram, row - 1) is (gram, row) if there is one */
+    index.cursor_set(&cursor, (uchar *)gram, SDN_GRAM, rows[i] - 1);
+    ndx = index.cursor_next(&cursor);
+    if ((ndx != NULL) && (ndx->pos == rows[i]) &&
+        (memcmp(ndx->key, gram, SDN_GRAM) == 0))
+      rows[kept++] = rows[i];
+  }
+  return kept;
+}
+
+/* keep the n rows (in order) that gram's list has, reading the list */
+long long Spartan_ngram_index::merge_postings(const uchar *gram,
+                                              long long *rows, long long n)
+{
+  SDI_CURSOR cursor;
+  SDE_INDEX *ndx;
+  long long kept = 0;
+  long long i = 0;
+
+  memset(&cursor, 0, sizeof(cursor));
+  for (ndx = index.cursor_lower_bound(&cursor, (uchar *)gram, SDN_GRAM);
+       (ndx != NULL) && (i < n) && (memcmp(ndx->key, gram, SDN_GRAM) == 0);
+       ndx = index.cursor_next(&cursor))
+  {
+    while ((i < n) && (rows[i] < ndx->pos))
+      i++;
+    if ((i < n) && (rows[i] == ndx->pos))
+      rows[kept++] = rows[i++];
+  }
+  return kept;
+}
+
+/*
+  Find the rows that have every one of count trigrams, in row order.
+  *rows is allocated here (also when no row has them, so an empty
+  result is told apart from none) and freed by the caller. Returns 1,
+  with no rows, if even the rarest trigram is expected in more than
+  max_rows rows, so reading all the rows is as cheap.
+*/
+int Spartan_ngram_index::find_rows(const uchar *grams_in, uint count,
+                                   long long max_rows, long long **rows,
+                                   long long *found)
+{
+  long long estimate[SDN_QUERY_MAX];
+  uint order[SDN_QUERY_MAX];
+  long long size = 0;
+  long long n;
+  uint i;
+  uint j;
+  uint k;
+  int rc;
+
+  DBUG_ENTER("Spartan_ngram_index::find_rows");
+  *rows = NULL;
+  *found = 0;
+  count = MY_MIN(count, SDN_QUERY_MAX);
+  if (count == 0)
+    DBUG_RETURN(1);
+  /* rarest trigram first */
+  for (i = 0; i < count; i++)
+  {
+    estimate[i] = gram_rows(grams_in + i * SDN_GRAM);
+    for (j = i; (j > 0) && (estimate[order[j - 1]] > estimate[i]); j--)
+      order[j] = order[j - 1];
+    order[j] = i;
+  }
+  if (estimate[order[0]] > max_rows)
+    DBUG_RETURN(1);
+  if ((rc = read_postings(grams_in + order[0] * SDN_GRAM, rows, &size, &n)) ||
+      ((*rows == NULL) &&
+       ((*rows = (long long *)my_malloc(sizeof(long long),
+                                        MYF(MY_WME))) == NULL)))
+  {
+    my_free(*rows);
+    *rows = NULL;
+    DBUG_RETURN(rc ? rc : HA_ERR_OUT_OF_MEM);
+  }
+  for (i = 1; (i < count) && (n > 0); i++)
+  {
+    k = order[i];
+    if (memcmp(grams_in + k * SDN_GRAM, grams_in + order[i - 1] * SDN_GRAM,
+               SDN_GRAM) == 0)
+      continue;
+    if (n * SDN_PROBE_RATIO < estimate[k])
+      n = probe_postings(grams_in + k * SDN_GRAM, *rows, n);
+    else
+      n = merge_postings(grams_in + k * SDN_GRAM, *rows, n);
+  }
+  *found = n;
+  DBUG_RETURN(0);
+}
+
+/* keep the rows of a (in order) that are also in b; returns how many */
+long long Spartan_ngram_index::intersect_rows(long long *a, long long na,
+                                              const long long *b,
+                                              long long nb)
+{
+  long long kept = 0;
+  long long i = 0;
+  long long j = 0;
+
+  while ((i < na) && (j < nb))
+  {
+    if (a[i] < b[j])
+      i++;
+    else if (a[i] > b[j])
+      j++;
+    else
+    {
+      a[kept++] = a[i++];
+      j++;
+    }
+  }
+  return kept;
+}
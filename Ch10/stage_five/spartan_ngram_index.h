@@ -0,0 +1,69 @@
+/*
+  Spartan_ngram_index.h
+
+  This header defines the n-gram index of a text column: an inverted
+  index from every run of SDN_GRAM bytes (a trigram) found in the column
+  to the rows it is found in. A substring search (LIKE '%text%') looks
+  up the trigrams of the substring and reads only the rows that have
+  all of them. A row with all of the trigrams need not hold the
+  substring, so the caller still checks the rows it reads.
+
+  The index is kept in a Spartan_index (see spartan_index.h) whose keys
+  are the trigrams: one entry per trigram of each row. Entries sort by
+  key and then by row position, so the entries of a trigram are its
+  posting list in row order, and the index pages store such a list
+  compressed (the trigram once in the page prefix, each row as a delta
+  from the smallest row on the page).
+
+  find_rows() intersects the posting lists of a set of trigrams,
+  starting with the shortest (estimated from the tree). A list much
+  longer than the rows left is not read in full: each row left is
+  looked up in it instead.
+
+  Text is indexed as given. The caller folds it first (to the weights of
+  the column's collation) so that a value and a pattern that compare
+  equal have the same trigrams. Each distinct trigram of a value is
+  indexed once per row; a value shorter than a trigram is not indexed.
+
+  The class does no locking; the caller holds the share mutex.
+*/
+/* Spartan_index (spartan_index.h) must be declared before this header */
+
+/* bytes of an n-gram */
+const uint SDN_GRAM = 3;
+/* a posting list is probed row by row when longer than this many times
+   the rows left */
+const long long SDN_PROBE_RATIO = 16;
+/* most trigrams find_rows() intersects */
+const uint SDN_QUERY_MAX = 32;
+
+class Spartan_ngram_index
+{
+public:
+  Spartan_ngram_index(void);
+  ~Spartan_ngram_index(void);
+  Spartan_index *postings() { return &index; }
+  int create_ngram(char *path);
+  int open_ngram(char *path, bool *fresh);
+  int close_ngram();
+  int trunc_ngram();
+  int add_text(const uchar *text, uint len, long long pos);
+  int remove_text(const uchar *text, uint len, long long pos);
+  int update_text(const uchar *old_text, uint old_len, const uchar *text,
+                  uint len, long long pos);
+  int find_rows(const uchar *grams, uint count, long long max_rows,
+                long long **rows, long long *found);
+  static uint make_grams(const uchar *text, uint len, uchar *to);
+  static long long intersect_rows(long long *a, long long na,
+                                  const long long *b, long long nb);
+private:
+  Spartan_index index;
+  uchar *grams[2];          /* the trigrams of a value (old and new) */
+  size_t grams_size[2];
+  uchar *reserve_grams(int which, uint len);
+  long long gram_rows(const uchar *gram);
+  int read_postings(const uchar *gram, long long **rows, long long *size,
+                    long long *found);
+  long long probe_postings(const uchar *gram, long long *rows, long long n);
+  long long merge_postings(const uchar *gram, long long *rows, long long n);
+};
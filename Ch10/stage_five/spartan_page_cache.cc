@@ -0,0 +1,398 @@
+/*
+  Spartan_page_cache.cc
+
+  This class implements the write-back page cache of the Spartan index.
+  Frames are found through a chained hash table over the page numbers.
+  When every frame holds a page, the CLOCK hand sweeps the unpinned frames
+  clearing reference bits until it finds one that has not been used since
+  the last sweep. A dirty victim is written to the index file first.
+
+  The mapping, when there is one, holds pages 0 to map_pages - 1 and no
+  frame holds any of them. It is made (again) only when every frame is
+  clean, by init_cache(), flush_cache() and the owner once a file it
+  has rewritten is ready, and dropped before anything else changes the
+  file (discard_cache(), which comes before a truncate).
+*/
+#include "spartan_page_cache.h"
+#include "my_base.h"
+#include <string.h>
+
+Spartan_page_cache::Spartan_page_cache(void)
+{
+  cache_file = -1;
+  frames = NULL;
+  pages = NULL;
+  buckets = NULL;
+  num_frames = 0;
+  num_buckets = 0;
+  page_len = 0;
+  clock_hand = 0;
+  use_map = false;
+  map = NULL;
+  map_pages = 0;
+  map_dirty = NULL;
+  map_dirty_count = 0;
+}
+
+Spartan_page_cache::~Spartan_page_cache(void)
+{
+  destroy_cache();
+}
+
+/* allocate frames for pages of page_size bytes within budget bytes */
+int Spartan_page_cache::init_cache(File file, int page_size,
+                                   ulonglong budget)
+{
+  ulonglong n;
+  int i;
+
+  DBUG_ENTER("Spartan_page_cache::init_cache");
+  destroy_cache();
+  cache_file = file;
+  page_len = page_size;
+  n = budget / page_len;
+  if (n < SDI_CACHE_MIN_FRAMES)
+    n = SDI_CACHE_MIN_FRAMES;
+  if (n > INT_MAX / 2)
+    n = INT_MAX / 2;
+  num_frames = (int)n;
+  for (num_buckets = 1; num_buckets < num_frames; num_buckets <<= 1)
+    ;
+  frames = (SDI_CACHE_FRAME *)my_malloc(num_frames * sizeof(SDI_CACHE_FRAME),
+                                        MYF(MY_WME));
+  pages = (uchar *)my_malloc((size_t)num_frames * page_len, MYF(MY_WME));
+  buckets = (int *)my_malloc(num_buckets * sizeof(int), MYF(MY_WME));
+  if (!frames || !pages || !buckets)
+  {
+    destroy_cache();
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  }
+  for (i = 0; i < num_frames; i++)
+  {
+    frames[i].page = 0;
+    frames[i].next = -1;
+    frames[i].pins = 0;
+    frames[i].dirty = false;
+    frames[i].referenced = false;
+  }
+  for (i = 0; i < num_buckets; i++)
+    buckets[i] = -1;
+  DBUG_RETURN(map_file());
+}
+
+/*
+  Map the index file as it is now, unless mapping is off. Frames that
+  hold a page inside the new mapping are clean (the caller has flushed
+  them) and are dropped. Without a mapping the frames are used for
+  every page, so a failure here is not an error.
+*/
+int Spartan_page_cache::map_file()
+{
+#ifdef HAVE_MMAP
+  my_off_t size;
+  uint32 pages;
+  uchar *p;
+  int i;
+
+  DBUG_ENTER("Spartan_page_cache::map_file");
+  unmap_file();
+  if (!use_map || (cache_file == -1))
+    DBUG_RETURN(0);
+  size = my_seek(cache_file, 0L, MY_SEEK_END, MYF(0));
+  if ((size == MY_FILEPOS_ERROR) || (size / page_len <= 1) ||
+      (size / page_len > UINT_MAX32))
+    DBUG_RETURN(0);
+  pages = (uint32)(size / page_len);
+  for (i = 0; i < num_frames; i++)
+  {
+    if ((frames[i].page != 0) && (frames[i].page < pages) &&
+        ((frames[i].pins > 0) || frames[i].dirty))
+      DBUG_RETURN(0);
+  }
+  map_dirty = (uchar *)my_malloc((pages + 7) / 8, MYF(MY_ZEROFILL | MY_WME));
+  if (map_dirty == NULL)
+    DBUG_RETURN(0);
+  p = (uchar *)my_mmap(0, (size_t)pages * page_len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE, cache_file, 0L);
+  if (p == (uchar *)MAP_FAILED)
+  {
+    my_free(map_dirty);
+    map_dirty = NULL;
+    DBUG_RETURN(0);
+  }
+  for (i = 0; i < num_frames; i++)
+  {
+    if ((frames[i].page != 0) && (frames[i].page < pages))
+      unlink_frame(i);
+  }
+  map = p;
+  map_pages = pages;
+  DBUG_RETURN(0);
+#else
+  return 0;
+#endif
+}
+
+/* drop the mapping and any changes made to it that were not flushed */
+void Spartan_page_cache::unmap_file()
+{
+#ifdef HAVE_MMAP
+  if (map != NULL)
+    my_munmap((char *)map, (size_t)map_pages * page_len);
+#endif
+  my_free(map_dirty);
+  map = NULL;
+  map_pages = 0;
+  map_dirty = NULL;
+  map_dirty_count = 0;
+}
+
+/* free the memory used by the cache (dirty pages are not written) */
+int Spartan_page_cache::destroy_cache()
+{
+  DBUG_ENTER("Spartan_page_cache::destroy_cache");
+  unmap_file();
+  my_free(frames);
+  my_free(pages);
+  my_free(buckets);
+  frames = NULL;
+  pages = NULL;
+  buckets = NULL;
+  num_frames = 0;
+  num_buckets = 0;
+  clock_hand = 0;
+  cache_file = -1;
+  DBUG_RETURN(0);
+}
+
+/* hash a page number to a bucket */
+int Spartan_page_cache::hash_page(uint32 page)
+{
+  uint32 h = page;
+
+  h ^= h >> 16;
+  h *= 0x45d9f3b;
+  h ^= h >> 16;
+  return (int)(h & (num_buckets - 1));
+}
+
+/* return the frame holding page or -1 if it is not cached */
+int Spartan_page_cache::find_frame(uint32 page)
+{
+  int f;
+
+  f = buckets[hash_page(page)];
+  while ((f != -1) && (frames[f].page != page))
+    f = frames[f].next;
+  return f;
+}
+
+/* remove a frame from its hash chain and mark it free */
+void Spartan_page_cache::unlink_frame(int frame)
+{
+  int *p = &buckets[hash_page(frames[frame].page)];
+
+  while (*p != frame)
+    p = &frames[*p].next;
+  *p = frames[frame].next;
+  frames[frame].page = 0;
+  frames[frame].next = -1;
+  frames[frame].dirty = false;
+  frames[frame].referenced = false;
+}
+
+/* write a dirty frame back to its place in the index file */
+int Spartan_page_cache::write_frame(int frame)
+{
+  DBUG_ENTER("Spartan_page_cache::write_frame");
+  if (my_pwrite(cache_file, pages + (size_t)frame * page_len, page_len,
+                (my_off_t)frames[frame].page * page_len, MYF(MY_NABP)))
+    DBUG_RETURN(-1);
+  frames[frame].dirty = false;
+  DBUG_RETURN(0);
+}
+
+/*
+  Choose a frame for a page that is not cached. Free frames are used
+  first, after that the CLOCK hand skips pinned frames and gives every
+  referenced frame a second chance. Returns -1 when every frame is pinned
+  or the victim could not be written.
+*/
+int Spartan_page_cache::evict_frame()
+{
+  int f;
+  int i;
+
+  for (i = 0; i < 2 * num_frames; i++)
+  {
+    f = clock_hand;
+    clock_hand = (clock_hand + 1) % num_frames;
+    if (frames[f].pins > 0)
+      continue;
+    if (frames[f].page == 0)
+      return f;
+    if (frames[f].referenced)
+    {
+      frames[f].referenced = false;
+      continue;
+    }
+    if (frames[f].dirty && write_frame(f))
+      return -1;
+    unlink_frame(f);
+    return f;
+  }
+  return -1;
+}
+
+/*
+  Return the frame holding page, pinned. With create the page is not
+  read from the file and the frame is cleared (a page being allocated).
+  Returns NULL if the page could not be read or no frame is free.
+*/
+uchar *Spartan_page_cache::get_page(uint32 page, bool create)
+{
+  uchar *p;
+  int f;
+  int b;
+
+  DBUG_ENTER("Spartan_page_cache::get_page");
+  if ((num_frames == 0) || (page == 0))
+    DBUG_RETURN(NULL);
+  if (page < map_pages)
+  {
+    p = map + (size_t)page * page_len;
+    if (create)
+      memset(p, 0, page_len);
+    DBUG_RETURN(p);
+  }
+  f = find_frame(page);
+  if (f != -1)
+  {
+    p = pages + (size_t)f * page_len;
+    if (create)
+      memset(p, 0, page_len);
+  }
+  else
+  {
+    f = evict_frame();
+    if (f == -1)
+      DBUG_RETURN(NULL);
+    p = pages + (size_t)f * page_len;
+    if (create)
+      memset(p, 0, page_len);
+    else if (my_pread(cache_file, p, page_len, (my_off_t)page * page_len,
+                      MYF(MY_NABP)))
+      DBUG_RETURN(NULL);
+    b = hash_page(page);
+    frames[f].page = page;
+    frames[f].next = buckets[b];
+    frames[f].dirty = false;
+    buckets[b] = f;
+  }
+  frames[f].pins++;
+  frames[f].referenced = true;
+  DBUG_RETURN(p);
+}
+
+/*
+  Unpin a frame returned by get_page(), dirty if the page was changed.
+  When more mapped pages are dirty than there are frames they are all
+  written back (see write_map()).
+*/
+void Spartan_page_cache::release_page(uchar *frame, bool dirty)
+{
+  size_t n;
+  int f;
+
+  if (in_map(frame))
+  {
+    n = (size_t)(frame - map) / page_len;
+    if (dirty && !(map_dirty[n / 8] & (1 << (n % 8))))
+    {
+      map_dirty[n / 8] |= (uchar)(1 << (n % 8));
+      if (++map_dirty_count > (uint32)num_frames)
+        write_map(true);
+    }
+    return;
+  }
+  f = (int)((frame - pages) / page_len);
+  frames[f].pins--;
+  if (dirty)
+    frames[f].dirty = true;
+}
+
+/*
+  Write every dirty page to the index file. The file is then mapped
+  again, which takes in the pages added since it was last mapped and
+  hands the private copies of changed pages back to the kernel.
+*/
+int Spartan_page_cache::flush_cache()
+{
+  uint32 n;
+  int i;
+  int rc = 0;
+
+  DBUG_ENTER("Spartan_page_cache::flush_cache");
+  for (i = 0; i < num_frames; i++)
+    if ((frames[i].page != 0) && frames[i].dirty && write_frame(i))
+      rc = -1;
+  if (write_map(false))
+    rc = -1;
+  if (rc == 0)
+    map_file();
+  DBUG_RETURN(rc);
+}
+
+/*
+  Write the changed pages of the mapping to the index file. With drop
+  the private copies of the pages written are given back to the kernel
+  as well, and the mapping shows them from the file again: the bytes are
+  the same, so a caller still holding such a page is not affected.
+*/
+int Spartan_page_cache::write_map(bool drop)
+{
+  uint32 n;
+  int rc = 0;
+
+  DBUG_ENTER("Spartan_page_cache::write_map");
+  for (n = 0; (map_dirty_count > 0) && (n < map_pages); n++)
+  {
+    if (!(map_dirty[n / 8] & (1 << (n % 8))))
+      continue;
+    if (my_pwrite(cache_file, map + (size_t)n * page_len, page_len,
+                  (my_off_t)n * page_len, MYF(MY_NABP)))
+    {
+      rc = -1;
+      continue;
+    }
+    map_dirty[n / 8] &= (uchar)~(1 << (n % 8));
+    map_dirty_count--;
+#if defined(HAVE_MMAP) && defined(HAVE_MADVISE) && defined(MADV_DONTNEED)
+    if (drop)
+      madvise((void *)(map + (size_t)n * page_len), page_len,
+              MADV_DONTNEED);
+#endif
+  }
+  DBUG_RETURN(rc);
+}
+
+/* drop every page without writing it (called on truncate and rebuild) */
+int Spartan_page_cache::discard_cache()
+{
+  int i;
+
+  DBUG_ENTER("Spartan_page_cache::discard_cache");
+  unmap_file();
+  for (i = 0; i < num_frames; i++)
+  {
+    frames[i].page = 0;
+    frames[i].next = -1;
+    frames[i].pins = 0;
+    frames[i].dirty = false;
+    frames[i].referenced = false;
+  }
+  for (i = 0; i < num_buckets; i++)
+    buckets[i] = -1;
+  clock_hand = 0;
+  DBUG_RETURN(0);
+}
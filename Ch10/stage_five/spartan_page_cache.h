@@ -0,0 +1,84 @@
+/*
+  Spartan_page_cache.h
+
+  This header defines the page cache used by the Spartan index. Pages of
+  the index file are read into a fixed number of frames on demand and
+  written back when they are evicted or the cache is flushed. A frame is
+  pinned while the caller works on it and is never evicted while pinned.
+  The cache is sized by a byte budget and uses the CLOCK (second chance)
+  algorithm to choose a victim when it is full.
+
+  Where the platform has mmap() the cache can instead map the index file
+  privately (see set_mmap()). Pages in the mapping are handed out in
+  place: nothing is read when the index is opened and the operating
+  system's page cache keeps them warm across restarts. A changed page is
+  copied on write by the kernel and reaches the file when the cache is
+  flushed, so the file is never changed through the mapping. Once more
+  pages are changed than the cache has frames they are written back at
+  once and their private copies given back to the kernel, so a long
+  run of changes is held to the same budget as the frames and is not
+  lost by a crash. Pages added past the end of the mapping go through
+  the frames as above until the next flush maps the file again at its
+  new size.
+
+  The cache does no locking of its own. The caller must hold the share
+  mutex for all calls.
+*/
+#include "my_global.h"
+#include "my_sys.h"
+
+/* the fewest frames a cache is given, enough to pin a full tree path */
+const int SDI_CACHE_MIN_FRAMES = 32;
+
+/*
+  This is the frame that describes one cached page. The page data itself
+  lives in a separate contiguous buffer at frame * page_size.
+*/
+struct SDI_CACHE_FRAME
+{
+  uint32 page;            /* page number held in frame (0 = free) */
+  int next;               /* next frame in hash chain (-1 = end) */
+  int pins;               /* callers using the frame */
+  bool dirty;             /* must be written before reuse */
+  bool referenced;        /* CLOCK reference bit */
+};
+
+class Spartan_page_cache
+{
+public:
+  Spartan_page_cache(void);
+  ~Spartan_page_cache(void);
+  int init_cache(File file, int page_size, ulonglong budget);
+  int destroy_cache();
+  uchar *get_page(uint32 page, bool create);
+  void release_page(uchar *frame, bool dirty);
+  int flush_cache();
+  int discard_cache();
+  bool is_enabled() { return (num_frames > 0); }
+  void set_mmap(bool on) { use_map = on; }
+  int map_file();
+private:
+  File cache_file;
+  SDI_CACHE_FRAME *frames;
+  uchar *pages;
+  int *buckets;
+  int num_frames;
+  int num_buckets;
+  int page_len;
+  int clock_hand;
+  bool use_map;
+  uchar *map;             /* the mapped file, NULL if not mapped */
+  uint32 map_pages;       /* pages in the mapping */
+  uchar *map_dirty;       /* bitmap of mapped pages changed since a flush */
+  uint32 map_dirty_count; /* bits set in map_dirty */
+  void unmap_file();
+  int write_map(bool drop);
+  bool in_map(uchar *frame)
+  { return (map != NULL) && (frame >= map) &&
+           (frame < map + (size_t)map_pages * page_len); }
+  int hash_page(uint32 page);
+  int find_frame(uint32 page);
+  int evict_frame();
+  int write_frame(int frame);
+  void unlink_frame(int frame);
+};
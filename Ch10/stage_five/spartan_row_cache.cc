@@ -0,0 +1,260 @@
+/*
+  Spartan_row_cache.cc
+
+  This class implements a fixed budget row cache keyed by the position of
+  the row in the data file. All rows of a Spartan table have the same
+  length so the cache is a simple array of slots with a chained hash
+  table over the positions. When all slots are in use, the CLOCK hand
+  sweeps the slots clearing reference bits until it finds one that has
+  not been used since the last sweep.
+*/
+#include "spartan_row_cache.h"
+#include "my_base.h"
+#include <string.h>
+
+Spartan_row_cache::Spartan_row_cache(void)
+{
+  slots = NULL;
+  rows = NULL;
+  buckets = NULL;
+  num_slots = 0;
+  num_buckets = 0;
+  row_len = 0;
+  clock_hand = 0;
+  used_slots = 0;
+  invalidations = 0;
+}
+
+Spartan_row_cache::~Spartan_row_cache(void)
+{
+  destroy_cache();
+}
+
+/* allocate the cache for rows of row_length bytes within budget bytes */
+int Spartan_row_cache::init_cache(int row_length, ulonglong budget)
+{
+  ulonglong n;
+  int i;
+
+  DBUG_ENTER("Spartan_row_cache::init_cache");
+  destroy_cache();
+  if (row_length <= 0)
+    DBUG_RETURN(0);
+  row_len = row_length;
+  /*
+    Each cached row costs its data plus the slot and one hash bucket.
+    A budget too small for a single row leaves the cache disabled.
+  */
+  n = budget / (row_len + sizeof(SDE_CACHE_SLOT) + sizeof(int));
+  if (n > INT_MAX / 2)
+    n = INT_MAX / 2;
+  if (n == 0)
+    DBUG_RETURN(0);
+  num_slots = (int)n;
+  for (num_buckets = 1; num_buckets < num_slots; num_buckets <<= 1)
+    ;
+  slots = (SDE_CACHE_SLOT *)my_malloc(num_slots * sizeof(SDE_CACHE_SLOT),
+                                      MYF(MY_WME));
+  rows = (uchar *)my_malloc((size_t)num_slots * row_len, MYF(MY_WME));
+  buckets = (int *)my_malloc(num_buckets * sizeof(int), MYF(MY_WME));
+  if (!slots || !rows || !buckets)
+  {
+    destroy_cache();
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  }
+  for (i = 0; i < num_slots; i++)
+  {
+    slots[i].pos = -1;
+    slots[i].next = -1;
+    slots[i].referenced = false;
+    slots[i].version = 0;
+  }
+  for (i = 0; i < num_buckets; i++)
+    buckets[i] = -1;
+  DBUG_RETURN(0);
+}
+
+/* free the memory used by the cache */
+int Spartan_row_cache::destroy_cache()
+{
+  DBUG_ENTER("Spartan_row_cache::destroy_cache");
+  my_free(slots);
+  my_free(rows);
+  my_free(buckets);
+  slots = NULL;
+  rows = NULL;
+  buckets = NULL;
+  num_slots = 0;
+  num_buckets = 0;
+  clock_hand = 0;
+  used_slots = 0;
+  DBUG_RETURN(0);
+}
+
+/* hash a row position to a bucket */
+int Spartan_row_cache::hash_pos(long long pos)
+{
+  ulonglong h = (ulonglong)pos;
+
+  /* Positions are multiples of the row size, so mix the bits first. */
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return (int)(h & (num_buckets - 1));
+}
+
+/* return the slot holding pos or -1 if it is not cached */
+int Spartan_row_cache::find_slot(long long pos)
+{
+  int s;
+
+  s = buckets[hash_pos(pos)];
+  while ((s != -1) && (slots[s].pos != pos))
+    s = slots[s].next;
+  return s;
+}
+
+/* remove a slot from its hash chain and mark it free */
+void Spartan_row_cache::unlink_slot(int slot)
+{
+  int *p = &buckets[hash_pos(slots[slot].pos)];
+
+  while (*p != slot)
+    p = &slots[*p].next;
+  begin_change(slot);
+  *p = slots[slot].next;
+  slots[slot].pos = -1;
+  slots[slot].next = -1;
+  slots[slot].referenced = false;
+  end_change(slot);
+  used_slots--;
+}
+
+/*
+  Choose a slot for a new row. Free slots are used first, after that
+  the CLOCK hand gives every referenced slot a second chance.
+*/
+int Spartan_row_cache::evict_slot()
+{
+  int s;
+
+  if (used_slots < num_slots)
+  {
+    while (slots[clock_hand].pos != -1)
+      clock_hand = (clock_hand + 1) % num_slots;
+    s = clock_hand;
+    clock_hand = (clock_hand + 1) % num_slots;
+    return s;
+  }
+  while (slots[clock_hand].referenced)
+  {
+    slots[clock_hand].referenced = false;
+    clock_hand = (clock_hand + 1) % num_slots;
+  }
+  s = clock_hand;
+  clock_hand = (clock_hand + 1) % num_slots;
+  unlink_slot(s);
+  return s;
+}
+
+/*
+  Copy the cached row at pos into buf, returns false on a miss. Called
+  without the share mutex (see spartan_row_cache.h): the hash chain is
+  followed for at most num_slots steps, since a slot may be moved to
+  another chain meanwhile, and the row only counts if the version of
+  its slot did not change while it was copied.
+*/
+bool Spartan_row_cache::fetch_row(long long pos, uchar *buf)
+{
+  int64 version;
+  int steps;
+  int s;
+
+  DBUG_ENTER("Spartan_row_cache::fetch_row");
+  if (num_slots == 0)
+    DBUG_RETURN(false);
+  s = my_atomic_load32((int32 volatile *)&buckets[hash_pos(pos)]);
+  for (steps = 0; (s >= 0) && (s < num_slots) && (steps < num_slots);
+       steps++)
+  {
+    version = my_atomic_load64(&slots[s].version);
+    if (((version & 1) == 0) && (slots[s].pos == pos))
+    {
+      memcpy(buf, rows + (size_t)s * row_len, row_len);
+      if (my_atomic_load64(&slots[s].version) != version)
+        DBUG_RETURN(false);
+      slots[s].referenced = true;
+      DBUG_RETURN(true);
+    }
+    s = slots[s].next;
+  }
+  DBUG_RETURN(false);
+}
+
+/* add (or refresh) the row at pos */
+int Spartan_row_cache::store_row(long long pos, uchar *buf)
+{
+  int s;
+  int b;
+
+  DBUG_ENTER("Spartan_row_cache::store_row");
+  if (num_slots == 0)
+    DBUG_RETURN(0);
+  s = find_slot(pos);
+  if (s == -1)
+  {
+    s = evict_slot();
+    b = hash_pos(pos);
+    begin_change(s);
+    slots[s].pos = pos;
+    slots[s].next = buckets[b];
+    buckets[b] = s;
+    used_slots++;
+  }
+  else
+    begin_change(s);
+  /*
+    New rows start unreferenced so a single scan cannot push out rows
+    that have been read more than once.
+  */
+  memcpy(rows + (size_t)s * row_len, buf, row_len);
+  end_change(s);
+  DBUG_RETURN(0);
+}
+
+/* drop the row at pos (called on update and delete) */
+int Spartan_row_cache::invalidate_row(long long pos)
+{
+  int s;
+
+  DBUG_ENTER("Spartan_row_cache::invalidate_row");
+  if (num_slots == 0)
+    DBUG_RETURN(0);
+  my_atomic_add64(&invalidations, 1);
+  s = find_slot(pos);
+  if (s != -1)
+    unlink_slot(s);
+  DBUG_RETURN(0);
+}
+
+/* drop every row in the cache (called on truncate) */
+int Spartan_row_cache::flush_cache()
+{
+  int i;
+
+  DBUG_ENTER("Spartan_row_cache::flush_cache");
+  my_atomic_add64(&invalidations, 1);
+  for (i = 0; i < num_slots; i++)
+  {
+    begin_change(i);
+    slots[i].pos = -1;
+    slots[i].next = -1;
+    slots[i].referenced = false;
+    end_change(i);
+  }
+  for (i = 0; i < num_buckets; i++)
+    buckets[i] = -1;
+  used_slots = 0;
+  clock_hand = 0;
+  DBUG_RETURN(0);
+}
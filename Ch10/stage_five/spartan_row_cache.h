@@ -0,0 +1,64 @@
+/*
+  Spartan_row_cache.h
+
+  This header defines a simple row cache for the Spartan data class. Rows
+  are cached by their position in the data file so that repeated reads of
+  the same row (rnd_pos calls from filesort and index lookups) can be
+  answered from memory. The cache is sized by a byte budget and uses the
+  CLOCK (second chance) algorithm to choose a victim when it is full.
+
+  The cache does no locking of its own. The caller must hold the share
+  mutex for all calls but fetch_row(), which reads a slot optimistically:
+  every change to a slot makes its version odd while it runs and even
+  again when it is done, and a row copied while the version stayed the
+  same and even is the row at its position. A reader that sees a slot
+  change, or a hash chain being relinked, just misses. Each invalidation
+  also bumps changes(), so a row read from the file without the mutex is
+  only stored if no row was invalidated since the read started.
+*/
+#include "my_global.h"
+#include "my_sys.h"
+#include "my_atomic.h"
+
+/*
+  This is the slot that describes one cached row. The row data itself
+  lives in a separate contiguous buffer at slot * row_len.
+*/
+struct SDE_CACHE_SLOT
+{
+  long long pos;          /* position of row in data file (-1 = free) */
+  int next;               /* next slot in hash chain (-1 = end) */
+  bool referenced;        /* CLOCK reference bit */
+  volatile int64 version; /* odd while the slot is being changed */
+};
+
+class Spartan_row_cache
+{
+public:
+  Spartan_row_cache(void);
+  ~Spartan_row_cache(void);
+  int init_cache(int row_length, ulonglong budget);
+  int destroy_cache();
+  bool fetch_row(long long pos, uchar *buf);
+  int store_row(long long pos, uchar *buf);
+  int invalidate_row(long long pos);
+  int flush_cache();
+  bool is_enabled() { return (num_slots > 0); }
+  int64 changes() { return my_atomic_load64(&invalidations); }
+private:
+  SDE_CACHE_SLOT *slots;
+  uchar *rows;
+  int *buckets;
+  int num_slots;
+  int num_buckets;
+  int row_len;
+  int clock_hand;
+  int used_slots;
+  volatile int64 invalidations;
+  int hash_pos(long long pos);
+  int find_slot(long long pos);
+  int evict_slot();
+  void unlink_slot(int slot);
+  void begin_change(int slot) { my_atomic_add64(&slots[slot].version, 1); }
+  void end_change(int slot) { my_atomic_add64(&slots[slot].version, 1); }
+};
@@ -0,0 +1,138 @@
+/*
+  Spartan_slab.cc
+
+  This class implements the slab arena of the in-memory index structures
+  (see spartan_slab.h). Objects are carved from the newest block in the
+  order they are asked for; the tail of a block too short for the next
+  object is left unused.
+*/
+#include "spartan_slab.h"
+#include <string.h>
+
+/* bytes of blocks held by all arenas, and the limit on them (0 = none) */
+volatile int64 Spartan_slab::total = 0;
+ulonglong Spartan_slab::limit = 0;
+
+Spartan_slab::Spartan_slab(void)
+{
+  blocks = NULL;
+  next_free = NULL;
+  left = 0;
+  num_classes = 0;
+  reserved = 0;
+}
+
+Spartan_slab::~Spartan_slab(void)
+{
+  free_all();
+}
+
+/* bytes of blocks held by all arenas */
+ulonglong Spartan_slab::total_memory()
+{
+  return (ulonglong)my_atomic_load64(&total);
+}
+
+/* true if the arenas hold more than the limit */
+bool Spartan_slab::over_limit()
+{
+  return (limit > 0) && (total_memory() > limit);
+}
+
+/* the size class for size, added if add is set and there is room */
+SDI_SLAB_CLASS *Spartan_slab::find_class(size_t size, bool add)
+{
+  uint i;
+
+  for (i = 0; i < num_classes; i++)
+  {
+    if (classes[i].size == size)
+      return &classes[i];
+  }
+  if (!add || (num_classes == SDI_SLAB_CLASSES))
+    return NULL;
+  classes[num_classes].size = size;
+  classes[num_classes].free_list = NULL;
+  return &classes[num_classes++];
+}
+
+/* take a block of size bytes (header included) from the system */
+uchar *Spartan_slab::new_block(size_t size)
+{
+  SDI_SLAB_BLOCK_HEAD *head;
+
+  if ((head = (SDI_SLAB_BLOCK_HEAD *)my_malloc(size, MYF(MY_WME))) == NULL)
+    return NULL;
+  head->next = blocks;
+  head->size = size;
+  blocks = head;
+  reserved += size;
+  my_atomic_add64(&total, (int64)size);
+  return (uchar *)head + ALIGN_SIZE(sizeof(SDI_SLAB_BLOCK_HEAD));
+}
+
+/* allocate size bytes, NULL if the system is out of memory */
+void *Spartan_slab::alloc(size_t size)
+{
+  SDI_SLAB_CLASS *c;
+  uchar *p;
+
+  size = ALIGN_SIZE(MY_MAX(size, sizeof(void *)));
+  if (size > SDI_SLAB_LARGE)
+    return new_block(ALIGN_SIZE(sizeof(SDI_SLAB_BLOCK_HEAD)) + size);
+  if (((c = find_class(size, false)) != NULL) && (c->free_list != NULL))
+  {
+    p = (uchar *)c->free_list;
+    c->free_list = *(void **)p;
+    return p;
+  }
+  if (left < size)
+  {
+    if ((next_free = new_block(SDI_SLAB_BLOCK)) == NULL)
+    {
+      left = 0;
+      return NULL;
+    }
+    left = SDI_SLAB_BLOCK - ALIGN_SIZE(sizeof(SDI_SLAB_BLOCK_HEAD));
+  }
+  p = next_free;
+  next_free += size;
+  left -= size;
+  return p;
+}
+
+/*
+  Give back an object of size bytes for reuse. The memory stays with
+  the arena until free_all(); an object of a size with no room for a
+  class, or a large one, is simply not reused.
+*/
+void Spartan_slab::release(void *p, size_t size)
+{
+  SDI_SLAB_CLASS *c;
+
+  if (p == NULL)
+    return;
+  size = ALIGN_SIZE(MY_MAX(size, sizeof(void *)));
+  if ((size > SDI_SLAB_LARGE) || ((c = find_class(size, true)) == NULL))
+    return;
+  *(void **)p = c->free_list;
+  c->free_list = p;
+}
+
+/* free every block: all objects of the arena are gone */
+void Spartan_slab::free_all()
+{
+  SDI_SLAB_BLOCK_HEAD *head;
+
+  while (blocks != NULL)
+  {
+    head = blocks;
+    blocks = head->next;
+    my_free(head);
+  }
+  my_atomic_add64(&total, -(int64)reserved);
+  reserved = 0;
+  next_free = NULL;
+  left = 0;
+  num_classes = 0;
+}
@@ -0,0 +1,76 @@
+/*
+  Spartan_slab.h
+
+  This header defines the slab arena that the in-memory structures of a
+  Spartan index (the nodes and leaves of its radix tree, see
+  spartan_art.h, and the entries of its hash index, see
+  spartan_hash_index.h) are allocated from. Instead of one my_malloc()
+  per object the arena takes memory from the system in blocks of
+  SDI_SLAB_BLOCK bytes and carves the objects out of them. A freed
+  object is put on a free list for its size and reused by the next
+  object of that size. free_all() gives back every block at once, so a
+  whole tree is freed without visiting it.
+
+  Sizes are rounded up to a multiple of 8 bytes, and each rounded size
+  is a size class with its own free list. An object larger than
+  SDI_SLAB_LARGE bytes gets a block of its own.
+
+  Every arena adds the blocks it holds to one count for the engine,
+  reported as the status variable spartan_index_memory. The count can
+  be given a limit (spartan_index_memory_limit). The arena does not
+  refuse memory itself; the structures built on it check over_limit()
+  before they grow and give up (the radix tree is dropped, the hash
+  index stops adding keys) when the engine is over its limit.
+
+  An arena does no locking of its own; its owner is used under the share
+  mutex. The count for the engine is updated atomically.
+*/
+#include "my_global.h"
+#include "my_sys.h"
+#include "my_atomic.h"
+
+/* bytes taken from the system at a time */
+const size_t SDI_SLAB_BLOCK = 64 * 1024;
+/* largest object carved from a shared block */
+const size_t SDI_SLAB_LARGE = 4096;
+/* most size classes with a free list */
+const uint SDI_SLAB_CLASSES = 32;
+
+/* the header of a block; the objects follow it */
+struct SDI_SLAB_BLOCK_HEAD
+{
+  SDI_SLAB_BLOCK_HEAD *next;  /* block taken before this one */
+  size_t size;                /* bytes of the block, header included */
+};
+
+/* the free objects of one size */
+struct SDI_SLAB_CLASS
+{
+  size_t size;
+  void *free_list;            /* each free object points to the next */
+};
+
+class Spartan_slab
+{
+public:
+  Spartan_slab(void);
+  ~Spartan_slab(void);
+  void *alloc(size_t size);
+  void release(void *p, size_t size);
+  void free_all();
+  ulonglong memory_used() { return reserved; }
+  static ulonglong total_memory();
+  static void set_limit(ulonglong bytes) { limit = bytes; }
+  static bool over_limit();
+private:
+  SDI_SLAB_BLOCK_HEAD *blocks;
+  uchar *next_free;           /* unused part of the newest shared block */
+  size_t left;
+  SDI_SLAB_CLASS classes[SDI_SLAB_CLASSES];
+  uint num_classes;
+  ulonglong reserved;         /* bytes of the blocks held */
+  static volatile int64 total;
+  static ulonglong limit;
+  SDI_SLAB_CLASS *find_class(size_t size, bool add);
+  uchar *new_block(size_t size);
+};